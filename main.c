@@ -1,20 +1,130 @@
+#ifdef _WIN32
 #define _WIN32_IE 0x0500
 #define _WIN32_WINNT 0x0600
 
 #include <windows.h>
 #include <commctrl.h> 
+#include <io.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <stddef.h>
+#include <stdint.h>
+#endif
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <time.h>
+#include <math.h>
+#include <limits.h>
 #include "resource.h"
 #include "sqlite3.h" 
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define VALIDATE_SSE2
+#endif
+
+#ifdef _MSC_VER
 #pragma comment(lib, "comctl32.lib")
+#endif
+
+// --- Portability ---
+// The window, the startup snapshot, the bench and the background threads
+// are Win32 only. The stores, search and the replay verb also build without
+// it (see Headless Main), with the stand-ins below for the few Win32 names
+// they use. Clock ticks are QueryPerformanceCounter counts on Windows and
+// CLOCK_MONOTONIC nanoseconds elsewhere; only differences mean anything.
+
+#ifndef _WIN32
+typedef int BOOL;
+typedef unsigned int UINT;
+typedef unsigned long DWORD;
+typedef long LONG;
+typedef long long LONGLONG;
+typedef uintptr_t UINT_PTR;
+typedef void *HANDLE;
+#define TRUE 1
+#define FALSE 0
+#define MAX_PATH 260
+#define ZeroMemory(p, size) memset((p), 0, (size))
+
+typedef pthread_mutex_t SRWLOCK;
+#define SRWLOCK_INIT PTHREAD_MUTEX_INITIALIZER
+#define AcquireSRWLockExclusive pthread_mutex_lock
+#define ReleaseSRWLockExclusive pthread_mutex_unlock
+typedef pthread_cond_t CONDITION_VARIABLE;
+#define CONDITION_VARIABLE_INIT PTHREAD_COND_INITIALIZER
+#define SleepConditionVariableSRW(cv, lock, ms, flags) pthread_cond_wait((cv), (lock))
+#define WakeAllConditionVariable pthread_cond_broadcast
+#define InterlockedIncrement(p) __atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedIncrement64 InterlockedIncrement
+#define InterlockedExchangeAdd64(p, v) __atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+#define GetCurrentThreadId() ((DWORD)(size_t)pthread_self())
+#define GetCurrentProcessId() ((DWORD)getpid())
+
+#define MOVEFILE_REPLACE_EXISTING 1
+static BOOL DeleteFileA(const char *path) { return remove(path) == 0; }
+static BOOL MoveFileExA(const char *from, const char *to, DWORD flags) { return rename(from, to) == 0; }
+static BOOL CopyFileA(const char *from, const char *to, BOOL failIfExists) {
+    FILE *in = fopen(from, "rb");
+    FILE *out = in ? fopen(to, "wb") : NULL;
+    BOOL ok = out != NULL;
+    char buf[65536];
+    size_t n;
+    while (ok && (n = fread(buf, 1, sizeof(buf), in)) > 0) ok = fwrite(buf, 1, n, out) == n;
+    if (in) {
+        ok = ok && !ferror(in);
+        fclose(in);
+    }
+    if (out && fclose(out) != 0) ok = FALSE;
+    return ok;
+}
+#define _strdup strdup
+#define _fileno fileno
+#define _commit fsync
+#define _chsize_s ftruncate
+#endif
+
+LONGLONG ClockNow(void) {
+#ifdef _WIN32
+    LARGE_INTEGER t;
+    QueryPerformanceCounter(&t);
+    return t.QuadPart;
+#else
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (LONGLONG)t.tv_sec * 1000000000 + t.tv_nsec;
+#endif
+}
+
+// ticks per second
+LONGLONG ClockFrequency(void) {
+#ifdef _WIN32
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    return freq.QuadPart;
+#else
+    return 1000000000;
+#endif
+}
+
+void SleepMs(DWORD ms) {
+#ifdef _WIN32
+    Sleep(ms);
+#else
+    struct timespec t = { (time_t)(ms / 1000), (long)(ms % 1000) * 1000000 };
+    while (nanosleep(&t, &t) != 0) {}
+#endif
+}
 
 #define DB_FILE "contacts.db"
 
-HINSTANCE hInst;
 sqlite3 *db;
+#ifdef _WIN32
+HINSTANCE hInst;
 HWND hListView = NULL;
 HWND hSearchEdit = NULL;
 HWND hStatusBar = NULL;
@@ -28,463 +138,9103 @@ BOOL InitInstance(HINSTANCE, int);
 LRESULT CALLBACK WndProc(HWND, UINT, WPARAM, LPARAM);
 INT_PTR CALLBACK AddDlgProc(HWND, UINT, WPARAM, LPARAM);
 INT_PTR CALLBACK EditDlgProc(HWND, UINT, WPARAM, LPARAM);
+#endif
 
 // helper: show SQLite error (CORRECTED: Now passes only 4 arguments)
 void sql_error(const char *msg) {
+#ifdef _WIN32
     MessageBoxA(NULL, msg, "SQLite Error", MB_ICONERROR);
+#else
+    fprintf(stderr, "SQLite Error: %s\n", msg);
+#endif
 }
 
-// helper: validation functions
-BOOL IsNameValid(const char *name) {
-    if (strlen(name) == 0) return FALSE;
-    for (int i = 0; name[i]; i++) {
-        if (!isalpha((unsigned char)name[i]) && !isspace((unsigned char)name[i])) {
-            return FALSE;
-        }
+// --- Validation ---
+// Field checks are table-driven: one lookup classifies a byte instead of the
+// isalpha/isspace/strchr calls. Names may contain UTF-8; any well-formed,
+// printable non-ASCII code point counts as a letter since telling letters
+// from symbols would need the Unicode tables. Phones and emails keep their
+// ASCII rules. Where SSE2 is available whole 16-byte blocks are range
+// checked at once and the scalar code finishes the tail, so both paths give
+// identical answers.
+
+#define CC_ALPHA 0x01
+#define CC_SPACE 0x02
+#define CC_DIGIT 0x04
+#define CC_COMMA 0x08
+#define CC_AT    0x10
+#define CC_HIGH  0x20
+
+static const unsigned char charClass[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, CC_SPACE, CC_SPACE, CC_SPACE, CC_SPACE, CC_SPACE, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    CC_SPACE, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, CC_COMMA, 0, 0, 0,
+    CC_DIGIT, CC_DIGIT, CC_DIGIT, CC_DIGIT, CC_DIGIT, CC_DIGIT, CC_DIGIT, CC_DIGIT, CC_DIGIT, CC_DIGIT, 0, 0, 0, 0, 0, 0,
+    CC_AT, CC_ALPHA, CC_ALPHA, CC_ALPHA, CC_ALPHA, CC_ALPHA, CC_ALPHA, CC_ALPHA, CC_ALPHA, CC_ALPHA, CC_ALPHA, CC_ALPHA, CC_ALPHA, CC_ALPHA, CC_ALPHA, CC_ALPHA,
+    CC_ALPHA, CC_ALPHA, CC_ALPHA, CC_ALPHA, CC_ALPHA, CC_ALPHA, CC_ALPHA, CC_ALPHA, CC_ALPHA, CC_ALPHA, CC_ALPHA, 0, 0, 0, 0, 0,
+    0, CC_ALPHA, CC_ALPHA, CC_ALPHA, CC_ALPHA, CC_ALPHA, CC_ALPHA, CC_ALPHA, CC_ALPHA, CC_ALPHA, CC_ALPHA, CC_ALPHA, CC_ALPHA, CC_ALPHA, CC_ALPHA, CC_ALPHA,
+    CC_ALPHA, CC_ALPHA, CC_ALPHA, CC_ALPHA, CC_ALPHA, CC_ALPHA, CC_ALPHA, CC_ALPHA, CC_ALPHA, CC_ALPHA, CC_ALPHA, 0, 0, 0, 0, 0,
+    CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH,
+    CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH,
+    CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH,
+    CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH,
+    CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH,
+    CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH,
+    CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH,
+    CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH, CC_HIGH,
+};
+
+#define VALID_NAME_BAD  0x01
+#define VALID_PHONE_BAD 0x02
+#define VALID_EMAIL_BAD 0x04
+
+// Length of the UTF-8 sequence at s if it encodes a printable non-ASCII code
+// point, otherwise 0 (stray continuation bytes, overlong forms, surrogates,
+// C1 controls, truncation by the terminator).
+static int Utf8LetterLength(const unsigned char *s) {
+    static const unsigned minCodePoint[5] = { 0, 0, 0x80, 0x800, 0x10000 };
+    unsigned cp;
+    int n;
+    if (s[0] >= 0xC2 && s[0] <= 0xDF) { n = 2; cp = s[0] & 0x1F; }
+    else if (s[0] >= 0xE0 && s[0] <= 0xEF) { n = 3; cp = s[0] & 0x0F; }
+    else if (s[0] >= 0xF0 && s[0] <= 0xF4) { n = 4; cp = s[0] & 0x07; }
+    else return 0;
+    for (int k = 1; k < n; k++) {
+        if ((s[k] & 0xC0) != 0x80) return 0;
+        cp = (cp << 6) | (s[k] & 0x3F);
     }
-    return TRUE;
+    if (cp < minCodePoint[n] || cp < 0xA0 || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) return 0;
+    return n;
 }
 
-BOOL IsPhoneValid(const char *phone) {
-    if (strlen(phone) == 0) return TRUE;
-    for (int i = 0; phone[i]; i++) {
-        if (!isdigit((unsigned char)phone[i])) return FALSE;
+static BOOL NameValidScalar(const unsigned char *s) {
+    while (*s) {
+        if (charClass[*s] & (CC_ALPHA | CC_SPACE)) { s++; continue; }
+        int n = Utf8LetterLength(s);
+        if (n == 0) return FALSE;
+        s += n;
     }
     return TRUE;
 }
 
-BOOL IsEmailValid(const char *email) {
-    if (strlen(email) == 0) return TRUE;
-    if (strchr(email, '@') == NULL) return FALSE;
-    for (int i = 0; email[i]; i++) {
-        if (isspace((unsigned char)email[i]) || email[i] == ',') return FALSE;
+static BOOL PhoneValidScalar(const unsigned char *s) {
+    for (; *s; s++) {
+        if (!(charClass[*s] & CC_DIGIT)) return FALSE;
     }
     return TRUE;
 }
 
-// --- Database Functions ---
-
-void InitDatabase() {
-    int rc = sqlite3_open(DB_FILE, &db);
-    if (rc != SQLITE_OK) {
-        char buf[512];
-        snprintf(buf, sizeof(buf), "Cannot open database: %s", sqlite3_errmsg(db));
-        sql_error(buf);
-        sqlite3_close(db);
-        db = NULL;
-        return;
-    }
-    char *errmsg = 0;
-    const char *sql =
-      "CREATE TABLE IF NOT EXISTS contacts("
-      "id INTEGER PRIMARY KEY AUTOINCREMENT,"
-      "name TEXT NOT NULL,"
-      "phone TEXT,"
-      "email TEXT"
-      ");";
-    rc = sqlite3_exec(db, sql, 0, 0, &errmsg);
-    if (rc != SQLITE_OK) {
-        sql_error(errmsg);
-        sqlite3_free(errmsg);
+static BOOL EmailValidScalar(const unsigned char *s, BOOL hasAt) {
+    for (; *s; s++) {
+        unsigned char cls = charClass[*s];
+        if (cls & (CC_SPACE | CC_COMMA)) return FALSE;
+        if (cls & CC_AT) hasAt = TRUE;
     }
+    return hasAt;
 }
 
-void AddContact(const char *name, const char *phone, const char *email) {
-    if (!db) return;
-    const char *sql = "INSERT INTO contacts(name,phone,email) VALUES(?,?,?);";
-    sqlite3_stmt *stmt = NULL;
-    int rc;
+#ifdef VALIDATE_SSE2
+// A 16-byte load that stays inside one 4 KiB page can't fault even if it
+// reads past the terminator, so blocks are loaded without a strlen pass and
+// the bytes after the NUL are masked off. The last bytes before a page
+// boundary go to the scalar code.
+#define SAME_PAGE_16(p) ((((UINT_PTR)(p)) & 4095) <= 4096 - 16)
 
-    rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-    if (rc != SQLITE_OK) {
-        char error_msg[512];
-        snprintf(error_msg, sizeof(error_msg), "Failed to prepare statement: %s", sqlite3_errmsg(db));
-        sql_error(error_msg);
-        return;
+// Mask of the bytes of v within [lo, hi]. SSE2 only compares signed bytes,
+// so both sides are shifted by 0x80 first.
+static int ByteRangeMask(__m128i v, unsigned char lo, unsigned char hi) {
+    __m128i x = _mm_xor_si128(v, _mm_set1_epi8((char)0x80));
+    __m128i aboveLo = _mm_cmpgt_epi8(x, _mm_set1_epi8((char)((lo - 1) ^ 0x80)));
+    __m128i belowHi = _mm_cmplt_epi8(x, _mm_set1_epi8((char)((hi + 1) ^ 0x80)));
+    return _mm_movemask_epi8(_mm_and_si128(aboveLo, belowHi));
+}
+
+static int ByteEqualMask(__m128i v, char c) {
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+}
+
+static int SpaceMask(__m128i v) {
+    return ByteRangeMask(v, 0x09, 0x0D) | ByteEqualMask(v, ' ');
+}
+
+// Bytes before the first NUL in the block, or all 16 if there is none.
+static int LiveMask(__m128i v, int *ended) {
+    int nul = ByteEqualMask(v, 0);
+    *ended = nul != 0;
+    return nul ? (nul & -nul) - 1 : 0xFFFF;
+}
+
+// Skips blocks that are pure ASCII letters and spaces; the first block that
+// is not (UTF-8 or a bad byte) and everything after it go to the scalar scan.
+static BOOL NameValidSse2(const unsigned char *s) {
+    for (; SAME_PAGE_16(s); s += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)s);
+        int ended, live = LiveMask(v, &ended);
+        int ok = ByteRangeMask(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 'z') | SpaceMask(v);
+        if ((ok & live) != live) break;
+        if (ended) return TRUE;
     }
+    return NameValidScalar(s);
+}
 
-    sqlite3_bind_text(stmt, 1, name, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 2, phone, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 3, email, -1, SQLITE_TRANSIENT);
+static BOOL PhoneValidSse2(const unsigned char *s) {
+    for (; SAME_PAGE_16(s); s += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)s);
+        int ended, live = LiveMask(v, &ended);
+        if ((ByteRangeMask(v, '0', '9') & live) != live) return FALSE;
+        if (ended) return TRUE;
+    }
+    return PhoneValidScalar(s);
+}
 
-    rc = sqlite3_step(stmt);
-    if (rc != SQLITE_DONE) {
-        char error_msg[512];
-        snprintf(error_msg, sizeof(error_msg), "Failed to execute: %s", sqlite3_errmsg(db));
-        sql_error(error_msg);
+static BOOL EmailValidSse2(const unsigned char *s) {
+    int at = 0;
+    for (; SAME_PAGE_16(s); s += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)s);
+        int ended, live = LiveMask(v, &ended);
+        if ((SpaceMask(v) | ByteEqualMask(v, ',')) & live) return FALSE;
+        at |= ByteEqualMask(v, '@') & live;
+        if (ended) return at != 0;
     }
+    return EmailValidScalar(s, at != 0);
+}
+#endif
 
-    if (stmt) sqlite3_finalize(stmt);
+// Per-field checks shared by the single and batch validators; a NULL field is
+// skipped. Empty names are invalid; empty phones and emails are allowed.
+static unsigned char ValidateFields(const char *name, const char *phone, const char *email, BOOL simd) {
+    const unsigned char *n = (const unsigned char *)name;
+    const unsigned char *p = (const unsigned char *)phone;
+    const unsigned char *e = (const unsigned char *)email;
+    unsigned char flags = 0;
+#ifdef VALIDATE_SSE2
+    if (simd) {
+        if (n && (!*n || !NameValidSse2(n))) flags |= VALID_NAME_BAD;
+        if (p && !PhoneValidSse2(p)) flags |= VALID_PHONE_BAD;
+        if (e && *e && !EmailValidSse2(e)) flags |= VALID_EMAIL_BAD;
+        return flags;
+    }
+#endif
+    if (n && (!*n || !NameValidScalar(n))) flags |= VALID_NAME_BAD;
+    if (p && !PhoneValidScalar(p)) flags |= VALID_PHONE_BAD;
+    if (e && *e && !EmailValidScalar(e, FALSE)) flags |= VALID_EMAIL_BAD;
+    return flags;
 }
 
-void UpdateContact(int id,const char *name,const char *phone,const char *email) {
-    if (!db) return;
-    const char *sql = "UPDATE contacts SET name=?, phone=?, email=? WHERE id=?;";
-    sqlite3_stmt *stmt = NULL;
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK) {
-        sqlite3_bind_text(stmt,1,name,-1,SQLITE_TRANSIENT);
-        sqlite3_bind_text(stmt,2,phone,-1,SQLITE_TRANSIENT);
-        sqlite3_bind_text(stmt,3,email,-1,SQLITE_TRANSIENT);
-        sqlite3_bind_int(stmt,4,id);
-        if (sqlite3_step(stmt) != SQLITE_DONE) {
-            sql_error(sqlite3_errmsg(db));
-        }
-    } else {
-        sql_error(sqlite3_errmsg(db));
+// Validates count contacts at once, e.g. a bulk import. flags[i] receives the
+// VALID_*_BAD bits for row i; any of the arrays may be NULL to skip that
+// field. Returns the number of rows with at least one bad field. simd FALSE
+// forces the scalar kernels (they are always used without SSE2).
+int ValidateContactBatch(const char *const *names, const char *const *phones, const char *const *emails,
+                         int count, unsigned char *flags, BOOL simd) {
+    int bad = 0;
+    for (int i = 0; i < count; i++) {
+        flags[i] = ValidateFields(names ? names[i] : NULL, phones ? phones[i] : NULL,
+                                  emails ? emails[i] : NULL, simd);
+        if (flags[i]) bad++;
     }
-    if (stmt) sqlite3_finalize(stmt);
+    return bad;
 }
 
-void DeleteContact(int id) {
-    if (!db) return;
-    const char *sql = "DELETE FROM contacts WHERE id=?;";
-    sqlite3_stmt *stmt = NULL;
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK) {
-        sqlite3_bind_int(stmt,1,id);
-        if (sqlite3_step(stmt) != SQLITE_DONE) {
-            sql_error(sqlite3_errmsg(db));
+BOOL IsNameValid(const char *name) {
+    return !(ValidateFields(name, NULL, NULL, TRUE) & VALID_NAME_BAD);
+}
+
+BOOL IsPhoneValid(const char *phone) {
+    return !(ValidateFields(NULL, phone, NULL, TRUE) & VALID_PHONE_BAD);
+}
+
+BOOL IsEmailValid(const char *email) {
+    return !(ValidateFields(NULL, NULL, email, TRUE) & VALID_EMAIL_BAD);
+}
+
+// What a bulk edit may write to column 0 (name), 1 (phone) or 2 (email):
+// the checks above, except that phones may keep the punctuation imported
+// and generated books have. A fragment is text to splice into a value, so
+// it may be empty, and an email fragment needs no '@'.
+BOOL IsColumnValueValid(int column, const char *value, BOOL fragment) {
+    const unsigned char *s = (const unsigned char *)value;
+    if (column == 1) {
+        for (; *s; s++) {
+            if (!(charClass[*s] & CC_DIGIT) && !strchr(" -().+/", *s)) return FALSE;
         }
-    } else {
-        sql_error(sqlite3_errmsg(db));
+        return TRUE;
     }
-    if (stmt) sqlite3_finalize(stmt);
+    if (column == 0) return (fragment || *s) && NameValidScalar(s);
+    return !*s || EmailValidScalar(s, fragment);
 }
 
-// --- UI & Control Functions ---
+// --- Sort Keys ---
+// Names are listed in the order of a precomputed sort key rather than
+// BINARY, so "alice" sorts with "Alice" and "Émile" with "Emile". The key
+// is the name folded to base letters (ASCII case folded, Latin-1 and
+// Latin Extended-A accents dropped, ß/æ/œ/þ/ĳ expanded), then 0x01, then
+// the name itself to break ties, so plain strcmp/memcmp on keys gives a
+// total order. Keys never contain NUL or 0xFF. The folding is per code
+// point, so the key of a prefix is a prefix of the key.
 
-HWND CreateListView(HWND parent) {
-    RECT rc; GetClientRect(parent, &rc);
-    HWND h = CreateWindowEx(0, WC_LISTVIEW, "",
-        WS_CHILD | WS_VISIBLE | LVS_REPORT | LVS_SHOWSELALWAYS,
-        10, 75, rc.right - 20, rc.bottom - 110, 
-        parent, (HMENU)IDC_LISTVIEW, hInst, NULL);
+// base letters for U+00C0..U+017F; '*' marks the expansions below, ' '
+// code points that are kept as they are
+static const char sortFoldLatin[] =
+    "aaaaaa*ceeeeiiiidnooooo ouuuuy**"      // U+00C0
+    "aaaaaa*ceeeeiiiidnooooo ouuuuy*y"      // U+00E0
+    "aaaaaaccccccccddddeeeeeeeeeegggggggghhhhiiiiiiiiii**jjkkkllllllllll"
+    "nnnnnnnnnoooooo**rrrrrrssssssssttttttuuuuuuuuuuuuwwyyyzzzzzzs";
 
-    ListView_SetExtendedListViewStyle(h, LVS_EX_FULLROWSELECT | LVS_EX_GRIDLINES);
+static const char *SortFoldExpansion(unsigned int cp) {
+    switch (cp) {
+    case 0xC6: case 0xE6: return "ae";
+    case 0xDE: case 0xFE: return "th";
+    case 0xDF: return "ss";
+    case 0x132: case 0x133: return "ij";
+    case 0x152: case 0x153: return "oe";
+    }
+    return "";
+}
 
-    LVCOLUMN col;
-    ZeroMemory(&col, sizeof(col));
-    col.mask = LVCF_TEXT | LVCF_WIDTH | LVCF_SUBITEM;
+// Worst case length of a key without its NUL: every byte folds to at most
+// one byte, plus the separator and the name.
+#define SORT_KEY_MAX(len) (2 * (len) + 1)
 
-    col.cx = 240; col.pszText = "Name"; ListView_InsertColumn(h, 0, &col);
-    col.cx = 140; col.pszText = "Phone"; ListView_InsertColumn(h, 1, &col);
-    col.cx = 300; col.pszText = "Email"; ListView_InsertColumn(h, 2, &col);
+// Writes the key for name (len bytes) to key, which must hold
+// SORT_KEY_MAX(len) + 1 bytes, and returns its length.
+static size_t NameSortKey(const char *name, size_t len, char *key) {
+    const unsigned char *s = (const unsigned char *)name;
+    size_t out = 0;
+    for (size_t i = 0; i < len;) {
+        unsigned char c = s[i];
+        if (c < 0x80) {
+            key[out++] = (char)((charClass[c] & CC_ALPHA) ? c | 0x20 : c);
+            i++;
+            continue;
+        }
+        size_t n = Utf8LetterLength(s + i);
+        unsigned int cp = n == 2 ? ((c & 0x1Fu) << 6) | (s[i + 1] & 0x3Fu) : 0;
+        char base = cp >= 0xC0 && cp <= 0x17F ? sortFoldLatin[cp - 0xC0] : ' ';
+        if (base == '*') {
+            const char *x = SortFoldExpansion(cp);
+            key[out++] = x[0];
+            key[out++] = x[1];
+        } else if (base != ' ') {
+            key[out++] = base;
+        } else {
+            if (n == 0 || i + n > len) n = 1;     // stray byte: keep it
+            memcpy(key + out, s + i, n);
+            out += n;
+        }
+        i += n ? n : 1;
+    }
+    key[out++] = '\x01';
+    memcpy(key + out, name, len);
+    out += len;
+    key[out] = '\0';
+    return out;
+}
 
-    return h;
+// name_sort_key(name): the key as a BLOB, for the sort_key column.
+static void SqlNameSortKey(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+    const char *name = (const char *)sqlite3_value_text(argv[0]);
+    if (!name) { sqlite3_result_null(ctx); return; }
+    size_t len = (size_t)sqlite3_value_bytes(argv[0]);
+    char *key = (char *)sqlite3_malloc64(SORT_KEY_MAX(len) + 1);
+    if (!key) { sqlite3_result_error_nomem(ctx); return; }
+    sqlite3_result_blob64(ctx, key, NameSortKey(name, len, key), sqlite3_free);
 }
 
-void LoadContactsToListView(HWND hList, const char *filter) {
-    if (!hList || !db) return;
-    ListView_DeleteAllItems(hList);
+// --- Search Matching ---
+// Substring search for the filter box. The term is folded once per query
+// into a SearchNeedle; rows are scanned for its first byte (16 at a time
+// with SSE2) and only candidates are compared in full. Matching is ASCII
+// case-insensitive like LIKE, but '%' and '_' in the term are literal.
+// Phones also match on digits alone when the term looks like a phone number,
+// so "555-0100" finds "(555) 0100".
 
-    sqlite3_stmt *stmt = NULL;
-    int total_rows = 0;
-
-    if (filter && strlen(filter) > 0) {
-        const char *sql = "SELECT id,name,phone,email FROM contacts WHERE name LIKE ? OR phone LIKE ? OR email LIKE ? ORDER BY name;";
-        sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-        char pat[512]; snprintf(pat, sizeof(pat), "%%%s%%", filter);
-        sqlite3_bind_text(stmt,1,pat,-1,SQLITE_TRANSIENT);
-        sqlite3_bind_text(stmt,2,pat,-1,SQLITE_TRANSIENT);
-        sqlite3_bind_text(stmt,3,pat,-1,SQLITE_TRANSIENT);
-    } else {
-        const char *sql = "SELECT id,name,phone,email FROM contacts ORDER BY name;";
-        sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-    }
+#define FOLD(c) ((unsigned char)((c) | ((charClass[(unsigned char)(c)] & CC_ALPHA) << 5)))
 
-    int row = 0;
-    while (stmt && sqlite3_step(stmt) == SQLITE_ROW) {
-        int id = sqlite3_column_int(stmt, 0);
-        const unsigned char *name = sqlite3_column_text(stmt, 1);
-        const unsigned char *phone = sqlite3_column_text(stmt, 2);
-        const unsigned char *email = sqlite3_column_text(stmt, 3);
+typedef struct {
+    size_t len;
+    size_t digitLen;
+    BOOL phoneLike;          // only digits and phone punctuation, at least one digit
+    unsigned char *folded;
+    unsigned char *digits;
+} SearchNeedle;
 
-        LVITEM item;
-        ZeroMemory(&item, sizeof(item));
-        item.mask = LVIF_TEXT | LVIF_PARAM;
-        item.iItem = row;
-        item.iSubItem = 0;
-        item.pszText = (LPSTR)name;
-        item.lParam = (LPARAM)id;
-        ListView_InsertItem(hList, &item);
+#define SEARCH_NEEDLE_SIZE(len) (sizeof(SearchNeedle) + 2 * (len) + 2)
 
-        ListView_SetItemText(hList, row, 1, (LPSTR)phone);
-        ListView_SetItemText(hList, row, 2, (LPSTR)email);
-        row++;
+// Builds the needle in mem, which holds SEARCH_NEEDLE_SIZE(strlen(term)) bytes.
+static SearchNeedle *SearchNeedleAt(void *mem, const char *term) {
+    size_t len = strlen(term);
+    SearchNeedle *n = (SearchNeedle *)mem;
+    n->folded = (unsigned char *)(n + 1);
+    n->digits = n->folded + len + 1;
+    n->len = len;
+    n->digitLen = 0;
+    n->phoneLike = TRUE;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)term[i];
+        n->folded[i] = FOLD(c);
+        if (charClass[c] & CC_DIGIT) n->digits[n->digitLen++] = c;
+        else if (!strchr(" -().+/", c)) n->phoneLike = FALSE;
     }
+    n->folded[len] = n->digits[n->digitLen] = '\0';
+    if (n->digitLen == 0) n->phoneLike = FALSE;
+    return n;
+}
 
-    if (stmt) sqlite3_finalize(stmt);
-    total_rows = row;
-    
-    // Update Status Bar
-    char status[64];
-    snprintf(status, sizeof(status), "Total %d contacts", total_rows);
-    SendMessage(hStatusBar, SB_SETTEXT, 0, (LPARAM)status);
+// One allocation, released with free(), so it can be handed to
+// sqlite3_set_auxdata directly.
+static SearchNeedle *SearchNeedleNew(const char *term) {
+    void *mem = malloc(SEARCH_NEEDLE_SIZE(strlen(term)));
+    return mem ? SearchNeedleAt(mem, term) : NULL;
+}
 
-    if (total_rows == 0 && filter && strlen(filter) > 0) {
-        MessageBox(hMainWnd, "No contact found matching your search.", "Search Result", MB_OK | MB_ICONINFORMATION);
+static BOOL MatchFoldedAt(const unsigned char *h, const SearchNeedle *n) {
+    for (size_t k = 1; k < n->len; k++) {
+        if (FOLD(h[k]) != n->folded[k]) return FALSE;
     }
+    return TRUE;
 }
 
-void CreateMainControls(HWND hWnd) {
-    // Search Edit Control (Search Bar) - Y=8
-    hSearchEdit = CreateWindowExA(0, "EDIT", SEARCH_PLACEHOLDER, WS_CHILD | WS_VISIBLE | WS_BORDER | ES_LEFT,
-        10, 8, 260, 24, hWnd, (HMENU)IDC_SEARCH_EDIT, hInst, NULL);
-    
-    // Search Button - Y=8
-    CreateWindowExA(0, "BUTTON", "Search", WS_CHILD | WS_VISIBLE | BS_PUSHBUTTON,
-        280, 8, 80, 24, hWnd, (HMENU)IDC_SEARCH_BTN, hInst, NULL);
+// Offset of the first match at or after from, or -1.
+static ptrdiff_t FindNoCaseFrom(const unsigned char *h, size_t hlen, size_t from, const SearchNeedle *n) {
+    if (n->len == 0) return from <= hlen ? (ptrdiff_t)from : -1;
+    if (!h || hlen < n->len) return -1;
+    size_t last = hlen - n->len;    // last possible start
+    size_t i = from;
+    unsigned char lo = n->folded[0];
+    unsigned char up = (charClass[lo] & CC_ALPHA) ? (unsigned char)(lo & ~0x20) : lo;
+#ifdef VALIDATE_SSE2
+    __m128i vlo = _mm_set1_epi8((char)lo), vup = _mm_set1_epi8((char)up);
+    for (; i + 15 <= last; i += 16) {   // all 16 lanes are valid starts
+        __m128i v = _mm_loadu_si128((const __m128i *)(h + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, vlo), _mm_cmpeq_epi8(v, vup)));
+        while (mask) {
+            int bit = 0;
+            while (!(mask & (1 << bit))) bit++;
+            if (MatchFoldedAt(h + i + bit, n)) return (ptrdiff_t)(i + bit);
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; i <= last; i++) {
+        if ((h[i] == lo || h[i] == up) && MatchFoldedAt(h + i, n)) return (ptrdiff_t)i;
+    }
+    return -1;
+}
 
-    // Add Button - Y=40
-    CreateWindowExA(0, "BUTTON", "Add Contact", WS_CHILD | WS_VISIBLE | BS_PUSHBUTTON,
-        10, 40, 100, 30, hWnd, (HMENU)IDC_ADD_CONTACT, hInst, NULL);
-    
-    // Edit Button - Y=40
-    CreateWindowExA(0, "BUTTON", "Edit Selected", WS_CHILD | WS_VISIBLE | BS_PUSHBUTTON,
-        120, 40, 110, 30, hWnd, (HMENU)IDC_EDIT_CONTACT, hInst, NULL);
-    
-    // Delete Button - Y=40
-    CreateWindowExA(0, "BUTTON", "Delete Selected", WS_CHILD | WS_VISIBLE | BS_PUSHBUTTON,
-        240, 40, 120, 30, hWnd, (HMENU)IDC_DELETE_CONTACT, hInst, NULL);
+static BOOL FindNoCase(const unsigned char *h, size_t hlen, const SearchNeedle *n) {
+    return FindNoCaseFrom(h, hlen, 0, n) >= 0;
+}
 
-    // List View - Starts at Y=75
-    hListView = CreateListView(hWnd);
-    
-    // Status Bar
-    hStatusBar = CreateWindowEx(0, STATUSCLASSNAME, NULL, WS_CHILD | WS_VISIBLE | SBARS_SIZEGRIP,
-        0, 0, 0, 0, hWnd, (HMENU)IDC_STATUSBAR, hInst, NULL);
+// Phone-like terms compare digit sequences, ignoring punctuation in both;
+// anything else falls back to the plain substring search.
+static BOOL PhoneMatches(const unsigned char *phone, size_t len, const SearchNeedle *n) {
+    if (!n->phoneLike) return FindNoCase(phone, len, n);
+    if (!phone) return FALSE;
+    for (size_t i = 0; i < len; i++) {
+        if (phone[i] != n->digits[0]) continue;
+        size_t p = i + 1, k = 1;
+        while (k < n->digitLen && p < len) {
+            if (charClass[phone[p]] & CC_DIGIT) {
+                if (phone[p] != n->digits[k]) break;
+                k++;
+            }
+            p++;
+        }
+        if (k == n->digitLen) return TRUE;
+    }
+    return FALSE;
 }
 
-int GetSelectedContactId() {
-    if (!hListView) return -1;
-    int sel = ListView_GetNextItem(hListView, -1, LVNI_SELECTED);
-    if (sel == -1) {
-        return -1;
+// SQL bindings: contains_ci(text, term) and phone_match(phone, term). The
+// folded term is cached on the statement with sqlite3_set_auxdata, so it is
+// built once per query as long as the term is a bound parameter.
+static SearchNeedle *SqlNeedle(sqlite3_context *ctx, sqlite3_value **argv, int arg) {
+    SearchNeedle *n = (SearchNeedle *)sqlite3_get_auxdata(ctx, arg);
+    if (n) return n;
+    const char *text = (const char *)sqlite3_value_text(argv[arg]);
+    if (!text) return NULL;
+    n = SearchNeedleNew(text);
+    if (!n) {
+        sqlite3_result_error_nomem(ctx);
+        return NULL;
     }
-    LVITEM it; ZeroMemory(&it, sizeof(it));
-    it.mask = LVIF_PARAM;
-    it.iItem = sel;
-    ListView_GetItem(hListView, &it);
-    return (int)it.lParam;
+    sqlite3_set_auxdata(ctx, arg, n, free);
+    // set_auxdata may have freed it already if it ran out of memory
+    return (SearchNeedle *)sqlite3_get_auxdata(ctx, arg);
 }
 
-// --- Dialog Procedures ---
+static void SqlContainsCi(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+    const unsigned char *h = sqlite3_value_text(argv[0]);
+    SearchNeedle *n = SqlNeedle(ctx, argv, 1);
+    if (!h || !n) { sqlite3_result_int(ctx, 0); return; }
+    sqlite3_result_int(ctx, FindNoCase(h, (size_t)sqlite3_value_bytes(argv[0]), n));
+}
 
-INT_PTR CALLBACK AddDlgProc(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam) {
-    switch (message) {
-    case WM_INITDIALOG:
-        return (INT_PTR)TRUE;
+static void SqlPhoneMatch(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+    const unsigned char *h = sqlite3_value_text(argv[0]);
+    SearchNeedle *n = SqlNeedle(ctx, argv, 1);
+    if (!h || !n) { sqlite3_result_int(ctx, 0); return; }
+    sqlite3_result_int(ctx, PhoneMatches(h, (size_t)sqlite3_value_bytes(argv[0]), n));
+}
 
-    case WM_COMMAND:
-        if (LOWORD(wParam) == IDOK) {
-            char name[100] = {0}, phone[20] = {0}, email[100] = {0};
-            GetDlgItemTextA(hDlg, IDC_ADD_NAME, name, sizeof(name));
-            GetDlgItemTextA(hDlg, IDC_ADD_PHONE, phone, sizeof(phone));
-            GetDlgItemTextA(hDlg, IDC_ADD_EMAIL, email, sizeof(email));
+// valid_value(column, value), for the bulk edits (see IsColumnValueValid)
+static void SqlValidValue(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+    const char *value = (const char *)sqlite3_value_text(argv[1]);
+    sqlite3_result_int(ctx, value && IsColumnValueValid(sqlite3_value_int(argv[0]), value, FALSE));
+}
 
-            if (!IsNameValid(name) || !IsPhoneValid(phone) || !IsEmailValid(email)) {
-                MessageBoxA(hDlg, "Invalid input. Check name (alphabetic), phone (numeric), or email (@ required).", "Input Error", MB_ICONERROR);
-                return (INT_PTR)TRUE;
-            }
-            AddContact(name, phone, email);
-            EndDialog(hDlg, IDOK);
-            return (INT_PTR)TRUE;
-        } else if (LOWORD(wParam) == IDCANCEL) {
-            EndDialog(hDlg, IDCANCEL);
-            return (INT_PTR)TRUE;
-        } else if (LOWORD(wParam) == IDC_CLEAR) {
-            SetDlgItemText(hDlg, IDC_ADD_NAME, "");
-            SetDlgItemText(hDlg, IDC_ADD_PHONE, "");
-            SetDlgItemText(hDlg, IDC_ADD_EMAIL, "");
-            SetFocus(GetDlgItem(hDlg, IDC_ADD_NAME));
-            return (INT_PTR)TRUE;
-        }
-        break;
-    }
-    return (INT_PTR)FALSE;
+// every connection that prepares the search query or writes names needs these
+static int RegisterSearchFunctions(sqlite3 *conn) {
+    int flags = SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS;
+    int rc = sqlite3_create_function_v2(conn, "contains_ci", 2, flags, NULL, SqlContainsCi, NULL, NULL, NULL);
+    if (rc == SQLITE_OK) rc = sqlite3_create_function_v2(conn, "phone_match", 2, flags, NULL, SqlPhoneMatch, NULL, NULL, NULL);
+    if (rc == SQLITE_OK) rc = sqlite3_create_function_v2(conn, "name_sort_key", 1, flags, NULL, SqlNameSortKey, NULL, NULL, NULL);
+    if (rc == SQLITE_OK) rc = sqlite3_create_function_v2(conn, "valid_value", 2, flags, NULL, SqlValidValue, NULL, NULL, NULL);
+    return rc;
 }
 
-INT_PTR CALLBACK EditDlgProc(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam) {
-    static int editId = -1;
-    switch (message) {
-    case WM_INITDIALOG: {
-        editId = (int)lParam;
-        if (editId <= 0) return (INT_PTR)TRUE;
+// --- Arenas ---
+// Bump allocators for data that lives exactly as long as one query or one
+// batch: the rows of the current list, the parse tree of a structured query
+// and the strings of queued writes. Allocating is a pointer bump in a large
+// chunk; ArenaReset rewinds to the first chunk in O(1) and keeps the chunks,
+// so refilling the list after the first time costs no malloc at all.
 
-        char sql[256];
-        snprintf(sql, sizeof(sql), "SELECT name, phone, email FROM contacts WHERE id=%d;", editId);
-        sqlite3_stmt *stmt;
-        sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
-        
-        if (sqlite3_step(stmt) == SQLITE_ROW) {
-            const unsigned char *name = sqlite3_column_text(stmt, 0);
-            const unsigned char *phone = sqlite3_column_text(stmt, 1);
-            const unsigned char *email = sqlite3_column_text(stmt, 2);
+#define ARENA_CHUNK_SIZE (256 * 1024)
+#define ARENA_ALIGN 8
 
-            if (name) SetDlgItemTextA(hDlg, IDC_EDIT_NAME, (const char*)name);
-            if (phone) SetDlgItemTextA(hDlg, IDC_EDIT_PHONE, (const char*)phone);
-            if (email) SetDlgItemTextA(hDlg, IDC_EDIT_EMAIL, (const char*)email);
-        }
-        sqlite3_finalize(stmt);
-        return (INT_PTR)TRUE;
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t size;                // usable bytes after the header
+    size_t used;
+} ArenaChunk;
+
+#define ARENA_HEADER ((sizeof(ArenaChunk) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+typedef struct {
+    const char *name;
+    ArenaChunk *first;
+    ArenaChunk *current;        // chunks after it are free since the last reset
+    size_t inUse;               // bytes handed out since the last reset
+    // statistics
+    unsigned long long allocs;
+    unsigned long long bytesAllocated;
+    unsigned long long resets;
+    size_t highWater;           // largest inUse seen
+    size_t reserved;            // bytes held in chunks
+    int chunks;
+} Arena;
+
+static void *ArenaTake(Arena *a, size_t size, size_t align) {
+    ArenaChunk *c = a->current;
+    size_t at = 0;
+    for (; c; c = c->next) {
+        if (c != a->current) c->used = 0;
+        at = (c->used + align - 1) & ~(align - 1);
+        if (at + size <= c->size) break;
+    }
+    if (!c) {
+        size_t cap = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        c = (ArenaChunk *)malloc(ARENA_HEADER + cap);
+        if (!c) return NULL;
+        c->next = NULL;
+        c->size = cap;
+        c->used = at = 0;
+        ArenaChunk **tail = &a->first;
+        while (*tail) tail = &(*tail)->next;
+        *tail = c;
+        a->chunks++;
+        a->reserved += cap;
     }
+    a->current = c;
+    c->used = at + size;
+    a->inUse += size;
+    a->allocs++;
+    a->bytesAllocated += size;
+    if (a->inUse > a->highWater) a->highWater = a->inUse;
+    return (char *)c + ARENA_HEADER + at;
+}
 
-    case WM_COMMAND:
-        if (LOWORD(wParam) == IDOK) {
-            char name[100] = {0}, phone[20] = {0}, email[100] = {0};
-            
-            GetDlgItemTextA(hDlg, IDC_EDIT_NAME, name, sizeof(name));
-            GetDlgItemTextA(hDlg, IDC_EDIT_PHONE, phone, sizeof(phone));
-            GetDlgItemTextA(hDlg, IDC_EDIT_EMAIL, email, sizeof(email));
+// size bytes aligned for any field type; valid until the next reset.
+void *ArenaAlloc(Arena *a, size_t size) {
+    return ArenaTake(a, size ? size : 1, ARENA_ALIGN);
+}
 
-            if (!IsNameValid(name) || !IsPhoneValid(phone) || !IsEmailValid(email)) {
-                MessageBoxA(hDlg, "Invalid input. Check name, phone, or email format.", "Input Error", MB_ICONERROR);
-                return (INT_PTR)TRUE;
-            }
-            UpdateContact(editId, name, phone, email); 
-            
-            EndDialog(hDlg, IDOK);
-            return (INT_PTR)TRUE;
+// Arena copy of s, like CopyField.
+char *ArenaCopy(Arena *a, const char *s) {
+    if (!s) s = "";
+    size_t n = strlen(s) + 1;
+    char *p = (char *)ArenaTake(a, n, 1);
+    if (p) memcpy(p, s, n);
+    return p;
+}
 
-        } else if (LOWORD(wParam) == IDC_DELETE_ITEM) { 
-            if (MessageBoxA(hDlg, "Delete this contact?", "Confirm", MB_YESNO | MB_ICONQUESTION) == IDYES) {
-                DeleteContact(editId);
-                EndDialog(hDlg, IDOK);
-            }
-            return (INT_PTR)TRUE;
+// Releases everything allocated so far; the chunks are kept for reuse.
+void ArenaReset(Arena *a) {
+    if (a->first) a->first->used = 0;
+    a->current = a->first;
+    a->inUse = 0;
+    a->resets++;
+}
 
-        } else if (LOWORD(wParam) == IDCANCEL) {
-            EndDialog(hDlg, IDCANCEL);
-            return (INT_PTR)TRUE;
-        }
-        break;
+void ArenaFree(Arena *a) {
+    ArenaChunk *c = a->first;
+    while (c) {
+        ArenaChunk *next = c->next;
+        free(c);
+        c = next;
     }
-    return (INT_PTR)FALSE;
+    a->first = a->current = NULL;
+    a->inUse = a->reserved = 0;
+    a->chunks = 0;
 }
 
-// --- Window Procedure ---
+// --- Instrumentation ---
+// Per-operation latency histograms with HDR-style log-linear buckets: each
+// power of two of nanoseconds is split into 16 sub-buckets, so recorded
+// values are within ~6% of the true latency. Recording is a counter read
+// and a few increments; statsEnabled turns it off entirely.
 
-LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam) {
-    switch (message) {
-    case WM_CREATE:
-        CreateMainControls(hWnd);
-        LoadContactsToListView(hListView, NULL);
-        break;
+typedef enum { OP_ADD, OP_UPDATE, OP_DELETE, OP_GET, OP_LIST, OP_SEARCH, OP_COMMIT, OP_COUNT } OpKind;
 
-    case WM_SIZE: {
-        // Resize Status Bar
-        SendMessage(hStatusBar, WM_SIZE, 0, 0);
+#ifdef _WIN32
+// for the statistics output
+static const char *opNames[OP_COUNT] = { "add", "update", "delete", "get", "list", "search", "commit" };
+#endif
 
-        // Resize List View to fill remaining space
-        RECT rc; GetClientRect(hWnd, &rc);
-        int sb_height;
-        RECT sb_rc;
-        if (GetWindowRect(hStatusBar, &sb_rc)) {
-            sb_height = sb_rc.bottom - sb_rc.top;
-        } else {
-            sb_height = 20; // Default height if failed
-        }
-        
-        int listview_height = rc.bottom - 75 - sb_height - 5; 
+#define HIST_SUB_BITS 4
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (40 * HIST_SUB_COUNT)   // up to 2^40 ns (~18 minutes)
 
-        HDWP hdwp = BeginDeferWindowPos(1);
-        DeferWindowPos(hdwp, hListView, NULL, 10, 75, rc.right - 20, listview_height, SWP_NOZORDER | SWP_NOACTIVATE);
-        EndDeferWindowPos(hdwp);
-        break;
-    }
+typedef struct {
+    unsigned long long counts[HIST_BUCKETS];
+    unsigned long long total;
+    unsigned long long sumNs;
+    unsigned long long maxNs;
+    unsigned long long rowsScanned;
+    unsigned long long rowsReturned;
+} OpStats;
 
-    case WM_COMMAND: {
-        int id = LOWORD(wParam);
-        int code = HIWORD(wParam);
+BOOL statsEnabled = TRUE;
+OpStats opStats[OP_COUNT];
+unsigned long long lastRowsScanned = 0;   // set by the backend after a scan or search
+static double nsPerTick = 0.0;
 
-        if (id == IDC_SEARCH_EDIT) {
-            // Search Placeholder Logic
-            if (code == EN_SETFOCUS) {
-                char buf[256];
-                GetWindowTextA(hSearchEdit, buf, sizeof(buf));
-                if (strcmp(buf, SEARCH_PLACEHOLDER) == 0) SetWindowTextA(hSearchEdit, "");
-            } else if (code == EN_KILLFOCUS) {
-                char buf[256];
-                GetWindowTextA(hSearchEdit, buf, sizeof(buf));
-                if (strlen(buf) == 0) SetWindowTextA(hSearchEdit, SEARCH_PLACEHOLDER);
+static int HistBucket(unsigned long long ns) {
+    if (ns < HIST_SUB_COUNT) return (int)ns;
+    int e = 63;
+    while (!(ns >> e)) e--;
+    int idx = (e - HIST_SUB_BITS + 1) * HIST_SUB_COUNT + (int)((ns >> (e - HIST_SUB_BITS)) & (HIST_SUB_COUNT - 1));
+    return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
+
+// largest value that falls into the bucket
+static unsigned long long HistBucketHigh(int idx) {
+    if (idx < HIST_SUB_COUNT) return (unsigned long long)idx;
+    int e = idx / HIST_SUB_COUNT + HIST_SUB_BITS - 1;
+    unsigned long long sub = (unsigned long long)(idx % HIST_SUB_COUNT);
+    return ((HIST_SUB_COUNT + sub + 1) << (e - HIST_SUB_BITS)) - 1;
+}
+
+unsigned long long HistPercentile(const OpStats *s, double pct) {
+    if (!s->total) return 0;
+    unsigned long long rank = (unsigned long long)(pct / 100.0 * (double)s->total + 0.5);
+    if (rank < 1) rank = 1;
+    unsigned long long seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += s->counts[i];
+        if (seen >= rank) {
+            unsigned long long high = HistBucketHigh(i);
+            return high < s->maxNs ? high : s->maxNs;
+        }
+    }
+    return s->maxNs;
+}
+
+LONGLONG OpStart(void) {
+    if (!statsEnabled) return 0;
+    return ClockNow();
+}
+
+unsigned long long TicksToNs(LONGLONG ticks) {
+    if (nsPerTick == 0.0) {
+        nsPerTick = 1e9 / (double)ClockFrequency();
+    }
+    return (unsigned long long)((double)ticks * nsPerTick);
+}
+
+void HistRecord(OpStats *s, unsigned long long ns) {
+    s->counts[HistBucket(ns)]++;
+    s->total++;
+    s->sumNs += ns;
+    if (ns > s->maxNs) s->maxNs = ns;
+}
+
+void OpEnd(OpKind op, LONGLONG start, unsigned long long rowsScanned, unsigned long long rowsReturned) {
+    if (!statsEnabled || !start) return;
+    OpStats *s = &opStats[op];
+    HistRecord(s, TicksToNs(ClockNow() - start));
+    s->rowsScanned += rowsScanned;
+    s->rowsReturned += rowsReturned;
+}
+
+// --- Tracing ---
+// Scoped spans for the UI and core paths, kept in a fixed ring buffer so
+// tracing can stay on all the time; only the newest TRACE_RING_SIZE spans
+// are kept. Export writes Chrome trace-event JSON (chrome://tracing,
+// Perfetto). A span is TraceBegin() at the start and TraceEnd(name, t0) on
+// every exit; names must be string literals.
+
+#define TRACE_RING_SIZE 16384   // power of two
+#define TRACE_FILE "contacts_trace.json"
+
+typedef struct {
+    const char *name;
+    LONGLONG start;
+    LONGLONG end;
+    DWORD tid;
+} TraceEvent;
+
+BOOL traceEnabled = TRUE;
+static TraceEvent traceRing[TRACE_RING_SIZE];
+static volatile LONG traceNext = 0;
+
+LONGLONG TraceBegin(void) {
+    if (!traceEnabled) return 0;
+    return ClockNow();
+}
+
+void TraceEnd(const char *name, LONGLONG start) {
+    if (!start) return;
+    LONGLONG end = ClockNow();
+    unsigned long slot = (unsigned long)InterlockedIncrement(&traceNext) - 1;
+    TraceEvent *e = &traceRing[slot & (TRACE_RING_SIZE - 1)];
+    e->name = name;
+    e->start = start;
+    e->end = end;
+    e->tid = GetCurrentThreadId();
+}
+
+BOOL ExportTrace(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f) return FALSE;
+
+    double usPerTick = 1e6 / (double)ClockFrequency();
+    unsigned long next = (unsigned long)traceNext;
+    unsigned long n = next < TRACE_RING_SIZE ? next : TRACE_RING_SIZE;
+    DWORD pid = GetCurrentProcessId();
+
+    fprintf(f, "{\"traceEvents\":[\n");
+    for (unsigned long i = next - n; i != next; i++) {
+        const TraceEvent *e = &traceRing[i & (TRACE_RING_SIZE - 1)];
+        fprintf(f, "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%lu,\"tid\":%lu}%s\n",
+                e->name ? e->name : "?", (double)e->start * usPerTick, (double)(e->end - e->start) * usPerTick,
+                (unsigned long)pid, (unsigned long)e->tid, i + 1 != next ? "," : "");
+    }
+    fprintf(f, "],\"displayTimeUnit\":\"ms\"}\n");
+    return fclose(f) == 0;
+}
+
+// --- Database Functions ---
+
+static char *CopyField(const char *s) {
+    if (!s) s = "";
+    size_t n = strlen(s) + 1;
+    char *p = (char *)malloc(n);
+    if (p) memcpy(p, s, n);
+    return p;
+}
+
+// --- Slow Query Log ---
+// Opt-in with "--slow-log[=ms]". Statements slower than the threshold are
+// handed to a writer thread through a small queue; the thread adds the
+// EXPLAIN QUERY PLAN output from its own connection and appends to a log
+// that rotates at SLOW_LOG_MAX_BYTES. When the queue is full entries are
+// dropped rather than blocking the caller. Bound values are left out
+// unless "--slow-log-params" is given.
+
+#define SLOW_LOG_FILE "contacts_slow.log"
+#define SLOW_LOG_MAX_BYTES (1 << 20)
+#define SLOW_QUERY_DEFAULT_MS 50
+#define SLOW_QUEUE_SIZE 64
+
+typedef struct {
+    long long durationNs;
+    time_t when;
+    char *sql;        // as prepared, with ? placeholders
+    char *expanded;   // with bound values, NULL when redacted
+} SlowQuery;
+
+#ifdef _WIN32
+static SlowQuery slowQueue[SLOW_QUEUE_SIZE];
+static int slowHead = 0, slowCount = 0;
+static unsigned long long slowDropped = 0;
+static CRITICAL_SECTION slowLock;
+static HANDLE hSlowEvent = NULL;
+static HANDLE hSlowThread = NULL;
+static volatile LONG slowStop = 0;
+static long long slowThresholdNs = 0;
+static BOOL slowRedact = TRUE;
+
+static int SlowQueryTrace(unsigned type, void *ctx, void *p, void *x) {
+    if (type != SQLITE_TRACE_PROFILE) return 0;
+    long long ns = (long long)*(sqlite3_int64 *)x;
+    if (ns < slowThresholdNs) return 0;
+
+    sqlite3_stmt *stmt = (sqlite3_stmt *)p;
+    SlowQuery q;
+    q.durationNs = ns;
+    q.when = time(NULL);
+    q.sql = CopyField(sqlite3_sql(stmt));
+    q.expanded = NULL;
+    if (!slowRedact) {
+        char *expanded = sqlite3_expanded_sql(stmt);
+        if (expanded) {
+            q.expanded = CopyField(expanded);
+            sqlite3_free(expanded);
+        }
+    }
+
+    EnterCriticalSection(&slowLock);
+    if (slowCount < SLOW_QUEUE_SIZE) {
+        slowQueue[(slowHead + slowCount) % SLOW_QUEUE_SIZE] = q;
+        slowCount++;
+        q.sql = q.expanded = NULL;
+    } else {
+        slowDropped++;
+    }
+    LeaveCriticalSection(&slowLock);
+    free(q.sql);
+    free(q.expanded);
+    SetEvent(hSlowEvent);
+    return 0;
+}
+
+static void WriteSlowQuery(FILE *f, sqlite3 *conn, const SlowQuery *q) {
+    char when[32];
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&q->when));
+    fprintf(f, "%s  %.3f ms\n  sql: %s\n", when, (double)q->durationNs / 1e6, q->sql ? q->sql : "");
+    fprintf(f, "  params: %s\n", q->expanded ? q->expanded : "(redacted)");
+
+    sqlite3_stmt *plan = NULL;
+    char *sql = sqlite3_mprintf("EXPLAIN QUERY PLAN %s", q->sql ? q->sql : "");
+    if (conn && sql && sqlite3_prepare_v2(conn, sql, -1, &plan, NULL) == SQLITE_OK) {
+        while (sqlite3_step(plan) == SQLITE_ROW) {
+            fprintf(f, "  plan: %s\n", (const char *)sqlite3_column_text(plan, 3));
+        }
+    }
+    sqlite3_finalize(plan);
+    sqlite3_free(sql);
+}
+
+static FILE *OpenSlowLog(void) {
+    FILE *f = fopen(SLOW_LOG_FILE, "a");
+    if (f && ftell(f) >= SLOW_LOG_MAX_BYTES) {
+        fclose(f);
+        MoveFileExA(SLOW_LOG_FILE, SLOW_LOG_FILE ".1", MOVEFILE_REPLACE_EXISTING);
+        f = fopen(SLOW_LOG_FILE, "a");
+    }
+    return f;
+}
+
+static DWORD WINAPI SlowQueryThread(LPVOID param) {
+    sqlite3 *conn = NULL;
+    if (sqlite3_open_v2(DB_FILE, &conn, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK ||
+        RegisterSearchFunctions(conn) != SQLITE_OK) {
+        sqlite3_close(conn);
+        conn = NULL;
+    }
+    unsigned long long reportedDrops = 0;
+
+    for (;;) {
+        WaitForSingleObject(hSlowEvent, INFINITE);
+        FILE *f = NULL;
+        for (;;) {
+            SlowQuery q;
+            unsigned long long dropped;
+            EnterCriticalSection(&slowLock);
+            BOOL have = slowCount > 0;
+            if (have) {
+                q = slowQueue[slowHead];
+                slowHead = (slowHead + 1) % SLOW_QUEUE_SIZE;
+                slowCount--;
+            }
+            dropped = slowDropped;
+            LeaveCriticalSection(&slowLock);
+            if (!have) break;
+
+            if (!f) f = OpenSlowLog();
+            if (f) {
+                if (dropped != reportedDrops) {
+                    fprintf(f, "(%llu slow queries dropped, queue full)\n", dropped - reportedDrops);
+                    reportedDrops = dropped;
+                }
+                WriteSlowQuery(f, conn, &q);
+                if (ftell(f) >= SLOW_LOG_MAX_BYTES) {
+                    fclose(f);
+                    f = NULL;
+                }
             }
+            free(q.sql);
+            free(q.expanded);
+        }
+        if (f) fclose(f);
+        if (slowStop) break;
+    }
+    sqlite3_close(conn);
+    return 0;
+}
+
+void StartSlowQueryLog(int thresholdMs, BOOL redact) {
+    if (hSlowThread || !db) return;
+    InitializeCriticalSection(&slowLock);
+    hSlowEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+    slowThresholdNs = (long long)thresholdMs * 1000000;
+    slowRedact = redact;
+    slowStop = 0;
+    hSlowThread = CreateThread(NULL, 0, SlowQueryThread, NULL, 0, NULL);
+    if (!hSlowThread) {
+        CloseHandle(hSlowEvent);
+        DeleteCriticalSection(&slowLock);
+        return;
+    }
+    sqlite3_trace_v2(db, SQLITE_TRACE_PROFILE, SlowQueryTrace, NULL);
+}
+
+// Detaches the trace hook and lets the writer drain what is queued.
+void StopSlowQueryLog(void) {
+    if (!hSlowThread) return;
+    if (db) sqlite3_trace_v2(db, 0, NULL, NULL);
+    InterlockedExchange(&slowStop, 1);
+    SetEvent(hSlowEvent);
+    WaitForSingleObject(hSlowThread, INFINITE);
+    CloseHandle(hSlowThread);
+    CloseHandle(hSlowEvent);
+    DeleteCriticalSection(&slowLock);
+    hSlowThread = hSlowEvent = NULL;
+}
+
+#else
+// The writer thread is Win32 only; headless builds run without the log.
+void StartSlowQueryLog(int thresholdMs, BOOL redact) {}
+void StopSlowQueryLog(void) {}
+#endif
+
+// --- SQLite Memory ---
+// Opt-in memory tuning for SQLite (--sqlite-mem=tuned). It must be in place
+// before SQLite initializes, so InitDatabase applies it before the store
+// opens. SQLite then allocates from a private low-fragmentation heap,
+// database pages come from one preallocated slab of slots, every
+// connection gets a bigger lookaside pool for its small objects, and
+// SQLite's global memory statistics, which take a mutex on every
+// allocation, are turned off. The private heap keeps its own byte counts,
+// so the stats output still shows how much SQLite uses.
+
+#define SQLMEM_PAGE_SIZE 4096
+#define SQLMEM_PAGECACHE_SLOTS 4096         // 16 MB of 4 KB pages, shared by all connections
+#define SQLMEM_LOOKASIDE_SIZE 256
+#define SQLMEM_LOOKASIDE_COUNT 512
+#define SQLMEM_DEFAULT_LOOKASIDE_SIZE 1200  // SQLite's own defaults, to switch back
+#define SQLMEM_DEFAULT_LOOKASIDE_COUNT 100
+#define SQLMEM_DEFAULT_PCACHE_PAGES 20
+
+typedef struct {
+    BOOL tuned;
+    int pageCacheSlots;
+    int lookasideSize;
+    int lookasideCount;
+    BOOL memStatus;
+} SqliteMemConfig;
+
+// what the bench switches back to
+static const SqliteMemConfig sqliteDefaultMem = {
+    FALSE, 0, SQLMEM_DEFAULT_LOOKASIDE_SIZE, SQLMEM_DEFAULT_LOOKASIDE_COUNT, TRUE
+};
+static const SqliteMemConfig sqliteTunedMem = {
+    TRUE, SQLMEM_PAGECACHE_SLOTS, SQLMEM_LOOKASIDE_SIZE, SQLMEM_LOOKASIDE_COUNT, FALSE
+};
+
+SqliteMemConfig sqliteMem = { FALSE, 0, SQLMEM_DEFAULT_LOOKASIDE_SIZE, SQLMEM_DEFAULT_LOOKASIDE_COUNT, TRUE };
+static void *pageCacheSlab = NULL;
+static volatile LONGLONG sqliteHeapBytes = 0;
+static volatile LONGLONG sqliteHeapPeak = 0;    // approximate under contention
+static volatile LONGLONG sqliteHeapAllocs = 0;
+
+#ifdef _WIN32
+static HANDLE sqliteHeap = NULL;
+
+static void *HeapBlockAlloc(int n) { return HeapAlloc(sqliteHeap, 0, (SIZE_T)n); }
+static void *HeapBlockRealloc(void *p, int n) { return HeapReAlloc(sqliteHeap, 0, p, (SIZE_T)n); }
+static void HeapBlockFree(void *p) { HeapFree(sqliteHeap, 0, p); }
+static LONGLONG HeapBlockSize(void *p) { return (LONGLONG)HeapSize(sqliteHeap, 0, p); }
+
+static int HeapBlockInit(void) {
+    sqliteHeap = HeapCreate(0, 0, 0);
+    if (!sqliteHeap) return SQLITE_NOMEM;
+    ULONG lfh = 2;  // low-fragmentation heap
+    HeapSetInformation(sqliteHeap, HeapCompatibilityInformation, &lfh, sizeof(lfh));
+    return SQLITE_OK;
+}
+
+static void HeapBlockShutdown(void) {
+    if (sqliteHeap) HeapDestroy(sqliteHeap);
+    sqliteHeap = NULL;
+}
+#else
+// No private heap off Windows: blocks come from the C heap, which still
+// reports their usable size for the byte counts.
+static void *HeapBlockAlloc(int n) { return malloc((size_t)n); }
+static void *HeapBlockRealloc(void *p, int n) { return realloc(p, (size_t)n); }
+static void HeapBlockFree(void *p) { free(p); }
+static LONGLONG HeapBlockSize(void *p) { return (LONGLONG)malloc_usable_size(p); }
+static int HeapBlockInit(void) { return SQLITE_OK; }
+static void HeapBlockShutdown(void) {}
+#endif
+
+static void SqliteHeapCount(LONGLONG delta) {
+    LONGLONG now = InterlockedExchangeAdd64(&sqliteHeapBytes, delta) + delta;
+    if (delta > 0) {
+        InterlockedIncrement64(&sqliteHeapAllocs);
+        if (now > sqliteHeapPeak) sqliteHeapPeak = now;
+    }
+}
+
+static void *SqliteHeapMalloc(int n) {
+    void *p = HeapBlockAlloc(n);
+    if (p) SqliteHeapCount(HeapBlockSize(p));
+    return p;
+}
+
+static void SqliteHeapFree(void *p) {
+    SqliteHeapCount(-HeapBlockSize(p));
+    HeapBlockFree(p);
+}
+
+static void *SqliteHeapRealloc(void *p, int n) {
+    LONGLONG before = HeapBlockSize(p);
+    void *q = HeapBlockRealloc(p, n);
+    if (q) SqliteHeapCount(HeapBlockSize(q) - before);
+    return q;
+}
+
+static int SqliteHeapSize(void *p) { return p ? (int)HeapBlockSize(p) : 0; }
+static int SqliteHeapRoundup(int n) { return (n + 7) & ~7; }
+
+static int SqliteHeapInit(void *unused) {
+    int rc = HeapBlockInit();
+    if (rc != SQLITE_OK) return rc;
+    sqliteHeapBytes = sqliteHeapPeak = sqliteHeapAllocs = 0;
+    return SQLITE_OK;
+}
+
+static void SqliteHeapShutdown(void *unused) {
+    HeapBlockShutdown();
+}
+
+static const sqlite3_mem_methods sqliteHeapMethods = {
+    SqliteHeapMalloc, SqliteHeapFree, SqliteHeapRealloc, SqliteHeapSize,
+    SqliteHeapRoundup, SqliteHeapInit, SqliteHeapShutdown, NULL
+};
+
+// Applies cfg. Only valid before SQLite initializes or after
+// sqlite3_shutdown(); returns SQLITE_MISUSE otherwise and leaves the
+// current setup alone. sqliteMem changes only on success; a failure past
+// the allocator can leave part of cfg in place, so the caller should apply
+// sqliteMem again.
+int ConfigureSqliteMemory(const SqliteMemConfig *cfg) {
+    sqlite3_mem_methods system;
+    ZeroMemory(&system, sizeof(system));   // no xMalloc: SQLite installs its default
+    int rc = sqlite3_config(SQLITE_CONFIG_MALLOC, cfg->tuned ? &sqliteHeapMethods : &system);
+    if (rc != SQLITE_OK) return rc;
+
+    void *slab = NULL;
+    int slotSize = 0;
+    if (cfg->pageCacheSlots > 0) {
+        int header = 0;
+        sqlite3_config(SQLITE_CONFIG_PCACHE_HDRSZ, &header);
+        slotSize = (SQLMEM_PAGE_SIZE + header + 7) & ~7;
+        slab = malloc((size_t)slotSize * (size_t)cfg->pageCacheSlots);
+    }
+    if (slab) rc = sqlite3_config(SQLITE_CONFIG_PAGECACHE, slab, slotSize, cfg->pageCacheSlots);
+    else rc = sqlite3_config(SQLITE_CONFIG_PAGECACHE, NULL, 0, SQLMEM_DEFAULT_PCACHE_PAGES);
+    free(pageCacheSlab);
+    pageCacheSlab = slab;
+
+    if (rc == SQLITE_OK) rc = sqlite3_config(SQLITE_CONFIG_LOOKASIDE, cfg->lookasideSize, cfg->lookasideCount);
+    if (rc == SQLITE_OK) rc = sqlite3_config(SQLITE_CONFIG_MEMSTATUS, cfg->memStatus);
+    if (rc == SQLITE_OK) rc = sqlite3_initialize();
+    if (rc == SQLITE_OK) {
+        sqliteMem = *cfg;
+        if (!slab) sqliteMem.pageCacheSlots = 0;
+    }
+    return rc;
+}
+
+typedef struct {
+    long long used;             // bytes, from SQLite or the private heap
+    long long peak;
+    long long allocs;
+    int pageCacheUsed;          // slots in use
+    int pageCacheSlots;
+    long long pageCacheOverflow; // page bytes that didn't fit the slab
+    int lookasideHits;          // main connection only
+    int lookasideMisses;
+    int cacheHits;
+    int cacheMisses;
+} SqliteMemStats;
+
+void GetSqliteMemStats(SqliteMemStats *s) {
+    ZeroMemory(s, sizeof(*s));
+    sqlite3_int64 cur = 0, hi = 0;
+    if (sqliteMem.memStatus) {
+        sqlite3_status64(SQLITE_STATUS_MEMORY_USED, &cur, &hi, 0);
+        s->used = cur;
+        s->peak = hi;
+        sqlite3_status64(SQLITE_STATUS_MALLOC_COUNT, &cur, &hi, 0);
+        s->allocs = cur;
+    } else {
+        s->used = sqliteHeapBytes;
+        s->peak = sqliteHeapPeak;
+        s->allocs = sqliteHeapAllocs;
+    }
+    sqlite3_status64(SQLITE_STATUS_PAGECACHE_USED, &cur, &hi, 0);
+    s->pageCacheUsed = (int)cur;
+    s->pageCacheSlots = sqliteMem.pageCacheSlots;
+    sqlite3_status64(SQLITE_STATUS_PAGECACHE_OVERFLOW, &cur, &hi, 0);
+    s->pageCacheOverflow = cur;
+    if (db) {
+        int c, h, miss;
+        sqlite3_db_status(db, SQLITE_DBSTATUS_LOOKASIDE_HIT, &c, &s->lookasideHits, 0);
+        sqlite3_db_status(db, SQLITE_DBSTATUS_LOOKASIDE_MISS_SIZE, &c, &miss, 0);
+        sqlite3_db_status(db, SQLITE_DBSTATUS_LOOKASIDE_MISS_FULL, &c, &h, 0);
+        s->lookasideMisses = miss + h;
+        sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_HIT, &s->cacheHits, &h, 0);
+        sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_MISS, &s->cacheMisses, &h, 0);
+    }
+}
+
+// --- Storage Backends ---
+// The CRUD paths go through a ContactStore so the same UI can run against
+// SQLite or a pure in-memory engine. Every entry point returns an SQLite
+// result code; row callbacks return nonzero to stop the scan early.
+
+typedef int (*ContactRowFn)(void *ctx, int id, const char *name, const char *phone, const char *email);
+
+// How an upsert that found an existing contact merges each field. A field
+// counts as empty when it has no key (see Contact keys); for names, when
+// it is "".
+typedef enum {
+    MERGE_KEEP,         // the existing value stays
+    MERGE_FILL,         // the incoming value fills an empty field
+    MERGE_OVERWRITE     // a non-empty incoming value replaces the existing one
+} MergeRule;
+
+typedef struct {
+    MergeRule name;
+    MergeRule phone;
+    MergeRule email;
+} MergeRules;
+
+const MergeRules defaultMergeRules = { MERGE_OVERWRITE, MERGE_FILL, MERGE_FILL };
+
+typedef struct ContactStore {
+    const char *name;
+    int  (*open)(const char *path);
+    void (*close)(void);
+    int  (*begin)(void);
+    int  (*commit)(void);
+    void (*rollback)(void);
+    int  (*insert)(const char *name, const char *phone, const char *email);
+    int  (*update)(int id, const char *name, const char *phone, const char *email);
+    int  (*remove)(int id);
+    int  (*removeMany)(const int *ids, int count);     // within the caller's transaction
+    int  (*touch)(int id);      // marks the contact as just used
+    int  (*get)(int id, ContactRowFn fn, void *ctx);
+    int  (*scan)(ContactRowFn fn, void *ctx);
+    int  (*search)(const char *filter, ContactRowFn fn, void *ctx);
+    int  (*lookup)(const char *phone, const char *email, ContactRowFn fn, void *ctx);  // same phone or email key
+    // Updates the contact with the same phone key, else the same email key
+    // (the lowest id if several), merging by the rules, or inserts a new
+    // one. *matchedId is the updated contact, 0 after an insert.
+    int  (*upsert)(const char *name, const char *phone, const char *email, const MergeRules *merge, int *matchedId);
+    const char *(*errmsg)(void);
+} ContactStore;
+
+const ContactStore *store = NULL;
+
+// SQLite backend
+
+// Email domains: most addresses share a few dozen domains, so since schema
+// version 3 the rows live in contact_rows with the part before the first
+// '@' in email_local and the rest as an id into domains. The contacts view
+// joins them back into the original columns and its INSTEAD OF triggers
+// intern domains on the way in, so every reader, other tools included,
+// still sees a plain contacts table. An address without '@' keeps a NULL
+// domain_id and is stored whole. Unused domains are left in place.
+#define EMAIL_HAS_DOMAIN(e) "instr(" e ",'@')>0"
+#define EMAIL_DOMAIN(e) "substr(" e ",instr(" e ",'@')+1)"
+#define EMAIL_LOCAL(e) "CASE WHEN " EMAIL_HAS_DOMAIN(e) " THEN substr(" e ",1,instr(" e ",'@')-1) ELSE " e " END"
+#define EMAIL_DOMAIN_ID(e) "(SELECT id FROM domains WHERE name=" EMAIL_DOMAIN(e) " AND " EMAIL_HAS_DOMAIN(e) ")"
+
+// Contact keys: duplicate checks and upserts match phones without the
+// usual punctuation and emails without ASCII case, so "(555) 010-2030"
+// and "5550102030" are one phone. Since schema version 5 contact_rows
+// keeps both keys in phone_key and email_key, set by the view's triggers,
+// and an empty field has a NULL key. PhoneKey and EmailKey are the same
+// rules in C and must agree with these.
+#define PHONE_KEY_STRIP " -().+"
+#define PHONE_KEY(e) "nullif(replace(replace(replace(replace(replace(replace(" e ",' ',''),'-',''),'(',''),')',''),'.',''),'+',''),'')"
+#define EMAIL_KEY(e) "nullif(lower(" e "),'')"
+#define CONTACT_KEY_MAX 320     // buffer size; longer values are cut to fit
+
+// a contact_rows row from name, phone and email in ?1..?3, for upserts
+#define UPSERT_VALUES "?1,?2," EMAIL_LOCAL("?3") "," EMAIL_DOMAIN_ID("?3") ",name_sort_key(?1)," PHONE_KEY("?2") "," EMAIL_KEY("?3")
+
+enum { STMT_INSERT, STMT_UPDATE, STMT_DELETE, STMT_GET, STMT_SCAN, STMT_SEARCH, STMT_TOUCH, STMT_LOOKUP,
+       STMT_ADD_DOMAIN, STMT_INSERT_ROW, STMT_UNIQUE_KEYS, STMT_COUNT };
+
+static const char *sqliteStmtSql[STMT_COUNT] = {
+    "INSERT INTO contacts(name,phone,email,sort_key) VALUES(?1,?2,?3,name_sort_key(?1));",
+    "UPDATE contacts SET name=?1, phone=?2, email=?3, sort_key=name_sort_key(?1) WHERE id=?4;",
+    "DELETE FROM contact_rows WHERE id=?;",
+    "SELECT id,name,phone,email FROM contacts WHERE id=?;",
+    "SELECT id,name,phone,email_local,domain_id FROM contact_rows ORDER BY sort_key,id;",
+    // the filter reads every row anyway, so sorting the matches beats walking
+    // the sort_key index ('+' keeps the planner off it)
+    "SELECT id,name,phone,email_local,domain_id FROM contact_rows"
+    " WHERE contains_ci(name,?1) OR phone_match(phone,?1) OR email_match(email_local,domain_id,?1) ORDER BY +sort_key,id;",
+    "UPDATE contact_rows SET last_used=? WHERE id=?;",
+    "SELECT id,name,phone,email_local,domain_id FROM contact_rows WHERE phone_key=" PHONE_KEY("?1")
+    " UNION SELECT id,name,phone,email_local,domain_id FROM contact_rows WHERE email_key=" EMAIL_KEY("?2") ";",
+    "INSERT OR IGNORE INTO domains(name) SELECT " EMAIL_DOMAIN("?1") " WHERE " EMAIL_HAS_DOMAIN("?1") ";",
+    "INSERT INTO contact_rows(name,phone,email_local,domain_id,sort_key,phone_key,email_key) VALUES(" UPSERT_VALUES ");",
+    "SELECT count(*)=2 FROM sqlite_master WHERE type='index'"
+    " AND name IN ('contact_rows_phone_key','contact_rows_email_key') AND sql LIKE 'CREATE UNIQUE %';"
+};
+
+#ifdef _WIN32
+// for the statistics output
+static const char *sqliteStmtNames[STMT_COUNT] = {
+    "insert", "update", "delete", "get", "scan", "search", "touch", "lookup", "add_domain", "insert_row", "unique_keys"
+};
+#endif
+
+static sqlite3_stmt *sqliteStmts[STMT_COUNT];
+static sqlite3_stmt *sqliteUpsertStmt;     // see SqliteUpsertStmt
+static int sqliteUpsertShape = -1;
+static int sqliteUniqueKeys = -1;          // whether the key indexes are unique, -1 until read
+
+typedef struct {
+    unsigned long long runs;
+    unsigned long long vmSteps;
+    unsigned long long fullscanSteps;
+    unsigned long long sorts;
+    unsigned long long autoindexes;
+} StmtStats;
+
+StmtStats stmtStats[STMT_COUNT];
+
+// statements are prepared once and reused for the life of the connection
+static sqlite3_stmt *SqliteStmt(int which) {
+    sqlite3_stmt *stmt = sqliteStmts[which];
+    if (!stmt) {
+        LONGLONG t0 = TraceBegin();
+        int rc = sqlite3_prepare_v3(db, sqliteStmtSql[which], -1, SQLITE_PREPARE_PERSISTENT, &stmt, NULL);
+        TraceEnd("sqlite.prepare", t0);
+        if (rc != SQLITE_OK) return NULL;
+        sqliteStmts[which] = stmt;
+    } else {
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+    }
+    return stmt;
+}
+
+// folds the statement's counters into stmtStats and resets them
+static void SqliteRecordStmt(sqlite3_stmt *stmt) {
+    if (!statsEnabled) return;
+    for (int i = 0; i < STMT_COUNT; i++) {
+        if (sqliteStmts[i] != stmt) continue;
+        StmtStats *s = &stmtStats[i];
+        s->runs++;
+        s->vmSteps += sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_VM_STEP, 1);
+        lastRowsScanned = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 1);
+        s->fullscanSteps += lastRowsScanned;
+        s->sorts += sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_SORT, 1);
+        s->autoindexes += sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_AUTOINDEX, 1);
+        return;
+    }
+}
+
+static int SqliteStepDone(sqlite3_stmt *stmt) {
+    LONGLONG t0 = TraceBegin();
+    int rc = sqlite3_step(stmt);
+    TraceEnd("sqlite.step", t0);
+    SqliteRecordStmt(stmt);
+    sqlite3_reset(stmt);
+    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+// PhoneKey and EmailKey write at most size-1 bytes plus a NUL and return
+// the key length, 0 for no key.
+size_t PhoneKey(const char *phone, char *out, size_t size) {
+    size_t n = 0;
+    for (; phone && *phone && n + 1 < size; phone++) {
+        if (!strchr(PHONE_KEY_STRIP, *phone)) out[n++] = *phone;
+    }
+    out[n] = '\0';
+    return n;
+}
+
+size_t EmailKey(const char *email, char *out, size_t size) {
+    size_t n = 0;
+    for (; email && *email && n + 1 < size; email++) {
+        out[n++] = (*email >= 'A' && *email <= 'Z') ? (char)(*email + 32) : *email;
+    }
+    out[n] = '\0';
+    return n;
+}
+
+// The list and search statements read contact_rows directly and put the
+// addresses back together in C: the view's join and concatenation doubled
+// the cost of a search. Names are cached by domain id as rows ask for them.
+// A rollback can hand an id to a different domain and another connection
+// can do the same, so the cache is dropped after either.
+typedef struct {
+    char **names;           // by domain id
+    sqlite3_int64 cap;
+    int dataVersion;
+} DomainCache;
+
+static DomainCache sqliteDomains;
+
+#define DOMAIN_CACHE_MAX_ID (1 << 24)
+
+static int ReadDataVersion(sqlite3 *conn);      // see Search Index
+
+static void DomainCacheClear(void) {
+    for (sqlite3_int64 i = 0; i < sqliteDomains.cap; i++) free(sqliteDomains.names[i]);
+    free(sqliteDomains.names);
+    ZeroMemory(&sqliteDomains, sizeof(sqliteDomains));
+}
+
+// before each list or search
+static void DomainCacheCheck(void) {
+    int version = ReadDataVersion(db);
+    if (version != sqliteDomains.dataVersion) {
+        DomainCacheClear();
+        sqliteDomains.dataVersion = version;
+    }
+}
+
+static const char *DomainName(sqlite3_int64 id) {
+    if (id <= 0 || id >= DOMAIN_CACHE_MAX_ID) return NULL;
+    if (id < sqliteDomains.cap && sqliteDomains.names[id]) return sqliteDomains.names[id];
+    if (id >= sqliteDomains.cap) {
+        sqlite3_int64 cap = sqliteDomains.cap ? sqliteDomains.cap : 64;
+        while (cap <= id) cap *= 2;
+        char **names = (char **)realloc(sqliteDomains.names, (size_t)cap * sizeof(*names));
+        if (!names) return NULL;
+        ZeroMemory(names + sqliteDomains.cap, (size_t)(cap - sqliteDomains.cap) * sizeof(*names));
+        sqliteDomains.names = names;
+        sqliteDomains.cap = cap;
+    }
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(db, "SELECT name FROM domains WHERE id=?;", -1, &stmt, NULL) == SQLITE_OK) {
+        sqlite3_bind_int64(stmt, 1, id);
+        if (sqlite3_step(stmt) == SQLITE_ROW) sqliteDomains.names[id] = CopyField((const char *)sqlite3_column_text(stmt, 0));
+    }
+    sqlite3_finalize(stmt);
+    return sqliteDomains.names[id];
+}
+
+// The address from an (email_local, domain_id) pair, as the view would show
+// it. Uses buf when it fits and the heap otherwise (*heap, to be freed).
+static const char *JoinEmail(sqlite3_value *local, sqlite3_value *domainId, char *buf, size_t size, char **heap) {
+    const char *text = (const char *)sqlite3_value_text(local);
+    *heap = NULL;
+    if (sqlite3_value_type(domainId) == SQLITE_NULL) return text;
+    const char *domain = DomainName(sqlite3_value_int64(domainId));
+    if (!text || !domain) return NULL;
+    size_t localLen = strlen(text), domainLen = strlen(domain);
+    if (localLen + domainLen + 2 > size) {
+        buf = *heap = (char *)malloc(localLen + domainLen + 2);
+        if (!buf) return NULL;
+    }
+    memcpy(buf, text, localLen);
+    buf[localLen] = '@';
+    memcpy(buf + localLen + 1, domain, domainLen + 1);
+    return buf;
+}
+
+// email_match(email_local, domain_id, term): contains_ci on the whole
+// address. Only a term with '@' in it can match across the join, so the
+// two parts are tried on their own first.
+static void SqlEmailMatch(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+    const unsigned char *local = sqlite3_value_text(argv[0]);
+    SearchNeedle *n = SqlNeedle(ctx, argv, 2);
+    if (!local || !n) { sqlite3_result_int(ctx, 0); return; }
+    if (FindNoCase(local, (size_t)sqlite3_value_bytes(argv[0]), n)) { sqlite3_result_int(ctx, 1); return; }
+    if (sqlite3_value_type(argv[1]) == SQLITE_NULL) { sqlite3_result_int(ctx, 0); return; }
+    const char *domain = DomainName(sqlite3_value_int64(argv[1]));
+    BOOL found = domain && FindNoCase((const unsigned char *)domain, strlen(domain), n);
+    if (!found && domain && memchr(n->folded, '@', n->len)) {
+        char buf[320], *heap;
+        const char *email = JoinEmail(argv[0], argv[1], buf, sizeof(buf), &heap);
+        found = email && FindNoCase((const unsigned char *)email, strlen(email), n);
+        free(heap);
+    }
+    sqlite3_result_int(ctx, found);
+}
+
+// Rows are (id, name, phone, email) or, from contact_rows, (id, name,
+// phone, email_local, domain_id).
+static int SqliteEachRow(sqlite3_stmt *stmt, ContactRowFn fn, void *ctx) {
+    LONGLONG t0 = TraceBegin();
+    BOOL encoded = sqlite3_column_count(stmt) > 4;
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        char buf[320], *heap = NULL;
+        const char *email = encoded
+            ? JoinEmail(sqlite3_column_value(stmt, 3), sqlite3_column_value(stmt, 4), buf, sizeof(buf), &heap)
+            : (const char *)sqlite3_column_text(stmt, 3);
+        int stop = fn(ctx, sqlite3_column_int(stmt, 0),
+                      (const char *)sqlite3_column_text(stmt, 1),
+                      (const char *)sqlite3_column_text(stmt, 2), email);
+        free(heap);
+        if (stop) {
+            rc = SQLITE_DONE;
             break;
         }
+    }
+    SqliteRecordStmt(stmt);
+    sqlite3_reset(stmt);
+    TraceEnd("sqlite.step_loop", t0);
+    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+static int RegisterSearchIndex(sqlite3 *conn);   // see Search Index
+
+// Schema changes since the original table, applied in order inside one
+// transaction each; PRAGMA user_version counts how many have run.
+static const char *sqliteMigrations[] = {
+    // 1: recency for ranked search
+    "ALTER TABLE contacts ADD COLUMN last_used INTEGER NOT NULL DEFAULT 0;",
+    // 2: precomputed name order (see Sort Keys)
+    "ALTER TABLE contacts ADD COLUMN sort_key BLOB;"
+    "UPDATE contacts SET sort_key=name_sort_key(name);"
+    "CREATE INDEX contacts_sort_key ON contacts(sort_key);",
+    // 3: email domains stored once (see Email domains above)
+    "CREATE TABLE domains(id INTEGER PRIMARY KEY, name TEXT NOT NULL UNIQUE);"
+    "CREATE TABLE contact_rows("
+    "id INTEGER PRIMARY KEY AUTOINCREMENT,"
+    "name TEXT NOT NULL,"
+    "phone TEXT,"
+    "email_local TEXT,"
+    "domain_id INTEGER REFERENCES domains(id),"
+    "last_used INTEGER NOT NULL DEFAULT 0,"
+    "sort_key BLOB"
+    ");"
+    "INSERT OR IGNORE INTO domains(name) SELECT " EMAIL_DOMAIN("email") " FROM contacts WHERE " EMAIL_HAS_DOMAIN("email") ";"
+    "INSERT INTO contact_rows SELECT id,name,phone," EMAIL_LOCAL("email") "," EMAIL_DOMAIN_ID("email") ",last_used,sort_key FROM contacts;"
+    "DELETE FROM sqlite_sequence WHERE name='contact_rows';"
+    "INSERT INTO sqlite_sequence(name,seq) SELECT 'contact_rows',seq FROM sqlite_sequence WHERE name='contacts';"
+    "DROP TABLE contacts;"
+    "CREATE INDEX contact_rows_sort_key ON contact_rows(sort_key);"
+    "CREATE VIEW contacts AS SELECT r.id AS id, r.name AS name, r.phone AS phone,"
+    " CASE WHEN r.domain_id IS NULL THEN r.email_local ELSE r.email_local||'@'||d.name END AS email,"
+    " r.last_used AS last_used, r.sort_key AS sort_key"
+    " FROM contact_rows r LEFT JOIN domains d ON d.id=+r.domain_id;"
+    "CREATE TRIGGER contacts_insert INSTEAD OF INSERT ON contacts BEGIN"
+    " INSERT OR IGNORE INTO domains(name) SELECT " EMAIL_DOMAIN("NEW.email") " WHERE " EMAIL_HAS_DOMAIN("NEW.email") ";"
+    " INSERT INTO contact_rows(id,name,phone,email_local,domain_id,last_used,sort_key) VALUES(NEW.id,NEW.name,NEW.phone,"
+    EMAIL_LOCAL("NEW.email") "," EMAIL_DOMAIN_ID("NEW.email") ",coalesce(NEW.last_used,0),NEW.sort_key);"
+    " END;"
+    // a rename by another tool drops the stale key; SqliteOpen recomputes it
+    "CREATE TRIGGER contacts_update INSTEAD OF UPDATE ON contacts BEGIN"
+    " INSERT OR IGNORE INTO domains(name) SELECT " EMAIL_DOMAIN("NEW.email") " WHERE " EMAIL_HAS_DOMAIN("NEW.email") ";"
+    " UPDATE contact_rows SET id=NEW.id, name=NEW.name, phone=NEW.phone, email_local=" EMAIL_LOCAL("NEW.email") ","
+    " domain_id=" EMAIL_DOMAIN_ID("NEW.email") ", last_used=NEW.last_used,"
+    " sort_key=CASE WHEN NEW.name IS NOT OLD.name AND NEW.sort_key IS OLD.sort_key THEN NULL ELSE NEW.sort_key END"
+    " WHERE id=OLD.id;"
+    " END;"
+    "CREATE TRIGGER contacts_delete INSTEAD OF DELETE ON contacts BEGIN"
+    " DELETE FROM contact_rows WHERE id=OLD.id;"
+    " END;",
+    // 4: exact phone and email lookups for the duplicate check
+    "CREATE INDEX contact_rows_phone ON contact_rows(phone);"
+    "CREATE INDEX contact_rows_email ON contact_rows(email_local,domain_id);",
+    // 5: normalized keys (see Contact keys above), replacing the exact lookups
+    "ALTER TABLE contact_rows ADD COLUMN phone_key TEXT;"
+    "ALTER TABLE contact_rows ADD COLUMN email_key TEXT;"
+    "UPDATE contact_rows SET phone_key=" PHONE_KEY("phone") ", email_key=" EMAIL_KEY(
+    "CASE WHEN domain_id IS NULL THEN email_local ELSE email_local||'@'||(SELECT name FROM domains WHERE id=domain_id) END") ";"
+    "DROP INDEX contact_rows_phone;"
+    "DROP INDEX contact_rows_email;"
+    "CREATE INDEX contact_rows_phone_key ON contact_rows(phone_key);"
+    "CREATE INDEX contact_rows_email_key ON contact_rows(email_key);"
+    "DROP TRIGGER contacts_insert;"
+    "DROP TRIGGER contacts_update;"
+    "CREATE TRIGGER contacts_insert INSTEAD OF INSERT ON contacts BEGIN"
+    " INSERT OR IGNORE INTO domains(name) SELECT " EMAIL_DOMAIN("NEW.email") " WHERE " EMAIL_HAS_DOMAIN("NEW.email") ";"
+    " INSERT INTO contact_rows(id,name,phone,email_local,domain_id,last_used,sort_key,phone_key,email_key)"
+    " VALUES(NEW.id,NEW.name,NEW.phone," EMAIL_LOCAL("NEW.email") "," EMAIL_DOMAIN_ID("NEW.email") ","
+    "coalesce(NEW.last_used,0),NEW.sort_key," PHONE_KEY("NEW.phone") "," EMAIL_KEY("NEW.email") ");"
+    " END;"
+    "CREATE TRIGGER contacts_update INSTEAD OF UPDATE ON contacts BEGIN"
+    " INSERT OR IGNORE INTO domains(name) SELECT " EMAIL_DOMAIN("NEW.email") " WHERE " EMAIL_HAS_DOMAIN("NEW.email") ";"
+    " UPDATE contact_rows SET id=NEW.id, name=NEW.name, phone=NEW.phone, email_local=" EMAIL_LOCAL("NEW.email") ","
+    " domain_id=" EMAIL_DOMAIN_ID("NEW.email") ", last_used=NEW.last_used,"
+    " sort_key=CASE WHEN NEW.name IS NOT OLD.name AND NEW.sort_key IS OLD.sort_key THEN NULL ELSE NEW.sort_key END,"
+    " phone_key=" PHONE_KEY("NEW.phone") ", email_key=" EMAIL_KEY("NEW.email")
+    " WHERE id=OLD.id;"
+    " END;",
+};
+
+static int SqliteMigrate(void) {
+    sqlite3_stmt *stmt = NULL;
+    int version = 0;
+    int rc = sqlite3_prepare_v2(db, "PRAGMA user_version;", -1, &stmt, NULL);
+    if (rc == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) version = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+    int count = (int)(sizeof(sqliteMigrations) / sizeof(sqliteMigrations[0]));
+    for (; rc == SQLITE_OK && version < count; version++) {
+        char bump[64];
+        snprintf(bump, sizeof(bump), "PRAGMA user_version=%d;", version + 1);
+        rc = sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, 0);
+        if (rc == SQLITE_OK) rc = sqlite3_exec(db, sqliteMigrations[version], 0, 0, 0);
+        if (rc == SQLITE_OK) rc = sqlite3_exec(db, bump, 0, 0, 0);
+        if (rc == SQLITE_OK) rc = sqlite3_exec(db, "COMMIT;", 0, 0, 0);
+        if (rc != SQLITE_OK) {
+            char buf[512];
+            snprintf(buf, sizeof(buf), "Cannot upgrade database to version %d: %s", version + 1, sqlite3_errmsg(db));
+            sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+            sql_error(buf);
+        }
+    }
+    return rc;
+}
+
+static int SqliteOpen(const char *path) {
+    int rc = sqlite3_open(path, &db);
+    if (rc != SQLITE_OK) {
+        char buf[512];
+        snprintf(buf, sizeof(buf), "Cannot open database: %s", sqlite3_errmsg(db));
+        sql_error(buf);
+        sqlite3_close(db);
+        db = NULL;
+        return rc;
+    }
+    char *errmsg = 0;
+    const char *sql =
+      "CREATE TABLE IF NOT EXISTS contacts("
+      "id INTEGER PRIMARY KEY AUTOINCREMENT,"
+      "name TEXT NOT NULL,"
+      "phone TEXT,"
+      "email TEXT"
+      ");";
+    rc = sqlite3_exec(db, sql, 0, 0, &errmsg);
+    if (rc != SQLITE_OK) {
+        sql_error(errmsg);
+        sqlite3_free(errmsg);
+        sqlite3_close(db);
+        db = NULL;
+        return rc;
+    }
+    if (sqliteMem.pageCacheSlots > 0) {
+        // the default 2 MB cache would leave most of the slab unused
+        char pragma[64];
+        snprintf(pragma, sizeof(pragma), "PRAGMA cache_size=-%d;", sqliteMem.pageCacheSlots * (SQLMEM_PAGE_SIZE / 1024));
+        sqlite3_exec(db, pragma, 0, 0, 0);
+    }
+    // migrations compute sort keys, so the functions come first
+    rc = RegisterSearchFunctions(db);
+    if (rc == SQLITE_OK) rc = sqlite3_create_function_v2(db, "email_match", 3, SQLITE_UTF8 | SQLITE_INNOCUOUS, NULL, SqlEmailMatch, NULL, NULL, NULL);
+    if (rc != SQLITE_OK) sql_error(sqlite3_errmsg(db));
+    // a failed upgrade leaves the statements without the tables they read,
+    // so the store does not open; SqliteMigrate has said why
+    else if ((rc = SqliteMigrate()) == SQLITE_OK) {
+        // rows written by other tools have no key yet
+        sqlite3_exec(db, "UPDATE contact_rows SET sort_key=name_sort_key(name) WHERE sort_key IS NULL;", 0, 0, 0);
+        rc = RegisterSearchIndex(db);
+        if (rc != SQLITE_OK) sql_error(sqlite3_errmsg(db));
+    }
+    if (rc != SQLITE_OK) {
+        sqlite3_close(db);
+        db = NULL;
+    }
+    return rc;
+}
+
+static void SqliteClose(void) {
+    StopSlowQueryLog();
+    for (int i = 0; i < STMT_COUNT; i++) {
+        if (sqliteStmts[i]) sqlite3_finalize(sqliteStmts[i]);
+        sqliteStmts[i] = NULL;
+    }
+    sqlite3_finalize(sqliteUpsertStmt);
+    sqliteUpsertStmt = NULL;
+    sqliteUpsertShape = -1;
+    sqliteUniqueKeys = -1;
+    DomainCacheClear();
+    sqlite3_close(db);
+    db = NULL;
+}
+
+static int SqliteBegin(void) { return sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, 0); }
+static int SqliteCommit(void) { return sqlite3_exec(db, "COMMIT;", 0, 0, 0); }
+static void SqliteRollback(void) {
+    sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+    sqliteUniqueKeys = -1;
+    DomainCacheClear();
+}
+
+static int SqliteInsert(const char *name, const char *phone, const char *email) {
+    sqlite3_stmt *stmt = SqliteStmt(STMT_INSERT);
+    if (!stmt) return sqlite3_errcode(db);
+    sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, phone, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 3, email, -1, SQLITE_STATIC);
+    return SqliteStepDone(stmt);
+}
+
+static int SqliteUpdate(int id, const char *name, const char *phone, const char *email) {
+    sqlite3_stmt *stmt = SqliteStmt(STMT_UPDATE);
+    if (!stmt) return sqlite3_errcode(db);
+    sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, phone, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 3, email, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 4, id);
+    return SqliteStepDone(stmt);
+}
+
+static int SqliteRemove(int id) {
+    sqlite3_stmt *stmt = SqliteStmt(STMT_DELETE);
+    if (!stmt) return sqlite3_errcode(db);
+    sqlite3_bind_int(stmt, 1, id);
+    return SqliteStepDone(stmt);
+}
+
+static int SqliteRemoveMany(const int *ids, int count) {
+    int rc = SQLITE_OK;
+    for (int i = 0; rc == SQLITE_OK && i < count; i++) rc = SqliteRemove(ids[i]);
+    return rc;
+}
+
+static int SqliteTouch(int id) {
+    sqlite3_stmt *stmt = SqliteStmt(STMT_TOUCH);
+    if (!stmt) return sqlite3_errcode(db);
+    sqlite3_bind_int64(stmt, 1, (sqlite3_int64)time(NULL));
+    sqlite3_bind_int(stmt, 2, id);
+    return SqliteStepDone(stmt);
+}
+
+static int SqliteGet(int id, ContactRowFn fn, void *ctx) {
+    sqlite3_stmt *stmt = SqliteStmt(STMT_GET);
+    if (!stmt) return sqlite3_errcode(db);
+    sqlite3_bind_int(stmt, 1, id);
+    return SqliteEachRow(stmt, fn, ctx);
+}
+
+static int SqliteScan(ContactRowFn fn, void *ctx) {
+    DomainCacheCheck();
+    sqlite3_stmt *stmt = SqliteStmt(STMT_SCAN);
+    if (!stmt) return sqlite3_errcode(db);
+    return SqliteEachRow(stmt, fn, ctx);
+}
+
+static int SqliteSearch(const char *filter, ContactRowFn fn, void *ctx) {
+    DomainCacheCheck();
+    sqlite3_stmt *stmt = SqliteStmt(STMT_SEARCH);
+    if (!stmt) return sqlite3_errcode(db);
+    sqlite3_bind_text(stmt, 1, filter, -1, SQLITE_TRANSIENT);
+    return SqliteEachRow(stmt, fn, ctx);
+}
+
+// Upserts run as one statement built for the merge rules. With unique key
+// indexes (see SqliteSetUniqueKeys) that is INSERT ... ON CONFLICT DO
+// UPDATE; without them, an UPDATE ... FROM of the matching row, and a plain
+// insert when there was none. The statement is kept until the rules or the
+// indexes change.
+static const struct {
+    const char *cols[3];
+    const char *empty;          // the stored field is empty
+    const char *incoming;       // the incoming field is not
+    const char *key;            // NULL for fields without a unique key
+} upsertFields[3] = {
+    { { "name", "sort_key" }, "contact_rows.name=''", "excluded.name<>''", NULL },
+    { { "phone", "phone_key" }, "contact_rows.phone_key IS NULL", "excluded.phone_key IS NOT NULL", "phone_key" },
+    { { "email_local", "domain_id", "email_key" }, "contact_rows.email_key IS NULL", "excluded.email_key IS NOT NULL", "email_key" },
+};
+
+// col=CASE WHEN <take incoming> THEN excluded.col ELSE contact_rows.col END, ...
+// With unique keys the phone can match one contact and the email another;
+// the matched contact then keeps its own key rather than taking the one
+// the other contact holds, which the index would refuse.
+static void AppendMergeSet(char *sql, size_t size, const MergeRules *merge, BOOL unique) {
+    MergeRule rules[3] = { merge->name, merge->phone, merge->email };
+    size_t used = strlen(sql);
+    BOOL any = FALSE;
+    for (int f = 0; f < 3; f++) {
+        if (rules[f] == MERGE_KEEP) continue;
+        char take[256];
+        snprintf(take, sizeof(take), "%s", rules[f] == MERGE_FILL ? upsertFields[f].empty : upsertFields[f].incoming);
+        if (unique && upsertFields[f].key) {
+            size_t n = strlen(take);
+            snprintf(take + n, sizeof(take) - n,
+                     " AND NOT EXISTS(SELECT 1 FROM contact_rows AS other WHERE other.%s=excluded.%s AND other.id<>contact_rows.id)",
+                     upsertFields[f].key, upsertFields[f].key);
+        }
+        for (int c = 0; c < 3 && upsertFields[f].cols[c]; c++) {
+            const char *col = upsertFields[f].cols[c];
+            used += (size_t)snprintf(sql + used, size - used, "%s%s=CASE WHEN %s THEN excluded.%s ELSE contact_rows.%s END",
+                                     any ? "," : "", col, take, col, col);
+            any = TRUE;
+        }
+    }
+    if (!any) snprintf(sql + used, size - used, "last_used=contact_rows.last_used");
+}
+
+static sqlite3_stmt *SqliteUpsertStmt(const MergeRules *merge, BOOL unique) {
+    int shape = ((merge->name * 3 + merge->phone) * 3 + merge->email) * 2 + unique;
+    if (sqliteUpsertStmt && shape == sqliteUpsertShape) {
+        sqlite3_reset(sqliteUpsertStmt);
+        return sqliteUpsertStmt;
+    }
+    sqlite3_finalize(sqliteUpsertStmt);
+    sqliteUpsertStmt = NULL;
+
+    static const char *incomingAs =
+        "?1 AS name,?2 AS phone," EMAIL_LOCAL("?3") " AS email_local," EMAIL_DOMAIN_ID("?3") " AS domain_id,"
+        "name_sort_key(?1) AS sort_key," PHONE_KEY("?2") " AS phone_key," EMAIL_KEY("?3") " AS email_key";
+    char sql[8192];
+    if (unique) {
+        snprintf(sql, sizeof(sql),
+                 "INSERT INTO contact_rows(name,phone,email_local,domain_id,sort_key,phone_key,email_key) VALUES(%s)"
+                 " ON CONFLICT(phone_key) DO UPDATE SET ", UPSERT_VALUES);
+        AppendMergeSet(sql, sizeof(sql), merge, TRUE);
+        strncat(sql, " ON CONFLICT(email_key) DO UPDATE SET ", sizeof(sql) - strlen(sql) - 1);
+        AppendMergeSet(sql, sizeof(sql), merge, TRUE);
+    } else {
+        snprintf(sql, sizeof(sql), "UPDATE contact_rows SET ");
+        AppendMergeSet(sql, sizeof(sql), merge, FALSE);
+        size_t used = strlen(sql);
+        snprintf(sql + used, sizeof(sql) - used,
+                 " FROM (SELECT %s) AS excluded"
+                 " WHERE contact_rows.id=coalesce((SELECT min(id) FROM contact_rows WHERE phone_key=excluded.phone_key),"
+                 "(SELECT min(id) FROM contact_rows WHERE email_key=excluded.email_key))", incomingAs);
+    }
+    strncat(sql, " RETURNING id;", sizeof(sql) - strlen(sql) - 1);
+    if (sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &sqliteUpsertStmt, NULL) != SQLITE_OK) return NULL;
+    sqliteUpsertShape = shape;
+    return sqliteUpsertStmt;
+}
+
+static int SqliteUpsert(const char *name, const char *phone, const char *email, const MergeRules *merge, int *matchedId) {
+    *matchedId = 0;
+    // the new domain has to exist before its id can be looked up
+    sqlite3_stmt *stmt = SqliteStmt(STMT_ADD_DOMAIN);
+    if (!stmt) return sqlite3_errcode(db);
+    sqlite3_bind_text(stmt, 1, email, -1, SQLITE_STATIC);
+    int rc = SqliteStepDone(stmt);
+    if (rc != SQLITE_OK) return rc;
+
+    // The index kind is cached. Another connection may change it, which
+    // fails the ON CONFLICT statement, so that is retried once after
+    // reading it again.
+    for (int attempt = 0; ; attempt++) {
+        if (sqliteUniqueKeys < 0) {
+            if (!(stmt = SqliteStmt(STMT_UNIQUE_KEYS))) return sqlite3_errcode(db);
+            sqliteUniqueKeys = sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_int(stmt, 0);
+            SqliteRecordStmt(stmt);
+            sqlite3_reset(stmt);
+        }
+        BOOL unique = sqliteUniqueKeys;
+        if (!(stmt = SqliteUpsertStmt(merge, unique))) rc = sqlite3_errcode(db);
+        int id = 0;
+        sqlite3_int64 lastInsert = sqlite3_last_insert_rowid(db);
+        if (stmt) {
+            sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 2, phone, -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 3, email, -1, SQLITE_STATIC);
+            while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) id = sqlite3_column_int(stmt, 0);
+            sqlite3_reset(stmt);
+            if (rc == SQLITE_DONE) rc = SQLITE_OK;
+        }
+        if (rc == SQLITE_ERROR && attempt == 0) {
+            sqliteUniqueKeys = -1;
+            continue;
+        }
+        if (rc != SQLITE_OK) return rc;
+        if (unique) {
+            if (sqlite3_last_insert_rowid(db) == lastInsert) *matchedId = id;
+            return SQLITE_OK;
+        }
+        if (id) {
+            *matchedId = id;
+            return SQLITE_OK;
+        }
+        // no match: the domain is in place, so skip the view's trigger
+        if (!(stmt = SqliteStmt(STMT_INSERT_ROW))) return sqlite3_errcode(db);
+        sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, phone, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 3, email, -1, SQLITE_STATIC);
+        return SqliteStepDone(stmt);
+    }
+}
+
+// Makes the key indexes unique, so upserts can use ON CONFLICT and the
+// database itself refuses a second contact with the same phone or email,
+// or plain again. Fails with SQLITE_CONSTRAINT while keys are shared,
+// leaving the indexes as they were; *shared counts those keys.
+int SqliteSetUniqueKeys(BOOL unique, int *shared) {
+    *shared = 0;
+    sqlite3_stmt *stmt = NULL;
+    int rc = sqlite3_prepare_v2(db,
+        "SELECT (SELECT count(*) FROM (SELECT 1 FROM contact_rows WHERE phone_key IS NOT NULL GROUP BY phone_key HAVING count(*)>1))"
+        "+(SELECT count(*) FROM (SELECT 1 FROM contact_rows WHERE email_key IS NOT NULL GROUP BY email_key HAVING count(*)>1));",
+        -1, &stmt, NULL);
+    if (rc != SQLITE_OK) return rc;
+    if (sqlite3_step(stmt) == SQLITE_ROW) *shared = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+    if (unique && *shared) return SQLITE_CONSTRAINT;
+
+    const char *kind = unique ? "UNIQUE INDEX" : "INDEX";
+    char sql[512];
+    snprintf(sql, sizeof(sql),
+             "SAVEPOINT unique_keys;"
+             "DROP INDEX IF EXISTS contact_rows_phone_key;"
+             "DROP INDEX IF EXISTS contact_rows_email_key;"
+             "CREATE %s contact_rows_phone_key ON contact_rows(phone_key);"
+             "CREATE %s contact_rows_email_key ON contact_rows(email_key);"
+             "RELEASE unique_keys;", kind, kind);
+    rc = sqlite3_exec(db, sql, 0, 0, 0);
+    if (rc != SQLITE_OK) sqlite3_exec(db, "ROLLBACK TO unique_keys; RELEASE unique_keys;", 0, 0, 0);
+    sqliteUniqueKeys = -1;
+    return rc;
+}
+
+static int SqliteLookup(const char *phone, const char *email, ContactRowFn fn, void *ctx) {
+    DomainCacheCheck();
+    sqlite3_stmt *stmt = SqliteStmt(STMT_LOOKUP);
+    if (!stmt) return sqlite3_errcode(db);
+    sqlite3_bind_text(stmt, 1, phone, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 2, email, -1, SQLITE_TRANSIENT);
+    return SqliteEachRow(stmt, fn, ctx);
+}
+
+static const char *SqliteErrmsg(void) { return sqlite3_errmsg(db); }
+
+const ContactStore sqliteStore = {
+    "sqlite", SqliteOpen, SqliteClose, SqliteBegin, SqliteCommit, SqliteRollback,
+    SqliteInsert, SqliteUpdate, SqliteRemove, SqliteRemoveMany, SqliteTouch, SqliteGet, SqliteScan, SqliteSearch, SqliteLookup, SqliteUpsert, SqliteErrmsg
+};
+
+// Upsert for stores without a single statement for it, and the bench's
+// select-then-write baseline: look the keys up, merge in C, then write.
+typedef struct {
+    char phoneKey[CONTACT_KEY_MAX], emailKey[CONTACT_KEY_MAX];
+    int phoneId, emailId;       // lowest id with each key
+    char *fields[2][3];         // by phone, by email
+} UpsertMatch;
+
+static int UpsertMatchRow(void *ctx, int id, const char *name, const char *phone, const char *email) {
+    UpsertMatch *m = ctx;
+    char key[CONTACT_KEY_MAX];
+    int slot = -1;
+    if (m->phoneKey[0] && PhoneKey(phone, key, sizeof(key)) && strcmp(key, m->phoneKey) == 0) {
+        if (!m->phoneId || id < m->phoneId) { m->phoneId = id; slot = 0; }
+    } else if (m->emailKey[0] && EmailKey(email, key, sizeof(key)) && strcmp(key, m->emailKey) == 0) {
+        if (!m->emailId || id < m->emailId) { m->emailId = id; slot = 1; }
+    }
+    if (slot >= 0) {
+        const char *values[3] = { name, phone, email };
+        for (int f = 0; f < 3; f++) {
+            free(m->fields[slot][f]);
+            m->fields[slot][f] = _strdup(values[f]);
+        }
+    }
+    return 0;
+}
+
+static const char *MergeField(MergeRule rule, const char *existing, BOOL existingEmpty, const char *incoming, BOOL incomingEmpty) {
+    if (rule == MERGE_FILL) return existingEmpty ? incoming : existing;
+    if (rule == MERGE_OVERWRITE) return incomingEmpty ? existing : incoming;
+    return existing;
+}
+
+int UpsertByLookup(const ContactStore *s, const char *name, const char *phone, const char *email,
+                   const MergeRules *merge, int *matchedId) {
+    *matchedId = 0;
+    UpsertMatch *m = calloc(1, sizeof(UpsertMatch));
+    if (!m) return SQLITE_NOMEM;
+    PhoneKey(phone, m->phoneKey, sizeof(m->phoneKey));
+    EmailKey(email, m->emailKey, sizeof(m->emailKey));
+    int rc = s->lookup(phone, email, UpsertMatchRow, m);
+    char **old = m->fields[m->phoneId ? 0 : 1];
+    int id = m->phoneId ? m->phoneId : m->emailId;
+    if (rc == SQLITE_OK && !id) {
+        rc = s->insert(name, phone, email);
+    } else if (rc == SQLITE_OK && (!old[0] || !old[1] || !old[2])) {
+        rc = SQLITE_NOMEM;
+    } else if (rc == SQLITE_OK) {
+        char key[CONTACT_KEY_MAX];
+        rc = s->update(id,
+                       MergeField(merge->name, old[0], !old[0][0], name, !name[0]),
+                       MergeField(merge->phone, old[1], !PhoneKey(old[1], key, sizeof(key)), phone, !m->phoneKey[0]),
+                       MergeField(merge->email, old[2], !EmailKey(old[2], key, sizeof(key)), email, !m->emailKey[0]));
+        if (rc == SQLITE_OK) *matchedId = id;
+    }
+    for (int i = 0; i < 6; i++) free(m->fields[i / 3][i % 3]);
+    free(m);
+    return rc;
+}
+
+// In-memory backend: an id hash (linear probing) plus an array kept sorted
+// by sort key, so scans come out in the same order as ORDER BY sort_key.
+//
+// Rows are packed so that large books stay small. Each contact is a single
+// record in the index's chunked arena, with no per-string mallocs. After
+// the fixed fields come:
+//
+//   the sort key (folded name, 0x01, name) and a NUL; the name is read in place
+//   varint phone length << 1 | packed, then the phone two characters per
+//       byte (digits, space, - ( ) + .), or its raw bytes and a NUL
+//   varint domain id, then the email's local part and a NUL; domains are
+//       interned once per process, and id 0 means the whole email is inline
+//
+// Replaced and removed records leave holes. Once the holes outweigh the
+// live records, the live ones are copied into a fresh arena in name order.
+
+#define MEM_FIELD_MAX 256   // longer phones and emails stay inline and unpacked
+
+typedef struct MemContact {
+    int id;
+    unsigned int visitMark;   // generation of the last in-memory query that visited it
+    long long lastUsed;       // unix time, 0 if never
+    // first bytes of words, for ranked search's score bound
+    unsigned int nameTokens;
+    unsigned int otherTokens;   // phone and email
+    unsigned int nameAt;        // offsets into rec
+    unsigned int phoneAt;
+    unsigned int emailAt;
+    unsigned int size;          // bytes in rec
+    unsigned char nameFirst, phoneFirst, emailFirst;
+    unsigned char rec[];
+} MemContact;
+
+typedef struct MemIndex {
+    MemContact **slots;   // id -> contact, open addressing
+    size_t slotCap;       // power of two
+    MemContact **byName;  // sorted by (sortKey, id)
+    size_t count;
+    size_t cap;
+    int nextId;
+    Arena records;
+    size_t liveBytes;     // records still referenced
+    size_t holeBytes;     // records replaced or removed since the last compaction
+} MemIndex;
+
+static MemIndex memIndex;
+static const char *memError = "not an error";
+
+typedef struct {
+    char **names;             // id - 1 -> domain
+    unsigned int count;
+    unsigned int cap;
+    unsigned int *slots;      // ids, open addressing
+    unsigned int slotCap;     // power of two
+    size_t bytes;
+} DomainTable;
+
+static DomainTable memDomains;
+
+static unsigned int DomainHash(const char *s, size_t len) {
+    unsigned int h = 2166136261u;
+    for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)s[i]) * 16777619u;
+    return h;
+}
+
+// Id of the domain (len bytes), interned on first use; 0 if out of memory.
+static unsigned int InternDomain(const char *s, size_t len) {
+    DomainTable *t = &memDomains;
+    if ((t->count + 1) * 2 > t->slotCap) {
+        unsigned int cap = t->slotCap ? t->slotCap * 2 : 256;
+        unsigned int *slots = (unsigned int *)calloc(cap, sizeof(*slots));
+        if (!slots) return 0;
+        for (unsigned int id = 1; id <= t->count; id++) {
+            unsigned int i = DomainHash(t->names[id - 1], strlen(t->names[id - 1])) & (cap - 1);
+            while (slots[i]) i = (i + 1) & (cap - 1);
+            slots[i] = id;
+        }
+        free(t->slots);
+        t->slots = slots;
+        t->slotCap = cap;
+    }
+    unsigned int mask = t->slotCap - 1;
+    unsigned int i = DomainHash(s, len) & mask;
+    for (; t->slots[i]; i = (i + 1) & mask) {
+        const char *d = t->names[t->slots[i] - 1];
+        if (strncmp(d, s, len) == 0 && d[len] == '\0') return t->slots[i];
+    }
+    if (t->count == t->cap) {
+        unsigned int cap = t->cap ? t->cap * 2 : 64;
+        char **names = (char **)realloc(t->names, cap * sizeof(*names));
+        if (!names) return 0;
+        t->names = names;
+        t->cap = cap;
+    }
+    char *copy = (char *)malloc(len + 1);
+    if (!copy) return 0;
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    t->names[t->count++] = copy;
+    t->bytes += len + 1 + sizeof(char *) + 2 * sizeof(unsigned int);
+    t->slots[i] = t->count;
+    return t->count;
+}
+
+static const char phoneNibbles[] = "0123456789 -()+.";
+
+static int PhoneNibble(unsigned char ch) {
+    const char *p = ch ? strchr(phoneNibbles, ch) : NULL;
+    return p ? (int)(p - phoneNibbles) : -1;
+}
+
+static unsigned char *PutVarint(unsigned char *p, size_t v) {
+    while (v >= 0x80) {
+        *p++ = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (unsigned char)v;
+    return p;
+}
+
+static size_t GetVarint(const unsigned char **p) {
+    size_t v = 0;
+    int shift = 0;
+    unsigned char b;
+    do {
+        b = *(*p)++;
+        v |= (size_t)(b & 0x7F) << shift;
+        shift += 7;
+    } while (b & 0x80);
+    return v;
+}
+
+static const char *MemSortKey(const MemContact *c) { return (const char *)c->rec; }
+static const char *MemName(const MemContact *c) { return (const char *)c->rec + c->nameAt; }
+
+// The phone as a string; buf (MEM_FIELD_MAX bytes) holds it if it was packed.
+static const char *MemPhone(const MemContact *c, char *buf) {
+    const unsigned char *p = c->rec + c->phoneAt;
+    size_t v = GetVarint(&p);
+    if (!(v & 1)) return (const char *)p;
+    size_t len = v >> 1;
+    for (size_t i = 0; i < len; i += 2, p++) {
+        buf[i] = phoneNibbles[*p >> 4];
+        buf[i + 1] = phoneNibbles[*p & 0x0F];
+    }
+    buf[len] = '\0';
+    return buf;
+}
+
+// The email as a string; buf (MEM_FIELD_MAX bytes) holds it if its domain
+// was interned.
+static const char *MemEmail(const MemContact *c, char *buf) {
+    const unsigned char *p = c->rec + c->emailAt;
+    size_t domain = GetVarint(&p);
+    if (!domain) return (const char *)p;
+    size_t len = strlen((const char *)p);
+    memcpy(buf, p, len);
+    buf[len] = '@';
+    strcpy(buf + len + 1, memDomains.names[domain - 1]);
+    return buf;
+}
+
+typedef struct {
+    const char *name;
+    const char *phone;
+    const char *email;
+    char phoneBuf[MEM_FIELD_MAX];
+    char emailBuf[MEM_FIELD_MAX];
+} MemRow;
+
+static const MemRow *MemRowOf(const MemContact *c, MemRow *row) {
+    row->name = MemName(c);
+    row->phone = MemPhone(c, row->phoneBuf);
+    row->email = MemEmail(c, row->emailBuf);
+    return row;
+}
+
+static size_t MemHashSlot(const MemIndex *ix, int id) {
+    return ((unsigned int)id * 2654435761u) & (ix->slotCap - 1);
+}
+
+static int MemCompare(const MemContact *a, const char *sortKey, int id) {
+    int c = strcmp(MemSortKey(a), sortKey);
+    if (c) return c;
+    return (a->id > id) - (a->id < id);
+}
+
+// first position in byName whose (sortKey, id) is not less than the key
+static size_t MemLowerBound(const MemIndex *ix, const char *sortKey, int id) {
+    size_t lo = 0, hi = ix->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (MemCompare(ix->byName[mid], sortKey, id) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+MemContact *MemIndexFind(const MemIndex *ix, int id) {
+    if (!ix->slotCap) return NULL;
+    size_t i = MemHashSlot(ix, id);
+    while (ix->slots[i]) {
+        if (ix->slots[i]->id == id) return ix->slots[i];
+        i = (i + 1) & (ix->slotCap - 1);
+    }
+    return NULL;
+}
+
+static void MemHashInsert(MemIndex *ix, MemContact *c) {
+    size_t i = MemHashSlot(ix, c->id);
+    while (ix->slots[i]) i = (i + 1) & (ix->slotCap - 1);
+    ix->slots[i] = c;
+}
+
+// backward-shift deletion keeps probe chains intact without tombstones
+static void MemHashRemove(MemIndex *ix, int id) {
+    size_t mask = ix->slotCap - 1;
+    size_t i = MemHashSlot(ix, id);
+    while (ix->slots[i] && ix->slots[i]->id != id) i = (i + 1) & mask;
+    if (!ix->slots[i]) return;
+    ix->slots[i] = NULL;
+    for (size_t j = (i + 1) & mask; ix->slots[j]; j = (j + 1) & mask) {
+        size_t k = MemHashSlot(ix, ix->slots[j]->id);
+        BOOL between = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+        if (!between) {
+            ix->slots[i] = ix->slots[j];
+            ix->slots[j] = NULL;
+            i = j;
+        }
+    }
+}
+
+static BOOL MemReserve(MemIndex *ix, size_t n) {
+    if (n > ix->cap) {
+        size_t cap = ix->cap ? ix->cap * 2 : 256;
+        while (cap < n) cap *= 2;
+        MemContact **p = (MemContact **)realloc(ix->byName, cap * sizeof(*p));
+        if (!p) return FALSE;
+        ix->byName = p;
+        ix->cap = cap;
+    }
+    if (n * 2 > ix->slotCap) {
+        size_t cap = ix->slotCap ? ix->slotCap * 2 : 512;
+        while (cap < n * 2) cap *= 2;
+        MemContact **slots = (MemContact **)calloc(cap, sizeof(*slots));
+        if (!slots) return FALSE;
+        free(ix->slots);
+        ix->slots = slots;
+        ix->slotCap = cap;
+        for (size_t i = 0; i < ix->count; i++) MemHashInsert(ix, ix->byName[i]);
+    }
+    return TRUE;
+}
+
+static void MemSortedInsert(MemIndex *ix, MemContact *c) {
+    size_t pos = MemLowerBound(ix, MemSortKey(c), c->id);
+    memmove(&ix->byName[pos + 1], &ix->byName[pos], (ix->count - pos) * sizeof(*ix->byName));
+    ix->byName[pos] = c;
+    ix->count++;
+}
+
+static void MemSortedRemove(MemIndex *ix, MemContact *c) {
+    size_t pos = MemLowerBound(ix, MemSortKey(c), c->id);
+    memmove(&ix->byName[pos], &ix->byName[pos + 1], (ix->count - pos - 1) * sizeof(*ix->byName));
+    ix->count--;
+}
+
+// Bit for a word's first byte: a-z case-folded, one bit for digits and
+// one for everything else.
+static unsigned int TokenBit(unsigned char c) {
+    if (charClass[c] & CC_ALPHA) return 1u << (FOLD(c) - 'a');
+    return (charClass[c] & CC_DIGIT) ? 1u << 26 : 1u << 27;
+}
+
+static unsigned int TokenStartMask(const char *s) {
+    unsigned int mask = 0;
+    BOOL start = TRUE;
+    for (const unsigned char *p = (const unsigned char *)s; *p; p++) {
+        if (start) mask |= TokenBit(*p);
+        start = !(charClass[*p] & (CC_ALPHA | CC_DIGIT | CC_HIGH));
+    }
+    return mask;
+}
+
+// Encodes the record into buf, which holds MEM_RECORD_MAX of the lengths.
+#define MEM_RECORD_MAX(name, phone, email) (SORT_KEY_MAX(name) + (phone) + (email) + 24)
+
+static size_t MemEncode(MemContact *c, unsigned char *buf, const char *name, const char *phone, const char *email) {
+    size_t nameLen = strlen(name), phoneLen = strlen(phone);
+    size_t keyLen = NameSortKey(name, nameLen, (char *)buf);
+    c->nameAt = (unsigned int)(keyLen - nameLen);
+    unsigned char *p = buf + keyLen + 1;
+
+    c->phoneAt = (unsigned int)(p - buf);
+    BOOL packed = phoneLen > 0 && phoneLen < MEM_FIELD_MAX;
+    for (size_t i = 0; packed && i < phoneLen; i++) packed = PhoneNibble((unsigned char)phone[i]) >= 0;
+    p = PutVarint(p, phoneLen << 1 | (packed ? 1 : 0));
+    if (packed) {
+        for (size_t i = 0; i < phoneLen; i += 2) {
+            int lo = i + 1 < phoneLen ? PhoneNibble((unsigned char)phone[i + 1]) : 0;
+            *p++ = (unsigned char)(PhoneNibble((unsigned char)phone[i]) << 4 | lo);
+        }
+    } else {
+        memcpy(p, phone, phoneLen + 1);
+        p += phoneLen + 1;
+    }
+
+    c->emailAt = (unsigned int)(p - buf);
+    const char *at = strrchr(email, '@');
+    unsigned int domain = 0;
+    if (at && at[1] && strlen(email) < MEM_FIELD_MAX) domain = InternDomain(at + 1, strlen(at + 1));
+    size_t localLen = domain ? (size_t)(at - email) : strlen(email);
+    p = PutVarint(p, domain);
+    memcpy(p, email, localLen);
+    p[localLen] = '\0';
+    p += localLen + 1;
+    return (size_t)(p - buf);
+}
+
+// Copies the live records into a fresh arena, in name order, and drops the
+// old one.
+static int MemCompact(MemIndex *ix) {
+    Arena fresh;
+    ZeroMemory(&fresh, sizeof(fresh));
+    fresh.name = ix->records.name;
+    MemContact **moved = (MemContact **)malloc((ix->count ? ix->count : 1) * sizeof(*moved));
+    if (!moved) return SQLITE_NOMEM;
+    for (size_t i = 0; i < ix->count; i++) {
+        const MemContact *c = ix->byName[i];
+        moved[i] = (MemContact *)ArenaAlloc(&fresh, sizeof(MemContact) + c->size);
+        if (!moved[i]) {
+            ArenaFree(&fresh);
+            free(moved);
+            return SQLITE_NOMEM;
+        }
+        memcpy(moved[i], c, sizeof(MemContact) + c->size);
+    }
+    memcpy(ix->byName, moved, ix->count * sizeof(*moved));
+    free(moved);
+    ZeroMemory(ix->slots, ix->slotCap * sizeof(*ix->slots));
+    for (size_t i = 0; i < ix->count; i++) MemHashInsert(ix, ix->byName[i]);
+    ArenaFree(&ix->records);
+    ix->records = fresh;
+    ix->holeBytes = 0;
+    return SQLITE_OK;
+}
+
+static void MemContactDrop(MemIndex *ix, MemContact *c) {
+    size_t bytes = sizeof(MemContact) + c->size;
+    ix->liveBytes -= bytes;
+    ix->holeBytes += bytes;
+}
+
+// Inserts or replaces the contact with the given id.
+int MemIndexPut(MemIndex *ix, int id, const char *name, const char *phone, const char *email) {
+    if (!name) name = "";
+    if (!phone) phone = "";
+    if (!email) email = "";
+    if (!MemReserve(ix, ix->count + 1)) return SQLITE_NOMEM;
+    MemContact header;
+    ZeroMemory(&header, sizeof(header));
+    unsigned char stackBuf[1024];
+    size_t max = MEM_RECORD_MAX(strlen(name), strlen(phone), strlen(email));
+    unsigned char *buf = max <= sizeof(stackBuf) ? stackBuf : (unsigned char *)malloc(max);
+    if (!buf) return SQLITE_NOMEM;
+    header.size = (unsigned int)MemEncode(&header, buf, name, phone, email);
+    MemContact *c = (MemContact *)ArenaAlloc(&ix->records, sizeof(MemContact) + header.size);
+    if (c) {
+        *c = header;
+        memcpy(c->rec, buf, header.size);
+    }
+    if (buf != stackBuf) free(buf);
+    if (!c) return SQLITE_NOMEM;
+    c->id = id;
+    c->nameTokens = TokenStartMask(name);
+    c->otherTokens = TokenStartMask(phone) | TokenStartMask(email);
+    c->nameFirst = FOLD(name[0]);
+    c->phoneFirst = FOLD(phone[0]);
+    c->emailFirst = FOLD(email[0]);
+    ix->liveBytes += sizeof(MemContact) + c->size;
+
+    MemContact *old = MemIndexFind(ix, id);
+    if (old) {
+        c->lastUsed = old->lastUsed;
+        MemSortedRemove(ix, old);
+        MemHashRemove(ix, id);
+        MemContactDrop(ix, old);
+    }
+    MemHashInsert(ix, c);
+    MemSortedInsert(ix, c);
+    if (id >= ix->nextId) ix->nextId = id + 1;
+    if (ix->holeBytes > ix->liveBytes && ix->holeBytes > ARENA_CHUNK_SIZE) MemCompact(ix);
+    return SQLITE_OK;
+}
+
+int MemIndexRemove(MemIndex *ix, int id) {
+    MemContact *c = MemIndexFind(ix, id);
+    if (!c) return SQLITE_OK;
+    MemSortedRemove(ix, c);
+    MemHashRemove(ix, id);
+    MemContactDrop(ix, c);
+    if (ix->holeBytes > ix->liveBytes && ix->holeBytes > ARENA_CHUNK_SIZE) MemCompact(ix);
+    return SQLITE_OK;
+}
+
+// Removing rows one at a time moves the tail of the name order each time;
+// this drops them all from the id hash first and closes the gaps in one pass.
+int MemIndexRemoveMany(MemIndex *ix, const int *ids, int count) {
+    int removed = 0;
+    for (int i = 0; i < count; i++) {
+        MemContact *c = MemIndexFind(ix, ids[i]);
+        if (!c) continue;
+        MemHashRemove(ix, ids[i]);
+        MemContactDrop(ix, c);
+        removed++;
+    }
+    if (!removed) return SQLITE_OK;
+    size_t kept = 0;
+    for (size_t i = 0; i < ix->count; i++) {
+        MemContact *c = ix->byName[i];
+        if (MemIndexFind(ix, c->id) == c) ix->byName[kept++] = c;
+    }
+    ix->count = kept;
+    if (ix->holeBytes > ix->liveBytes && ix->holeBytes > ARENA_CHUNK_SIZE) MemCompact(ix);
+    return SQLITE_OK;
+}
+
+void MemIndexTouch(MemIndex *ix, int id, long long when) {
+    MemContact *c = MemIndexFind(ix, id);
+    if (c) c->lastUsed = when;
+}
+
+void MemIndexClear(MemIndex *ix) {
+    free(ix->byName);
+    free(ix->slots);
+    const char *name = ix->records.name;
+    ArenaFree(&ix->records);
+    ZeroMemory(ix, sizeof(*ix));
+    ix->records.name = name;
+    ix->nextId = 1;
+}
+
+typedef struct {
+    size_t count;
+    size_t recordBytes;     // live records, fixed fields included
+    size_t holeBytes;
+    size_t arenaBytes;      // chunks held
+    size_t indexBytes;      // id hash and name order
+    size_t domainBytes;     // shared by every index
+    unsigned int domains;
+} MemIndexStats;
+
+void GetMemIndexStats(const MemIndex *ix, MemIndexStats *s) {
+    s->count = ix->count;
+    s->recordBytes = ix->liveBytes;
+    s->holeBytes = ix->holeBytes;
+    s->arenaBytes = ix->records.reserved;
+    s->indexBytes = (ix->cap + ix->slotCap) * sizeof(MemContact *);
+    s->domainBytes = memDomains.bytes + memDomains.slotCap * sizeof(unsigned int);
+    s->domains = memDomains.count;
+}
+
+// Seeds the index from an existing database file, read-only. A missing or
+// unreadable file just leaves the index empty.
+void MemIndexLoadDatabase(MemIndex *ix, const char *path) {
+    sqlite3 *src = NULL;
+    if (sqlite3_open_v2(path, &src, SQLITE_OPEN_READONLY, NULL) == SQLITE_OK) {
+        sqlite3_stmt *stmt = NULL;
+        if (sqlite3_prepare_v2(src, "SELECT id,name,phone,email FROM contacts;", -1, &stmt, NULL) == SQLITE_OK) {
+            while (sqlite3_step(stmt) == SQLITE_ROW) {
+                if (MemIndexPut(ix, sqlite3_column_int(stmt, 0),
+                                (const char *)sqlite3_column_text(stmt, 1),
+                                (const char *)sqlite3_column_text(stmt, 2),
+                                (const char *)sqlite3_column_text(stmt, 3)) != SQLITE_OK) {
+                    break;
+                }
+            }
+        }
+        sqlite3_finalize(stmt);
+    }
+    sqlite3_close(src);
+}
+
+static int MemRowFn(ContactRowFn fn, void *ctx, const MemContact *c) {
+    MemRow row;
+    MemRowOf(c, &row);
+    return fn(ctx, c->id, row.name, row.phone, row.email);
+}
+
+int MemIndexGet(const MemIndex *ix, int id, ContactRowFn fn, void *ctx) {
+    MemContact *c = MemIndexFind(ix, id);
+    if (c) MemRowFn(fn, ctx, c);
+    return SQLITE_OK;
+}
+
+int MemIndexScan(const MemIndex *ix, ContactRowFn fn, void *ctx) {
+    size_t i;
+    for (i = 0; i < ix->count; i++) {
+        if (MemRowFn(fn, ctx, ix->byName[i])) { i++; break; }
+    }
+    lastRowsScanned = i;
+    return SQLITE_OK;
+}
+
+// same matching as the SQLite search query
+static BOOL MemContactMatches(const MemContact *c, const SearchNeedle *n) {
+    char buf[MEM_FIELD_MAX];
+    const char *name = MemName(c);
+    if (FindNoCase((const unsigned char *)name, strlen(name), n)) return TRUE;
+    const char *phone = MemPhone(c, buf);
+    if (PhoneMatches((const unsigned char *)phone, strlen(phone), n)) return TRUE;
+    const char *email = MemEmail(c, buf);
+    return FindNoCase((const unsigned char *)email, strlen(email), n);
+}
+
+int MemIndexSearch(const MemIndex *ix, const char *filter, ContactRowFn fn, void *ctx) {
+    SearchNeedle *n = SearchNeedleNew(filter);
+    if (!n) return SQLITE_NOMEM;
+    size_t i;
+    for (i = 0; i < ix->count; i++) {
+        MemContact *c = ix->byName[i];
+        if (MemContactMatches(c, n)) {
+            if (MemRowFn(fn, ctx, c)) { i++; break; }
+        }
+    }
+    free(n);
+    lastRowsScanned = i;
+    return SQLITE_OK;
+}
+
+// Rows with the same phone or email key (see Contact keys). There is no
+// index to use, but the rows are in memory and the callers only get here
+// for a possible match or a write.
+int MemIndexLookup(const MemIndex *ix, const char *phone, const char *email, ContactRowFn fn, void *ctx) {
+    char phoneKey[CONTACT_KEY_MAX], emailKey[CONTACT_KEY_MAX], buf[MEM_FIELD_MAX], key[CONTACT_KEY_MAX];
+    BOOL byPhone = PhoneKey(phone, phoneKey, sizeof(phoneKey)) > 0;
+    BOOL byEmail = EmailKey(email, emailKey, sizeof(emailKey)) > 0;
+    size_t i;
+    for (i = 0; (byPhone || byEmail) && i < ix->count; i++) {
+        MemContact *c = ix->byName[i];
+        BOOL hit = byPhone && PhoneKey(MemPhone(c, buf), key, sizeof(key)) && strcmp(key, phoneKey) == 0;
+        if (!hit && byEmail) hit = EmailKey(MemEmail(c, buf), key, sizeof(key)) && strcmp(key, emailKey) == 0;
+        if (hit && MemRowFn(fn, ctx, c)) { i++; break; }
+    }
+    lastRowsScanned = i;
+    return SQLITE_OK;
+}
+
+static int MemOpen(const char *path) {
+    MemIndexClear(&memIndex);
+    MemIndexLoadDatabase(&memIndex, path);
+    return SQLITE_OK;
+}
+
+// A transaction keeps an undo journal: the earlier version of each contact
+// it writes, or that the contact did not exist. Rollback puts those back
+// newest first. Recency is not journaled, as in the log store.
+typedef struct {
+    int id;
+    BOOL existed;
+    long long lastUsed;
+    const char *name, *phone, *email;   // in memUndoArena
+} MemUndo;
+
+static BOOL memInTxn = FALSE;
+static MemUndo *memUndo = NULL;
+static size_t memUndoCount = 0, memUndoCap = 0;
+static int memUndoNextId = 1;
+Arena memUndoArena = { "undo" };
+
+static void MemUndoReset(void) {
+    memInTxn = FALSE;
+    memUndoCount = 0;
+    ArenaReset(&memUndoArena);
+}
+
+static int MemJournal(int id) {
+    if (!memInTxn) return SQLITE_OK;
+    if (memUndoCount == memUndoCap) {
+        size_t cap = memUndoCap ? memUndoCap * 2 : 256;
+        MemUndo *p = (MemUndo *)realloc(memUndo, cap * sizeof(*p));
+        if (!p) {
+            memError = "out of memory";
+            return SQLITE_NOMEM;
+        }
+        memUndo = p;
+        memUndoCap = cap;
+    }
+    MemUndo *u = &memUndo[memUndoCount];
+    ZeroMemory(u, sizeof(*u));
+    u->id = id;
+    const MemContact *c = MemIndexFind(&memIndex, id);
+    if (c) {
+        MemRow row;
+        MemRowOf(c, &row);
+        u->existed = TRUE;
+        u->lastUsed = c->lastUsed;
+        u->name = ArenaCopy(&memUndoArena, row.name);
+        u->phone = ArenaCopy(&memUndoArena, row.phone);
+        u->email = ArenaCopy(&memUndoArena, row.email);
+        if (!u->name || !u->phone || !u->email) {
+            memError = "out of memory";
+            return SQLITE_NOMEM;
+        }
+    }
+    memUndoCount++;
+    return SQLITE_OK;
+}
+
+static void MemClose(void) {
+    MemUndoReset();
+    MemIndexClear(&memIndex);
+}
+
+static int MemBegin(void) {
+    if (memInTxn) {
+        memError = "cannot start a transaction within a transaction";
+        return SQLITE_ERROR;
+    }
+    MemUndoReset();
+    memInTxn = TRUE;
+    memUndoNextId = memIndex.nextId;
+    return SQLITE_OK;
+}
+
+static int MemCommit(void) {
+    MemUndoReset();
+    return SQLITE_OK;
+}
+
+static void MemRollback(void) {
+    if (!memInTxn) return;
+    for (size_t i = memUndoCount; i-- > 0; ) {
+        const MemUndo *u = &memUndo[i];
+        if (u->existed) {
+            MemIndexPut(&memIndex, u->id, u->name, u->phone, u->email);
+            MemIndexTouch(&memIndex, u->id, u->lastUsed);
+        } else {
+            MemIndexRemove(&memIndex, u->id);
+        }
+    }
+    memIndex.nextId = memUndoNextId;
+    MemUndoReset();
+}
+
+static int MemInsert(const char *name, const char *phone, const char *email) {
+    int rc = MemJournal(memIndex.nextId);
+    if (rc == SQLITE_OK) rc = MemIndexPut(&memIndex, memIndex.nextId, name, phone, email);
+    if (rc != SQLITE_OK) memError = "out of memory";
+    return rc;
+}
+
+static int MemUpdate(int id, const char *name, const char *phone, const char *email) {
+    if (!MemIndexFind(&memIndex, id)) return SQLITE_OK; // same as UPDATE matching no rows
+    int rc = MemJournal(id);
+    if (rc == SQLITE_OK) rc = MemIndexPut(&memIndex, id, name, phone, email);
+    if (rc != SQLITE_OK) memError = "out of memory";
+    return rc;
+}
+
+static int MemRemove(int id) {
+    if (!MemIndexFind(&memIndex, id)) return SQLITE_OK;
+    int rc = MemJournal(id);
+    return rc == SQLITE_OK ? MemIndexRemove(&memIndex, id) : rc;
+}
+
+static int MemRemoveMany(const int *ids, int count) {
+    for (int i = 0; i < count; i++) {
+        if (!MemIndexFind(&memIndex, ids[i])) continue;
+        int rc = MemJournal(ids[i]);
+        if (rc != SQLITE_OK) return rc;
+    }
+    return MemIndexRemoveMany(&memIndex, ids, count);
+}
+static int MemTouch(int id) { MemIndexTouch(&memIndex, id, (long long)time(NULL)); return SQLITE_OK; }
+
+static int MemGet(int id, ContactRowFn fn, void *ctx) { return MemIndexGet(&memIndex, id, fn, ctx); }
+static int MemScan(ContactRowFn fn, void *ctx) { return MemIndexScan(&memIndex, fn, ctx); }
+static int MemSearch(const char *filter, ContactRowFn fn, void *ctx) { return MemIndexSearch(&memIndex, filter, fn, ctx); }
+static int MemLookup(const char *phone, const char *email, ContactRowFn fn, void *ctx) { return MemIndexLookup(&memIndex, phone, email, fn, ctx); }
+
+extern const ContactStore memoryStore;
+static int MemUpsert(const char *name, const char *phone, const char *email, const MergeRules *merge, int *matchedId) {
+    return UpsertByLookup(&memoryStore, name, phone, email, merge, matchedId);
+}
+
+static const char *MemErrmsg(void) { return memError; }
+
+const ContactStore memoryStore = {
+    "memory", MemOpen, MemClose, MemBegin, MemCommit, MemRollback,
+    MemInsert, MemUpdate, MemRemove, MemRemoveMany, MemTouch, MemGet, MemScan, MemSearch, MemLookup, MemUpsert, MemErrmsg
+};
+
+// Log-structured backend: every write appends a checksummed record to
+// contacts.log and updates an in-memory MemIndex. Opening replays the log;
+// a torn tail left by a crash is dropped by rewriting the live records.
+// The log is compacted the same way once most of it is dead records.
+
+#define LOG_FILE "contacts.log"
+#define LOG_COMPACT_MIN_BYTES (1 << 20)
+
+enum { LOG_OP_PUT = 1, LOG_OP_DELETE = 2 };
+
+typedef struct {
+    unsigned int crc;       // CRC-32 of the rest of the header and the strings
+    unsigned char op;
+    unsigned char pad;
+    unsigned short nameLen;
+    unsigned short phoneLen;
+    unsigned short emailLen;
+    int id;
+} LogRecordHeader;
+
+const char *logFilePath = LOG_FILE;
+static MemIndex logIndex;
+static FILE *logFile = NULL;
+static long long logTotalBytes = 0;  // bytes in the file
+static long long logLiveBytes = 0;   // bytes of records still referenced by the index
+static long long logTxnStart = 0;
+static const char *logError = "not an error";
+
+static unsigned int Crc32Update(unsigned int crc, const void *data, size_t len) {
+    static unsigned int table[256];
+    if (!table[1]) {
+        for (unsigned int i = 0; i < 256; i++) {
+            unsigned int c = i;
+            for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+    }
+    const unsigned char *p = (const unsigned char *)data;
+    crc = ~crc;
+    while (len--) crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static long long LogRecordSize(const char *name, const char *phone, const char *email) {
+    return (long long)(sizeof(LogRecordHeader) + strlen(name) + strlen(phone) + strlen(email));
+}
+
+static long long LogContactSize(const MemContact *c) {
+    MemRow row;
+    MemRowOf(c, &row);
+    return LogRecordSize(row.name, row.phone, row.email);
+}
+
+// Appends one record to f and returns its size, or -1 on failure.
+static long long LogWriteRecord(FILE *f, unsigned char op, int id, const char *name, const char *phone, const char *email) {
+    size_t lens[3] = { strlen(name), strlen(phone), strlen(email) };
+    if (lens[0] > 0xFFFF || lens[1] > 0xFFFF || lens[2] > 0xFFFF) {
+        logError = "field too long for the log format";
+        return -1;
+    }
+
+    LogRecordHeader hdr;
+    ZeroMemory(&hdr, sizeof(hdr));
+    hdr.op = op;
+    hdr.nameLen = (unsigned short)lens[0];
+    hdr.phoneLen = (unsigned short)lens[1];
+    hdr.emailLen = (unsigned short)lens[2];
+    hdr.id = id;
+
+    size_t size = sizeof(hdr) + lens[0] + lens[1] + lens[2];
+    unsigned char stackBuf[512];
+    unsigned char *buf = size <= sizeof(stackBuf) ? stackBuf : (unsigned char *)malloc(size);
+    if (!buf) {
+        logError = "out of memory";
+        return -1;
+    }
+    unsigned char *p = buf + sizeof(hdr);
+    memcpy(p, name, lens[0]); p += lens[0];
+    memcpy(p, phone, lens[1]); p += lens[1];
+    memcpy(p, email, lens[2]);
+    memcpy(buf, &hdr, sizeof(hdr));
+    hdr.crc = Crc32Update(0, buf + sizeof(hdr.crc), size - sizeof(hdr.crc));
+    memcpy(buf, &hdr, sizeof(hdr));
+
+    size_t written = fwrite(buf, 1, size, f);
+    if (buf != stackBuf) free(buf);
+    if (written != size) {
+        logError = "cannot write to contacts.log";
+        return -1;
+    }
+    return (long long)size;
+}
+
+static BOOL LogSync(FILE *f) {
+    return fflush(f) == 0 && _commit(_fileno(f)) == 0;
+}
+
+// Replays the log into logIndex. Returns the offset just past the last
+// intact record; anything after it is a torn or corrupt tail.
+static long long LogReplay(FILE *f) {
+    long long good = 0;
+    unsigned char *payload = NULL;
+    size_t payloadCap = 0;
+    LogRecordHeader hdr;
+
+    while (fread(&hdr, sizeof(hdr), 1, f) == 1) {
+        size_t len = (size_t)hdr.nameLen + hdr.phoneLen + hdr.emailLen;
+        if (len + 3 > payloadCap) {
+            payloadCap = len + 3 > 1024 ? len + 3 : 1024;
+            unsigned char *p = (unsigned char *)realloc(payload, payloadCap);
+            if (!p) break;
+            payload = p;
+        }
+        if (len && fread(payload, 1, len, f) != len) break;
+
+        unsigned int crc = Crc32Update(0, (const unsigned char *)&hdr + sizeof(hdr.crc), sizeof(hdr) - sizeof(hdr.crc));
+        crc = Crc32Update(crc, payload, len);
+        if (crc != hdr.crc || (hdr.op != LOG_OP_PUT && hdr.op != LOG_OP_DELETE)) break;
+
+        // split the payload into three terminated strings
+        char *email = (char *)payload + hdr.nameLen + hdr.phoneLen + 2;
+        memmove(email, payload + hdr.nameLen + hdr.phoneLen, hdr.emailLen);
+        email[hdr.emailLen] = '\0';
+        char *phone = (char *)payload + hdr.nameLen + 1;
+        memmove(phone, payload + hdr.nameLen, hdr.phoneLen);
+        phone[hdr.phoneLen] = '\0';
+        char *name = (char *)payload;
+        name[hdr.nameLen] = '\0';
+
+        long long size = (long long)(sizeof(hdr) + len);
+        MemContact *old = MemIndexFind(&logIndex, hdr.id);
+        if (old) logLiveBytes -= LogContactSize(old);
+        if (hdr.op == LOG_OP_PUT) {
+            if (MemIndexPut(&logIndex, hdr.id, name, phone, email) != SQLITE_OK) break;
+            logLiveBytes += size;
+        } else {
+            MemIndexRemove(&logIndex, hdr.id);
+            if (hdr.id >= logIndex.nextId) logIndex.nextId = hdr.id + 1;
+        }
+        good += size;
+    }
+    free(payload);
+    logTotalBytes = good;
+    return good;
+}
+
+// Rewrites the live records into a fresh file and swaps it in.
+static int LogCompact(void) {
+    char tmpPath[MAX_PATH];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", logFilePath);
+    FILE *out = fopen(tmpPath, "wb");
+    if (!out) {
+        logError = "cannot create compacted log";
+        return SQLITE_CANTOPEN;
+    }
+
+    long long total = 0;
+    BOOL ok = TRUE;
+    for (size_t i = 0; ok && i < logIndex.count; i++) {
+        MemContact *c = logIndex.byName[i];
+        MemRow row;
+        MemRowOf(c, &row);
+        long long size = LogWriteRecord(out, LOG_OP_PUT, c->id, row.name, row.phone, row.email);
+        if (size < 0) ok = FALSE;
+        else total += size;
+    }
+    long long live = total;
+    // keep ids from being reused when the highest id was deleted
+    int lastId = logIndex.nextId - 1;
+    if (ok && lastId > 0 && !MemIndexFind(&logIndex, lastId)) {
+        long long size = LogWriteRecord(out, LOG_OP_DELETE, lastId, "", "", "");
+        if (size < 0) ok = FALSE;
+        else total += size;
+    }
+    ok = ok && LogSync(out);
+    fclose(out);
+
+    if (logFile) {
+        fclose(logFile);
+        logFile = NULL;
+    }
+    if (!ok || !MoveFileExA(tmpPath, logFilePath, MOVEFILE_REPLACE_EXISTING)) {
+        DeleteFileA(tmpPath);
+        logFile = fopen(logFilePath, "ab");
+        if (ok) logError = "cannot replace contacts.log";
+        return SQLITE_IOERR;
+    }
+
+    logTotalBytes = total;
+    logLiveBytes = live;
+    logFile = fopen(logFilePath, "ab");
+    return logFile ? SQLITE_OK : SQLITE_CANTOPEN;
+}
+
+// Replays contacts.log, or seeds it from the SQLite file on first use.
+static int LogOpen(const char *path) {
+    MemIndexClear(&logIndex);
+    logTotalBytes = logLiveBytes = 0;
+
+    BOOL rewrite = FALSE;
+    FILE *f = fopen(logFilePath, "rb");
+    if (f) {
+        long long good = LogReplay(f);
+        fseek(f, 0, SEEK_END);
+        rewrite = ftell(f) > good;
+        fclose(f);
+    } else {
+        MemIndexLoadDatabase(&logIndex, path);
+        rewrite = TRUE;
+    }
+
+    int rc = rewrite ? LogCompact() : SQLITE_OK;
+    if (!logFile) logFile = fopen(logFilePath, "ab");
+    if (!logFile) {
+        char buf[512];
+        snprintf(buf, sizeof(buf), "Cannot open %s: %s", logFilePath, logError);
+        sql_error(buf);
+        MemIndexClear(&logIndex);
+        return rc != SQLITE_OK ? rc : SQLITE_CANTOPEN;
+    }
+    return SQLITE_OK;
+}
+
+static void LogClose(void) {
+    if (logFile) {
+        LogSync(logFile);
+        fclose(logFile);
+        logFile = NULL;
+    }
+    MemIndexClear(&logIndex);
+}
+
+static int LogBegin(void) {
+    logTxnStart = logTotalBytes;
+    return SQLITE_OK;
+}
+
+static int LogCommit(void) {
+    if (!LogSync(logFile)) {
+        logError = "cannot sync contacts.log";
+        return SQLITE_IOERR;
+    }
+    if (logTotalBytes >= LOG_COMPACT_MIN_BYTES && logTotalBytes - logLiveBytes > logLiveBytes) {
+        LogCompact();
+    }
+    return SQLITE_OK;
+}
+
+// Cuts the file back to where the transaction started and rebuilds the
+// index from what is left.
+static void LogRollback(void) {
+    fflush(logFile);
+    _chsize_s(_fileno(logFile), logTxnStart);
+    fclose(logFile);
+    logFile = NULL;
+    MemIndexClear(&logIndex);
+    logTotalBytes = logLiveBytes = 0;
+    FILE *f = fopen(logFilePath, "rb");
+    if (f) {
+        LogReplay(f);
+        fclose(f);
+    }
+    logFile = fopen(logFilePath, "ab");
+}
+
+static int LogPut(int id, const char *name, const char *phone, const char *email) {
+    if (!name) name = "";
+    if (!phone) phone = "";
+    if (!email) email = "";
+    long long size = LogWriteRecord(logFile, LOG_OP_PUT, id, name, phone, email);
+    if (size < 0) return SQLITE_IOERR;
+    logTotalBytes += size;
+
+    MemContact *old = MemIndexFind(&logIndex, id);
+    if (old) logLiveBytes -= LogContactSize(old);
+    if (MemIndexPut(&logIndex, id, name, phone, email) != SQLITE_OK) {
+        logError = "out of memory";
+        return SQLITE_NOMEM;
+    }
+    logLiveBytes += size;
+    return SQLITE_OK;
+}
+
+static int LogInsert(const char *name, const char *phone, const char *email) {
+    return LogPut(logIndex.nextId, name, phone, email);
+}
+
+static int LogUpdate(int id, const char *name, const char *phone, const char *email) {
+    if (!MemIndexFind(&logIndex, id)) return SQLITE_OK;
+    return LogPut(id, name, phone, email);
+}
+
+static int LogRemove(int id) {
+    MemContact *old = MemIndexFind(&logIndex, id);
+    if (!old) return SQLITE_OK;
+    long long size = LogWriteRecord(logFile, LOG_OP_DELETE, id, "", "", "");
+    if (size < 0) return SQLITE_IOERR;
+    logTotalBytes += size;
+    logLiveBytes -= LogContactSize(old);
+    return MemIndexRemove(&logIndex, id);
+}
+
+static int LogRemoveMany(const int *ids, int count) {
+    for (int i = 0; i < count; i++) {
+        MemContact *old = MemIndexFind(&logIndex, ids[i]);
+        if (!old) continue;
+        long long size = LogWriteRecord(logFile, LOG_OP_DELETE, ids[i], "", "", "");
+        if (size < 0) return SQLITE_IOERR;
+        logTotalBytes += size;
+        logLiveBytes -= LogContactSize(old);
+    }
+    return MemIndexRemoveMany(&logIndex, ids, count);
+}
+
+// recency is not logged, so it only lasts for the session
+static int LogTouch(int id) { MemIndexTouch(&logIndex, id, (long long)time(NULL)); return SQLITE_OK; }
+static int LogGet(int id, ContactRowFn fn, void *ctx) { return MemIndexGet(&logIndex, id, fn, ctx); }
+static int LogScan(ContactRowFn fn, void *ctx) { return MemIndexScan(&logIndex, fn, ctx); }
+static int LogSearch(const char *filter, ContactRowFn fn, void *ctx) { return MemIndexSearch(&logIndex, filter, fn, ctx); }
+static int LogLookup(const char *phone, const char *email, ContactRowFn fn, void *ctx) { return MemIndexLookup(&logIndex, phone, email, fn, ctx); }
+extern const ContactStore logStore;
+static int LogUpsert(const char *name, const char *phone, const char *email, const MergeRules *merge, int *matchedId) {
+    return UpsertByLookup(&logStore, name, phone, email, merge, matchedId);
+}
+static const char *LogErrmsg(void) { return logError; }
+
+const ContactStore logStore = {
+    "log", LogOpen, LogClose, LogBegin, LogCommit, LogRollback,
+    LogInsert, LogUpdate, LogRemove, LogRemoveMany, LogTouch, LogGet, LogScan, LogSearch, LogLookup, LogUpsert, LogErrmsg
+};
+
+extern double dupFalsePositiveRate;     // see Duplicate Check
+
+// Picks the backend from the command line ("--store=memory" or
+// "--store=log"), SQLite by default, and applies the SQLite-only options;
+// the memory setup has to come before anything opens a connection.
+void InitDatabase(const char *cmdLine) {
+    const ContactStore *selected = &sqliteStore;
+    if (cmdLine && strstr(cmdLine, "--store=memory")) selected = &memoryStore;
+    if (cmdLine && strstr(cmdLine, "--store=log")) selected = &logStore;
+    if (cmdLine && strstr(cmdLine, "--sqlite-mem=tuned")) {
+        SqliteMemConfig cfg = sqliteTunedMem;
+        if (strstr(cmdLine, "--sqlite-memstatus")) cfg.memStatus = TRUE;
+        int rc = ConfigureSqliteMemory(&cfg);
+        if (rc != SQLITE_OK) {
+            SqliteMemConfig current = sqliteMem;
+            ConfigureSqliteMemory(&current);
+            char msg[192];
+            snprintf(msg, sizeof(msg), "--sqlite-mem=tuned was not applied (%s); SQLite uses its default memory setup.",
+                     sqlite3_errstr(rc));
+            sql_error(msg);
+        }
+    }
+    if (selected->open(DB_FILE) != SQLITE_OK) return;
+    store = selected;
+    const char *fpr = cmdLine ? strstr(cmdLine, "--dup-fpr=") : NULL;
+    if (fpr) dupFalsePositiveRate = atof(fpr + 10);
+
+    const char *opt = cmdLine ? strstr(cmdLine, "--slow-log") : NULL;
+    if (opt && store == &sqliteStore) {
+        int ms = SLOW_QUERY_DEFAULT_MS;
+        sscanf(opt, "--slow-log=%d", &ms);
+        StartSlowQueryLog(ms, strstr(cmdLine, "--slow-log-params") == NULL);
+    }
+}
+
+// --- Search Index ---
+// contacts_search(term) is an eponymous table-valued function over an
+// in-memory trigram index of the contacts table, so ad-hoc SQL gets the
+// search box's matching without a full scan:
+//
+//   SELECT c.* FROM contacts c JOIN contacts_search('acme') USING(id);
+//
+// Every folded trigram of name, phone, email and the phone's digits is
+// hashed to a posting list of ids. A query takes the shortest posting list
+// among its trigrams as candidates and checks each with the same matcher as
+// the search query, streaming matches in id order. Terms shorter than three
+// bytes check every row. The index is built on first use and follows this
+// connection's writes through the update hook; writes from other
+// connections, rollbacks and deletes the hook can't see cause a rebuild.
+
+#define TRIGRAM_BUCKETS 65536
+
+typedef struct {
+    int *ids;
+    int count;
+    int cap;
+} Posting;
+
+typedef struct {
+    sqlite3 *conn;
+    MemIndex rows;
+    Posting *postings;          // TRIGRAM_BUCKETS lists; may hold stale ids
+    size_t staleRows;
+    int *dirty;                 // rowids written since the last refresh
+    int dirtyCount;
+    int dirtyCap;
+    BOOL built;
+    BOOL rebuild;
+    int dataVersion;
+    sqlite3_int64 totalChanges; // sqlite3_total_changes64 at the last refresh
+    sqlite3_int64 hookedChanges;
+} SearchIndex;
+
+static SearchIndex *mainSearchIndex;   // the one on db, used by ranked search
+
+typedef struct {
+    sqlite3_vtab base;
+    SearchIndex *ix;
+} SearchVtab;
+
+typedef struct {
+    sqlite3_vtab_cursor base;
+    SearchIndex *ix;
+    SearchNeedle *needle;
+    sqlite3_value *term;
+    int *ids;                   // sorted, unique candidates
+    int count;
+    int pos;
+    const MemContact *row;      // current match
+} SearchCursor;
+
+enum { SEARCH_COL_ID, SEARCH_COL_NAME, SEARCH_COL_PHONE, SEARCH_COL_EMAIL, SEARCH_COL_QUERY };
+
+static unsigned TrigramBucket(unsigned char a, unsigned char b, unsigned char c) {
+    return ((((unsigned)a << 16) | ((unsigned)b << 8) | c) * 2654435761u) >> 16;
+}
+
+static BOOL PostingAdd(Posting *p, int id) {
+    if (p->count && p->ids[p->count - 1] == id) return TRUE;   // repeated trigram in one row
+    if (p->count == p->cap) {
+        int cap = p->cap ? p->cap * 2 : 4;
+        int *ids = (int *)realloc(p->ids, cap * sizeof(int));
+        if (!ids) return FALSE;
+        p->ids = ids;
+        p->cap = cap;
+    }
+    p->ids[p->count++] = id;
+    return TRUE;
+}
+
+// Adds the trigrams of text (folded, or only its digits) for row id.
+static BOOL SearchIndexAddText(SearchIndex *ix, int id, const char *text, BOOL digitsOnly) {
+    unsigned char a = 0, b = 0;
+    int seen = 0;
+    for (const unsigned char *s = (const unsigned char *)text; s && *s; s++) {
+        if (digitsOnly && !(charClass[*s] & CC_DIGIT)) continue;
+        unsigned char c = FOLD(*s);
+        if (++seen >= 3 && !PostingAdd(&ix->postings[TrigramBucket(a, b, c)], id)) return FALSE;
+        a = b;
+        b = c;
+    }
+    return TRUE;
+}
+
+static int SearchIndexAddRow(SearchIndex *ix, int id, const char *name, const char *phone, const char *email,
+                             long long lastUsed) {
+    int rc = MemIndexPut(&ix->rows, id, name, phone, email);
+    if (rc != SQLITE_OK) return rc;
+    MemIndexTouch(&ix->rows, id, lastUsed);
+    if (!SearchIndexAddText(ix, id, name, FALSE) || !SearchIndexAddText(ix, id, phone, FALSE) ||
+        !SearchIndexAddText(ix, id, email, FALSE) || !SearchIndexAddText(ix, id, phone, TRUE)) {
+        return SQLITE_NOMEM;
+    }
+    return SQLITE_OK;
+}
+
+static void SearchIndexReset(SearchIndex *ix) {
+    MemIndexClear(&ix->rows);
+    for (int i = 0; ix->postings && i < TRIGRAM_BUCKETS; i++) {
+        free(ix->postings[i].ids);
+        ZeroMemory(&ix->postings[i], sizeof(Posting));
+    }
+    ix->staleRows = 0;
+    ix->dirtyCount = 0;
+    ix->built = FALSE;
+}
+
+static int ReadDataVersion(sqlite3 *conn) {
+    sqlite3_stmt *stmt = NULL;
+    int version = -1;
+    if (sqlite3_prepare_v2(conn, "PRAGMA data_version;", -1, &stmt, NULL) == SQLITE_OK &&
+        sqlite3_step(stmt) == SQLITE_ROW) {
+        version = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    return version;
+}
+
+static int SearchIndexBuild(SearchIndex *ix) {
+    LONGLONG t0 = TraceBegin();
+    SearchIndexReset(ix);
+    if (!ix->postings) {
+        ix->postings = (Posting *)calloc(TRIGRAM_BUCKETS, sizeof(Posting));
+        if (!ix->postings) return SQLITE_NOMEM;
+    }
+    sqlite3_stmt *stmt = NULL;
+    // name order makes every insert into the sorted array an append
+    int rc = sqlite3_prepare_v2(ix->conn, "SELECT id,name,phone,email,last_used FROM contacts ORDER BY sort_key,id;", -1, &stmt, NULL);
+    while (rc == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+        rc = SearchIndexAddRow(ix, sqlite3_column_int(stmt, 0), (const char *)sqlite3_column_text(stmt, 1),
+                               (const char *)sqlite3_column_text(stmt, 2), (const char *)sqlite3_column_text(stmt, 3),
+                               sqlite3_column_int64(stmt, 4));
+    }
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_OK) {
+        SearchIndexReset(ix);
+        return rc;
+    }
+    ix->built = TRUE;
+    ix->rebuild = FALSE;
+    ix->dataVersion = ReadDataVersion(ix->conn);
+    ix->totalChanges = sqlite3_total_changes64(ix->conn);
+    ix->hookedChanges = 0;
+    TraceEnd("search_index.build", t0);
+    return SQLITE_OK;
+}
+
+// Brings the index up to date before a query: re-reads the rows this
+// connection touched, or rebuilds when that isn't enough or a bulk change
+// touched so many that a rebuild is quicker.
+static int SearchIndexRefresh(SearchIndex *ix) {
+    if (!ix->built || ix->rebuild || ix->dataVersion != ReadDataVersion(ix->conn) ||
+        sqlite3_total_changes64(ix->conn) - ix->totalChanges != ix->hookedChanges ||
+        ix->staleRows > ix->rows.count + 1024 || ix->dirtyCount > ix->rows.count / 4 + 1024) {
+        return SearchIndexBuild(ix);
+    }
+    if (ix->dirtyCount == 0) return SQLITE_OK;
+
+    sqlite3_stmt *stmt = NULL;
+    int rc = sqlite3_prepare_v2(ix->conn, "SELECT name,phone,email,last_used FROM contacts WHERE id=?;", -1, &stmt, NULL);
+    for (int i = 0; rc == SQLITE_OK && i < ix->dirtyCount; i++) {
+        int id = ix->dirty[i];
+        if (MemIndexFind(&ix->rows, id)) {
+            MemIndexRemove(&ix->rows, id);
+            ix->staleRows++;
+        }
+        sqlite3_bind_int(stmt, 1, id);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            rc = SearchIndexAddRow(ix, id, (const char *)sqlite3_column_text(stmt, 0),
+                                   (const char *)sqlite3_column_text(stmt, 1), (const char *)sqlite3_column_text(stmt, 2),
+                                   sqlite3_column_int64(stmt, 3));
+        }
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_OK) return SearchIndexBuild(ix);
+    ix->dirtyCount = 0;
+    ix->totalChanges = sqlite3_total_changes64(ix->conn);
+    ix->hookedChanges = 0;
+    return SQLITE_OK;
+}
+
+static void SearchIndexUpdateHook(void *arg, int op, const char *dbName, const char *table, sqlite3_int64 rowid) {
+    SearchIndex *ix = (SearchIndex *)arg;
+    ix->hookedChanges++;
+    if (!ix->built || strcmp(dbName, "main") != 0 || strcmp(table, "contact_rows") != 0) return;
+    if (ix->dirtyCount == ix->dirtyCap) {
+        int cap = ix->dirtyCap ? ix->dirtyCap * 2 : 64;
+        int *dirty = (int *)realloc(ix->dirty, cap * sizeof(int));
+        if (!dirty) {
+            ix->rebuild = TRUE;
+            return;
+        }
+        ix->dirty = dirty;
+        ix->dirtyCap = cap;
+    }
+    ix->dirty[ix->dirtyCount++] = (int)rowid;
+}
+
+static void SearchIndexRollbackHook(void *arg) {
+    ((SearchIndex *)arg)->rebuild = TRUE;
+}
+
+static void SearchIndexFree(void *arg) {
+    SearchIndex *ix = (SearchIndex *)arg;
+    if (ix == mainSearchIndex) mainSearchIndex = NULL;
+    SearchIndexReset(ix);
+    free(ix->postings);
+    free(ix->dirty);
+    free(ix);
+}
+
+static int CompareInt(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+// Shortest posting list among the trigrams of s (len bytes, already folded),
+// or NULL if s is too short to have any.
+static const Posting *ShortestPosting(const SearchIndex *ix, const unsigned char *s, size_t len) {
+    const Posting *best = NULL;
+    for (size_t i = 0; i + 3 <= len; i++) {
+        const Posting *p = &ix->postings[TrigramBucket(s[i], s[i + 1], s[i + 2])];
+        if (!best || p->count < best->count) best = p;
+    }
+    return best;
+}
+
+// Candidate ids for the needle: ids from the best posting list of the term
+// and, for phone-like terms, of its digits. Either side without a trigram
+// means every row is a candidate.
+static int *SearchCandidates(const SearchIndex *ix, const SearchNeedle *n, int *count) {
+    const Posting *text = ShortestPosting(ix, n->folded, n->len);
+    const Posting *digits = n->phoneLike ? ShortestPosting(ix, n->digits, n->digitLen) : NULL;
+    BOOL all = !text || (n->phoneLike && !digits);
+    size_t total = all ? ix->rows.count : (size_t)text->count + (digits ? digits->count : 0);
+    int *ids = (int *)malloc((total ? total : 1) * sizeof(int));
+    if (!ids) return NULL;
+    if (all) {
+        for (size_t i = 0; i < ix->rows.count; i++) ids[i] = ix->rows.byName[i]->id;
+    } else {
+        memcpy(ids, text->ids, text->count * sizeof(int));
+        if (digits) memcpy(ids + text->count, digits->ids, digits->count * sizeof(int));
+    }
+    qsort(ids, total, sizeof(int), CompareInt);
+    int unique = 0;
+    for (size_t i = 0; i < total; i++) {
+        if (unique == 0 || ids[unique - 1] != ids[i]) ids[unique++] = ids[i];
+    }
+    *count = unique;
+    return ids;
+}
+
+static int SearchConnect(sqlite3 *conn, void *aux, int argc, const char *const *argv,
+                         sqlite3_vtab **vtab, char **errmsg) {
+    int rc = sqlite3_declare_vtab(conn, "CREATE TABLE x(id INTEGER, name TEXT, phone TEXT, email TEXT, query HIDDEN)");
+    if (rc != SQLITE_OK) return rc;
+    SearchVtab *v = (SearchVtab *)sqlite3_malloc(sizeof(SearchVtab));
+    if (!v) return SQLITE_NOMEM;
+    ZeroMemory(v, sizeof(*v));
+    v->ix = (SearchIndex *)aux;
+    *vtab = &v->base;
+    return SQLITE_OK;
+}
+
+static int SearchDisconnect(sqlite3_vtab *vtab) {
+    sqlite3_free(vtab);
+    return SQLITE_OK;
+}
+
+// Only plans with "query = ?" are usable; rows come out in id order.
+static int SearchBestIndex(sqlite3_vtab *vtab, sqlite3_index_info *info) {
+    int term = -1;
+    for (int i = 0; i < info->nConstraint; i++) {
+        const struct sqlite3_index_constraint *c = &info->aConstraint[i];
+        if (c->iColumn != SEARCH_COL_QUERY || c->op != SQLITE_INDEX_CONSTRAINT_EQ) continue;
+        if (!c->usable) return SQLITE_CONSTRAINT;
+        term = i;
+    }
+    if (term < 0) {
+        sqlite3_free(vtab->zErrMsg);
+        vtab->zErrMsg = sqlite3_mprintf("contacts_search needs a search term");
+        return SQLITE_ERROR;
+    }
+    info->aConstraintUsage[term].argvIndex = 1;
+    info->aConstraintUsage[term].omit = 1;
+    info->idxNum = 1;
+    info->estimatedCost = 100.0;
+    info->estimatedRows = 100;
+    if (info->nOrderBy == 1 && info->aOrderBy[0].iColumn == SEARCH_COL_ID && !info->aOrderBy[0].desc) {
+        info->orderByConsumed = 1;
+    }
+    return SQLITE_OK;
+}
+
+static int SearchOpen(sqlite3_vtab *vtab, sqlite3_vtab_cursor **cursor) {
+    SearchCursor *c = (SearchCursor *)sqlite3_malloc(sizeof(SearchCursor));
+    if (!c) return SQLITE_NOMEM;
+    ZeroMemory(c, sizeof(*c));
+    c->ix = ((SearchVtab *)vtab)->ix;
+    *cursor = &c->base;
+    return SQLITE_OK;
+}
+
+static void SearchCursorReset(SearchCursor *c) {
+    free(c->needle);
+    free(c->ids);
+    sqlite3_value_free(c->term);
+    c->needle = NULL;
+    c->term = NULL;
+    c->ids = NULL;
+    c->count = c->pos = 0;
+    c->row = NULL;
+}
+
+static int SearchClose(sqlite3_vtab_cursor *cursor) {
+    SearchCursorReset((SearchCursor *)cursor);
+    sqlite3_free(cursor);
+    return SQLITE_OK;
+}
+
+// advances to the next candidate that is still present and matches
+static int SearchNext(sqlite3_vtab_cursor *cursor) {
+    SearchCursor *c = (SearchCursor *)cursor;
+    c->row = NULL;
+    while (c->pos < c->count) {
+        const MemContact *row = MemIndexFind(&c->ix->rows, c->ids[c->pos++]);
+        if (row && MemContactMatches(row, c->needle)) {
+            c->row = row;
+            break;
+        }
+    }
+    return SQLITE_OK;
+}
+
+static int SearchFilter(sqlite3_vtab_cursor *cursor, int idxNum, const char *idxStr, int argc, sqlite3_value **argv) {
+    SearchCursor *c = (SearchCursor *)cursor;
+    SearchCursorReset(c);
+    const char *term = argc > 0 ? (const char *)sqlite3_value_text(argv[0]) : NULL;
+    if (!term) return SQLITE_OK;   // NULL term matches nothing
+    int rc = SearchIndexRefresh(c->ix);
+    if (rc != SQLITE_OK) return rc;
+    c->needle = SearchNeedleNew(term);
+    c->term = sqlite3_value_dup(argv[0]);
+    if (!c->needle || !c->term) return SQLITE_NOMEM;
+    c->ids = SearchCandidates(c->ix, c->needle, &c->count);
+    if (!c->ids) return SQLITE_NOMEM;
+    lastRowsScanned = c->count;
+    return SearchNext(cursor);
+}
+
+static int SearchEof(sqlite3_vtab_cursor *cursor) {
+    return ((SearchCursor *)cursor)->row == NULL;
+}
+
+static int SearchColumn(sqlite3_vtab_cursor *cursor, sqlite3_context *ctx, int col) {
+    const MemContact *row = ((SearchCursor *)cursor)->row;
+    char buf[MEM_FIELD_MAX];
+    switch (col) {
+    case SEARCH_COL_ID: sqlite3_result_int(ctx, row->id); break;
+    case SEARCH_COL_NAME: sqlite3_result_text(ctx, MemName(row), -1, SQLITE_TRANSIENT); break;
+    case SEARCH_COL_PHONE: sqlite3_result_text(ctx, MemPhone(row, buf), -1, SQLITE_TRANSIENT); break;
+    case SEARCH_COL_EMAIL: sqlite3_result_text(ctx, MemEmail(row, buf), -1, SQLITE_TRANSIENT); break;
+    default: sqlite3_result_value(ctx, ((SearchCursor *)cursor)->term); break;
+    }
+    return SQLITE_OK;
+}
+
+static int SearchRowid(sqlite3_vtab_cursor *cursor, sqlite3_int64 *rowid) {
+    *rowid = ((SearchCursor *)cursor)->row->id;
+    return SQLITE_OK;
+}
+
+static const sqlite3_module searchModule = {
+    0,                  // iVersion
+    NULL,               // xCreate: eponymous only
+    SearchConnect, SearchBestIndex, SearchDisconnect, NULL,
+    SearchOpen, SearchClose, SearchFilter, SearchNext, SearchEof, SearchColumn, SearchRowid,
+    NULL, NULL, NULL, NULL, NULL, NULL, NULL
+};
+
+// Registers contacts_search on conn; the index lives until conn is closed.
+static int RegisterSearchIndex(sqlite3 *conn) {
+    SearchIndex *ix = (SearchIndex *)calloc(1, sizeof(SearchIndex));
+    if (!ix) return SQLITE_NOMEM;
+    ix->conn = conn;
+    ix->rows.nextId = 1;
+    int rc = sqlite3_create_module_v2(conn, "contacts_search", &searchModule, ix, SearchIndexFree);
+    if (rc != SQLITE_OK) return rc;   // the destructor has already run
+    sqlite3_update_hook(conn, SearchIndexUpdateHook, ix);
+    sqlite3_rollback_hook(conn, SearchIndexRollbackHook, ix);
+    if (conn == db) mainSearchIndex = ix;
+    return SQLITE_OK;
+}
+
+// --- Ranked Search ---
+// With ranking on, a search returns the best RANK_TOP_K matches instead of
+// every match in name order. A field scores by how the term matches it
+// (exact > prefix > start of a word > anywhere) times the field's weight;
+// a contact's score is its best field plus a bonus for recent use. Matches
+// go through a bounded min-heap, so only K rows are kept and sorted.
+
+#define RANK_TOP_K 50
+#define RANK_RECENCY_BONUS 150.0
+#define RANK_RECENCY_HALF_DAYS 7.0
+
+BOOL rankResults = FALSE;
+int lastRankScored = 0;     // rows the last ranked search had to score in full
+
+enum { MATCH_NONE, MATCH_INFIX, MATCH_TOKEN, MATCH_PREFIX, MATCH_EXACT };
+static const double matchScores[] = { 0, 10, 40, 60, 100 };
+enum { RANK_NAME_WEIGHT = 10, RANK_PHONE_WEIGHT = 6, RANK_EMAIL_WEIGHT = 6 };
+
+typedef struct {
+    double score;
+    const MemContact *c;
+} RankedRow;
+
+typedef struct {
+    RankedRow *heap;        // heap[0] is the weakest row kept
+    int count;
+    int k;
+    int scored;
+    long long now;
+} TopK;
+
+static unsigned int visitGeneration;
+
+static int MatchClass(const unsigned char *h, size_t len, const SearchNeedle *n) {
+    ptrdiff_t pos = FindNoCaseFrom(h, len, 0, n);
+    if (pos < 0) return MATCH_NONE;
+    if (pos == 0) return len == n->len ? MATCH_EXACT : MATCH_PREFIX;
+    do {
+        if (!(charClass[h[pos - 1]] & (CC_ALPHA | CC_DIGIT | CC_HIGH))) return MATCH_TOKEN;
+        pos = FindNoCaseFrom(h, len, (size_t)pos + 1, n);
+    } while (pos > 0);
+    return MATCH_INFIX;
+}
+
+// Phone-like terms also match the phone's digits, like PhoneMatches.
+static int PhoneMatchClass(const unsigned char *phone, size_t len, const SearchNeedle *n) {
+    int best = MatchClass(phone, len, n);
+    if (!n->phoneLike || best == MATCH_EXACT) return best;
+    unsigned char digits[64];
+    size_t count = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (charClass[phone[i]] & CC_DIGIT) {
+            if (count == sizeof(digits)) {   // too long to copy: only tell whether it matches
+                return best == MATCH_NONE && PhoneMatches(phone, len, n) ? MATCH_INFIX : best;
+            }
+            digits[count++] = phone[i];
+        }
+    }
+    SearchNeedle digitNeedle = *n;
+    digitNeedle.folded = n->digits;
+    digitNeedle.len = n->digitLen;
+    int cls = MatchClass(digits, count, &digitNeedle);
+    return cls > best ? cls : best;
+}
+
+static double ContactScore(const MemContact *c, const SearchNeedle *n, long long now) {
+    MemRow row;
+    MemRowOf(c, &row);
+    double best = matchScores[MatchClass((const unsigned char *)row.name, strlen(row.name), n)] * RANK_NAME_WEIGHT;
+    double phone = matchScores[PhoneMatchClass((const unsigned char *)row.phone, strlen(row.phone), n)] * RANK_PHONE_WEIGHT;
+    double email = matchScores[MatchClass((const unsigned char *)row.email, strlen(row.email), n)] * RANK_EMAIL_WEIGHT;
+    if (phone > best) best = phone;
+    if (email > best) best = email;
+    if (best > 0 && c->lastUsed > 0) {
+        double days = (double)(now - c->lastUsed) / 86400.0;
+        best += RANK_RECENCY_BONUS / (1.0 + (days > 0 ? days : 0) / RANK_RECENCY_HALF_DAYS);
+    }
+    return best;
+}
+
+// Upper bound on ContactScore that doesn't touch the strings: a field can
+// only be an exact or prefix match if it starts with the term's first byte,
+// and a word match if one of its words does. Phone-like terms may match on
+// digits anywhere, so they don't bound the phone.
+static double ContactScoreBound(const MemContact *c, const SearchNeedle *n) {
+    unsigned char first = n->folded[0];
+    unsigned int bit = TokenBit(first);
+    int name = c->nameFirst == first ? MATCH_EXACT : (c->nameTokens & bit) ? MATCH_TOKEN : MATCH_INFIX;
+    int other = n->phoneLike || c->phoneFirst == first || c->emailFirst == first ? MATCH_EXACT
+              : (c->otherTokens & bit) ? MATCH_TOKEN : MATCH_INFIX;
+    double bound = matchScores[name] * RANK_NAME_WEIGHT;
+    if (matchScores[other] * RANK_PHONE_WEIGHT > bound) bound = matchScores[other] * RANK_PHONE_WEIGHT;
+    if (c->lastUsed > 0) bound += RANK_RECENCY_BONUS;
+    return bound;
+}
+
+// Higher score first, then the usual name order.
+static BOOL RankedBefore(const RankedRow *a, const RankedRow *b) {
+    if (a->score != b->score) return a->score > b->score;
+    int cmp = strcmp(MemSortKey(a->c), MemSortKey(b->c));
+    return cmp != 0 ? cmp < 0 : a->c->id < b->c->id;
+}
+
+static void TopKSiftDown(TopK *t, int i) {
+    for (;;) {
+        int weakest = i, l = 2 * i + 1, r = l + 1;
+        if (l < t->count && RankedBefore(&t->heap[weakest], &t->heap[l])) weakest = l;
+        if (r < t->count && RankedBefore(&t->heap[weakest], &t->heap[r])) weakest = r;
+        if (weakest == i) return;
+        RankedRow tmp = t->heap[i];
+        t->heap[i] = t->heap[weakest];
+        t->heap[weakest] = tmp;
+        i = weakest;
+    }
+}
+
+// Once the heap is full, rows whose bound is below the weakest kept score
+// are skipped without scoring.
+static void TopKOffer(TopK *t, const MemContact *c, const SearchNeedle *n) {
+    if (t->count == t->k && t->k > 0 && ContactScoreBound(c, n) < t->heap[0].score) return;
+    RankedRow row = { ContactScore(c, n, t->now), c };
+    t->scored++;
+    if (row.score <= 0) return;
+    if (t->count < t->k) {
+        int i = t->count++;
+        while (i > 0 && RankedBefore(&t->heap[(i - 1) / 2], &row)) {
+            t->heap[i] = t->heap[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        t->heap[i] = row;
+    } else if (t->k > 0 && RankedBefore(&row, &t->heap[0])) {
+        t->heap[0] = row;
+        TopKSiftDown(t, 0);
+    }
+}
+
+static int CompareRanked(const void *a, const void *b) {
+    const RankedRow *x = (const RankedRow *)a, *y = (const RankedRow *)b;
+    return RankedBefore(x, y) ? -1 : RankedBefore(y, x) ? 1 : 0;
+}
+
+// Scores the rows of ix; with the SQLite store only the rows on the term's
+// shortest trigram posting lists are visited. Posting lists can repeat an
+// id, so visited rows are marked with the query's generation.
+static size_t RankMemIndex(TopK *t, const MemIndex *ix, const SearchIndex *postings, const SearchNeedle *n) {
+    const Posting *text = postings ? ShortestPosting(postings, n->folded, n->len) : NULL;
+    const Posting *digits = postings && n->phoneLike ? ShortestPosting(postings, n->digits, n->digitLen) : NULL;
+    if (!text || (n->phoneLike && !digits)) {
+        for (size_t i = 0; i < ix->count; i++) TopKOffer(t, ix->byName[i], n);
+        return ix->count;
+    }
+    unsigned int generation = ++visitGeneration;
+    size_t visited = 0;
+    const Posting *lists[2] = { text, digits };
+    for (int l = 0; l < 2 && lists[l]; l++) {
+        for (int i = 0; i < lists[l]->count; i++) {
+            MemContact *c = MemIndexFind(ix, lists[l]->ids[i]);
+            if (!c || c->visitMark == generation) continue;
+            c->visitMark = generation;
+            visited++;
+            TopKOffer(t, c, n);
+        }
+    }
+    return visited;
+}
+
+// The rows of the current store as a MemIndex: the search index's copy for
+// SQLite, which also has posting lists, or the store's own index.
+static int SearchRows(const MemIndex **ix, const SearchIndex **postings) {
+    *ix = store == &memoryStore ? &memIndex : store == &logStore ? &logIndex : NULL;
+    *postings = NULL;
+    if (store == &sqliteStore) {
+        if (!mainSearchIndex) return SQLITE_ERROR;
+        int rc = SearchIndexRefresh(mainSearchIndex);
+        if (rc != SQLITE_OK) return rc;
+        *postings = mainSearchIndex;
+        *ix = &mainSearchIndex->rows;
+    }
+    return *ix ? SQLITE_OK : SQLITE_MISUSE;
+}
+
+// Hands the k best matches for filter to fn, best first.
+int RankedSearch(const char *filter, int k, ContactRowFn fn, void *ctx) {
+    const MemIndex *ix;
+    const SearchIndex *postings;
+    int rc = SearchRows(&ix, &postings);
+    if (rc != SQLITE_OK) return rc;
+
+    SearchNeedle *n = SearchNeedleNew(filter);
+    TopK t = { (RankedRow *)malloc((k > 0 ? k : 1) * sizeof(RankedRow)), 0, k, 0, (long long)time(NULL) };
+    if (!n || !t.heap) {
+        free(n);
+        free(t.heap);
+        return SQLITE_NOMEM;
+    }
+    lastRowsScanned = RankMemIndex(&t, ix, postings, n);
+    lastRankScored = t.scored;
+    qsort(t.heap, t.count, sizeof(RankedRow), CompareRanked);
+    for (int i = 0; i < t.count; i++) {
+        if (MemRowFn(fn, ctx, t.heap[i].c)) break;
+    }
+    free(t.heap);
+    free(n);
+    return SQLITE_OK;
+}
+
+// --- Structured Query ---
+// Search box syntax for power users:
+//
+//   name:smith email:@acme.com phone:555*     terms side by side are ANDed
+//   name:"van der" OR email:example.org       quoted phrases keep their spaces
+//   smith NOT phone:212, smith -phone:212     (a OR b) c groups
+//
+// A term without a field matches like the plain search; a trailing '*' makes
+// it a prefix match (on the digits, for phone-like terms). AND, OR and NOT
+// are keywords only in capitals so that "or" can still be searched for, and
+// input without any of this syntax keeps the plain substring search.
+//
+// The planner estimates how many rows each node has to check and picks the
+// cheapest way to find candidates: trigram posting lists (SQLite store),
+// range scans of the name order for name prefixes, or a filtered scan of
+// every row. AND drives from its cheaper side, OR unions both sides if that
+// beats a scan, NOT scans. Every candidate is checked against the whole
+// query, so plans only change the cost, never the result.
+
+#define QUERY_MAX_TERMS 64
+#define QUERY_MAX_DEPTH 16
+
+typedef enum { QUERY_TERM, QUERY_AND, QUERY_OR, QUERY_NOT } QueryKind;
+typedef enum { FIELD_ANY, FIELD_NAME, FIELD_PHONE, FIELD_EMAIL } QueryField;
+typedef enum { PLAN_SCAN, PLAN_TRIGRAM, PLAN_NAME_RANGE, PLAN_DRIVE, PLAN_UNION } PlanKind;
+
+typedef struct QueryNode {
+    QueryKind kind;
+    QueryField field;
+    BOOL prefix;
+    char *text;                 // the term as typed, without quotes or '*'
+    SearchNeedle *needle;
+    struct QueryNode *left;     // NOT has only left
+    struct QueryNode *right;
+    PlanKind plan;
+    double cost;                // estimated rows checked
+} QueryNode;
+
+typedef enum { TOK_END, TOK_TERM, TOK_AND, TOK_OR, TOK_NOT, TOK_LPAREN, TOK_RPAREN, TOK_ERROR } QueryToken;
+
+typedef struct {
+    const char *p;
+    QueryToken kind;
+    QueryField field;
+    BOOL prefix;
+    BOOL quoted;
+    char text[256];
+    int terms;
+    const char *error;
+} QueryLexer;
+
+typedef struct {
+    const MemIndex *rows;
+    const SearchIndex *postings;    // NULL if the store has no trigram index
+} QueryEnv;
+
+BOOL queryPlanner = TRUE;     // off: every query is a filtered scan (bench baseline)
+
+static const char *const queryFieldNames[] = { "", "name:", "phone:", "email:" };
+static const char *const queryPlanNames[] = { "filtered scan", "trigram lookup", "name range scan", "drive", "union" };
+
+static QueryNode *QueryFail(QueryLexer *lx, const char *error) {
+    if (!lx->error) lx->error = error;
+    return NULL;
+}
+
+static void QueryNextToken(QueryLexer *lx) {
+    lx->p += strspn(lx->p, " \t");
+    lx->field = FIELD_ANY;
+    lx->prefix = lx->quoted = FALSE;
+    lx->text[0] = '\0';
+    char c = *lx->p;
+    if (!c) { lx->kind = TOK_END; return; }
+    if (c == '(') { lx->p++; lx->kind = TOK_LPAREN; return; }
+    if (c == ')') { lx->p++; lx->kind = TOK_RPAREN; return; }
+    if (c == '-' && lx->p[1] && !strchr(" \t)", lx->p[1])) { lx->p++; lx->kind = TOK_NOT; return; }
+
+    for (int f = FIELD_NAME; f <= FIELD_EMAIL; f++) {
+        size_t k = 0, len = strlen(queryFieldNames[f]);
+        while (k < len && FOLD(lx->p[k]) == (unsigned char)queryFieldNames[f][k]) k++;
+        if (k == len) {
+            lx->field = (QueryField)f;
+            lx->p += len;
+            break;
+        }
+    }
+    size_t len;
+    if (*lx->p == '"') {
+        const char *end = strchr(lx->p + 1, '"');
+        if (!end) { lx->kind = TOK_ERROR; QueryFail(lx, "unterminated quote"); return; }
+        len = (size_t)(end - lx->p - 1);
+        if (len >= sizeof(lx->text)) { lx->kind = TOK_ERROR; QueryFail(lx, "term too long"); return; }
+        memcpy(lx->text, lx->p + 1, len);
+        lx->p = end + 1;
+        lx->quoted = TRUE;
+        if (*lx->p == '*') { lx->p++; lx->prefix = TRUE; }
+    } else {
+        len = strcspn(lx->p, " \t()\"");
+        if (len >= sizeof(lx->text)) { lx->kind = TOK_ERROR; QueryFail(lx, "term too long"); return; }
+        memcpy(lx->text, lx->p, len);
+        lx->p += len;
+        if (len && lx->text[len - 1] == '*') { len--; lx->prefix = TRUE; }
+    }
+    lx->text[len] = '\0';
+    lx->kind = TOK_TERM;
+    if (!lx->quoted && lx->field == FIELD_ANY && !lx->prefix) {
+        if (strcmp(lx->text, "AND") == 0) lx->kind = TOK_AND;
+        else if (strcmp(lx->text, "OR") == 0) lx->kind = TOK_OR;
+        else if (strcmp(lx->text, "NOT") == 0) lx->kind = TOK_NOT;
+    }
+    if (lx->kind == TOK_TERM && len == 0) { lx->kind = TOK_ERROR; QueryFail(lx, "empty term"); }
+}
+
+// Parse trees live in queryArena, which each StructuredSearch resets, so a
+// failed parse simply abandons its nodes.
+Arena queryArena = { "query" };
+
+static QueryNode *QueryNodeNew(QueryKind kind) {
+    QueryNode *q = (QueryNode *)ArenaAlloc(&queryArena, sizeof(QueryNode));
+    if (q) {
+        ZeroMemory(q, sizeof(*q));
+        q->kind = kind;
+    }
+    return q;
+}
+
+static QueryNode *QueryJoin(QueryLexer *lx, QueryKind kind, QueryNode *left, QueryNode *right) {
+    QueryNode *q = left && (right || kind == QUERY_NOT) ? QueryNodeNew(kind) : NULL;
+    if (!q) return QueryFail(lx, "out of memory");
+    q->kind = kind;
+    q->left = left;
+    q->right = right;
+    return q;
+}
+
+static QueryNode *ParseOr(QueryLexer *lx, int depth);
+
+static QueryNode *ParseUnary(QueryLexer *lx, int depth) {
+    if (depth > QUERY_MAX_DEPTH) return QueryFail(lx, "query nested too deeply");
+    if (lx->kind == TOK_NOT) {
+        QueryNextToken(lx);
+        return QueryJoin(lx, QUERY_NOT, ParseUnary(lx, depth + 1), NULL);
+    }
+    if (lx->kind == TOK_LPAREN) {
+        QueryNextToken(lx);
+        QueryNode *inner = ParseOr(lx, depth + 1);
+        if (inner && lx->kind != TOK_RPAREN) return QueryFail(lx, "missing ')'");
+        if (inner) QueryNextToken(lx);
+        return inner;
+    }
+    if (lx->kind != TOK_TERM) return QueryFail(lx, "expected a term");
+    if (++lx->terms > QUERY_MAX_TERMS) return QueryFail(lx, "too many terms");
+
+    QueryNode *q = QueryNodeNew(QUERY_TERM);
+    void *needle = q ? ArenaAlloc(&queryArena, SEARCH_NEEDLE_SIZE(strlen(lx->text))) : NULL;
+    if (q) q->text = ArenaCopy(&queryArena, lx->text);
+    if (!q || !needle || !q->text) return QueryFail(lx, "out of memory");
+    q->field = lx->field;
+    q->prefix = lx->prefix;
+    q->needle = SearchNeedleAt(needle, lx->text);
+    QueryNextToken(lx);
+    return q;
+}
+
+static QueryNode *ParseAnd(QueryLexer *lx, int depth) {
+    QueryNode *q = ParseUnary(lx, depth);
+    while (q && (lx->kind == TOK_AND || lx->kind == TOK_NOT || lx->kind == TOK_LPAREN || lx->kind == TOK_TERM)) {
+        if (lx->kind == TOK_AND) QueryNextToken(lx);
+        q = QueryJoin(lx, QUERY_AND, q, ParseUnary(lx, depth));
+    }
+    return q;
+}
+
+static QueryNode *ParseOr(QueryLexer *lx, int depth) {
+    QueryNode *q = ParseAnd(lx, depth);
+    while (q && lx->kind == TOK_OR) {
+        QueryNextToken(lx);
+        q = QueryJoin(lx, QUERY_OR, q, ParseAnd(lx, depth));
+    }
+    return q;
+}
+
+static QueryNode *ParseQuery(const char *text, const char **error) {
+    QueryLexer lx;
+    ZeroMemory(&lx, sizeof(lx));
+    lx.p = text;
+    QueryNextToken(&lx);
+    QueryNode *q = ParseOr(&lx, 0);
+    if (q && lx.kind != TOK_END) {
+        q = QueryFail(&lx, lx.kind == TOK_RPAREN ? "unbalanced ')'" : "unexpected input");
+    }
+    if (!q && error) *error = lx.error ? lx.error : "empty query";
+    return q;
+}
+
+// True if text uses a field prefix, a quote, a trailing '*' or AND, OR or
+// NOT. Parentheses and a leading '-' only act as operators once one of those
+// is there, so "(555) 010-2030" and "-5550102" keep the plain search and
+// its phone matching.
+BOOL IsStructuredQuery(const char *text) {
+    QueryLexer lx;
+    ZeroMemory(&lx, sizeof(lx));
+    lx.p = text;
+    for (QueryNextToken(&lx); lx.kind != TOK_END; QueryNextToken(&lx)) {
+        if (lx.kind == TOK_ERROR) return FALSE;
+        if (lx.kind == TOK_AND || lx.kind == TOK_OR || (lx.kind == TOK_NOT && lx.text[0])) return TRUE;
+        if (lx.kind == TOK_TERM && (lx.field != FIELD_ANY || lx.prefix || lx.quoted)) return TRUE;
+    }
+    return FALSE;
+}
+
+// Case-insensitive prefix test; folded needles never contain NUL, so this
+// stops at the end of h.
+static BOOL StartsNoCase(const char *h, const SearchNeedle *n) {
+    if (!h) return FALSE;
+    for (size_t k = 0; k < n->len; k++) {
+        if (FOLD(h[k]) != n->folded[k]) return FALSE;
+    }
+    return TRUE;
+}
+
+static BOOL PhoneStartsWith(const char *phone, const SearchNeedle *n) {
+    if (!n->phoneLike) return StartsNoCase(phone, n);
+    size_t k = 0;
+    for (const char *p = phone; p && *p && k < n->digitLen; p++) {
+        if (!(charClass[(unsigned char)*p] & CC_DIGIT)) continue;
+        if (*p != (char)n->digits[k++]) return FALSE;
+    }
+    return k == n->digitLen;
+}
+
+static BOOL QueryTermMatches(const QueryNode *q, const MemContact *c) {
+    const SearchNeedle *n = q->needle;
+    BOOL any = q->field == FIELD_ANY;
+    char buf[MEM_FIELD_MAX];
+    if (!q->prefix) {
+        if (any) return MemContactMatches(c, n);
+        const char *h = q->field == FIELD_NAME ? MemName(c) : q->field == FIELD_PHONE ? MemPhone(c, buf) : MemEmail(c, buf);
+        size_t len = strlen(h);
+        return q->field == FIELD_PHONE ? PhoneMatches((const unsigned char *)h, len, n)
+                                       : FindNoCase((const unsigned char *)h, len, n);
+    }
+    return ((any || q->field == FIELD_NAME) && StartsNoCase(MemName(c), n)) ||
+           ((any || q->field == FIELD_PHONE) && PhoneStartsWith(MemPhone(c, buf), n)) ||
+           ((any || q->field == FIELD_EMAIL) && StartsNoCase(MemEmail(c, buf), n));
+}
+
+static BOOL QueryMatches(const QueryNode *q, const MemContact *c) {
+    switch (q->kind) {
+    case QUERY_TERM: return QueryTermMatches(q, c);
+    case QUERY_AND:  return QueryMatches(q->left, c) && QueryMatches(q->right, c);
+    case QUERY_OR:   return QueryMatches(q->left, c) || QueryMatches(q->right, c);
+    case QUERY_NOT:  return !QueryMatches(q->left, c);
+    }
+    return FALSE;
+}
+
+// Posting lists whose union holds every row the term can match: its text
+// trigrams, or its digits when the match may be on a phone's digits alone.
+// FALSE when one of them has no trigram to look up.
+static BOOL TermPostings(const QueryEnv *env, const QueryNode *q, const Posting *lists[2]) {
+    const SearchNeedle *n = q->needle;
+    lists[0] = lists[1] = NULL;
+    if (!env->postings) return FALSE;
+    BOOL digits = n->phoneLike && (q->field == FIELD_ANY || q->field == FIELD_PHONE);
+    if (q->field != FIELD_PHONE || !digits) {
+        lists[0] = ShortestPosting(env->postings, n->folded, n->len);
+        if (!lists[0]) return FALSE;
+    }
+    if (digits) {
+        lists[1] = ShortestPosting(env->postings, n->digits, n->digitLen);
+        if (!lists[1]) return FALSE;
+    }
+    return TRUE;
+}
+
+// The byName range holding every name that starts with the term: folding
+// is per code point, so those names' sort keys start with the folded term.
+// UTF-8 never contains 0xFF, so the folded term + "\xFF" sorts after all of
+// them. FALSE if the term ends inside a code point.
+static BOOL NameRange(const MemIndex *ix, const QueryNode *q, size_t *lo, size_t *hi) {
+    const unsigned char *s = (const unsigned char *)q->text;
+    for (size_t i = 0; s[i];) {
+        int n = s[i] < 0x80 ? 1 : Utf8LetterLength(s + i);
+        if (n == 0) return FALSE;
+        i += n;
+    }
+    size_t len = strlen(q->text);
+    char *key = (char *)malloc(SORT_KEY_MAX(len) + 2);
+    if (!key) return FALSE;
+    NameSortKey(q->text, len, key);
+    char *end = strchr(key, '\x01');
+    *end = '\0';
+    *lo = MemLowerBound(ix, key, 0);
+    end[0] = '\xFF';
+    end[1] = '\0';
+    *hi = MemLowerBound(ix, key, 0);
+    free(key);
+    return TRUE;
+}
+
+static double PlanQuery(const QueryEnv *env, QueryNode *q) {
+    double all = (double)env->rows->count;
+    q->plan = PLAN_SCAN;
+    q->cost = all;
+    if (!queryPlanner) return all;
+    switch (q->kind) {
+    case QUERY_TERM: {
+        const Posting *lists[2];
+        if (TermPostings(env, q, lists)) {
+            double cost = (lists[0] ? lists[0]->count : 0) + (lists[1] ? lists[1]->count : 0);
+            if (cost < q->cost) { q->plan = PLAN_TRIGRAM; q->cost = cost; }
+        }
+        size_t lo, hi;
+        if (q->field == FIELD_NAME && q->prefix && NameRange(env->rows, q, &lo, &hi) && (double)(hi - lo) < q->cost) {
+            q->plan = PLAN_NAME_RANGE;
+            q->cost = (double)(hi - lo);
+        }
+        break;
+    }
+    case QUERY_AND: {
+        double l = PlanQuery(env, q->left), r = PlanQuery(env, q->right);
+        if ((l < r ? l : r) < all) { q->plan = PLAN_DRIVE; q->cost = l < r ? l : r; }
+        break;
+    }
+    case QUERY_OR: {
+        double cost = PlanQuery(env, q->left) + PlanQuery(env, q->right);
+        if (cost < all) { q->plan = PLAN_UNION; q->cost = cost; }
+        break;
+    }
+    case QUERY_NOT:
+        PlanQuery(env, q->left);    // for explain
+        break;
+    }
+    return q->cost;
+}
+
+typedef struct {
+    const QueryNode *root;
+    unsigned int generation;
+    const MemContact **hits;
+    size_t count;
+    size_t cap;
+    size_t checked;
+    BOOL nomem;
+} QueryRun;
+
+static void QueryVisit(QueryRun *r, MemContact *c) {
+    if (!c || c->visitMark == r->generation) return;
+    c->visitMark = r->generation;
+    r->checked++;
+    if (!QueryMatches(r->root, c)) return;
+    if (r->count == r->cap) {
+        size_t cap = r->cap ? r->cap * 2 : 64;
+        const MemContact **hits = (const MemContact **)realloc((void *)r->hits, cap * sizeof(*hits));
+        if (!hits) { r->nomem = TRUE; return; }
+        r->hits = hits;
+        r->cap = cap;
+    }
+    r->hits[r->count++] = c;
+}
+
+static void QueryEnumerate(QueryRun *r, const QueryEnv *env, const QueryNode *q) {
+    const MemIndex *ix = env->rows;
+    switch (q->plan) {
+    case PLAN_SCAN:
+        for (size_t i = 0; i < ix->count; i++) QueryVisit(r, ix->byName[i]);
+        break;
+    case PLAN_TRIGRAM: {
+        const Posting *lists[2];
+        TermPostings(env, q, lists);
+        for (int l = 0; l < 2; l++) {
+            for (int i = 0; lists[l] && i < lists[l]->count; i++) QueryVisit(r, MemIndexFind(ix, lists[l]->ids[i]));
+        }
+        break;
+    }
+    case PLAN_NAME_RANGE: {
+        size_t lo = 0, hi = 0;
+        NameRange(ix, q, &lo, &hi);
+        for (size_t k = lo; k < hi; k++) QueryVisit(r, ix->byName[k]);
+        break;
+    }
+    case PLAN_DRIVE:
+        QueryEnumerate(r, env, q->left->cost <= q->right->cost ? q->left : q->right);
+        break;
+    case PLAN_UNION:
+        QueryEnumerate(r, env, q->left);
+        QueryEnumerate(r, env, q->right);
+        break;
+    }
+}
+
+static int CompareByName(const void *a, const void *b) {
+    const MemContact *x = *(const MemContact *const *)a, *y = *(const MemContact *const *)b;
+    return MemCompare(x, MemSortKey(y), y->id);
+}
+
+static void ExplainNode(const QueryNode *q, int depth, char *buf, size_t size) {
+    size_t used = strlen(buf);
+    if (used + 1 >= size) return;
+    char what[300];
+    if (q->kind == QUERY_TERM) {
+        snprintf(what, sizeof(what), "%s\"%s\"%s", queryFieldNames[q->field], q->text, q->prefix ? "*" : "");
+    } else {
+        snprintf(what, sizeof(what), "%s", q->kind == QUERY_AND ? "AND" : q->kind == QUERY_OR ? "OR" : "NOT");
+    }
+    char how[64];
+    if (q->plan == PLAN_DRIVE) {
+        snprintf(how, sizeof(how), "drive from operand %d", q->left->cost <= q->right->cost ? 1 : 2);
+    } else {
+        snprintf(how, sizeof(how), "%s", queryPlanNames[q->plan]);
+    }
+    snprintf(buf + used, size - used, "%*s%s  [%s, est. cost %.0f]\n", depth * 2, "", what, how, q->cost);
+    if (q->left) ExplainNode(q->left, depth + 1, buf, size);
+    if (q->right) ExplainNode(q->right, depth + 1, buf, size);
+}
+
+// Runs a structured query, handing matches to fn in name order. With explain
+// set, the plan and what it actually checked are written there. Input that
+// doesn't parse is searched literally, like the plain search box.
+int StructuredSearch(const char *text, ContactRowFn fn, void *ctx, char *explain, size_t explainSize) {
+    if (explain && explainSize) explain[0] = '\0';
+    const char *error = NULL;
+    ArenaReset(&queryArena);
+    QueryNode *q = ParseQuery(text, &error);
+    if (!q) {
+        if (explain) snprintf(explain, explainSize, "not a query (%s): literal search\n", error);
+        return store->search(text, fn, ctx);
+    }
+    QueryEnv env;
+    int rc = SearchRows(&env.rows, &env.postings);
+    if (rc != SQLITE_OK) return rc;
+    PlanQuery(&env, q);
+
+    QueryRun r;
+    ZeroMemory(&r, sizeof(r));
+    r.root = q;
+    r.generation = ++visitGeneration;
+    QueryEnumerate(&r, &env, q);
+    lastRowsScanned = r.checked;
+    if (r.nomem) rc = SQLITE_NOMEM;
+    if (rc == SQLITE_OK && q->plan != PLAN_SCAN) qsort((void *)r.hits, r.count, sizeof(*r.hits), CompareByName);
+    for (size_t i = 0; rc == SQLITE_OK && i < r.count; i++) {
+        if (MemRowFn(fn, ctx, r.hits[i])) break;
+    }
+    if (explain) {
+        ExplainNode(q, 0, explain, explainSize);
+        size_t used = strlen(explain);
+        snprintf(explain + used, explainSize - used, "checked %zu of %zu rows, %zu matches\n",
+                 r.checked, env.rows->count, r.count);
+    }
+    free((void *)r.hits);
+    return rc;
+}
+
+// --- Duplicate Check ---
+// Adding a contact warns when its phone or email is already in the book. A
+// blocked Bloom filter over both keys (see Contact keys) answers the common
+// "definitely new" case from memory: each key sets k bits inside one
+// 64-byte block, so a test touches a single cache line. Only a possible
+// match runs the store's lookup. The filter is built when the list has loaded, takes the
+// keys of every add and edit as its batch commits, and is rebuilt from the store when it
+// outgrows its size or missed a write. Keys of edited or deleted contacts
+// stay set, which only costs an extra lookup.
+
+#define DUP_FPR_DEFAULT 0.01
+#define DUP_BLOCK_WORDS 8           // 512 bits
+#define DUP_MIN_KEYS 1024
+#define DUP_LN2 0.6931471805599453
+
+typedef struct {
+    unsigned long long *blocks;     // DUP_BLOCK_WORDS words each, in mem
+    void *mem;
+    size_t blockCount;
+    int k;                          // bits per key
+    size_t keys;
+    size_t capacity;                // keys it was sized for
+    BOOL stale;                     // rebuild from the store before the next test
+} DupFilter;
+
+typedef struct {
+    unsigned long long checks;
+    unsigned long long ruledOut;    // answered by the filter alone
+    unsigned long long lookups;
+    unsigned long long falsePositives;
+    unsigned long long found;
+    unsigned long long rebuilds;
+} DupStats;
+
+typedef struct {
+    int id;                         // 0 when nothing matched
+    BOOL phone;
+    BOOL email;
+    char name[300];
+} DupMatch;
+
+DupFilter dupFilter;
+DupStats dupStats;
+double dupFalsePositiveRate = DUP_FPR_DEFAULT;  // "--dup-fpr=P"
+
+int FlushWrites(void);              // see Write Batching
+static SRWLOCK flushLock = SRWLOCK_INIT;    // held by a flush, which adds the keys it committed
+
+// FNV-1a with the field as the first byte, finished with the murmur3 mixer
+// so the low bits used for bit positions are well spread.
+static unsigned long long DupHash(char field, const char *s) {
+    unsigned long long h = (14695981039346656037ull ^ (unsigned char)field) * 1099511628211ull;
+    for (; *s; s++) h = (h ^ (unsigned char)*s) * 1099511628211ull;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    return h ^ (h >> 33);
+}
+
+// The high half picks the block; the low bits, nine at a time and remixed
+// when they run out, pick the k bits in it.
+static unsigned long long *DupBlock(const DupFilter *f, unsigned long long h) {
+    return f->blocks + (size_t)(((h >> 32) * f->blockCount) >> 32) * DUP_BLOCK_WORDS;
+}
+
+static void DupFilterSet(DupFilter *f, unsigned long long h) {
+    unsigned long long *block = DupBlock(f, h), bits = h;
+    for (int i = 0; i < f->k; i++) {
+        if (i && i % 7 == 0) bits = (bits ^ (bits >> 31)) * 0x9E3779B97F4A7C15ull;
+        block[(bits >> 6) & 7] |= 1ull << (bits & 63);
+        bits >>= 9;
+    }
+}
+
+static BOOL DupFilterTest(const DupFilter *f, unsigned long long h) {
+    const unsigned long long *block = DupBlock(f, h);
+    unsigned long long bits = h;
+    for (int i = 0; i < f->k; i++) {
+        if (i && i % 7 == 0) bits = (bits ^ (bits >> 31)) * 0x9E3779B97F4A7C15ull;
+        if (!(block[(bits >> 6) & 7] & (1ull << (bits & 63)))) return FALSE;
+        bits >>= 9;
+    }
+    return TRUE;
+}
+
+void DupFilterFree(DupFilter *f) {
+    free(f->mem);
+    ZeroMemory(f, sizeof(*f));
+}
+
+// for the statistics output and the bench
+static size_t DupFilterBytes(const DupFilter *f) {
+    return f->blockCount * DUP_BLOCK_WORDS * sizeof(unsigned long long);
+}
+
+// Sizes the filter for twice expectedKeys at false-positive rate fpr:
+// -ln(fpr)/ln(2)^2 bits and ln(2) times that many probes per key. Blocking
+// costs some accuracy at the same size, hence the extra bit.
+BOOL DupFilterInit(DupFilter *f, size_t expectedKeys, double fpr) {
+    DupFilterFree(f);
+    if (fpr <= 0.0 || fpr >= 1.0) fpr = DUP_FPR_DEFAULT;
+    double bitsPerKey = -log(fpr) / (DUP_LN2 * DUP_LN2) + 1.0;
+    int k = (int)(bitsPerKey * DUP_LN2 + 0.5);
+    f->k = k < 1 ? 1 : k > 16 ? 16 : k;
+    f->capacity = expectedKeys * 2 < DUP_MIN_KEYS ? DUP_MIN_KEYS : expectedKeys * 2;
+    f->blockCount = (size_t)((double)f->capacity * bitsPerKey / 512.0) + 1;
+    f->mem = calloc(f->blockCount * DUP_BLOCK_WORDS + 8, sizeof(unsigned long long));
+    if (!f->mem) {
+        ZeroMemory(f, sizeof(*f));
+        return FALSE;
+    }
+    f->blocks = (unsigned long long *)(((size_t)f->mem + 63) & ~(size_t)63);
+    return TRUE;
+}
+
+// Adds the contact's keys (see Contact keys); empty fields have none.
+void DupFilterAdd(DupFilter *f, const char *phone, const char *email) {
+    if (!f->blocks) {
+        f->stale = TRUE;
+        return;
+    }
+    char key[CONTACT_KEY_MAX];
+    if (PhoneKey(phone, key, sizeof(key))) { DupFilterSet(f, DupHash('p', key)); f->keys++; }
+    if (EmailKey(email, key, sizeof(key))) { DupFilterSet(f, DupHash('e', key)); f->keys++; }
+    if (f->keys > f->capacity) f->stale = TRUE;
+}
+
+typedef struct {
+    unsigned long long *hashes;
+    size_t count;
+    size_t cap;
+    BOOL nomem;
+} DupKeys;
+
+static int CollectDupKeys(void *ctx, int id, const char *name, const char *phone, const char *email) {
+    DupKeys *keys = (DupKeys *)ctx;
+    if (keys->count + 2 > keys->cap) {
+        size_t cap = keys->cap ? keys->cap * 2 : 65536;
+        unsigned long long *p = (unsigned long long *)realloc(keys->hashes, cap * sizeof(*p));
+        if (!p) { keys->nomem = TRUE; return 1; }
+        keys->hashes = p;
+        keys->cap = cap;
+    }
+    char key[CONTACT_KEY_MAX];
+    if (PhoneKey(phone, key, sizeof(key))) keys->hashes[keys->count++] = DupHash('p', key);
+    if (EmailKey(email, key, sizeof(key))) keys->hashes[keys->count++] = DupHash('e', key);
+    return 0;
+}
+
+// Rebuilds the filter from every contact in the store. The keys are
+// gathered first so the filter can be sized for them. The caller holds
+// flushLock, so no batch commits between the scan and the new filter;
+// writes still queued add their keys when they do.
+static int DupFilterReload(DupFilter *f, double fpr) {
+    DupKeys keys = { NULL, 0, 0, FALSE };
+    int rc = store->scan(CollectDupKeys, &keys);
+    if (rc == SQLITE_OK && keys.nomem) rc = SQLITE_NOMEM;
+    if (rc == SQLITE_OK && !DupFilterInit(f, keys.count, fpr)) rc = SQLITE_NOMEM;
+    if (rc == SQLITE_OK) {
+        for (size_t i = 0; i < keys.count; i++) DupFilterSet(f, keys.hashes[i]);
+        f->keys = keys.count;
+    } else {
+        DupFilterFree(f);   // checks go straight to the lookup
+    }
+    free(keys.hashes);
+    dupStats.rebuilds++;
+    return rc;
+}
+
+int DupFilterRebuild(DupFilter *f, double fpr) {
+    AcquireSRWLockExclusive(&flushLock);
+    int rc = DupFilterReload(f, fpr);
+    ReleaseSRWLockExclusive(&flushLock);
+    return rc;
+}
+
+typedef struct {
+    const char *phoneKey;       // "" to ignore
+    const char *emailKey;
+    DupMatch *match;
+} DupLookup;
+
+static int DupMatchRow(void *ctx, int id, const char *name, const char *phone, const char *email) {
+    DupLookup *l = (DupLookup *)ctx;
+    DupMatch *m = l->match;
+    if (!m->id) {
+        m->id = id;
+        snprintf(m->name, sizeof(m->name), "%s", name ? name : "");
+    }
+    char key[CONTACT_KEY_MAX];
+    if (*l->phoneKey && PhoneKey(phone, key, sizeof(key)) && strcmp(key, l->phoneKey) == 0) m->phone = TRUE;
+    if (*l->emailKey && EmailKey(email, key, sizeof(key)) && strcmp(key, l->emailKey) == 0) m->email = TRUE;
+    return 0;
+}
+
+// Looks for a contact already using phone or email (either may be empty),
+// compared by key. Returns TRUE and fills m when one exists; m->phone and
+// m->email say which of the two are taken.
+BOOL FindDuplicateContact(const char *phone, const char *email, DupMatch *m) {
+    ZeroMemory(m, sizeof(*m));
+    char phoneKey[CONTACT_KEY_MAX], emailKey[CONTACT_KEY_MAX];
+    BOOL hasPhone = PhoneKey(phone, phoneKey, sizeof(phoneKey)) > 0;
+    BOOL hasEmail = EmailKey(email, emailKey, sizeof(emailKey)) > 0;
+    if (!store || (!hasPhone && !hasEmail)) return FALSE;
+    dupStats.checks++;
+    // queued writes add their keys when they commit
+    FlushWrites();
+    AcquireSRWLockExclusive(&flushLock);
+    if (dupFilter.stale) DupFilterReload(&dupFilter, dupFalsePositiveRate);
+    if (dupFilter.blocks) {
+        // a key the filter rules out cannot match
+        hasPhone = hasPhone && DupFilterTest(&dupFilter, DupHash('p', phoneKey));
+        hasEmail = hasEmail && DupFilterTest(&dupFilter, DupHash('e', emailKey));
+        if (!hasPhone && !hasEmail) {
+            ReleaseSRWLockExclusive(&flushLock);
+            dupStats.ruledOut++;
+            return FALSE;
+        }
+    }
+
+    dupStats.lookups++;
+    LONGLONG span = TraceBegin();
+    DupLookup lookup = { hasPhone ? phoneKey : "", hasEmail ? emailKey : "", m };
+    store->lookup(hasPhone ? phone : "", hasEmail ? email : "", DupMatchRow, &lookup);
+    TraceEnd("FindDuplicateContact", span);
+    ReleaseSRWLockExclusive(&flushLock);
+    if (!m->id) {
+        if (dupFilter.blocks) dupStats.falsePositives++;
+        return FALSE;
+    }
+    dupStats.found++;
+    return TRUE;
+}
+
+// --- Write Batching ---
+// Writes are queued and committed together, either when the window elapses
+// or when the queue fills up. Callbacks run only after the batch commits.
+//
+// Any thread may queue. The window is kept by the write batch thread, which
+// sleeps on a waitable timer until the open batch is due; SetTimer would
+// round anything under USER_TIMER_MINIMUM up to 10 ms. With a main window
+// the thread posts the flush to it, so the window's thread stays the only
+// one using the store, and other threads that find the batch full wait for
+// it to be taken. Without a window the thread flushes by itself, and whoever
+// started it leaves the store to the queue until StopWriteBatcher.
+
+#define WRITE_BATCH_WINDOW_MS 2
+#define WRITE_BATCH_MAX_OPS 256
+#define WM_APP_FLUSH_WRITES (WM_APP + 6)
+
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+
+typedef enum {
+    WRITE_ADD = OP_ADD, WRITE_UPDATE = OP_UPDATE, WRITE_DELETE = OP_DELETE, WRITE_TOUCH = OP_COUNT, WRITE_UPSERT
+} WriteOp;
+typedef void (*WriteDoneFn)(void *ctx, int rc, const char *errmsg);
+
+typedef struct {
+    WriteOp op;
+    int id;
+    char *name;                 // in writeArena, then flushArena
+    char *phone;
+    char *email;
+    MergeRules merge;           // for WRITE_UPSERT
+    WriteDoneFn done;
+    void *ctx;
+} PendingWrite;
+
+UINT writeBatchWindowMs = WRITE_BATCH_WINDOW_MS;
+int writeBatchMaxOps = WRITE_BATCH_MAX_OPS;
+
+// writeLock guards the queue, its arena and the deadline. flushLock (see
+// Duplicate Check) keeps two flushes from running at once and guards
+// dupFilter, which takes the keys of each write once it has committed.
+static SRWLOCK writeLock = SRWLOCK_INIT;
+static CONDITION_VARIABLE writeRoom = CONDITION_VARIABLE_INIT;  // a batch was taken
+static PendingWrite pendingWrites[WRITE_BATCH_MAX_OPS];
+static int pendingCount = 0;
+static LONGLONG writeDeadline = 0;      // QPC ticks when the open batch is due, 0 if none
+static BOOL flushPosted = FALSE;        // WM_APP_FLUSH_WRITES is on its way
+
+static HANDLE hWriteThread = NULL;      // stays NULL in headless builds
+#ifdef _WIN32
+static HANDLE hWriteWake = NULL;        // a batch opened or fell due, or stop
+static HANDLE hWriteTimer = NULL;
+static volatile LONG writeStop = 0;
+#endif
+
+// Strings of the queued writes. They are dead once their statements have
+// run, so the arena is reset whenever a write is queued into an empty batch.
+// FlushWrites copies the batch it takes into flushArena, which only the
+// flush holding flushLock touches, so producers can reset writeArena while
+// the batch runs.
+Arena writeArena = { "writes" };
+Arena flushArena = { "flush" };
+
+// default completion: report failures the same way the direct calls did
+static void ReportWriteError(void *ctx, int rc, const char *errmsg) {
+    if (rc != SQLITE_OK) sql_error(errmsg ? errmsg : "Write failed");
+}
+
+static int ExecPendingWrite(const PendingWrite *w) {
+    switch (w->op) {
+    case WRITE_ADD:    return store->insert(w->name, w->phone, w->email);
+    case WRITE_UPDATE: return store->update(w->id, w->name, w->phone, w->email);
+    case WRITE_DELETE: return store->remove(w->id);
+    case WRITE_TOUCH:  return store->touch(w->id);
+    case WRITE_UPSERT: {
+        int matchedId;
+        return store->upsert(w->name, w->phone, w->email, &w->merge, &matchedId);
+    }
+    }
+    return SQLITE_MISUSE;
+}
+
+// TRUE if this thread may run a flush itself
+static BOOL OwnsWrites(void) {
+#ifdef _WIN32
+    return !hMainWnd || !hWriteThread || GetWindowThreadProcessId(hMainWnd, NULL) == GetCurrentThreadId();
+#else
+    return TRUE;
+#endif
+}
+
+// Commits every queued write in one transaction. Each callback gets the
+// result of its own statement, or the commit error if the batch failed.
+int FlushWrites(void) {
+    AcquireSRWLockExclusive(&flushLock);
+
+    // take the batch first so callbacks and other threads may queue new writes
+    PendingWrite batch[WRITE_BATCH_MAX_OPS];
+    AcquireSRWLockExclusive(&writeLock);
+    int count = pendingCount;
+    if (count) ArenaReset(&flushArena);
+    for (int i = 0; i < count; i++) {
+        batch[i] = pendingWrites[i];
+        if (batch[i].name) {
+            batch[i].name = ArenaCopy(&flushArena, batch[i].name);
+            batch[i].phone = ArenaCopy(&flushArena, batch[i].phone);
+            batch[i].email = ArenaCopy(&flushArena, batch[i].email);
+        }
+    }
+    pendingCount = 0;
+    writeDeadline = 0;
+    flushPosted = FALSE;
+    ReleaseSRWLockExclusive(&writeLock);
+    WakeAllConditionVariable(&writeRoom);
+
+    if (count == 0 || !store) {
+        ReleaseSRWLockExclusive(&flushLock);
+        return SQLITE_OK;
+    }
+
+    int results[WRITE_BATCH_MAX_OPS];
+    char errmsg[512] = {0};
+
+    int rc = store->begin();
+    if (rc == SQLITE_OK) {
+        static const char *spanNames[] = { "AddContact", "UpdateContact", "DeleteContact" };
+        for (int i = 0; i < count; i++) {
+            LONGLONG t0 = OpStart();
+            LONGLONG span = TraceBegin();
+            results[i] = ExecPendingWrite(&batch[i]);
+            switch (batch[i].op) {
+            case WRITE_TOUCH:  TraceEnd("TouchContact", span); break;
+            case WRITE_UPSERT: TraceEnd("UpsertContact", span); break;
+            default:           TraceEnd(spanNames[batch[i].op], span); break;
+            }
+            OpEnd(batch[i].op >= WRITE_TOUCH ? OP_UPDATE : (OpKind)batch[i].op, t0, 0, 0);
+            if (results[i] != SQLITE_OK && !errmsg[0]) {
+                snprintf(errmsg, sizeof(errmsg), "Failed to execute: %s", store->errmsg());
+            }
+        }
+        LONGLONG t0 = OpStart();
+        LONGLONG span = TraceBegin();
+        rc = store->commit();
+        TraceEnd("commit", span);
+        OpEnd(OP_COMMIT, t0, 0, 0);
+    }
+
+    if (rc != SQLITE_OK) {
+        snprintf(errmsg, sizeof(errmsg), "Failed to commit writes: %s", store->errmsg());
+        store->rollback();
+        for (int i = 0; i < count; i++) results[i] = rc;
+    }
+    for (int i = 0; i < count; i++) {
+        if (results[i] == SQLITE_OK && batch[i].name) DupFilterAdd(&dupFilter, batch[i].phone, batch[i].email);
+    }
+    ReleaseSRWLockExclusive(&flushLock);
+
+    for (int i = 0; i < count; i++) {
+        if (batch[i].done) batch[i].done(batch[i].ctx, results[i], results[i] == SQLITE_OK ? NULL : errmsg);
+    }
+    return rc;
+}
+
+#ifdef _WIN32
+// WM_APP_FLUSH_WRITES: the batch may have been flushed some other way since
+void FlushPostedWrites(void) {
+    AcquireSRWLockExclusive(&writeLock);
+    BOOL due = flushPosted;
+    ReleaseSRWLockExclusive(&writeLock);
+    if (due) FlushWrites();
+}
+
+static DWORD WINAPI WriteBatchThread(LPVOID param) {
+    HANDLE waits[2] = { hWriteWake, hWriteTimer };
+    while (!writeStop) {
+        AcquireSRWLockExclusive(&writeLock);
+        LONGLONG due = flushPosted ? 0 : writeDeadline;
+        LONGLONG now = ClockNow();
+        BOOL post = due && now >= due && hMainWnd;
+        if (post) flushPosted = TRUE;
+        ReleaseSRWLockExclusive(&writeLock);
+
+        if (post) {
+            PostMessage(hMainWnd, WM_APP_FLUSH_WRITES, 0, 0);
+        } else if (due && now >= due) {
+            FlushWrites();
+        } else if (due) {
+            // relative due time, in 100 ns units
+            LARGE_INTEGER when;
+            when.QuadPart = -(LONGLONG)((TicksToNs(due - now) + 99) / 100);
+            SetWaitableTimer(hWriteTimer, &when, 0, NULL, NULL, FALSE);
+            WaitForMultipleObjects(2, waits, FALSE, INFINITE);
+        } else {
+            WaitForSingleObject(hWriteWake, INFINITE);
+        }
+    }
+    return 0;
+}
+
+// Starts the thread that flushes a batch when its window elapses. Until it
+// runs, QueueWrite commits each write as it is queued.
+BOOL StartWriteBatcher(void) {
+    if (hWriteThread) return TRUE;
+    hWriteWake = CreateEvent(NULL, FALSE, FALSE, NULL);
+    hWriteTimer = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+    // before Windows 10 1803 only the default timer resolution is offered
+    if (!hWriteTimer) hWriteTimer = CreateWaitableTimerW(NULL, FALSE, NULL);
+    writeStop = 0;
+    if (hWriteWake && hWriteTimer) hWriteThread = CreateThread(NULL, 0, WriteBatchThread, NULL, 0, NULL);
+    if (!hWriteThread) {
+        if (hWriteWake) CloseHandle(hWriteWake);
+        if (hWriteTimer) CloseHandle(hWriteTimer);
+        hWriteWake = hWriteTimer = NULL;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+// Stops the thread and commits what it left queued.
+int StopWriteBatcher(void) {
+    if (hWriteThread) {
+        InterlockedExchange(&writeStop, 1);
+        SetEvent(hWriteWake);
+        WaitForSingleObject(hWriteThread, INFINITE);
+        CloseHandle(hWriteThread);
+        CloseHandle(hWriteWake);
+        CloseHandle(hWriteTimer);
+        hWriteThread = hWriteWake = hWriteTimer = NULL;
+    }
+    return FlushWrites();
+}
+
+static void WakeWriteBatcher(void) {
+    SetEvent(hWriteWake);
+}
+#else
+// Headless builds have no writer thread: every write is due when queued
+// and its caller commits it.
+BOOL StartWriteBatcher(void) { return FALSE; }
+int StopWriteBatcher(void) { return FlushWrites(); }
+static void WakeWriteBatcher(void) {}
+#endif
+
+// Queues a write. The batch is flushed once it reaches writeBatchMaxOps or
+// writeBatchWindowMs after its first write; a window of 0 commits each
+// write as it is queued.
+void QueueWrite(WriteOp op, int id, const char *name, const char *phone, const char *email,
+                const MergeRules *merge, WriteDoneFn done, void *ctx) {
+    if (!store) return;
+    int maxOps = writeBatchMaxOps;
+    if (maxOps < 1 || maxOps > WRITE_BATCH_MAX_OPS) maxOps = WRITE_BATCH_MAX_OPS;
+    BOOL owner = OwnsWrites();
+
+    AcquireSRWLockExclusive(&writeLock);
+    // only the owner flushes a full batch; the others wait for it to go
+    while (pendingCount >= WRITE_BATCH_MAX_OPS || (!owner && pendingCount >= maxOps)) {
+        if (owner) {
+            ReleaseSRWLockExclusive(&writeLock);
+            FlushWrites();
+            AcquireSRWLockExclusive(&writeLock);
+            continue;
+        }
+        SleepConditionVariableSRW(&writeRoom, &writeLock, INFINITE, 0);
+    }
+    if (pendingCount == 0) ArenaReset(&writeArena);
+    PendingWrite *w = &pendingWrites[pendingCount];
+    ZeroMemory(w, sizeof(*w));
+    w->op = op;
+    w->id = id;
+    if (op == WRITE_ADD || op == WRITE_UPDATE || op == WRITE_UPSERT) {
+        w->name = ArenaCopy(&writeArena, name);
+        w->phone = ArenaCopy(&writeArena, phone);
+        w->email = ArenaCopy(&writeArena, email);
+    }
+    if (merge) w->merge = *merge;
+    w->done = done;
+    w->ctx = ctx;
+    pendingCount++;
+
+    BOOL flushNow = FALSE, wake = FALSE;
+    if (!hWriteThread || writeBatchWindowMs == 0 || pendingCount >= maxOps) {
+        // due now: flush here if allowed, else have the thread post it
+        flushNow = owner;
+        wake = !owner;
+        if (!owner) writeDeadline = ClockNow();
+    } else if (pendingCount == 1) {
+        writeDeadline = ClockNow() + (LONGLONG)writeBatchWindowMs * ClockFrequency() / 1000;
+        wake = TRUE;
+    }
+    ReleaseSRWLockExclusive(&writeLock);
+
+    if (flushNow) FlushWrites();
+    else if (wake) WakeWriteBatcher();
+}
+
+void AddContact(const char *name, const char *phone, const char *email) {
+    QueueWrite(WRITE_ADD, 0, name, phone, email, NULL, ReportWriteError, NULL);
+}
+
+void UpdateContact(int id,const char *name,const char *phone,const char *email) {
+    QueueWrite(WRITE_UPDATE, id, name, phone, email, NULL, ReportWriteError, NULL);
+}
+
+void DeleteContact(int id) {
+    QueueWrite(WRITE_DELETE, id, NULL, NULL, NULL, NULL, ReportWriteError, NULL);
+}
+
+// records that the contact was opened, for ranked search
+void TouchContact(int id) {
+    QueueWrite(WRITE_TOUCH, id, NULL, NULL, NULL, NULL, NULL, NULL);
+}
+
+// Adds the contact, or merges it into the one with the same phone or email
+// key (see ContactStore.upsert). rules may be NULL for defaultMergeRules.
+void UpsertContact(const char *name, const char *phone, const char *email, const MergeRules *rules) {
+    QueueWrite(WRITE_UPSERT, 0, name, phone, email, rules ? rules : &defaultMergeRules, ReportWriteError, NULL);
+}
+
+typedef struct {
+    const char *name;
+    const char *phone;
+    const char *email;
+} UpsertRow;
+
+typedef struct {
+    int inserted;
+    int updated;
+} UpsertCounts;
+
+// Upserts the rows in one transaction, outside the write queue: queued
+// writes are flushed first so they cannot land in between. All or none of
+// the rows are written.
+int UpsertBatch(const UpsertRow *rows, int count, const MergeRules *rules, UpsertCounts *counts) {
+    if (!store) return SQLITE_MISUSE;
+    if (!rules) rules = &defaultMergeRules;
+    UpsertCounts local = {0};
+    int rc = FlushWrites();
+    if (rc == SQLITE_OK) rc = store->begin();
+    if (rc != SQLITE_OK) return rc;
+
+    LONGLONG span = TraceBegin();
+    for (int i = 0; rc == SQLITE_OK && i < count; i++) {
+        LONGLONG t0 = OpStart();
+        int matchedId;
+        rc = store->upsert(rows[i].name, rows[i].phone, rows[i].email, rules, &matchedId);
+        OpEnd(OP_UPDATE, t0, 0, 0);
+        if (matchedId) local.updated++;
+        else local.inserted++;
+    }
+    if (rc == SQLITE_OK) {
+        LONGLONG t0 = OpStart();
+        rc = store->commit();
+        OpEnd(OP_COMMIT, t0, 0, 0);
+    }
+    TraceEnd("UpsertBatch", span);
+    if (rc != SQLITE_OK) {
+        store->rollback();
+        return rc;
+    }
+    for (int i = 0; i < count; i++) DupFilterAdd(&dupFilter, rows[i].phone, rows[i].email);
+    if (counts) *counts = local;
+    return SQLITE_OK;
+}
+
+// --- Bulk Operations ---
+// Deleting or editing many contacts runs in one transaction instead of one
+// queued write and commit per contact. The rows go through the store
+// BULK_CHUNK_ROWS at a time, with a progress call after each chunk; a call
+// that returns FALSE rolls the whole operation back and it returns
+// SQLITE_ABORT. Queued writes are flushed first. The memory store has no
+// transactions, so there a cancel keeps the chunks already done.
+
+#define BULK_CHUNK_ROWS 2048
+
+typedef BOOL (*BulkProgressFn)(void *ctx, int done, int total);
+
+typedef struct {
+    int *ids;
+    int count;
+    int cap;
+    BOOL nomem;
+} BulkIds;
+
+void BulkIdsFree(BulkIds *b) {
+    free(b->ids);
+    ZeroMemory(b, sizeof(*b));
+}
+
+static int BulkCollectRow(void *ctx, int id, const char *name, const char *phone, const char *email) {
+    BulkIds *b = (BulkIds *)ctx;
+    if (b->count == b->cap) {
+        int cap = b->cap ? b->cap * 2 : 1024;
+        int *ids = (int *)realloc(b->ids, cap * sizeof(int));
+        if (!ids) {
+            b->nomem = TRUE;
+            return 1;
+        }
+        b->ids = ids;
+        b->cap = cap;
+    }
+    b->ids[b->count++] = id;
+    return 0;
+}
+
+// The ids of every contact the search box text matches, structured query or
+// plain filter; ranking does not apply. An empty filter matches nothing.
+int BulkMatchIds(const char *filter, BulkIds *out) {
+    ZeroMemory(out, sizeof(*out));
+    if (!store || !filter || !*filter) return SQLITE_OK;
+    int rc = FlushWrites();
+    if (rc != SQLITE_OK) return rc;
+    if (IsStructuredQuery(filter)) rc = StructuredSearch(filter, BulkCollectRow, out, NULL, 0);
+    else rc = store->search(filter, BulkCollectRow, out);
+    if (rc == SQLITE_OK && out->nomem) rc = SQLITE_NOMEM;
+    return rc;
+}
+
+static int BulkBegin(void) {
+    if (!store) return SQLITE_MISUSE;
+    int rc = FlushWrites();
+    return rc == SQLITE_OK ? store->begin() : rc;
+}
+
+static int BulkCommit(int rc) {
+    if (rc == SQLITE_OK) {
+        LONGLONG t0 = OpStart();
+        rc = store->commit();
+        OpEnd(OP_COMMIT, t0, 0, 0);
+    }
+    if (rc != SQLITE_OK) store->rollback();
+    return rc;
+}
+
+static int BulkEnd(int rc, const char *spanName, LONGLONG span) {
+    rc = BulkCommit(rc);
+    TraceEnd(spanName, span);
+    return rc;
+}
+
+int BulkDelete(const int *ids, int count, BulkProgressFn progress, void *ctx) {
+    int rc = BulkBegin();
+    if (rc != SQLITE_OK) return rc;
+    LONGLONG span = TraceBegin();
+    for (int done = 0; rc == SQLITE_OK && done < count; ) {
+        int n = count - done < BULK_CHUNK_ROWS ? count - done : BULK_CHUNK_ROWS;
+        rc = store->removeMany(ids + done, n);
+        done += n;
+        if (rc == SQLITE_OK && progress && !progress(ctx, done, count)) rc = SQLITE_ABORT;
+    }
+    return BulkEnd(rc, "BulkDelete", span);
+}
+
+typedef struct {
+    char *fields[3];            // name, phone, email
+} BulkRow;
+
+static int BulkGetRow(void *ctx, int id, const char *name, const char *phone, const char *email) {
+    BulkRow *r = (BulkRow *)ctx;
+    r->fields[0] = _strdup(name);
+    r->fields[1] = _strdup(phone);
+    r->fields[2] = _strdup(email);
+    return 1;
+}
+
+// Sets one field (FIELD_NAME, FIELD_PHONE or FIELD_EMAIL) of every contact
+// to value; the caller validates it. Missing ids are skipped.
+int BulkSetField(const int *ids, int count, QueryField field, const char *value, BulkProgressFn progress, void *ctx) {
+    if (field < FIELD_NAME || field > FIELD_EMAIL) return SQLITE_MISUSE;
+    int rc = BulkBegin();
+    if (rc != SQLITE_OK) return rc;
+    LONGLONG span = TraceBegin();
+    for (int done = 0; rc == SQLITE_OK && done < count; ) {
+        int end = count - done < BULK_CHUNK_ROWS ? count : done + BULK_CHUNK_ROWS;
+        for (; rc == SQLITE_OK && done < end; done++) {
+            BulkRow r = { { NULL, NULL, NULL } };
+            rc = store->get(ids[done], BulkGetRow, &r);
+            if (rc == SQLITE_OK && r.fields[0] && r.fields[1] && r.fields[2]) {
+                const char *f[3] = { r.fields[0], r.fields[1], r.fields[2] };
+                f[field - FIELD_NAME] = value;
+                rc = store->update(ids[done], f[0], f[1], f[2]);
+            } else if (rc == SQLITE_OK && (r.fields[0] || r.fields[1] || r.fields[2])) {
+                rc = SQLITE_NOMEM;
+            }
+            for (int i = 0; i < 3; i++) free(r.fields[i]);
+        }
+        if (rc == SQLITE_OK && progress && !progress(ctx, done, count)) rc = SQLITE_ABORT;
+    }
+    rc = BulkEnd(rc, "BulkSetField", span);
+    if (rc == SQLITE_OK && field != FIELD_NAME) {
+        DupFilterAdd(&dupFilter, field == FIELD_PHONE ? value : "", field == FIELD_EMAIL ? value : "");
+    }
+    return rc;
+}
+
+// Deletes every contact the filter matches (see BulkMatchIds).
+int BulkDeleteByFilter(const char *filter, BulkProgressFn progress, void *ctx, int *deleted) {
+    BulkIds b;
+    int rc = BulkMatchIds(filter, &b);
+    if (rc == SQLITE_OK) rc = BulkDelete(b.ids, b.count, progress, ctx);
+    if (deleted) *deleted = rc == SQLITE_OK ? b.count : 0;
+    BulkIdsFree(&b);
+    return rc;
+}
+
+// Set-based edits: rewriting every address at one domain to another,
+// stripping a prefix from a field, or replacing text within it, for all
+// contacts it applies to. SQLite runs each as one UPDATE per chunk of
+// BULK_UPDATE_CHUNK_IDS ids; the memory and log stores apply the same rule
+// in C to the rows a scan finds. Unlike the operations above each chunk
+// commits on its own, so a long edit never holds the write lock for long; a
+// failure or a cancel keeps the chunks already committed. Rows the edit
+// would leave with an invalid value (see IsColumnValueValid), such as a
+// name replaced by nothing, are skipped and counted.
+
+#define BULK_UPDATE_CHUNK_IDS 16384
+
+typedef enum { BULK_EDIT_DOMAIN, BULK_EDIT_STRIP_PREFIX, BULK_EDIT_REPLACE } BulkEditKind;
+
+typedef struct {
+    BulkEditKind kind;
+    QueryField field;       // FIELD_EMAIL for BULK_EDIT_DOMAIN
+    const char *from;       // old domain, prefix or text to replace; not empty
+    const char *to;         // new domain or replacement; unused for prefixes
+} BulkEdit;
+
+// Whether the edit is well formed and its new text could appear in a valid
+// value of the field.
+BOOL BulkEditValid(const BulkEdit *e) {
+    if (!e->from || !*e->from || e->field < FIELD_NAME || e->field > FIELD_EMAIL) return FALSE;
+    if (e->kind == BULK_EDIT_STRIP_PREFIX) return TRUE;
+    if (!e->to || !IsColumnValueValid(e->field - FIELD_NAME, e->to, TRUE)) return FALSE;
+    return e->kind != BULK_EDIT_DOMAIN || (e->field == FIELD_EMAIL && *e->to && !strchr(e->to, '@'));
+}
+
+static BOOL BulkEditMatches(const BulkEdit *e, const char *value) {
+    if (e->kind == BULK_EDIT_STRIP_PREFIX) return strncmp(value, e->from, strlen(e->from)) == 0;
+    if (e->kind == BULK_EDIT_REPLACE) return strstr(value, e->from) != NULL;
+    const char *at = strchr(value, '@');
+    char domain[CONTACT_KEY_MAX], from[CONTACT_KEY_MAX];
+    return at && EmailKey(at + 1, domain, sizeof(domain)) == EmailKey(e->from, from, sizeof(from)) &&
+           strcmp(domain, from) == 0;
+}
+
+// The edited value, malloc'd; value must match.
+static char *BulkEditResult(const BulkEdit *e, const char *value) {
+    if (e->kind == BULK_EDIT_STRIP_PREFIX) return _strdup(value + strlen(e->from));
+    size_t fromLen = strlen(e->from), toLen = strlen(e->to), keep = strlen(value);
+    if (e->kind == BULK_EDIT_DOMAIN) keep = strchr(value, '@') + 1 - value;
+    size_t size = keep + toLen + 1;
+    if (e->kind == BULK_EDIT_REPLACE) {
+        for (const char *p = value; (p = strstr(p, e->from)) != NULL; p += fromLen) size += toLen;
+    }
+    char *out = (char *)malloc(size);
+    if (!out || e->kind == BULK_EDIT_DOMAIN) {
+        if (out) snprintf(out, size, "%.*s%s", (int)keep, value, e->to);
+        return out;
+    }
+    char *o = out;
+    for (const char *p = value, *hit; ; p = hit + fromLen) {
+        if (!(hit = strstr(p, e->from))) {
+            strcpy(o, p);
+            break;
+        }
+        memcpy(o, p, hit - p);
+        memcpy(o + (hit - p), e->to, toLen);
+        o += (hit - p) + toLen;
+    }
+    return out;
+}
+
+typedef struct {
+    const BulkEdit *edit;
+    BulkIds ids;
+    int skipped;
+} BulkEditScan;
+
+static int BulkEditScanRow(void *ctx, int id, const char *name, const char *phone, const char *email) {
+    BulkEditScan *scan = (BulkEditScan *)ctx;
+    const char *fields[3] = { name, phone, email };
+    int column = scan->edit->field - FIELD_NAME;
+    if (!BulkEditMatches(scan->edit, fields[column])) return 0;
+    char *edited = BulkEditResult(scan->edit, fields[column]);
+    if (!edited) {
+        scan->ids.nomem = TRUE;
+        return 1;
+    }
+    BOOL valid = IsColumnValueValid(column, edited, FALSE);
+    free(edited);
+    if (!valid) {
+        scan->skipped++;
+        return 0;
+    }
+    return BulkCollectRow(&scan->ids, id, name, phone, email);
+}
+
+// The rule in C: one scan finds the rows the edit leaves valid, then each
+// chunk reads, edits and writes its rows back.
+static int BulkUpdateRows(const BulkEdit *e, BOOL dryRun, BulkProgressFn progress, void *ctx, int *matched, int *skipped) {
+    BulkEditScan scan = { e };
+    int rc = store->scan(BulkEditScanRow, &scan);
+    if (rc == SQLITE_OK && scan.ids.nomem) rc = SQLITE_NOMEM;
+    *matched = rc == SQLITE_OK ? scan.ids.count : 0;
+    *skipped = rc == SQLITE_OK ? scan.skipped : 0;
+    int done = 0;
+    while (rc == SQLITE_OK && !dryRun && done < scan.ids.count) {
+        int end = scan.ids.count - done < BULK_CHUNK_ROWS ? scan.ids.count : done + BULK_CHUNK_ROWS;
+        rc = store->begin();
+        for (; rc == SQLITE_OK && done < end; done++) {
+            BulkRow r = { { NULL, NULL, NULL } };
+            rc = store->get(scan.ids.ids[done], BulkGetRow, &r);
+            if (rc == SQLITE_OK && r.fields[0] && r.fields[1] && r.fields[2]) {
+                const char *f[3] = { r.fields[0], r.fields[1], r.fields[2] };
+                char *edited = BulkEditResult(e, f[e->field - FIELD_NAME]);
+                f[e->field - FIELD_NAME] = edited;
+                rc = edited ? store->update(scan.ids.ids[done], f[0], f[1], f[2]) : SQLITE_NOMEM;
+                free(edited);
+            } else if (rc == SQLITE_OK && (r.fields[0] || r.fields[1] || r.fields[2])) {
+                rc = SQLITE_NOMEM;
+            }
+            for (int i = 0; i < 3; i++) free(r.fields[i]);
+        }
+        rc = BulkCommit(rc);
+        if (rc == SQLITE_OK && progress && !progress(ctx, done, scan.ids.count)) rc = SQLITE_ABORT;
+    }
+    if (!dryRun) *matched = done;
+    BulkIdsFree(&scan.ids);
+    return rc;
+}
+
+// Per field: the rows to read it from, and the contact_rows columns that
+// follow from its new value n.v
+static const struct {
+    const char *source;
+    const char *set;
+} bulkUpdateFields[] = {
+    { "contact_rows", "name=n.v, sort_key=name_sort_key(n.v)" },
+    { "contact_rows", "phone=n.v, phone_key=" PHONE_KEY("n.v") },
+    { "contacts", "email_local=" EMAIL_LOCAL("n.v") ", domain_id=" EMAIL_DOMAIN_ID("n.v") ", email_key=" EMAIL_KEY("n.v") },
+};
+
+// The rule as SQL, with ?1 from, ?2 to and ?3..?4 the chunk's id range: the
+// count of matching rows with their id range and how many the edit would
+// leave invalid, the UPDATE of the rest, and for emails the statement adding
+// the new domains first.
+static void BulkUpdateSql(const BulkEdit *e, char *count, char *update, char *domains, size_t size) {
+    domains[0] = '\0';
+    if (e->kind == BULK_EDIT_DOMAIN) {
+        const char *where = " WHERE domain_id IN (SELECT id FROM domains WHERE name=?1 COLLATE NOCASE)";
+        const char *valid = "valid_value(2,email_local||'@'||?2)";
+        snprintf(count, size, "SELECT count(*),min(id),max(id),sum(NOT %s) FROM contact_rows%s;", valid, where);
+        snprintf(update, size, "UPDATE contact_rows SET domain_id=(SELECT id FROM domains WHERE name=?2),"
+                 " email_key=" EMAIL_KEY("email_local||'@'||?2") "%s AND %s AND id BETWEEN ?3 AND ?4;", where, valid);
+        snprintf(domains, size, "INSERT OR IGNORE INTO domains(name) VALUES(?2);");
+        return;
+    }
+    const char *column = e->field == FIELD_NAME ? "name" : e->field == FIELD_PHONE ? "phone" : "email";
+    int index = e->field - FIELD_NAME;
+    const char *source = bulkUpdateFields[index].source;
+    char value[64], where[64];
+    if (e->kind == BULK_EDIT_STRIP_PREFIX) {
+        snprintf(value, sizeof(value), "substr(%s,length(?1)+1)", column);
+        snprintf(where, sizeof(where), "substr(%s,1,length(?1))=?1", column);
+    } else {
+        snprintf(value, sizeof(value), "replace(%s,?1,?2)", column);
+        snprintf(where, sizeof(where), "instr(%s,?1)>0", column);
+    }
+    snprintf(count, size, "SELECT count(*),min(id),max(id),sum(NOT valid_value(%d,%s)) FROM %s WHERE %s;",
+             index, value, source, where);
+    snprintf(update, size, "UPDATE contact_rows SET %s FROM (SELECT id AS nid, %s AS v FROM %s WHERE %s AND id BETWEEN ?3 AND ?4) AS n"
+             " WHERE contact_rows.id=n.nid AND valid_value(%d,n.v);", bulkUpdateFields[index].set, value, source, where, index);
+    if (e->field == FIELD_EMAIL) {
+        snprintf(domains, size, "INSERT OR IGNORE INTO domains(name) SELECT " EMAIL_DOMAIN("v")
+                 " FROM (SELECT %s AS v FROM contacts WHERE %s AND id BETWEEN ?3 AND ?4) WHERE " EMAIL_HAS_DOMAIN("v")
+                 " AND valid_value(2,v);", value, where);
+    }
+}
+
+static int BulkStepChunk(sqlite3_stmt *stmt, const BulkEdit *e, sqlite3_int64 lo, sqlite3_int64 hi) {
+    if (!stmt) return SQLITE_OK;
+    sqlite3_bind_text(stmt, 1, e->from, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, e->to ? e->to : "", -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 3, lo);
+    sqlite3_bind_int64(stmt, 4, hi);
+    return SqliteStepDone(stmt);
+}
+
+static int BulkUpdateSqlite(const BulkEdit *e, BOOL dryRun, BulkProgressFn progress, void *ctx, int *matched, int *skipped) {
+    char countSql[1024], updateSql[1024], domainsSql[1024];
+    BulkUpdateSql(e, countSql, updateSql, domainsSql, sizeof(countSql));
+    sqlite3_stmt *count = NULL, *update = NULL, *domains = NULL;
+    int rc = sqlite3_prepare_v2(db, countSql, -1, &count, NULL);
+    sqlite3_int64 lo = 0, last = -1;
+    *matched = *skipped = 0;
+    if (rc == SQLITE_OK) {
+        sqlite3_bind_text(count, 1, e->from, -1, SQLITE_STATIC);
+        sqlite3_bind_text(count, 2, e->to ? e->to : "", -1, SQLITE_STATIC);
+        if ((rc = sqlite3_step(count)) == SQLITE_ROW) {
+            *skipped = sqlite3_column_int(count, 3);
+            *matched = sqlite3_column_int(count, 0) - *skipped;
+            lo = sqlite3_column_int64(count, 1);
+            last = sqlite3_column_int64(count, 2);
+            rc = SQLITE_OK;
+        }
+        sqlite3_finalize(count);
+    }
+    if (rc != SQLITE_OK || dryRun || !*matched) return rc;
+
+    int total = *matched, done = 0;
+    rc = sqlite3_prepare_v2(db, updateSql, -1, &update, NULL);
+    if (rc == SQLITE_OK && domainsSql[0]) rc = sqlite3_prepare_v2(db, domainsSql, -1, &domains, NULL);
+    for (; rc == SQLITE_OK && lo <= last; lo += BULK_UPDATE_CHUNK_IDS) {
+        rc = store->begin();
+        if (rc == SQLITE_OK) rc = BulkStepChunk(domains, e, lo, lo + BULK_UPDATE_CHUNK_IDS - 1);
+        if (rc == SQLITE_OK) rc = BulkStepChunk(update, e, lo, lo + BULK_UPDATE_CHUNK_IDS - 1);
+        int changed = sqlite3_changes(db);
+        rc = BulkCommit(rc);
+        if (rc == SQLITE_OK) done += changed;
+        if (rc == SQLITE_OK && progress && !progress(ctx, done, total)) rc = SQLITE_ABORT;
+    }
+    sqlite3_finalize(update);
+    sqlite3_finalize(domains);
+    *matched = done;
+    return rc;
+}
+
+// Applies an edit to every contact it matches, or with dryRun only counts
+// them. matched gets the count, or how many were updated, and skipped the
+// matching contacts the edit would leave invalid.
+int BulkUpdate(const BulkEdit *e, BOOL dryRun, BulkProgressFn progress, void *ctx, int *matched, int *skipped) {
+    *matched = *skipped = 0;
+    if (!store || !BulkEditValid(e)) return SQLITE_MISUSE;
+    int rc = FlushWrites();
+    if (rc != SQLITE_OK) return rc;
+    LONGLONG span = TraceBegin();
+    rc = store == &sqliteStore ? BulkUpdateSqlite(e, dryRun, progress, ctx, matched, skipped)
+                               : BulkUpdateRows(e, dryRun, progress, ctx, matched, skipped);
+    TraceEnd(dryRun ? "BulkUpdate.dry_run" : "BulkUpdate", span);
+    if (!dryRun && *matched && e->field != FIELD_NAME) dupFilter.stale = TRUE;
+    return rc;
+}
+
+// --- Contact Search ---
+
+typedef struct {
+    ContactRowFn fn;
+    void *ctx;
+    int rows;
+} CountingRows;
+
+static int CountRow(void *ctx, int id, const char *name, const char *phone, const char *email) {
+    CountingRows *c = (CountingRows *)ctx;
+    c->rows++;
+    return c->fn(c->ctx, id, name, phone, email);
+}
+
+// The search path shared by the list view and the replay harness: flushes
+// queued writes, then runs the filter (or the full list when it is empty)
+// with statistics and a trace span. With rankResults set, a filter returns
+// the top RANK_TOP_K matches by relevance. Returns the store's result code.
+int RunContactSearch(const char *filter, ContactRowFn fn, void *ctx, int *rowsOut) {
+    FlushWrites(); // make queued writes visible to this query
+
+    CountingRows counting = { fn, ctx, 0 };
+    BOOL searching = filter && strlen(filter) > 0;
+    LONGLONG t0 = OpStart();
+    LONGLONG query = TraceBegin();
+    lastRowsScanned = 0;
+    int rc;
+    BOOL structured = searching && IsStructuredQuery(filter);
+    if (!searching) rc = store->scan(CountRow, &counting);
+    else if (structured) rc = StructuredSearch(filter, CountRow, &counting, NULL, 0);
+    else if (rankResults) rc = RankedSearch(filter, RANK_TOP_K, CountRow, &counting);
+    else rc = store->search(filter, CountRow, &counting);
+    TraceEnd(!searching ? "store.scan" : structured ? "store.query" : rankResults ? "store.rank" : "store.search", query);
+    OpEnd(searching ? OP_SEARCH : OP_LIST, t0, lastRowsScanned, (unsigned long long)counting.rows);
+    if (rowsOut) *rowsOut = counting.rows;
+    return rc;
+}
+
+// --- Keystroke Replay ---
+// Replays a recorded search session in real time through RunContactSearch,
+// as if every keystroke in the search box started a new query:
+//
+//   contact_manager.exe replay --db=bench_contacts.db --session=typing.txt
+//   contact_manager.exe replay --db=bench_contacts.db --type=smith --interval=120
+//
+// A session file has one keystroke per line: "<ms since previous> <key>",
+// where key is a single character, <space> or <bs>. A query still running
+// when the next keystroke arrives is cancelled; one that finishes after it
+// arrived is counted as wasted.
+
+#define REPLAY_DB_FILE "bench_contacts.db"   // what "generate" and "bench" leave behind
+#define REPLAY_MAX_KEYS 4096
+#define REPLAY_PROGRESS_OPS 1000
+
+// value following key in a verb's arguments, e.g. "--db="
+static const char *ArgValue(const char *args, const char *key) {
+    const char *p = args ? strstr(args, key) : NULL;
+    return p ? p + strlen(key) : NULL;
+}
+
+typedef struct {
+    int delayMs;
+    char key;     // '\b' for backspace
+} ReplayKey;
+
+static LONGLONG replayDeadline = 0;   // QPC ticks; 0 when nothing is pending
+static BOOL replayStopped = FALSE;
+
+static BOOL ReplayDeadlinePassed(void) {
+    return replayDeadline && ClockNow() >= replayDeadline;
+}
+
+static int ReplayProgress(void *ctx) {
+    return ReplayDeadlinePassed();
+}
+
+static int ReplayRow(void *ctx, int id, const char *name, const char *phone, const char *email) {
+    if (ReplayDeadlinePassed()) replayStopped = TRUE;
+    return replayStopped;
+}
+
+static void PrintJsonString(const char *s) {
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') putchar('\\');
+        if ((unsigned char)*s >= 0x20) putchar(*s);
+    }
+    putchar('"');
+}
+
+static int LoadReplaySession(const char *path, ReplayKey *keys, int maxKeys) {
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    int n = 0;
+    char line[128];
+    while (n < maxKeys && fgets(line, sizeof(line), f)) {
+        int delay;
+        char key[32];
+        if (sscanf(line, "%d %31s", &delay, key) != 2) {
+            // a bare delay followed by a literal space
+            if (sscanf(line, "%d", &delay) != 1 || !strchr(line, ' ')) continue;
+            strcpy(key, " ");
+        }
+        keys[n].delayMs = delay;
+        if (strcmp(key, "<bs>") == 0) keys[n].key = '\b';
+        else if (strcmp(key, "<space>") == 0) keys[n].key = ' ';
+        else keys[n].key = key[0];
+        n++;
+    }
+    fclose(f);
+    return n;
+}
+
+static int CommandReplay(const char *args) {
+    const char *v;
+    char path[MAX_PATH] = REPLAY_DB_FILE;
+    if ((v = ArgValue(args, "--db=")) != NULL) sscanf(v, "%259s", path);
+
+    ReplayKey *keys = (ReplayKey *)calloc(REPLAY_MAX_KEYS, sizeof(ReplayKey));
+    if (!keys) return 1;
+    int nkeys = 0;
+    if ((v = ArgValue(args, "--session=")) != NULL) {
+        char session[MAX_PATH];
+        sscanf(v, "%259s", session);
+        nkeys = LoadReplaySession(session, keys, REPLAY_MAX_KEYS);
+        if (nkeys < 0) {
+            fprintf(stderr, "Cannot read session %s\n", session);
+            free(keys);
+            return 1;
+        }
+    } else if ((v = ArgValue(args, "--type=")) != NULL) {
+        int interval = ArgValue(args, "--interval=") ? atoi(ArgValue(args, "--interval=")) : 120;
+        for (; *v && *v != ' ' && nkeys < REPLAY_MAX_KEYS; v++, nkeys++) {
+            keys[nkeys].delayMs = nkeys ? interval : 0;
+            keys[nkeys].key = *v;
+        }
+    }
+    if (nkeys == 0) {
+        fprintf(stderr, "usage: replay [--db=path] [--store=sqlite|memory|log] [--log=path] --session=file | --type=text [--interval=ms]\n");
+        free(keys);
+        return 1;
+    }
+
+    // the log store replays --log= (default LOG_FILE), seeded from --db= if missing
+    const ContactStore *selected = &sqliteStore;
+    char logPath[MAX_PATH] = LOG_FILE;
+    if ((v = ArgValue(args, "--store=")) != NULL) {
+        if (strncmp(v, "memory", 6) == 0) selected = &memoryStore;
+        else if (strncmp(v, "log", 3) == 0) selected = &logStore;
+        else if (strncmp(v, "sqlite", 6) != 0) {
+            fprintf(stderr, "replay: unknown store, expected sqlite, memory or log\n");
+            free(keys);
+            return 1;
+        }
+    }
+    if ((v = ArgValue(args, "--log=")) != NULL) sscanf(v, "%259s", logPath);
+    logFilePath = logPath;
+    store = selected;
+    if (store->open(path) != SQLITE_OK) {
+        store = NULL;
+        logFilePath = LOG_FILE;
+        free(keys);
+        return 1;
+    }
+    if (db) sqlite3_progress_handler(db, REPLAY_PROGRESS_OPS, ReplayProgress, NULL);
+
+    LONGLONG msTicks = ClockFrequency() / 1000;
+
+    char text[256] = {0};
+    size_t len = 0;
+    int queries = 0, cancelled = 0, wasted = 0;
+    OpStats ttr;
+    ZeroMemory(&ttr, sizeof(ttr));
+
+    LONGLONG arrival = ClockNow();
+    for (int i = 0; i < nkeys; i++) {
+        arrival += (LONGLONG)keys[i].delayMs * msTicks;
+        LONGLONG now = ClockNow();
+        // rounded up, so the query never starts before its keystroke arrives
+        if (now < arrival) SleepMs((DWORD)((arrival - now + msTicks - 1) / msTicks));
+
+        if (keys[i].key == '\b') {
+            if (len) text[--len] = '\0';
+        } else if (len + 1 < sizeof(text)) {
+            text[len++] = keys[i].key;
+            text[len] = '\0';
+        }
+
+        LONGLONG nextArrival = i + 1 < nkeys ? arrival + (LONGLONG)keys[i + 1].delayMs * msTicks : 0;
+        replayDeadline = nextArrival;
+        replayStopped = FALSE;
+        int rows = 0;
+        int rc = RunContactSearch(text, ReplayRow, NULL, &rows);
+        LONGLONG done = ClockNow();
+        replayDeadline = 0;
+        queries++;
+
+        const char *outcome = "ok";
+        if (rc == SQLITE_INTERRUPT || replayStopped) {
+            outcome = "cancelled";
+            cancelled++;
+        } else if (nextArrival && done >= nextArrival) {
+            outcome = "wasted";
+            wasted++;
+        } else {
+            HistRecord(&ttr, TicksToNs(done - arrival));
+        }
+        printf("{\"key\":%d,\"text\":", i);
+        PrintJsonString(text);
+        printf(",\"rows\":%d,\"ms\":%.3f,\"outcome\":\"%s\"}\n", rows, (double)TicksToNs(done - arrival) / 1e6, outcome);
+    }
+
+    printf("{\"summary\":true,\"store\":\"%s\",\"keystrokes\":%d,\"queries\":%d,\"cancelled\":%d,\"wasted\":%d,"
+           "\"ttr_p50_ms\":%.3f,\"ttr_p99_ms\":%.3f,\"ttr_max_ms\":%.3f}\n",
+           store->name, nkeys, queries, cancelled, wasted,
+           (double)HistPercentile(&ttr, 50) / 1e6, (double)HistPercentile(&ttr, 99) / 1e6, (double)ttr.maxNs / 1e6);
+
+    if (db) sqlite3_progress_handler(db, 0, NULL, NULL);
+    store->close();
+    store = NULL;
+    logFilePath = LOG_FILE;
+    free(keys);
+    return 0;
+}
+
+#ifdef _WIN32
+// --- Display Rows ---
+// The list view is owner-data and Unicode. The rows of the current list or
+// search are kept here as UTF-8, and the list asks for text by index with
+// LVN_GETDISPINFOW. Only the rows in the visible window are converted to
+// UTF-16, all at once when the list sends LVN_ODCACHEHINT, and the strings
+// stay cached until the window moves, so repaints and scrolling within a
+// page convert nothing.
+
+#define WIDE_CACHE_MAX_ROWS 512
+#define WIDE_CACHE_MISS_ROWS 64     // rows converted when a request misses the hint
+
+// UTF-8 -> UTF-16. ASCII runs are widened 16 bytes at a time with SSE2,
+// other sequences are decoded one code point at a time and invalid ones
+// become U+FFFD. Writes at most len units plus a NUL and returns the number
+// of units before the NUL.
+size_t Utf8ToUtf16(const char *src, size_t len, WCHAR *dst) {
+    const unsigned char *s = (const unsigned char *)src;
+    size_t i = 0, out = 0;
+    while (i < len) {
+#ifdef VALIDATE_SSE2
+        while (i + 16 <= len) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+            if (_mm_movemask_epi8(v)) break;
+            __m128i zero = _mm_setzero_si128();
+            _mm_storeu_si128((__m128i *)(dst + out), _mm_unpacklo_epi8(v, zero));
+            _mm_storeu_si128((__m128i *)(dst + out + 8), _mm_unpackhi_epi8(v, zero));
+            i += 16;
+            out += 16;
+        }
+        if (i >= len) break;
+#endif
+        unsigned char c = s[i];
+        if (c < 0x80) {
+            dst[out++] = c;
+            i++;
+            continue;
+        }
+        unsigned int cp = 0xFFFD;
+        size_t n = c >= 0xC2 && c <= 0xDF ? 2 : c >= 0xE0 && c <= 0xEF ? 3 : c >= 0xF0 && c <= 0xF4 ? 4 : 1;
+        if (n > 1 && i + n <= len) {
+            unsigned int v = c & (0x7F >> n);
+            size_t k = 1;
+            for (; k < n && (s[i + k] & 0xC0) == 0x80; k++) v = (v << 6) | (s[i + k] & 0x3F);
+            static const unsigned int minCodePoint[5] = { 0, 0, 0x80, 0x800, 0x10000 };
+            if (k == n && v >= minCodePoint[n] && v <= 0x10FFFF && (v < 0xD800 || v > 0xDFFF)) cp = v;
+        }
+        if (cp == 0xFFFD) n = 1;    // resynchronise on the next byte
+        if (cp >= 0x10000) {
+            cp -= 0x10000;
+            dst[out++] = (WCHAR)(0xD800 | (cp >> 10));
+            dst[out++] = (WCHAR)(0xDC00 | (cp & 0x3FF));
+        } else {
+            dst[out++] = (WCHAR)cp;
+        }
+        i += n;
+    }
+    dst[out] = 0;
+    return out;
+}
+
+// UTF-16 -> UTF-8 for text read back from controls; size must allow three
+// bytes per unit. Not on a hot path.
+static void Utf16ToUtf8(const WCHAR *src, char *dst, int size) {
+    if (!WideCharToMultiByte(CP_UTF8, 0, src, -1, dst, size, NULL, NULL) && size > 0) dst[0] = '\0';
+}
+
+void GetWindowTextUtf8(HWND hWnd, char *buf, int size) {
+    WCHAR wide[256];
+    int units = (size - 1) / 3 + 1;
+    GetWindowTextW(hWnd, wide, units < 256 ? units : 256);
+    Utf16ToUtf8(wide, buf, size);
+}
+
+void SetWindowTextUtf8(HWND hWnd, const char *text) {
+    size_t len = strlen(text);
+    WCHAR *wide = (WCHAR *)malloc((len + 1) * sizeof(WCHAR));
+    if (!wide) return;
+    Utf8ToUtf16(text, len, wide);
+    SetWindowTextW(hWnd, wide);
+    free(wide);
+}
+
+typedef struct {
+    int *ids;
+    const char *(*fields)[3];   // strings in text
+    Arena text;
+    size_t used;                // string bytes, NULs included
+    int count;
+    int cap;
+} DisplayRows;
+
+typedef struct {
+    int first;                  // first cached row
+    int count;
+    WCHAR *text;
+    size_t textCap;             // in units
+    unsigned int (*fields)[3];  // offsets into text, per cached row
+    int fieldsCap;
+    // statistics
+    unsigned long long fills;
+    unsigned long long rowsConverted;
+    size_t peakBytes;
+} WideCache;
+
+static DisplayRows listRows = { NULL, NULL, { "rows" } };
+static WideCache listCache;
+
+void DisplayRowsClear(DisplayRows *rows) {
+    rows->count = 0;
+    rows->used = 0;
+    ArenaReset(&rows->text);
+}
+
+void DisplayRowsFree(DisplayRows *rows) {
+    free(rows->ids);
+    free((void *)rows->fields);
+    ArenaFree(&rows->text);
+    rows->ids = NULL;
+    rows->fields = NULL;
+    rows->used = 0;
+    rows->count = rows->cap = 0;
+}
+
+// ContactRowFn that copies the row to the end of a DisplayRows.
+int AppendDisplayRow(void *ctx, int id, const char *name, const char *phone, const char *email) {
+    DisplayRows *rows = (DisplayRows *)ctx;
+    if (rows->count == rows->cap) {
+        int cap = rows->cap ? rows->cap * 2 : 1024;
+        int *ids = (int *)realloc(rows->ids, cap * sizeof(int));
+        if (ids) rows->ids = ids;
+        const char *(*fields)[3] = ids ? (const char *(*)[3])realloc((void *)rows->fields, cap * sizeof(*fields)) : NULL;
+        if (!fields) return 1;
+        rows->fields = fields;
+        rows->cap = cap;
+    }
+    const char *values[3] = { name ? name : "", phone ? phone : "", email ? email : "" };
+    size_t lens[3], total = 0;
+    for (int i = 0; i < 3; i++) total += lens[i] = strlen(values[i]) + 1;
+    char *text = (char *)ArenaTake(&rows->text, total, 1);
+    if (!text) return 1;
+    for (int i = 0; i < 3; i++) {
+        memcpy(text, values[i], lens[i]);
+        rows->fields[rows->count][i] = text;
+        text += lens[i];
+    }
+    rows->used += total;
+    rows->ids[rows->count++] = id;
+    return 0;
+}
+
+static const char *DisplayField(const DisplayRows *rows, int row, int col) {
+    return rows->fields[row][col];
+}
+
+void WideCacheReset(WideCache *cache) {
+    cache->first = cache->count = 0;
+}
+
+void WideCacheFree(WideCache *cache) {
+    free(cache->text);
+    free(cache->fields);
+    ZeroMemory(cache, sizeof(*cache));
+}
+
+// Converts rows [from, to] in one pass. UTF-16 never needs more units than
+// the UTF-8 had bytes, so the buffer is sized from the string lengths.
+int WideCacheFill(WideCache *cache, const DisplayRows *rows, int from, int to) {
+    if (from < 0) from = 0;
+    if (to >= rows->count) to = rows->count - 1;
+    if (to - from + 1 > WIDE_CACHE_MAX_ROWS) to = from + WIDE_CACHE_MAX_ROWS - 1;
+    cache->first = from;
+    cache->count = 0;
+    if (from > to) return SQLITE_OK;
+
+    int count = to - from + 1;
+    size_t units = 0;
+    for (int r = from; r <= to; r++) {
+        for (int col = 0; col < 3; col++) units += strlen(rows->fields[r][col]) + 1;
+    }
+    if (units > cache->textCap) {
+        WCHAR *text = (WCHAR *)realloc(cache->text, units * sizeof(WCHAR));
+        if (!text) return SQLITE_NOMEM;
+        cache->text = text;
+        cache->textCap = units;
+    }
+    if (count > cache->fieldsCap) {
+        unsigned int (*fields)[3] = (unsigned int (*)[3])realloc(cache->fields, WIDE_CACHE_MAX_ROWS * sizeof(*fields));
+        if (!fields) return SQLITE_NOMEM;
+        cache->fields = fields;
+        cache->fieldsCap = WIDE_CACHE_MAX_ROWS;
+    }
+    size_t out = 0;
+    for (int r = 0; r < count; r++) {
+        for (int col = 0; col < 3; col++) {
+            const char *s = DisplayField(rows, from + r, col);
+            cache->fields[r][col] = (unsigned int)out;
+            out += Utf8ToUtf16(s, strlen(s), cache->text + out) + 1;
+        }
+    }
+    cache->count = count;
+    cache->fills++;
+    cache->rowsConverted += (unsigned long long)count;
+    size_t bytes = cache->textCap * sizeof(WCHAR) + (size_t)cache->fieldsCap * sizeof(*cache->fields);
+    if (bytes > cache->peakBytes) cache->peakBytes = bytes;
+    return SQLITE_OK;
+}
+
+// Display text for a cell; a row outside the cached window refills it from
+// that row on. The pointer is valid until the next fill.
+const WCHAR *WideCacheText(WideCache *cache, const DisplayRows *rows, int row, int col) {
+    if (row < 0 || row >= rows->count || col < 0 || col > 2) return L"";
+    if (row < cache->first || row >= cache->first + cache->count) {
+        if (WideCacheFill(cache, rows, row, row + WIDE_CACHE_MISS_ROWS - 1) != SQLITE_OK) return L"";
+    }
+    return cache->text + cache->fields[row - cache->first][col];
+}
+
+// --- UI & Control Functions ---
+
+HWND CreateListView(HWND parent) {
+    RECT rc; GetClientRect(parent, &rc);
+    HWND h = CreateWindowExW(0, WC_LISTVIEWW, L"",
+        WS_CHILD | WS_VISIBLE | LVS_REPORT | LVS_SHOWSELALWAYS | LVS_OWNERDATA,
+        10, 75, rc.right - 20, rc.bottom - 110, 
+        parent, (HMENU)IDC_LISTVIEW, hInst, NULL);
+
+    ListView_SetExtendedListViewStyle(h, LVS_EX_FULLROWSELECT | LVS_EX_GRIDLINES);
+
+    LVCOLUMNW col;
+    ZeroMemory(&col, sizeof(col));
+    col.mask = LVCF_TEXT | LVCF_WIDTH | LVCF_SUBITEM;
+
+    col.cx = 240; col.pszText = L"Name"; SendMessageW(h, LVM_INSERTCOLUMNW, 0, (LPARAM)&col);
+    col.cx = 140; col.pszText = L"Phone"; SendMessageW(h, LVM_INSERTCOLUMNW, 1, (LPARAM)&col);
+    col.cx = 300; col.pszText = L"Email"; SendMessageW(h, LVM_INSERTCOLUMNW, 2, (LPARAM)&col);
+
+    return h;
+}
+
+// Tells the list how many rows listRows has. A reload drops the cached text
+// and the selection; appended rows leave both alone.
+static void SetListRowCount(HWND hList, BOOL appended) {
+    if (!appended) {
+        WideCacheReset(&listCache);
+        ListView_SetItemState(hList, -1, 0, LVIS_SELECTED);
+    }
+    ListView_SetItemCountEx(hList, listRows.count, appended ? LVSICF_NOINVALIDATEALL | LVSICF_NOSCROLL : 0);
+}
+
+// LVN_ODFINDITEMW: type-ahead in the list matches the start of names.
+static int FindListRow(const NMLVFINDITEMW *find) {
+    if (!(find->lvfi.flags & (LVFI_STRING | LVFI_PARTIAL)) || !find->lvfi.psz || listRows.count == 0) return -1;
+    char text[768];
+    Utf16ToUtf8(find->lvfi.psz, text, sizeof(text));
+    SearchNeedle *n = text[0] ? SearchNeedleNew(text) : NULL;
+    if (!n) return -1;
+    int found = -1;
+    int start = find->iStart >= 0 && find->iStart < listRows.count ? find->iStart : 0;
+    int span = (find->lvfi.flags & LVFI_WRAP) ? listRows.count : listRows.count - start;
+    for (int k = 0; k < span && found < 0; k++) {
+        int row = (start + k) % listRows.count;
+        const char *name = DisplayField(&listRows, row, 0);
+        if (StartsNoCase(name, n) && ((find->lvfi.flags & LVFI_PARTIAL) || strlen(name) == n->len)) found = row;
+    }
+    free(n);
+    return found;
+}
+
+void LoadContactsToListView(HWND hList, const char *filter) {
+    if (!hList || !store) return;
+    LONGLONG span = TraceBegin();
+
+    DisplayRowsClear(&listRows);
+    RunContactSearch(filter, AppendDisplayRow, &listRows, NULL);
+    int total_rows = listRows.count;
+
+    LONGLONG count = TraceBegin();
+    SetListRowCount(hList, FALSE);
+    TraceEnd("ListView_SetItemCountEx", count);
+
+    // Update Status Bar
+    LONGLONG paint = TraceBegin();
+    char status[64];
+    if (rankResults && filter && *filter && !IsStructuredQuery(filter)) {
+        snprintf(status, sizeof(status), "Top %d matches by relevance", total_rows);
+    } else {
+        snprintf(status, sizeof(status), "Total %d contacts", total_rows);
+    }
+    SendMessage(hStatusBar, SB_SETTEXT, 0, (LPARAM)status);
+    UpdateWindow(hList);
+    TraceEnd("repaint", paint);
+    TraceEnd("LoadContactsToListView", span);
+
+    if (total_rows == 0 && filter && strlen(filter) > 0) {
+        MessageBox(hMainWnd, "No contact found matching your search.", "Search Result", MB_OK | MB_ICONINFORMATION);
+    }
+}
+
+// --- Startup Index Snapshot ---
+// A name-sorted copy of the list is persisted next to the database so the
+// first screen can be drawn straight from a memory-mapped file. The snapshot
+// records the database's file change counter and is ignored once it differs.
+
+#define SNAPSHOT_FILE "contacts.idx"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_FIRST_PAGE 64
+#define WM_APP_SNAPSHOT_REST (WM_APP + 1)
+
+typedef struct {
+    char magic[4];                  // "CIDX"
+    unsigned int version;
+    unsigned int changeCounter;     // database header bytes 24..27
+    unsigned int count;
+    unsigned long long entriesOffset;
+} SnapshotHeader;
+
+typedef struct {
+    int id;
+    unsigned int name;              // offsets of NUL-terminated strings
+    unsigned int phone;
+    unsigned int email;
+} SnapshotEntry;
+
+typedef struct {
+    HANDLE hFile;
+    HANDLE hMapping;
+    const unsigned char *base;
+    const SnapshotHeader *header;
+    const SnapshotEntry *entries;
+    unsigned int next;              // first entry not yet in the list view
+} MappedSnapshot;
+
+static MappedSnapshot snapshot;
+static volatile unsigned int snapshotChangeCounter = 0;
+static HANDLE hSnapshotThread = NULL;
+
+// The change counter is bumped by every committed write transaction.
+unsigned int ReadDbChangeCounter(const char *path) {
+    unsigned char hdr[28];
+    unsigned int counter = 0;
+    FILE *f = fopen(path, "rb");
+    if (!f) return 0;
+    if (fread(hdr, 1, sizeof(hdr), f) == sizeof(hdr)) {
+        counter = ((unsigned int)hdr[24] << 24) | ((unsigned int)hdr[25] << 16) |
+                  ((unsigned int)hdr[26] << 8) | hdr[27];
+    }
+    fclose(f);
+    return counter;
+}
+
+// Writes the snapshot from its own read-only connection, so it can run on
+// a worker thread. Strings are streamed out first and the entry table is
+// appended at the end.
+int WriteIndexSnapshot(const char *dbPath, const char *snapPath) {
+    sqlite3 *conn = NULL;
+    sqlite3_stmt *stmt = NULL;
+    SnapshotEntry *entries = NULL;
+    size_t count = 0, cap = 0;
+    unsigned long long offset = sizeof(SnapshotHeader);
+    char tmpPath[MAX_PATH];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", snapPath);
+
+    FILE *out = fopen(tmpPath, "wb");
+    if (!out) return SQLITE_CANTOPEN;
+
+    SnapshotHeader hdr;
+    ZeroMemory(&hdr, sizeof(hdr));
+    fwrite(&hdr, sizeof(hdr), 1, out);
+
+    int rc = sqlite3_open_v2(dbPath, &conn, SQLITE_OPEN_READONLY, NULL);
+    if (rc == SQLITE_OK) rc = sqlite3_exec(conn, "BEGIN;", 0, 0, 0);
+    if (rc == SQLITE_OK) rc = sqlite3_prepare_v2(conn, "SELECT id,name,phone,email FROM contacts ORDER BY sort_key,id;", -1, &stmt, NULL);
+
+    // the counter is read while the read transaction holds its lock
+    while (rc == SQLITE_OK && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if (count == 0) hdr.changeCounter = ReadDbChangeCounter(dbPath);
+        if (count == cap) {
+            cap = cap ? cap * 2 : 4096;
+            SnapshotEntry *p = (SnapshotEntry *)realloc(entries, cap * sizeof(*p));
+            if (!p) { rc = SQLITE_NOMEM; break; }
+            entries = p;
+        }
+        SnapshotEntry *e = &entries[count++];
+        e->id = sqlite3_column_int(stmt, 0);
+        unsigned int *fields[3] = { &e->name, &e->phone, &e->email };
+        for (int i = 0; i < 3; i++) {
+            const char *text = (const char *)sqlite3_column_text(stmt, i + 1);
+            size_t len = strlen(text ? text : "") + 1;
+            if (offset + len > 0xFFFFFFFFu) { rc = SQLITE_TOOBIG; break; }
+            *fields[i] = (unsigned int)offset;
+            fwrite(text ? text : "", 1, len, out);
+            offset += len;
+        }
+        if (rc == SQLITE_TOOBIG) break;
+        rc = SQLITE_OK;
+    }
+    if (rc == SQLITE_DONE) {
+        if (count == 0) hdr.changeCounter = ReadDbChangeCounter(dbPath);
+        rc = SQLITE_OK;
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_close(conn);
+
+    if (rc == SQLITE_OK) {
+        memcpy(hdr.magic, "CIDX", 4);
+        hdr.version = SNAPSHOT_VERSION;
+        hdr.count = (unsigned int)count;
+        hdr.entriesOffset = offset;
+        if (count && fwrite(entries, sizeof(*entries), count, out) != count) rc = SQLITE_IOERR;
+        if (fseek(out, 0, SEEK_SET) != 0 || fwrite(&hdr, sizeof(hdr), 1, out) != 1) rc = SQLITE_IOERR;
+    }
+    free(entries);
+    if (fclose(out) != 0 && rc == SQLITE_OK) rc = SQLITE_IOERR;
+
+    if (rc == SQLITE_OK && MoveFileExA(tmpPath, snapPath, MOVEFILE_REPLACE_EXISTING)) {
+        snapshotChangeCounter = hdr.changeCounter;
+        return SQLITE_OK;
+    }
+    DeleteFileA(tmpPath);
+    return rc == SQLITE_OK ? SQLITE_IOERR : rc;
+}
+
+static DWORD WINAPI SnapshotRebuildThread(LPVOID param) {
+    WriteIndexSnapshot(DB_FILE, SNAPSHOT_FILE);
+    return 0;
+}
+
+void CloseSnapshot(void) {
+    if (snapshot.base) UnmapViewOfFile(snapshot.base);
+    if (snapshot.hMapping) CloseHandle(snapshot.hMapping);
+    if (snapshot.hFile && snapshot.hFile != INVALID_HANDLE_VALUE) CloseHandle(snapshot.hFile);
+    ZeroMemory(&snapshot, sizeof(snapshot));
+}
+
+// Maps the snapshot and checks it against the database. Anything that does
+// not line up exactly is treated as stale.
+BOOL OpenSnapshot(const char *snapPath, unsigned int changeCounter) {
+    CloseSnapshot();
+    snapshot.hFile = CreateFileA(snapPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (snapshot.hFile == INVALID_HANDLE_VALUE) return FALSE;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(snapshot.hFile, &size) || size.QuadPart < (LONGLONG)sizeof(SnapshotHeader)) {
+        CloseSnapshot();
+        return FALSE;
+    }
+    snapshot.hMapping = CreateFileMappingA(snapshot.hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (snapshot.hMapping) snapshot.base = (const unsigned char *)MapViewOfFile(snapshot.hMapping, FILE_MAP_READ, 0, 0, 0);
+    if (!snapshot.base) {
+        CloseSnapshot();
+        return FALSE;
+    }
+
+    const SnapshotHeader *hdr = (const SnapshotHeader *)snapshot.base;
+    unsigned long long end = hdr->entriesOffset + (unsigned long long)hdr->count * sizeof(SnapshotEntry);
+    if (memcmp(hdr->magic, "CIDX", 4) != 0 || hdr->version != SNAPSHOT_VERSION ||
+        hdr->changeCounter != changeCounter || hdr->entriesOffset < sizeof(SnapshotHeader) ||
+        end != (unsigned long long)size.QuadPart ||
+        (hdr->entriesOffset > sizeof(SnapshotHeader) && snapshot.base[hdr->entriesOffset - 1] != '\0')) {
+        CloseSnapshot();
+        return FALSE;
+    }
+    snapshot.header = hdr;
+    snapshot.entries = (const SnapshotEntry *)(snapshot.base + hdr->entriesOffset);
+    snapshotChangeCounter = changeCounter;
+    return TRUE;
+}
+
+static BOOL SnapshotEntryValid(const SnapshotEntry *e) {
+    unsigned long long limit = snapshot.header->entriesOffset;
+    return e->name >= sizeof(SnapshotHeader) && e->name < limit &&
+           e->phone >= sizeof(SnapshotHeader) && e->phone < limit &&
+           e->email >= sizeof(SnapshotHeader) && e->email < limit;
+}
+
+// Moves up to maxRows snapshot entries into the list view.
+static void InsertSnapshotRows(HWND hList, unsigned int maxRows) {
+    unsigned int end = snapshot.header->count;
+    if (end - snapshot.next > maxRows) end = snapshot.next + maxRows;
+    for (; snapshot.next < end; snapshot.next++) {
+        const SnapshotEntry *e = &snapshot.entries[snapshot.next];
+        if (!SnapshotEntryValid(e)) continue;
+        AppendDisplayRow(&listRows, e->id, (const char *)snapshot.base + e->name,
+                         (const char *)snapshot.base + e->phone, (const char *)snapshot.base + e->email);
+    }
+    SetListRowCount(hList, TRUE);
+}
+
+void BuildDupFilterFromList(int total);   // see Background Startup
+
+void LoadRemainingSnapshotRows(void) {
+    if (!snapshot.header) return;
+    SendMessage(hListView, WM_SETREDRAW, FALSE, 0);
+    InsertSnapshotRows(hListView, snapshot.header->count);
+    SendMessage(hListView, WM_SETREDRAW, TRUE, 0);
+    InvalidateRect(hListView, NULL, TRUE);
+    BuildDupFilterFromList((int)snapshot.header->count);
+    CloseSnapshot();
+}
+
+// Called on shutdown after the final flush: refreshes the snapshot when
+// this session changed the database, so the next start stays fast.
+void SaveSnapshotOnExit(void) {
+    if (hSnapshotThread) {
+        WaitForSingleObject(hSnapshotThread, INFINITE);
+        CloseHandle(hSnapshotThread);
+        hSnapshotThread = NULL;
+    }
+    CloseSnapshot();
+    if (ReadDbChangeCounter(DB_FILE) != snapshotChangeCounter) {
+        WriteIndexSnapshot(DB_FILE, SNAPSHOT_FILE);
+    }
+}
+
+// --- Background Startup ---
+// The window is shown before the database is touched. A worker thread opens
+// the store and streams the sorted list to the UI thread in batches; the
+// first batch is kept small so the first screen fills in quickly.
+
+#define WM_APP_DB_READY  (WM_APP + 2)   // wParam: TRUE if the snapshot is mapped
+#define WM_APP_ROWS      (WM_APP + 3)   // lParam: RowBatch*, freed by the receiver
+#define WM_APP_LOAD_DONE (WM_APP + 4)   // wParam: total rows streamed
+#define WM_APP_DB_FAILED (WM_APP + 5)
+#define ROW_BATCH_SIZE 256
+
+typedef struct RowBatch {
+    int count;
+    int ids[ROW_BATCH_SIZE];
+    unsigned int fields[ROW_BATCH_SIZE][3];  // offsets into text
+    char *text;
+    size_t used;
+    size_t cap;
+} RowBatch;
+
+typedef struct {
+    HWND hWnd;
+    RowBatch *batch;
+    int total;
+} StartupLoad;
+
+const char *startupCmdLine = NULL;
+LONGLONG processStart;
+double firstRowsMs = -1.0;     // process start -> first rows in the list
+BOOL databaseReady = FALSE;
+static volatile LONG startupCancel = 0;
+static HANDLE hStartupThread = NULL;
+
+double ElapsedMs(LONGLONG since) {
+    return (double)(ClockNow() - since) * 1000.0 / (double)ClockFrequency();
+}
+
+static void FreeRowBatch(RowBatch *batch) {
+    if (!batch) return;
+    free(batch->text);
+    free(batch);
+}
+
+static void PostRowBatch(StartupLoad *load) {
+    RowBatch *batch = load->batch;
+    load->batch = NULL;
+    if (!batch || batch->count == 0) {
+        FreeRowBatch(batch);
+        return;
+    }
+    if (!PostMessage(load->hWnd, WM_APP_ROWS, 0, (LPARAM)batch)) FreeRowBatch(batch);
+}
+
+static int StreamStartupRow(void *ctx, int id, const char *name, const char *phone, const char *email) {
+    StartupLoad *load = (StartupLoad *)ctx;
+    if (startupCancel) return 1;
+
+    RowBatch *batch = load->batch;
+    if (!batch) {
+        batch = load->batch = (RowBatch *)calloc(1, sizeof(RowBatch));
+        if (!batch) return 1;
+    }
+    const char *values[3] = { name ? name : "", phone ? phone : "", email ? email : "" };
+    for (int i = 0; i < 3; i++) {
+        size_t len = strlen(values[i]) + 1;
+        if (batch->used + len > batch->cap) {
+            size_t cap = batch->cap ? batch->cap * 2 : 16384;
+            while (cap < batch->used + len) cap *= 2;
+            char *p = (char *)realloc(batch->text, cap);
+            if (!p) return 1;
+            batch->text = p;
+            batch->cap = cap;
+        }
+        memcpy(batch->text + batch->used, values[i], len);
+        batch->fields[batch->count][i] = (unsigned int)batch->used;
+        batch->used += len;
+    }
+    batch->ids[batch->count++] = id;
+    load->total++;
+
+    int limit = load->total <= SNAPSHOT_FIRST_PAGE ? SNAPSHOT_FIRST_PAGE : ROW_BATCH_SIZE;
+    if (batch->count >= limit) PostRowBatch(load);
+    return 0;
+}
+
+static DWORD WINAPI StartupThread(LPVOID param) {
+    HWND hWnd = (HWND)param;
+    InitDatabase(startupCmdLine);
+    if (!store) {
+        PostMessage(hWnd, WM_APP_DB_FAILED, 0, 0);
+        return 0;
+    }
+    if (store == &sqliteStore && OpenSnapshot(SNAPSHOT_FILE, ReadDbChangeCounter(DB_FILE))) {
+        PostMessage(hWnd, WM_APP_DB_READY, TRUE, 0);
+        return 0;
+    }
+    PostMessage(hWnd, WM_APP_DB_READY, FALSE, 0);
+
+    StartupLoad load = { hWnd, NULL, 0 };
+    LONGLONG t0 = OpStart();
+    lastRowsScanned = 0;
+    store->scan(StreamStartupRow, &load);
+    OpEnd(OP_LIST, t0, lastRowsScanned, (unsigned long long)load.total);
+    PostRowBatch(&load);
+    PostMessage(hWnd, WM_APP_LOAD_DONE, (WPARAM)load.total, 0);
+    return 0;
+}
+
+void StartBackgroundLoad(HWND hWnd) {
+    SendMessage(hStatusBar, SB_SETTEXT, 0, (LPARAM)"Loading contacts...");
+    hStartupThread = CreateThread(NULL, 0, StartupThread, hWnd, 0, NULL);
+    if (!hStartupThread) StartupThread(hWnd);
+}
+
+// Stops a load still in progress; called before the store is closed.
+void StopBackgroundLoad(void) {
+    if (!hStartupThread) return;
+    InterlockedExchange(&startupCancel, 1);
+    WaitForSingleObject(hStartupThread, INFINITE);
+    CloseHandle(hStartupThread);
+    hStartupThread = NULL;
+}
+
+// WM_APP_DB_READY: with a mapped snapshot the first page is drawn from it
+// and the rest is posted; otherwise rows will follow as WM_APP_ROWS.
+void OnDatabaseReady(HWND hWnd, BOOL fromSnapshot) {
+    DisplayRowsClear(&listRows);
+    SetListRowCount(hListView, FALSE);
+    if (!fromSnapshot) return;
+    InsertSnapshotRows(hListView, SNAPSHOT_FIRST_PAGE);
+    firstRowsMs = ElapsedMs(processStart);
+    databaseReady = TRUE;
+    char status[64];
+    snprintf(status, sizeof(status), "Total %u contacts", snapshot.header->count);
+    SendMessage(hStatusBar, SB_SETTEXT, 0, (LPARAM)status);
+    PostMessage(hWnd, WM_APP_SNAPSHOT_REST, 0, 0);
+}
+
+void OnRowBatch(RowBatch *batch) {
+    for (int i = 0; i < batch->count; i++) {
+        AppendDisplayRow(&listRows, batch->ids[i], batch->text + batch->fields[i][0],
+                         batch->text + batch->fields[i][1], batch->text + batch->fields[i][2]);
+    }
+    SetListRowCount(hListView, TRUE);
+    if (firstRowsMs < 0) firstRowsMs = ElapsedMs(processStart);
+    FreeRowBatch(batch);
+
+    char status[64];
+    snprintf(status, sizeof(status), "Loading... %d contacts", listRows.count);
+    SendMessage(hStatusBar, SB_SETTEXT, 0, (LPARAM)status);
+}
+
+// Once loading finishes the list holds every contact, so the duplicate
+// filter is built from it rather than from another pass over the store.
+// If a write got in first, or the list is not the whole book, the filter
+// is left to rebuild from the store on the first check.
+void BuildDupFilterFromList(int total) {
+    if (dupFilter.stale || listRows.count != total) {
+        dupFilter.stale = TRUE;
+        return;
+    }
+    LONGLONG span = TraceBegin();
+    size_t keys = 0;
+    for (int i = 0; i < listRows.count; i++) {
+        keys += (*listRows.fields[i][1] != 0) + (*listRows.fields[i][2] != 0);
+    }
+    if (DupFilterInit(&dupFilter, keys, dupFalsePositiveRate)) {
+        for (int i = 0; i < listRows.count; i++) DupFilterAdd(&dupFilter, listRows.fields[i][1], listRows.fields[i][2]);
+    }
+    TraceEnd("BuildDupFilter", span);
+}
+
+void OnLoadDone(int total) {
+    if (firstRowsMs < 0) firstRowsMs = ElapsedMs(processStart);
+    databaseReady = TRUE;
+    BuildDupFilterFromList(total);
+    char status[64];
+    snprintf(status, sizeof(status), "Total %d contacts", total);
+    SendMessage(hStatusBar, SB_SETTEXT, 0, (LPARAM)status);
+    if (store == &sqliteStore) {
+        hSnapshotThread = CreateThread(NULL, 0, SnapshotRebuildThread, NULL, 0, NULL);
+    }
+}
+
+// --- Statistics Output ---
+
+#define METRICS_FILE "contacts_metrics.prom"
+
+static double NsToMs(unsigned long long ns) { return (double)ns / 1e6; }
+
+static Arena *const statArenas[] = { &listRows.text, &queryArena, &writeArena, &flushArena, &memUndoArena };
+#define STAT_ARENA_COUNT (int)(sizeof(statArenas) / sizeof(statArenas[0]))
+
+// The in-memory rows behind the memory and log stores.
+static const MemIndex *StatMemIndex(void) {
+    return store == &memoryStore ? &memIndex : store == &logStore ? &logIndex : NULL;
+}
+
+// Short human-readable summary, one line per operation that has run.
+void FormatStatsSummary(char *buf, size_t size) {
+    size_t used = (size_t)snprintf(buf, size, "%-8s %8s %9s %9s %9s %9s\n", "op", "count", "p50 ms", "p99 ms", "max ms", "rows");
+    for (int op = 0; op < OP_COUNT && used < size; op++) {
+        const OpStats *s = &opStats[op];
+        if (!s->total) continue;
+        used += (size_t)snprintf(buf + used, size - used, "%-8s %8llu %9.3f %9.3f %9.3f %9llu\n",
+            opNames[op], s->total, NsToMs(HistPercentile(s, 50)), NsToMs(HistPercentile(s, 99)),
+            NsToMs(s->maxNs), s->rowsReturned);
+    }
+    for (int i = 0; i < STAT_ARENA_COUNT && used < size; i++) {
+        const Arena *a = statArenas[i];
+        if (!a->allocs) continue;
+        used += (size_t)snprintf(buf + used, size - used, "arena %-6s %llu allocs, high water %.1f KB, %.1f KB in %d chunks\n",
+            a->name, a->allocs, (double)a->highWater / 1024.0, (double)a->reserved / 1024.0, a->chunks);
+    }
+    if (used < size && store == &sqliteStore) {
+        SqliteMemStats m;
+        GetSqliteMemStats(&m);
+        used += (size_t)snprintf(buf + used, size - used,
+            "sqlite %s memory: %.1f KB used, peak %.1f KB; page cache %d of %d slots, %.1f KB overflow; "
+            "lookaside %d hits, %d misses\n",
+            sqliteMem.tuned ? "tuned" : "default", (double)m.used / 1024.0, (double)m.peak / 1024.0,
+            m.pageCacheUsed, m.pageCacheSlots, (double)m.pageCacheOverflow / 1024.0, m.lookasideHits, m.lookasideMisses);
+    }
+    const MemIndex *ix = StatMemIndex();
+    if (used < size && ix && ix->count) {
+        MemIndexStats m;
+        GetMemIndexStats(ix, &m);
+        used += (size_t)snprintf(buf + used, size - used,
+            "rows %zu: %.1f KB records, %.1f KB holes, %.1f KB index, %u domains; %.1f bytes per contact\n",
+            m.count, (double)m.recordBytes / 1024.0, (double)m.holeBytes / 1024.0, (double)m.indexBytes / 1024.0,
+            m.domains, (double)(m.arenaBytes + m.indexBytes + m.domainBytes) / (double)m.count);
+    }
+    if (used < size && dupStats.checks) {
+        used += (size_t)snprintf(buf + used, size - used,
+            "duplicate checks %llu: %llu ruled out by filter, %llu lookups (%llu false positives), %llu found; "
+            "filter %.1f KB, %zu keys, k=%d\n",
+            dupStats.checks, dupStats.ruledOut, dupStats.lookups, dupStats.falsePositives, dupStats.found,
+            (double)DupFilterBytes(&dupFilter) / 1024.0, dupFilter.keys, dupFilter.k);
+    }
+    if (used < size && firstRowsMs >= 0) {
+        snprintf(buf + used, size - used, "first rows after %.1f ms\n", firstRowsMs);
+    }
+}
+
+// Prometheus text exposition format.
+void WritePrometheus(FILE *f) {
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+    fprintf(f, "# HELP contacts_op_latency_seconds Latency of core contact operations.\n");
+    fprintf(f, "# TYPE contacts_op_latency_seconds summary\n");
+    for (int op = 0; op < OP_COUNT; op++) {
+        const OpStats *s = &opStats[op];
+        for (int q = 0; q < 4; q++) {
+            fprintf(f, "contacts_op_latency_seconds{op=\"%s\",quantile=\"%g\"} %.9f\n",
+                    opNames[op], quantiles[q], (double)HistPercentile(s, quantiles[q] * 100.0) / 1e9);
+        }
+        fprintf(f, "contacts_op_latency_seconds_sum{op=\"%s\"} %.9f\n", opNames[op], (double)s->sumNs / 1e9);
+        fprintf(f, "contacts_op_latency_seconds_count{op=\"%s\"} %llu\n", opNames[op], s->total);
+    }
+
+    fprintf(f, "# HELP contacts_rows_scanned_total Rows examined by list and search operations.\n");
+    fprintf(f, "# TYPE contacts_rows_scanned_total counter\n");
+    for (int op = 0; op < OP_COUNT; op++) {
+        fprintf(f, "contacts_rows_scanned_total{op=\"%s\"} %llu\n", opNames[op], opStats[op].rowsScanned);
+    }
+    fprintf(f, "# HELP contacts_rows_returned_total Rows handed back to the caller.\n");
+    fprintf(f, "# TYPE contacts_rows_returned_total counter\n");
+    for (int op = 0; op < OP_COUNT; op++) {
+        fprintf(f, "contacts_rows_returned_total{op=\"%s\"} %llu\n", opNames[op], opStats[op].rowsReturned);
+    }
+
+    static const char *stmtMetrics[] = { "runs", "vm_steps", "fullscan_steps", "sorts", "autoindexes" };
+    for (int m = 0; m < 5; m++) {
+        fprintf(f, "# TYPE contacts_sqlite_stmt_%s_total counter\n", stmtMetrics[m]);
+        for (int i = 0; i < STMT_COUNT; i++) {
+            const StmtStats *s = &stmtStats[i];
+            unsigned long long v[] = { s->runs, s->vmSteps, s->fullscanSteps, s->sorts, s->autoindexes };
+            fprintf(f, "contacts_sqlite_stmt_%s_total{stmt=\"%s\"} %llu\n", stmtMetrics[m], sqliteStmtNames[i], v[m]);
+        }
+    }
+
+    fprintf(f, "# HELP contacts_arena_allocated_bytes_total Bytes handed out by each arena.\n");
+    fprintf(f, "# TYPE contacts_arena_allocated_bytes_total counter\n");
+    for (int i = 0; i < STAT_ARENA_COUNT; i++) {
+        fprintf(f, "contacts_arena_allocated_bytes_total{arena=\"%s\"} %llu\n", statArenas[i]->name, statArenas[i]->bytesAllocated);
+    }
+    fprintf(f, "# TYPE contacts_arena_high_water_bytes gauge\n");
+    for (int i = 0; i < STAT_ARENA_COUNT; i++) {
+        fprintf(f, "contacts_arena_high_water_bytes{arena=\"%s\"} %llu\n", statArenas[i]->name, (unsigned long long)statArenas[i]->highWater);
+    }
+    fprintf(f, "# TYPE contacts_arena_reserved_bytes gauge\n");
+    for (int i = 0; i < STAT_ARENA_COUNT; i++) {
+        fprintf(f, "contacts_arena_reserved_bytes{arena=\"%s\"} %llu\n", statArenas[i]->name, (unsigned long long)statArenas[i]->reserved);
+    }
+
+    const MemIndex *ix = StatMemIndex();
+    if (ix) {
+        MemIndexStats m;
+        GetMemIndexStats(ix, &m);
+        fprintf(f, "# HELP contacts_memory_rows_bytes Memory held by the in-memory contact rows.\n");
+        fprintf(f, "# TYPE contacts_memory_rows_bytes gauge\n");
+        fprintf(f, "contacts_memory_rows_bytes{kind=\"records\"} %zu\n", m.recordBytes);
+        fprintf(f, "contacts_memory_rows_bytes{kind=\"holes\"} %zu\n", m.holeBytes);
+        fprintf(f, "contacts_memory_rows_bytes{kind=\"arena\"} %zu\n", m.arenaBytes);
+        fprintf(f, "contacts_memory_rows_bytes{kind=\"index\"} %zu\n", m.indexBytes);
+        fprintf(f, "contacts_memory_rows_bytes{kind=\"domains\"} %zu\n", m.domainBytes);
+        fprintf(f, "# TYPE contacts_memory_rows gauge\n");
+        fprintf(f, "contacts_memory_rows %zu\n", m.count);
+    }
+
+    if (store == &sqliteStore) {
+        SqliteMemStats m;
+        GetSqliteMemStats(&m);
+        fprintf(f, "# HELP contacts_sqlite_memory_bytes Memory held by SQLite (mode: default or tuned).\n");
+        fprintf(f, "# TYPE contacts_sqlite_memory_bytes gauge\n");
+        fprintf(f, "contacts_sqlite_memory_bytes{mode=\"%s\",kind=\"used\"} %lld\n", sqliteMem.tuned ? "tuned" : "default", m.used);
+        fprintf(f, "contacts_sqlite_memory_bytes{mode=\"%s\",kind=\"peak\"} %lld\n", sqliteMem.tuned ? "tuned" : "default", m.peak);
+        fprintf(f, "# TYPE contacts_sqlite_allocations_total counter\n");
+        fprintf(f, "contacts_sqlite_allocations_total %lld\n", m.allocs);
+        fprintf(f, "# TYPE contacts_sqlite_pagecache_slots gauge\n");
+        fprintf(f, "contacts_sqlite_pagecache_slots{kind=\"used\"} %d\n", m.pageCacheUsed);
+        fprintf(f, "contacts_sqlite_pagecache_slots{kind=\"total\"} %d\n", m.pageCacheSlots);
+        fprintf(f, "# TYPE contacts_sqlite_pagecache_overflow_bytes gauge\n");
+        fprintf(f, "contacts_sqlite_pagecache_overflow_bytes %lld\n", m.pageCacheOverflow);
+        fprintf(f, "# TYPE contacts_sqlite_lookaside_total counter\n");
+        fprintf(f, "contacts_sqlite_lookaside_total{result=\"hit\"} %d\n", m.lookasideHits);
+        fprintf(f, "contacts_sqlite_lookaside_total{result=\"miss\"} %d\n", m.lookasideMisses);
+        fprintf(f, "# TYPE contacts_sqlite_cache_total counter\n");
+        fprintf(f, "contacts_sqlite_cache_total{result=\"hit\"} %d\n", m.cacheHits);
+        fprintf(f, "contacts_sqlite_cache_total{result=\"miss\"} %d\n", m.cacheMisses);
+    }
+
+    fprintf(f, "# HELP contacts_dup_checks_total Duplicate checks; the filter rules most out without a lookup.\n");
+    fprintf(f, "# TYPE contacts_dup_checks_total counter\n");
+    fprintf(f, "contacts_dup_checks_total %llu\n", dupStats.checks);
+    fprintf(f, "# TYPE contacts_dup_filter_ruled_out_total counter\n");
+    fprintf(f, "contacts_dup_filter_ruled_out_total %llu\n", dupStats.ruledOut);
+    fprintf(f, "# TYPE contacts_dup_lookups_total counter\n");
+    fprintf(f, "contacts_dup_lookups_total{result=\"found\"} %llu\n", dupStats.found);
+    fprintf(f, "contacts_dup_lookups_total{result=\"false_positive\"} %llu\n", dupStats.falsePositives);
+    fprintf(f, "contacts_dup_lookups_total{result=\"not_found\"} %llu\n",
+            dupStats.lookups - dupStats.found - dupStats.falsePositives);
+    fprintf(f, "# TYPE contacts_dup_filter_rebuilds_total counter\n");
+    fprintf(f, "contacts_dup_filter_rebuilds_total %llu\n", dupStats.rebuilds);
+    fprintf(f, "# TYPE contacts_dup_filter_bytes gauge\n");
+    fprintf(f, "contacts_dup_filter_bytes %zu\n", DupFilterBytes(&dupFilter));
+    fprintf(f, "# TYPE contacts_dup_filter_keys gauge\n");
+    fprintf(f, "contacts_dup_filter_keys %zu\n", dupFilter.keys);
+
+    if (firstRowsMs >= 0) {
+        fprintf(f, "# TYPE contacts_startup_first_rows_seconds gauge\n");
+        fprintf(f, "contacts_startup_first_rows_seconds %.6f\n", firstRowsMs / 1000.0);
+    }
+}
+
+BOOL SaveMetricsFile(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f) return FALSE;
+    WritePrometheus(f);
+    return fclose(f) == 0;
+}
+
+void CreateMainControls(HWND hWnd) {
+    // Search Edit Control (Search Bar) - Y=8
+    hSearchEdit = CreateWindowExW(0, L"EDIT", L"", WS_CHILD | WS_VISIBLE | WS_BORDER | ES_LEFT,
+        10, 8, 260, 24, hWnd, (HMENU)IDC_SEARCH_EDIT, hInst, NULL);
+    SetWindowTextUtf8(hSearchEdit, SEARCH_PLACEHOLDER);
+    
+    // Search Button - Y=8
+    CreateWindowExA(0, "BUTTON", "Search", WS_CHILD | WS_VISIBLE | BS_PUSHBUTTON,
+        280, 8, 80, 24, hWnd, (HMENU)IDC_SEARCH_BTN, hInst, NULL);
+
+    // Add Button - Y=40
+    CreateWindowExA(0, "BUTTON", "Add Contact", WS_CHILD | WS_VISIBLE | BS_PUSHBUTTON,
+        10, 40, 100, 30, hWnd, (HMENU)IDC_ADD_CONTACT, hInst, NULL);
+    
+    // Edit Button - Y=40
+    CreateWindowExA(0, "BUTTON", "Edit Selected", WS_CHILD | WS_VISIBLE | BS_PUSHBUTTON,
+        120, 40, 110, 30, hWnd, (HMENU)IDC_EDIT_CONTACT, hInst, NULL);
+    
+    // Delete Button - Y=40
+    CreateWindowExA(0, "BUTTON", "Delete Selected", WS_CHILD | WS_VISIBLE | BS_PUSHBUTTON,
+        240, 40, 120, 30, hWnd, (HMENU)IDC_DELETE_CONTACT, hInst, NULL);
+
+    // List View - Starts at Y=75
+    hListView = CreateListView(hWnd);
+    
+    // Status Bar
+    hStatusBar = CreateWindowEx(0, STATUSCLASSNAME, NULL, WS_CHILD | WS_VISIBLE | SBARS_SIZEGRIP,
+        0, 0, 0, 0, hWnd, (HMENU)IDC_STATUSBAR, hInst, NULL);
+}
+
+// The search box as UTF-8, empty while it shows the placeholder.
+static void GetSearchText(char *buf, int size) {
+    GetWindowTextUtf8(hSearchEdit, buf, size);
+    if (strcmp(buf, SEARCH_PLACEHOLDER) == 0) buf[0] = '\0';
+}
+
+int GetSelectedContactId() {
+    if (!hListView) return -1;
+    int sel = ListView_GetNextItem(hListView, -1, LVNI_SELECTED);
+    if (sel < 0 || sel >= listRows.count) {
+        return -1;
+    }
+    return listRows.ids[sel];
+}
+
+// The ids of every selected row, in list order, in a malloc'd array the
+// caller frees. Returns how many, 0 when nothing is selected.
+int GetSelectedContactIds(int **ids) {
+    *ids = NULL;
+    if (!hListView) return 0;
+    int total = ListView_GetSelectedCount(hListView);
+    if (total <= 0 || !(*ids = (int *)malloc(total * sizeof(int)))) return 0;
+    int count = 0;
+    for (int sel = -1; count < total && (sel = ListView_GetNextItem(hListView, sel, LVNI_SELECTED)) >= 0; ) {
+        if (sel < listRows.count) (*ids)[count++] = listRows.ids[sel];
+    }
+    return count;
+}
+
+// Shows a bulk operation's progress in the status bar.
+static BOOL BulkStatusProgress(void *ctx, int done, int total) {
+    char status[96];
+    snprintf(status, sizeof(status), "%s %d of %d contacts...", (const char *)ctx, done, total);
+    SendMessage(hStatusBar, SB_SETTEXT, 0, (LPARAM)status);
+    UpdateWindow(hStatusBar);
+    return TRUE;
+}
+
+static void ReportBulkResult(HWND hWnd, int rc) {
+    if (rc != SQLITE_OK) {
+        char msg[512];
+        snprintf(msg, sizeof(msg), "Bulk operation failed, nothing was changed: %s", store->errmsg());
+        sql_error(msg);
+    }
+    ListView_SetItemState(hListView, -1, 0, LVIS_SELECTED);
+    char search[600] = {0};
+    GetSearchText(search, sizeof(search));
+    LoadContactsToListView(hListView, search);
+}
+
+// --- Dialog Procedures ---
+
+// Describes which of the fields are already taken, e.g. for the warning
+// line under the fields while typing.
+static void FormatDuplicate(const DupMatch *m, char *buf, size_t size) {
+    const char *what = m->phone && m->email ? "Phone and email" : m->phone ? "Phone" : "Email";
+    snprintf(buf, size, "%s already used by %s", what, m->name);
+}
+
+static void UpdateDuplicateWarning(HWND hDlg) {
+    char phone[60] = {0}, email[300] = {0}, text[400] = "";
+    GetWindowTextUtf8(GetDlgItem(hDlg, IDC_ADD_PHONE), phone, sizeof(phone));
+    GetWindowTextUtf8(GetDlgItem(hDlg, IDC_ADD_EMAIL), email, sizeof(email));
+    DupMatch m;
+    if (FindDuplicateContact(phone, email, &m)) FormatDuplicate(&m, text, sizeof(text));
+    SetWindowTextUtf8(GetDlgItem(hDlg, IDC_ADD_DUP), text);
+}
+
+INT_PTR CALLBACK AddDlgProc(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam) {
+    switch (message) {
+    case WM_INITDIALOG:
+        return (INT_PTR)TRUE;
+
+    case WM_COMMAND:
+        if (HIWORD(wParam) == EN_CHANGE && (LOWORD(wParam) == IDC_ADD_PHONE || LOWORD(wParam) == IDC_ADD_EMAIL)) {
+            UpdateDuplicateWarning(hDlg);
+            return (INT_PTR)TRUE;
+        }
+        if (LOWORD(wParam) == IDOK) {
+            LONGLONG span = TraceBegin();
+            char name[300] = {0}, phone[60] = {0}, email[300] = {0};   // 99, 19 and 99 characters
+            GetWindowTextUtf8(GetDlgItem(hDlg, IDC_ADD_NAME), name, sizeof(name));
+            GetWindowTextUtf8(GetDlgItem(hDlg, IDC_ADD_PHONE), phone, sizeof(phone));
+            GetWindowTextUtf8(GetDlgItem(hDlg, IDC_ADD_EMAIL), email, sizeof(email));
+
+            if (!IsNameValid(name) || !IsPhoneValid(phone) || !IsEmailValid(email)) {
+                TraceEnd("AddDlgProc.invalid", span);
+                MessageBoxA(hDlg, "Invalid input. Check name (alphabetic), phone (numeric), or email (@ required).", "Input Error", MB_ICONERROR);
+                return (INT_PTR)TRUE;
+            }
+            DupMatch dup;
+            if (FindDuplicateContact(phone, email, &dup)) {
+                char text[400];
+                FormatDuplicate(&dup, text, sizeof(text));
+                strncat(text, ". Add anyway?", sizeof(text) - strlen(text) - 1);
+                WCHAR wide[400];
+                Utf8ToUtf16(text, strlen(text), wide);
+                if (MessageBoxW(hDlg, wide, L"Possible Duplicate", MB_YESNO | MB_ICONWARNING) != IDYES) {
+                    TraceEnd("AddDlgProc.duplicate", span);
+                    return (INT_PTR)TRUE;
+                }
+            }
+            AddContact(name, phone, email);
+            TraceEnd("AddDlgProc.OK", span);
+            EndDialog(hDlg, IDOK);
+            return (INT_PTR)TRUE;
+        } else if (LOWORD(wParam) == IDCANCEL) {
+            EndDialog(hDlg, IDCANCEL);
+            return (INT_PTR)TRUE;
+        } else if (LOWORD(wParam) == IDC_CLEAR) {
+            SetDlgItemText(hDlg, IDC_ADD_NAME, "");
+            SetDlgItemText(hDlg, IDC_ADD_PHONE, "");
+            SetDlgItemText(hDlg, IDC_ADD_EMAIL, "");
+            SetFocus(GetDlgItem(hDlg, IDC_ADD_NAME));
+            return (INT_PTR)TRUE;
+        }
+        break;
+    }
+    return (INT_PTR)FALSE;
+}
+
+static int FillEditDialog(void *ctx, int id, const char *name, const char *phone, const char *email) {
+    HWND hDlg = (HWND)ctx;
+    if (name) SetWindowTextUtf8(GetDlgItem(hDlg, IDC_EDIT_NAME), name);
+    if (phone) SetWindowTextUtf8(GetDlgItem(hDlg, IDC_EDIT_PHONE), phone);
+    if (email) SetWindowTextUtf8(GetDlgItem(hDlg, IDC_EDIT_EMAIL), email);
+    return 1;
+}
+
+INT_PTR CALLBACK EditDlgProc(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam) {
+    static int editId = -1;
+    switch (message) {
+    case WM_INITDIALOG: {
+        editId = (int)lParam;
+        if (editId <= 0) return (INT_PTR)TRUE;
+        FlushWrites();
+
+        LONGLONG span = TraceBegin();
+        LONGLONG t0 = OpStart();
+        store->get(editId, FillEditDialog, hDlg);
+        OpEnd(OP_GET, t0, 0, 1);
+        TouchContact(editId);
+        TraceEnd("EditDlgProc.init", span);
+        return (INT_PTR)TRUE;
+    }
+
+    case WM_COMMAND:
+        if (LOWORD(wParam) == IDOK) {
+            LONGLONG span = TraceBegin();
+            char name[300] = {0}, phone[60] = {0}, email[300] = {0};
+            
+            GetWindowTextUtf8(GetDlgItem(hDlg, IDC_EDIT_NAME), name, sizeof(name));
+            GetWindowTextUtf8(GetDlgItem(hDlg, IDC_EDIT_PHONE), phone, sizeof(phone));
+            GetWindowTextUtf8(GetDlgItem(hDlg, IDC_EDIT_EMAIL), email, sizeof(email));
+
+            if (!IsNameValid(name) || !IsPhoneValid(phone) || !IsEmailValid(email)) {
+                TraceEnd("EditDlgProc.invalid", span);
+                MessageBoxA(hDlg, "Invalid input. Check name, phone, or email format.", "Input Error", MB_ICONERROR);
+                return (INT_PTR)TRUE;
+            }
+            UpdateContact(editId, name, phone, email); 
+            TraceEnd("EditDlgProc.OK", span);
+            
+            EndDialog(hDlg, IDOK);
+            return (INT_PTR)TRUE;
+
+        } else if (LOWORD(wParam) == IDC_DELETE_ITEM) { 
+            if (MessageBoxA(hDlg, "Delete this contact?", "Confirm", MB_YESNO | MB_ICONQUESTION) == IDYES) {
+                DeleteContact(editId);
+                EndDialog(hDlg, IDOK);
+            }
+            return (INT_PTR)TRUE;
+
+        } else if (LOWORD(wParam) == IDCANCEL) {
+            EndDialog(hDlg, IDCANCEL);
+            return (INT_PTR)TRUE;
+        }
+        break;
+    }
+    return (INT_PTR)FALSE;
+}
+
+// Asks which field to set on the selected contacts, and to what. lParam is
+// how many are selected; the choice is left in bulkEditField/bulkEditValue.
+static QueryField bulkEditField = FIELD_NAME;
+static char bulkEditValue[300];
+
+INT_PTR CALLBACK BulkEditDlgProc(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam) {
+    switch (message) {
+    case WM_INITDIALOG: {
+        char text[64];
+        snprintf(text, sizeof(text), "%d contacts selected", (int)lParam);
+        SetWindowTextUtf8(GetDlgItem(hDlg, IDC_BULK_COUNT), text);
+        CheckRadioButton(hDlg, IDC_BULK_NAME, IDC_BULK_EMAIL, IDC_BULK_NAME);
+        return (INT_PTR)TRUE;
+    }
+
+    case WM_COMMAND:
+        if (LOWORD(wParam) == IDOK) {
+            char value[300] = {0};
+            GetWindowTextUtf8(GetDlgItem(hDlg, IDC_BULK_VALUE), value, sizeof(value));
+            QueryField field = IsDlgButtonChecked(hDlg, IDC_BULK_PHONE) ? FIELD_PHONE
+                             : IsDlgButtonChecked(hDlg, IDC_BULK_EMAIL) ? FIELD_EMAIL : FIELD_NAME;
+            BOOL valid = field == FIELD_PHONE ? IsPhoneValid(value) : field == FIELD_EMAIL ? IsEmailValid(value) : IsNameValid(value);
+            if (!valid) {
+                MessageBoxA(hDlg, "Invalid input. Check the value's format.", "Input Error", MB_ICONERROR);
+                return (INT_PTR)TRUE;
+            }
+            bulkEditField = field;
+            snprintf(bulkEditValue, sizeof(bulkEditValue), "%s", value);
+            EndDialog(hDlg, IDOK);
+            return (INT_PTR)TRUE;
+        } else if (LOWORD(wParam) == IDCANCEL) {
+            EndDialog(hDlg, IDCANCEL);
+            return (INT_PTR)TRUE;
+        }
+        break;
+    }
+    return (INT_PTR)FALSE;
+}
+
+// --- Window Procedure ---
+
+LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam) {
+    switch (message) {
+    case WM_CREATE:
+        CreateMainControls(hWnd);
+        StartBackgroundLoad(hWnd);
+        break;
+
+    case WM_APP_DB_READY:
+        OnDatabaseReady(hWnd, (BOOL)wParam);
+        return 0;
+
+    case WM_APP_ROWS:
+        OnRowBatch((RowBatch *)lParam);
+        return 0;
+
+    case WM_APP_LOAD_DONE:
+        OnLoadDone((int)wParam);
+        return 0;
+
+    case WM_APP_DB_FAILED:
+        DestroyWindow(hWnd);
+        return 0;
+
+    case WM_APP_SNAPSHOT_REST:
+        LoadRemainingSnapshotRows();
+        return 0;
+
+    case WM_SIZE: {
+        // Resize Status Bar
+        SendMessage(hStatusBar, WM_SIZE, 0, 0);
+
+        // Resize List View to fill remaining space
+        RECT rc; GetClientRect(hWnd, &rc);
+        int sb_height;
+        RECT sb_rc;
+        if (GetWindowRect(hStatusBar, &sb_rc)) {
+            sb_height = sb_rc.bottom - sb_rc.top;
+        } else {
+            sb_height = 20; // Default height if failed
+        }
+        
+        int listview_height = rc.bottom - 75 - sb_height - 5; 
+
+        HDWP hdwp = BeginDeferWindowPos(1);
+        DeferWindowPos(hdwp, hListView, NULL, 10, 75, rc.right - 20, listview_height, SWP_NOZORDER | SWP_NOACTIVATE);
+        EndDeferWindowPos(hdwp);
+        break;
+    }
+
+    case WM_COMMAND: {
+        int id = LOWORD(wParam);
+        int code = HIWORD(wParam);
+
+        if (id == IDC_SEARCH_EDIT) {
+            // Search Placeholder Logic
+            if (code == EN_SETFOCUS) {
+                char buf[256];
+                GetWindowTextUtf8(hSearchEdit, buf, sizeof(buf));
+                if (strcmp(buf, SEARCH_PLACEHOLDER) == 0) SetWindowTextUtf8(hSearchEdit, "");
+            } else if (code == EN_KILLFOCUS) {
+                char buf[256];
+                GetWindowTextUtf8(hSearchEdit, buf, sizeof(buf));
+                if (strlen(buf) == 0) SetWindowTextUtf8(hSearchEdit, SEARCH_PLACEHOLDER);
+            }
+            break;
+        }
+
+        // contact commands wait until the background load has finished
+        if (!databaseReady && id != IDM_FILE_EXIT) break;
+
+        switch (id) {
+        case IDC_ADD_CONTACT:
+        case IDM_CONTACT_ADD:
+            if (DialogBoxW(hInst, MAKEINTRESOURCEW(IDD_ADD_CONTACT), hWnd, AddDlgProc) == IDOK) {
+                LoadContactsToListView(hListView, NULL);
+            }
+            break;
+
+        case IDM_CONTACT_SELECT_ALL:
+            if (GetFocus() == hSearchEdit) SendMessage(hSearchEdit, EM_SETSEL, 0, -1);
+            else ListView_SetItemState(hListView, -1, LVIS_SELECTED, LVIS_SELECTED);
+            break;
+
+        case IDC_EDIT_CONTACT:
+        case IDM_CONTACT_EDIT: {
+            int *ids;
+            int count = GetSelectedContactIds(&ids);
+            if (count > 1) {
+                if (DialogBoxParamW(hInst, MAKEINTRESOURCEW(IDD_BULK_EDIT), hWnd, BulkEditDlgProc, (LPARAM)count) == IDOK) {
+                    ReportBulkResult(hWnd, BulkSetField(ids, count, bulkEditField, bulkEditValue, BulkStatusProgress, "Updated"));
+                }
+                free(ids);
+                break;
+            }
+            free(ids);
+            int idToEdit = GetSelectedContactId();
+            if (idToEdit != -1) {
+                if (DialogBoxParamW(hInst, MAKEINTRESOURCEW(IDD_EDIT_CONTACT), hWnd, EditDlgProc, (LPARAM)idToEdit) == IDOK) {
+                    LoadContactsToListView(hListView, NULL);
+                }
+            } else {
+                MessageBox(hWnd, "Please select a contact first.", "Info", MB_OK | MB_ICONINFORMATION);
+            }
+            break;
+        }
+        
+        case IDC_DELETE_CONTACT:
+        case IDM_CONTACT_DEL: {
+            int *ids;
+            int count = GetSelectedContactIds(&ids);
+            if (count > 1) {
+                char prompt[96];
+                snprintf(prompt, sizeof(prompt), "Delete the %d selected contacts?", count);
+                if (MessageBoxA(hWnd, prompt, "Confirm", MB_YESNO | MB_ICONQUESTION) == IDYES) {
+                    ReportBulkResult(hWnd, BulkDelete(ids, count, BulkStatusProgress, "Deleted"));
+                }
+                free(ids);
+                break;
+            }
+            free(ids);
+            int idToDelete = GetSelectedContactId();
+            if (idToDelete != -1) {
+                if (MessageBoxA(hWnd, "Delete selected contact?", "Confirm", MB_YESNO | MB_ICONQUESTION) == IDYES) {
+                    DeleteContact(idToDelete);
+                    LoadContactsToListView(hListView, NULL);
+                }
+            } else {
+                MessageBox(hWnd, "Please select a contact first.", "Info", MB_OK | MB_ICONINFORMATION);
+            }
+            break;
+        }
+
+        case IDM_CONTACT_DEL_MATCHING: {
+            char search[600] = {0};
+            GetSearchText(search, sizeof(search));
+            BulkIds matches;
+            int rc = BulkMatchIds(search, &matches);
+            if (rc != SQLITE_OK) {
+                ReportBulkResult(hWnd, rc);
+            } else if (!matches.count) {
+                MessageBox(hWnd, "Type a search first; its matches are deleted.", "Info", MB_OK | MB_ICONINFORMATION);
+            } else {
+                char prompt[700];
+                snprintf(prompt, sizeof(prompt), "Delete all %d contacts matching \"%s\"?", matches.count, search);
+                if (MessageBoxA(hWnd, prompt, "Confirm", MB_YESNO | MB_ICONQUESTION) == IDYES) {
+                    ReportBulkResult(hWnd, BulkDelete(matches.ids, matches.count, BulkStatusProgress, "Deleted"));
+                }
+            }
+            BulkIdsFree(&matches);
+            break;
+        }
+
+        case IDC_SEARCH_BTN:
+        case IDM_CONTACT_SEARCH: {
+            LONGLONG span = TraceBegin();
+            char search[600] = {0};
+            GetSearchText(search, sizeof(search));
+            LoadContactsToListView(hListView, search);
+            TraceEnd("SearchCommand", span);
+            break;
+        }
+        
+        case IDM_CONTACT_RANK: {
+            rankResults = !rankResults;
+            CheckMenuItem(GetMenu(hWnd), IDM_CONTACT_RANK, rankResults ? MF_CHECKED : MF_UNCHECKED);
+            char search[600] = {0};
+            GetSearchText(search, sizeof(search));
+            LoadContactsToListView(hListView, search);
+            break;
+        }
+
+        case IDM_CONTACT_VIEW: // Explicitly load all (Clear filter)
+            SetWindowTextUtf8(hSearchEdit, SEARCH_PLACEHOLDER);
+            LoadContactsToListView(hListView, NULL);
+            break;
+
+        case IDM_FILE_STATS: {
+            char summary[2048];
+            FormatStatsSummary(summary, sizeof(summary));
+            SaveMetricsFile(METRICS_FILE);
+            MessageBoxA(hWnd, summary, "Statistics (saved to " METRICS_FILE ")", MB_OK | MB_ICONINFORMATION);
+            break;
+        }
+
+        case IDM_FILE_TRACE:
+            if (ExportTrace(TRACE_FILE)) {
+                MessageBoxA(hWnd, "Trace saved to " TRACE_FILE ".", "Trace", MB_OK | MB_ICONINFORMATION);
+            } else {
+                MessageBoxA(hWnd, "Cannot write " TRACE_FILE ".", "Trace", MB_OK | MB_ICONERROR);
+            }
+            break;
+
+        case IDM_FILE_EXIT:
+            DestroyWindow(hWnd);
+            break;
+        } 
+        break;
+    } 
+
+    case WM_NOTIFYFORMAT:
+        return NFR_UNICODE;     // the list view's notifications come as W
+
+    case WM_NOTIFY: {
+        LPNMHDR lpnmhdr = (LPNMHDR)lParam;
+        if (lpnmhdr->idFrom == IDC_LISTVIEW) {
+            if (lpnmhdr->code == LVN_GETDISPINFOW) {
+                LVITEMW *item = &((NMLVDISPINFOW *)lParam)->item;
+                if (item->mask & LVIF_TEXT) {
+                    item->pszText = (LPWSTR)WideCacheText(&listCache, &listRows, item->iItem, item->iSubItem);
+                }
+                return 0;
+            }
+            if (lpnmhdr->code == LVN_ODCACHEHINT) {
+                const NMLVCACHEHINT *hint = (const NMLVCACHEHINT *)lParam;
+                if (hint->iFrom < listCache.first || hint->iTo >= listCache.first + listCache.count) {
+                    WideCacheFill(&listCache, &listRows, hint->iFrom, hint->iTo);
+                }
+                return 0;
+            }
+            if (lpnmhdr->code == LVN_ODFINDITEMW) return FindListRow((const NMLVFINDITEMW *)lParam);
+        }
+        if (lpnmhdr->code == NM_DBLCLK) {
+            if (lpnmhdr->idFrom == IDC_LISTVIEW) {
+                // Double-click to Edit
+                SendMessage(hWnd, WM_COMMAND, (WPARAM)IDC_EDIT_CONTACT, 0);
+                return TRUE;
+            }
+        }
+        break;
+    }
+
+    case WM_APP_FLUSH_WRITES:
+        FlushPostedWrites();
+        return 0;
+
+    case WM_DESTROY:
+        StopBackgroundLoad();
+        DisplayRowsFree(&listRows);
+        WideCacheFree(&listCache);
+        StopWriteBatcher();
+        if (store) {
+            const ContactStore *closing = store;
+            store->close();
+            store = NULL;
+            if (closing == &sqliteStore) SaveSnapshotOnExit();
+            SaveMetricsFile(METRICS_FILE);
+        }
+        PostQuitMessage(0);
+        break;
+    }
+
+    return DefWindowProc(hWnd, message, wParam, lParam);
+}
+
+#endif
+
+// --- Benchmark ---
+// "bench" builds a synthetic book with a deterministic generator and runs a
+// fixed suite against the selected store. Each case prints one JSON object
+// per line so runs from different builds can be diffed or plotted:
+//
+//   contact_manager.exe bench --rows=100000 --dups=5 --seed=1 --store=memory --out=bench.jsonl
+//
+// "generate" only builds the database:
+//
+//   contact_manager.exe generate --rows=1000000 --db=big.db
+
+#define BENCH_DB_FILE "bench_contacts.db"
+#define BENCH_LOG_FILE "bench_contacts.log"
+#define BENCH_FLAT_FILE "bench_contacts_flat.db"
+#define BENCH_PACKED_FILE "bench_contacts_packed.db"
+#define BENCH_BATCH_SIZE 256
+#define BENCH_OPS 1000
+#define BENCH_QUERIES 20
+#define BENCH_FIRST_PAGE 64     // as SNAPSHOT_FIRST_PAGE, which is Win32 only
+
+static const char *genFirstNames[] = {
+    "James", "Mary", "John", "Patricia", "Robert", "Jennifer", "Michael", "Linda", "William", "Elizabeth",
+    "David", "Barbara", "Richard", "Susan", "Joseph", "Jessica", "Thomas", "Sarah", "Charles", "Karen",
+    "Christopher", "Nancy", "Daniel", "Lisa", "Matthew", "Betty", "Anthony", "Margaret", "Mark", "Sandra",
+    "Fatima", "Mohammed", "Wei", "Yuki", "Priya", "Ahmed", "Olga", "Carlos", "Ana", "Kwame"
+};
+
+static const char *genLastNames[] = {
+    "Smith", "Johnson", "Williams", "Brown", "Jones", "Garcia", "Miller", "Davis", "Rodriguez", "Martinez",
+    "Hernandez", "Lopez", "Gonzalez", "Wilson", "Anderson", "Thomas", "Taylor", "Moore", "Jackson", "Martin",
+    "Lee", "Perez", "Thompson", "White", "Harris", "Sanchez", "Clark", "Ramirez", "Lewis", "Robinson",
+    "Haque", "Rahman", "Chen", "Tanaka", "Patel", "Khan", "Ivanova", "Silva", "Mensah", "Nguyen"
+};
+
+static const char *genDomains[] = {
+    "gmail.com", "yahoo.com", "outlook.com", "hotmail.com", "icloud.com", "aol.com", "proton.me",
+    "mail.com", "gmx.net", "yandex.ru", "qq.com", "163.com", "live.com", "msn.com", "comcast.net",
+    "acme.com", "globex.com", "initech.com", "umbrella.org", "hooli.io", "example.org", "contoso.com",
+    "fabrikam.com", "northwind.net", "tailspin.io", "wayne.co", "stark.dev", "oscorp.net", "cyberdyne.ai",
+    "aperture.sci"
+};
+
+#define COUNT_OF(a) ((int)(sizeof(a) / sizeof((a)[0])))
+#define GEN_DUP_RING 1024
+
+typedef struct { unsigned long long state; } Rng;
+
+// splitmix64: small, fast and identical on every platform
+static unsigned long long RngNext(Rng *r) {
+    unsigned long long z = (r->state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+static double RngUniform(Rng *r) {
+    return (double)(RngNext(r) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int RngBelow(Rng *r, int n) {
+    return (int)(RngNext(r) % (unsigned long long)n);
+}
+
+// Zipf(s) over n ranks, sampled by binary search over the CDF
+typedef struct {
+    double cdf[64];
+    int n;
+} Zipf;
+
+static void ZipfInit(Zipf *z, int n, double s) {
+    double sum = 0.0;
+    z->n = n;
+    for (int i = 0; i < n; i++) {
+        sum += 1.0 / pow((double)(i + 1), s);
+        z->cdf[i] = sum;
+    }
+    for (int i = 0; i < n; i++) z->cdf[i] /= sum;
+}
+
+static int ZipfSample(const Zipf *z, Rng *r) {
+    double u = RngUniform(r);
+    int lo = 0, hi = z->n - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (z->cdf[mid] < u) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+typedef struct {
+    Rng rng;
+    Zipf firstNames;
+    Zipf lastNames;
+    Zipf domains;
+    int dupPercent;
+    char dupPhones[GEN_DUP_RING][24];
+    char dupEmails[GEN_DUP_RING][100];
+    int generated;
+} ContactGen;
+
+void ContactGenInit(ContactGen *g, unsigned long long seed, int dupPercent) {
+    ZeroMemory(g, sizeof(*g));
+    g->rng.state = seed;
+    g->dupPercent = dupPercent;
+    ZipfInit(&g->firstNames, COUNT_OF(genFirstNames), 0.8);
+    ZipfInit(&g->lastNames, COUNT_OF(genLastNames), 0.9);
+    ZipfInit(&g->domains, COUNT_OF(genDomains), 1.2);
+}
+
+static void GenPhone(ContactGen *g, char *out, size_t size) {
+    int area = 200 + RngBelow(&g->rng, 800);
+    int exch = 200 + RngBelow(&g->rng, 800);
+    int line = RngBelow(&g->rng, 10000);
+    switch (RngBelow(&g->rng, 5)) {
+    case 0: snprintf(out, size, "%03d%03d%04d", area, exch, line); break;
+    case 1: snprintf(out, size, "+1 %03d %03d %04d", area, exch, line); break;
+    case 2: snprintf(out, size, "(%03d) %03d-%04d", area, exch, line); break;
+    case 3: snprintf(out, size, "%03d-%03d-%04d", area, exch, line); break;
+    default: snprintf(out, size, "+44 20 %04d %04d", exch * 10 + line % 10, line); break;
+    }
+}
+
+// Produces the next contact. With dupPercent set, that share of rows reuses
+// a phone or email from an earlier row.
+void GenerateContact(ContactGen *g, char *name, size_t nameSize, char *phone, size_t phoneSize,
+                     char *email, size_t emailSize) {
+    const char *first = genFirstNames[ZipfSample(&g->firstNames, &g->rng)];
+    const char *last = genLastNames[ZipfSample(&g->lastNames, &g->rng)];
+    const char *domain = genDomains[ZipfSample(&g->domains, &g->rng)];
+    snprintf(name, nameSize, "%s %s", first, last);
+
+    char local[64];
+    switch (RngBelow(&g->rng, 3)) {
+    case 0: snprintf(local, sizeof(local), "%s.%s", first, last); break;
+    case 1: snprintf(local, sizeof(local), "%c%s", first[0], last); break;
+    default: snprintf(local, sizeof(local), "%s%d", first, RngBelow(&g->rng, 100)); break;
+    }
+    for (char *p = local; *p; p++) *p = (char)tolower((unsigned char)*p);
+    snprintf(email, emailSize, "%s@%s", local, domain);
+    GenPhone(g, phone, phoneSize);
+
+    int dupSlots = g->generated < GEN_DUP_RING ? g->generated : GEN_DUP_RING;
+    if (dupSlots && RngBelow(&g->rng, 100) < g->dupPercent) {
+        int slot = RngBelow(&g->rng, dupSlots);
+        if (RngBelow(&g->rng, 2)) snprintf(phone, phoneSize, "%s", g->dupPhones[slot]);
+        else snprintf(email, emailSize, "%s", g->dupEmails[slot]);
+    }
+    int slot = g->generated % GEN_DUP_RING;
+    snprintf(g->dupPhones[slot], sizeof(g->dupPhones[slot]), "%s", phone);
+    snprintf(g->dupEmails[slot], sizeof(g->dupEmails[slot]), "%s", email);
+    g->generated++;
+}
+
+typedef struct {
+    const char *storeName;
+    int rows;
+    FILE *out;
+} BenchRun;
+
+static LONGLONG BenchNow(void) {
+    return ClockNow();
+}
+
+static void BenchReport(const BenchRun *run, const char *name, const OpStats *s,
+                        unsigned long long ops, LONGLONG elapsed) {
+    double seconds = (double)TicksToNs(elapsed) / 1e9;
+    char line[512];
+    snprintf(line, sizeof(line),
+        "{\"case\":\"%s\",\"store\":\"%s\",\"rows\":%d,\"ops\":%llu,\"seconds\":%.6f,"
+        "\"ops_per_sec\":%.1f,\"p50_us\":%.3f,\"p99_us\":%.3f,\"max_us\":%.3f}\n",
+        name, run->storeName, run->rows, ops, seconds, seconds > 0 ? (double)ops / seconds : 0.0,
+        (double)HistPercentile(s, 50) / 1e3, (double)HistPercentile(s, 99) / 1e3, (double)s->maxNs / 1e3);
+    fputs(line, stdout);
+    if (run->out) fputs(line, run->out);
+}
+
+// The result of an equivalence check: how many answers differed between
+// two ways of computing them, which should be none.
+static void BenchReportMismatches(const BenchRun *run, const char *name, int mismatches) {
+    char line[256];
+    snprintf(line, sizeof(line), "{\"case\":\"%s\",\"store\":\"%s\",\"rows\":%d,\"mismatches\":%d}\n",
+             name, run->storeName, run->rows, mismatches);
+    fputs(line, stdout);
+    if (run->out) fputs(line, run->out);
+}
+
+static int BenchCountRow(void *ctx, int id, const char *name, const char *phone, const char *email) {
+    (*(int *)ctx)++;
+    return 0;
+}
+
+static int BenchFirstPageRow(void *ctx, int id, const char *name, const char *phone, const char *email) {
+    return ++(*(int *)ctx) >= BENCH_FIRST_PAGE;
+}
+
+// Fills the open store with rows generated contacts, BENCH_BATCH_SIZE per
+// transaction. Records one latency sample per transaction.
+static int BenchPopulate(ContactGen *gen, int rows, OpStats *stats) {
+    char name[100], phone[24], email[100];
+    for (int done = 0; done < rows; ) {
+        LONGLONG t0 = BenchNow();
+        int rc = store->begin();
+        for (int i = 0; rc == SQLITE_OK && i < BENCH_BATCH_SIZE && done < rows; i++, done++) {
+            GenerateContact(gen, name, sizeof(name), phone, sizeof(phone), email, sizeof(email));
+            rc = store->insert(name, phone, email);
+        }
+        if (rc == SQLITE_OK) rc = store->commit();
+        if (rc != SQLITE_OK) {
+            store->rollback();
+            fprintf(stderr, "populate failed: %s\n", store->errmsg());
+            return rc;
+        }
+        if (stats) HistRecord(stats, TicksToNs(BenchNow() - t0));
+    }
+    return SQLITE_OK;
+}
+
+static void BenchSearch(const BenchRun *run, const char *name, char terms[][32], int nterms) {
+    OpStats s;
+    ZeroMemory(&s, sizeof(s));
+    LONGLONG start = BenchNow();
+    for (int i = 0; i < nterms; i++) {
+        int found = 0;
+        LONGLONG t0 = BenchNow();
+        store->search(terms[i], BenchCountRow, &found);
+        HistRecord(&s, TicksToNs(BenchNow() - t0));
+    }
+    BenchReport(run, name, &s, (unsigned long long)nterms, BenchNow() - start);
+}
+
+// Times one filter statement over every term; ops are rows scanned, so
+// ops_per_sec is the filter's row throughput.
+static void BenchFilterSql(const BenchRun *run, const char *name, const char *sql, BOOL likePattern,
+                           char terms[][32], int nterms) {
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "%s: %s\n", name, sqlite3_errmsg(db));
+        return;
+    }
+    OpStats s;
+    ZeroMemory(&s, sizeof(s));
+    LONGLONG start = BenchNow();
+    for (int i = 0; i < nterms; i++) {
+        char pat[64];
+        snprintf(pat, sizeof(pat), likePattern ? "%%%s%%" : "%s", terms[i]);
+        LONGLONG t0 = BenchNow();
+        sqlite3_bind_text(stmt, 1, pat, -1, SQLITE_TRANSIENT);
+        sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        HistRecord(&s, TicksToNs(BenchNow() - t0));
+    }
+    sqlite3_finalize(stmt);
+    BenchReport(run, name, &s, (unsigned long long)run->rows * nterms, BenchNow() - start);
+}
+
+// Runs two count(*) statements over the same terms and reports how many
+// terms gave different counts.
+// the search filter with the custom functions, and the same through contacts_search
+static const char benchFunctionSql[] =
+    "SELECT count(*) FROM contacts WHERE contains_ci(name,?1) OR phone_match(phone,?1) OR contains_ci(email,?1);";
+static const char benchVtabSql[] = "SELECT count(*) FROM contacts JOIN contacts_search(?1) USING(id);";
+
+// Search terms are slices of generated values, so they always hit.
+static void BenchSearchTerms(ContactGen *gen, char nameTerms[][32], char phoneTerms[][32], char emailTerms[][32]) {
+    char name[100], phone[24], email[100];
+    for (int i = 0; i < BENCH_QUERIES; i++) {
+        GenerateContact(gen, name, sizeof(name), phone, sizeof(phone), email, sizeof(email));
+        const char *last = strchr(name, ' ');
+        snprintf(nameTerms[i], 32, "%.4s", last ? last + 1 : name);
+        snprintf(phoneTerms[i], 32, "%.4s", phone + strlen(phone) - 4);
+        const char *at = strchr(email, '@');
+        snprintf(emailTerms[i], 32, "%.6s", at ? at : email);
+    }
+}
+
+static int BenchCompareCounts(const BenchRun *run, const char *name, const char *sqlA, const char *sqlB,
+                              char terms1[][32], char terms2[][32], char terms3[][32]) {
+    sqlite3_stmt *a = NULL, *b = NULL;
+    int mismatches = 0;
+    if (sqlite3_prepare_v2(db, sqlA, -1, &a, NULL) != SQLITE_OK || sqlite3_prepare_v2(db, sqlB, -1, &b, NULL) != SQLITE_OK) {
+        fprintf(stderr, "%s: %s\n", name, sqlite3_errmsg(db));
+        mismatches = -1;
+    }
+    for (int i = 0; mismatches >= 0 && i < 3 * BENCH_QUERIES; i++) {
+        const char *term = i < BENCH_QUERIES ? terms1[i] : i < 2 * BENCH_QUERIES ? terms2[i - BENCH_QUERIES] : terms3[i - 2 * BENCH_QUERIES];
+        sqlite3_bind_text(a, 1, term, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(b, 1, term, -1, SQLITE_TRANSIENT);
+        int countA = sqlite3_step(a) == SQLITE_ROW ? sqlite3_column_int(a, 0) : -1;
+        int countB = sqlite3_step(b) == SQLITE_ROW ? sqlite3_column_int(b, 0) : -1;
+        if (countA != countB) {
+            fprintf(stderr, "%s: \"%s\" %d vs %d\n", name, term, countA, countB);
+            mismatches++;
+        }
+        sqlite3_reset(a);
+        sqlite3_reset(b);
+    }
+    sqlite3_finalize(a);
+    sqlite3_finalize(b);
+    BenchReportMismatches(run, name, mismatches);
+    return mismatches;
+}
+
+static long long BenchDbBytes(const char *schema) {
+    char sql[96];
+    long long pages[3] = { 0, 0, 0 };
+    static const char *pragmas[3] = { "page_count", "freelist_count", "page_size" };
+    for (int i = 0; i < 3; i++) {
+        sqlite3_stmt *stmt = NULL;
+        snprintf(sql, sizeof(sql), "PRAGMA %s.%s;", schema, pragmas[i]);
+        if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+            pages[i] = sqlite3_column_int64(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+    }
+    return (pages[0] - pages[1]) * pages[2];
+}
+
+// Dictionary-encoded emails against the original single-column layout,
+// rebuilt in a scratch file from the contacts view: bytes in use (the
+// encoded side vacuumed into another scratch file, so neither counts
+// free space), domain filters on each (a string compare against an
+// integer compare), and awkward addresses written through the view and
+// read back.
+static int BenchDomains(const BenchRun *run) {
+    static const char *flatSql =
+        "CREATE TABLE flat.contacts(id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT NOT NULL, phone TEXT, email TEXT,"
+        " last_used INTEGER NOT NULL DEFAULT 0, sort_key BLOB);"
+        "INSERT INTO flat.contacts SELECT id,name,phone,email,last_used,sort_key FROM main.contacts;"
+        "CREATE INDEX flat.contacts_sort_key ON contacts(sort_key);";
+    DeleteFileA(BENCH_FLAT_FILE);
+    DeleteFileA(BENCH_PACKED_FILE);
+    char attach[256];
+    snprintf(attach, sizeof(attach), "ATTACH '%s' AS flat; VACUUM main INTO '%s'; ATTACH '%s' AS packed;",
+             BENCH_FLAT_FILE, BENCH_PACKED_FILE, BENCH_PACKED_FILE);
+    int rc = sqlite3_exec(db, attach, 0, 0, 0);
+    if (rc == SQLITE_OK) rc = sqlite3_exec(db, flatSql, 0, 0, 0);
+    long long flatBytes = BenchDbBytes("flat"), encodedBytes = BenchDbBytes("packed");
+    sqlite3_exec(db, "DETACH packed;", 0, 0, 0);
+    DeleteFileA(BENCH_PACKED_FILE);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "domain_storage: %s\n", sqlite3_errmsg(db));
+        sqlite3_exec(db, "DETACH flat;", 0, 0, 0);
+        DeleteFileA(BENCH_FLAT_FILE);
+        return 1;
+    }
+
+    char terms[BENCH_QUERIES][32];
+    int termCount = 0, domains = 0;
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(db, "SELECT name FROM domains ORDER BY id;", -1, &stmt, NULL) == SQLITE_OK) {
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            if (termCount < BENCH_QUERIES) {
+                snprintf(terms[termCount++], sizeof(terms[0]), "%s", (const char *)sqlite3_column_text(stmt, 0));
+            }
+            domains++;
+        }
+    }
+    sqlite3_finalize(stmt);
+    for (int i = termCount; i < BENCH_QUERIES; i++) strcpy(terms[i], termCount ? terms[i % termCount] : "example.com");
+
+    char line[320];
+    snprintf(line, sizeof(line),
+             "{\"case\":\"domain_storage\",\"store\":\"%s\",\"rows\":%d,\"domains\":%d,\"flat_bytes\":%lld,"
+             "\"encoded_bytes\":%lld,\"saved_pct\":%.1f}\n",
+             run->storeName, run->rows, domains, flatBytes, encodedBytes,
+             flatBytes ? 100.0 * (double)(flatBytes - encodedBytes) / (double)flatBytes : 0.0);
+    fputs(line, stdout);
+    if (run->out) fputs(line, run->out);
+
+    static const char *flatFilter = "SELECT count(*) FROM flat.contacts WHERE " EMAIL_DOMAIN("email") "=?1;";
+    static const char *encodedFilter = "SELECT count(*) FROM contact_rows WHERE domain_id=(SELECT id FROM domains WHERE name=?1);";
+    BenchFilterSql(run, "domain_filter_flat", flatFilter, FALSE, terms, BENCH_QUERIES);
+    BenchFilterSql(run, "domain_filter_encoded", encodedFilter, FALSE, terms, BENCH_QUERIES);
+    int mismatches = BenchCompareCounts(run, "domain_filter_equivalence", flatFilter, encodedFilter, terms, terms, terms);
+    sqlite3_exec(db, "DETACH flat;", 0, 0, 0);
+    DeleteFileA(BENCH_FLAT_FILE);
+
+    // every address must come back exactly as written
+    static const char *awkward[] = { "", "plain", "a@", "@b.org", "x@y@z.com", "Mixed@Example.COM", "mixed@example.com" };
+    int bad = 0;
+    sqlite3_stmt *put = NULL, *get = NULL;
+    if (sqlite3_exec(db, "SAVEPOINT bench_domains;", 0, 0, 0) != SQLITE_OK ||
+        sqlite3_prepare_v2(db, "INSERT INTO contacts(name,email) VALUES('Bench Domain',?1);", -1, &put, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(db, "SELECT email FROM contacts WHERE id=(SELECT max(id) FROM contact_rows);", -1, &get, NULL) != SQLITE_OK) {
+        bad = -1;
+    }
+    for (int i = 0; bad >= 0 && i <= COUNT_OF(awkward); i++) {
+        const char *email = i < COUNT_OF(awkward) ? awkward[i] : NULL;   // and NULL
+        sqlite3_bind_text(put, 1, email, -1, SQLITE_STATIC);
+        sqlite3_step(put);
+        sqlite3_reset(put);
+        const char *back = sqlite3_step(get) == SQLITE_ROW ? (const char *)sqlite3_column_text(get, 0) : "(missing)";
+        if (email ? !back || strcmp(back, email) : back != NULL) {
+            fprintf(stderr, "domain_roundtrip: \"%s\" came back as \"%s\"\n", email ? email : "(null)", back ? back : "(null)");
+            bad++;
+        }
+        sqlite3_reset(get);
+    }
+    sqlite3_finalize(put);
+    sqlite3_finalize(get);
+    sqlite3_exec(db, "ROLLBACK TO bench_domains; RELEASE bench_domains;", 0, 0, 0);
+    DomainCacheClear();
+    BenchReportMismatches(run, "domain_roundtrip", bad);
+    return mismatches != 0 || bad != 0;
+}
+
+// The byte-by-byte checks the table-driven validators replaced, kept as the
+// reference for the equivalence case.
+static BOOL LegacyNameValid(const char *name) {
+    if (strlen(name) == 0) return FALSE;
+    for (int i = 0; name[i]; i++) {
+        if (!isalpha((unsigned char)name[i]) && !isspace((unsigned char)name[i])) return FALSE;
+    }
+    return TRUE;
+}
+
+static BOOL LegacyPhoneValid(const char *phone) {
+    if (strlen(phone) == 0) return TRUE;
+    for (int i = 0; phone[i]; i++) {
+        if (!isdigit((unsigned char)phone[i])) return FALSE;
+    }
+    return TRUE;
+}
+
+static BOOL LegacyEmailValid(const char *email) {
+    if (strlen(email) == 0) return TRUE;
+    if (strchr(email, '@') == NULL) return FALSE;
+    for (int i = 0; email[i]; i++) {
+        if (isspace((unsigned char)email[i]) || email[i] == ',') return FALSE;
+    }
+    return TRUE;
+}
+
+#define BENCH_VALIDATE_MAX_ROWS 100000
+#define BENCH_VALIDATE_PASSES 5
+
+// Generated contacts plus a share of edge cases: UTF-8 names, malformed
+// UTF-8, digit-only phones, long fields and emails with separators.
+static void BenchValidateRow(ContactGen *gen, int i, char *name, char *phone, char *email) {
+    static const char *names[] = {
+        "Jos\xC3\xA9 M\xC3\xBCller", "\xC5\x81ukasz \xC5\xBB\xC3\xB3\xC5\x82\xC4\x87", "\xE5\xB1\xB1\xE7\x94\xB0 \xE5\xA4\xAA\xE9\x83\x8E",
+        "Bad \xC3\x28 Byte", "Overlong \xC0\xAF", "Surrogate \xED\xA0\x80", "Truncated \xE2\x82",
+        "Control\x01 Char", "Alexandria Montgomery Featherstonehaugh", "  ", ""
+    };
+    static const char *emails[] = {
+        "no.at.sign.example.com", "two,parts@example.com", "spa ce@example.com", "tab\t@example.com",
+        "a.very.long.local.part.for.testing@subdomain.example.com", "@", "j\xC3\xA9r\xC3\xB4me@example.fr"
+    };
+    GenerateContact(gen, name, 100, phone, 24, email, 100);
+    switch (i % 8) {
+    case 1: snprintf(name, 100, "%s", names[RngBelow(&gen->rng, COUNT_OF(names))]); break;
+    case 2: snprintf(email, 100, "%s", emails[RngBelow(&gen->rng, COUNT_OF(emails))]); break;
+    case 3: snprintf(phone, 24, "%010d%08d", RngBelow(&gen->rng, 1000000000), i); break;
+    case 4: phone[0] = '\0'; email[0] = '\0'; break;
+    default: break;
+    }
+}
+
+// Checks that the SSE2 and scalar kernels agree everywhere and match the old
+// functions on ASCII input, then, if timed, times all three over the same rows.
+static int BenchValidate(const BenchRun *run, ContactGen *gen, BOOL timed) {
+    int rows = run->rows < BENCH_VALIDATE_MAX_ROWS ? run->rows : BENCH_VALIDATE_MAX_ROWS;
+    char *text = (char *)malloc((size_t)rows * 224);
+    const char **fields = (const char **)calloc((size_t)rows * 3, sizeof(char *));
+    unsigned char *scalarFlags = (unsigned char *)malloc((size_t)rows * 2);
+    if (!text || !fields || !scalarFlags) {
+        free(text); free((void *)fields); free(scalarFlags);
+        return 1;
+    }
+    const char **names = fields, **phones = fields + rows, **emails = fields + 2 * rows;
+    unsigned char *simdFlags = scalarFlags + rows;
+    for (int i = 0; i < rows; i++) {
+        char *row = text + (size_t)i * 224;
+        BenchValidateRow(gen, i, row, row + 100, row + 124);
+        names[i] = row;
+        phones[i] = row + 100;
+        emails[i] = row + 124;
+    }
+
+    ValidateContactBatch(names, phones, emails, rows, scalarFlags, FALSE);
+    ValidateContactBatch(names, phones, emails, rows, simdFlags, TRUE);
+    int mismatches = 0;
+    for (int i = 0; i < rows; i++) {
+        BOOL ascii = TRUE;
+        for (const char *p = names[i]; *p; p++) if ((unsigned char)*p >= 0x80) ascii = FALSE;
+        unsigned char legacy = (unsigned char)((LegacyNameValid(names[i]) ? 0 : VALID_NAME_BAD) |
+                                               (LegacyPhoneValid(phones[i]) ? 0 : VALID_PHONE_BAD) |
+                                               (LegacyEmailValid(emails[i]) ? 0 : VALID_EMAIL_BAD));
+        unsigned char compare = ascii ? 0xFF : (unsigned char)~VALID_NAME_BAD;
+        if (scalarFlags[i] != simdFlags[i] || (legacy & compare) != (scalarFlags[i] & compare)) {
+            if (mismatches++ < 10) {
+                fprintf(stderr, "validate mismatch: \"%s\" \"%s\" \"%s\" legacy=%d scalar=%d simd=%d\n",
+                        names[i], phones[i], emails[i], legacy, scalarFlags[i], simdFlags[i]);
+            }
+        }
+    }
+    BenchReportMismatches(run, "validate_equivalence", mismatches);
+
+    static const char *cases[] = { "validate_legacy", "validate_scalar", "validate_simd" };
+    for (int c = 0; timed && c < 3; c++) {
+        OpStats s;
+        ZeroMemory(&s, sizeof(s));
+        volatile int bad = 0;
+        LONGLONG start = BenchNow();
+        for (int pass = 0; pass < BENCH_VALIDATE_PASSES; pass++) {
+            LONGLONG t0 = BenchNow();
+            if (c == 0) {
+                for (int i = 0; i < rows; i++) {
+                    bad += !LegacyNameValid(names[i]) | !LegacyPhoneValid(phones[i]) | !LegacyEmailValid(emails[i]);
+                }
+            } else {
+                bad += ValidateContactBatch(names, phones, emails, rows, scalarFlags, c == 2);
+            }
+            HistRecord(&s, TicksToNs(BenchNow() - t0));
+        }
+        BenchReport(run, cases[c], &s, (unsigned long long)rows * BENCH_VALIDATE_PASSES, BenchNow() - start);
+    }
+
+    free(text);
+    free((void *)fields);
+    free(scalarFlags);
+    return mismatches == 0 ? 0 : 1;
+}
+
+static void BenchRank(const BenchRun *run, const char *name, char terms[][32], int nterms) {
+    OpStats s;
+    ZeroMemory(&s, sizeof(s));
+    unsigned long long scored = 0;
+    LONGLONG start = BenchNow();
+    for (int i = 0; i < nterms; i++) {
+        int found = 0;
+        LONGLONG t0 = BenchNow();
+        RankedSearch(terms[i], RANK_TOP_K, BenchCountRow, &found);
+        HistRecord(&s, TicksToNs(BenchNow() - t0));
+        scored += lastRankScored;
+    }
+    LONGLONG elapsed = BenchNow() - start;
+    BenchReport(run, name, &s, (unsigned long long)nterms, elapsed);
+    char line[256];
+    snprintf(line, sizeof(line), "{\"case\":\"%s_scored\",\"store\":\"%s\",\"rows\":%d,\"avg_scored\":%.1f}\n",
+             name, run->storeName, run->rows, nterms ? (double)scored / nterms : 0.0);
+    fputs(line, stdout);
+    if (run->out) fputs(line, run->out);
+}
+
+// Sort order computed on every comparison, as a custom collation would:
+// the baseline for the precomputed sort_key column.
+static int BenchNameCollation(void *arg, int lenA, const void *a, int lenB, const void *b) {
+    char textA[256], textB[256], keyA[SORT_KEY_MAX(255) + 1], keyB[SORT_KEY_MAX(255) + 1];
+    if (lenA > 255) lenA = 255;
+    if (lenB > 255) lenB = 255;
+    memcpy(textA, a, lenA);
+    memcpy(textB, b, lenB);
+    textA[lenA] = textB[lenB] = '\0';
+    NameSortKey(textA, (size_t)lenA, keyA);
+    NameSortKey(textB, (size_t)lenB, keyB);
+    return strcmp(keyA, keyB);
+}
+
+// Reads every id the query returns, in order; ids may be NULL.
+static int BenchSortRun(const char *sql, int *ids, int cap) {
+    sqlite3_stmt *stmt = NULL;
+    int count = 0;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) return -1;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        if (ids && count < cap) ids[count] = sqlite3_column_int(stmt, 0);
+        count++;
+    }
+    sqlite3_finalize(stmt);
+    return count;
+}
+
+// Full name ordering by BINARY (the old order), by a collation and by the
+// sort key; the last two must agree row for row.
+static int BenchSort(const BenchRun *run) {
+    static const char *cases[3][2] = {
+        { "sort_binary",    "SELECT id FROM contacts ORDER BY name,id;" },
+        { "sort_collation", "SELECT id FROM contacts ORDER BY name COLLATE bench_name_order,id;" },
+        { "sort_key",       "SELECT id FROM contacts ORDER BY sort_key,id;" },
+    };
+    sqlite3_create_collation_v2(db, "bench_name_order", SQLITE_UTF8, NULL, BenchNameCollation, NULL);
+    int cap = run->rows + 1;
+    int *ids[2] = { (int *)malloc(cap * sizeof(int)), (int *)malloc(cap * sizeof(int)) };
+    int counts[2] = { 0, 0 };
+    for (int c = 0; c < 3; c++) {
+        OpStats s;
+        ZeroMemory(&s, sizeof(s));
+        LONGLONG start = BenchNow();
+        for (int i = 0; i < 3; i++) {
+            LONGLONG t0 = BenchNow();
+            int count = BenchSortRun(cases[c][1], c > 0 ? ids[c - 1] : NULL, cap);
+            HistRecord(&s, TicksToNs(BenchNow() - t0));
+            if (c > 0) counts[c - 1] = count;
+        }
+        BenchReport(run, cases[c][0], &s, 3, BenchNow() - start);
+    }
+    int mismatches = 0;
+    if (!ids[0] || !ids[1] || counts[0] != counts[1] || counts[0] < 0) {
+        mismatches = -1;
+    } else {
+        for (int i = 0; i < counts[0] && i < cap; i++) mismatches += ids[0][i] != ids[1][i];
+    }
+    free(ids[0]);
+    free(ids[1]);
+    BenchReportMismatches(run, "sort_key_equivalence", mismatches);
+    return mismatches;
+}
+
+// Structured queries built from the search terms, timed with the planner
+// and as filtered scans; both must find the same rows.
+static int BenchQuery(const BenchRun *run, char nameTerms[][32], char phoneTerms[][32], char emailTerms[][32]) {
+    char queries[BENCH_QUERIES][128];
+    for (int i = 0; i < BENCH_QUERIES; i++) {
+        switch (i % 3) {
+        case 0: snprintf(queries[i], sizeof(queries[i]), "name:%s email:\"%s\"", nameTerms[i], emailTerms[i]); break;
+        case 1: snprintf(queries[i], sizeof(queries[i]), "name:%.2s* OR phone:%s", nameTerms[i], phoneTerms[i]); break;
+        default: snprintf(queries[i], sizeof(queries[i]), "%s NOT email:\"%s\"", nameTerms[i], emailTerms[i]); break;
+        }
+    }
+    int counts[BENCH_QUERIES];
+    int mismatches = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        OpStats s;
+        ZeroMemory(&s, sizeof(s));
+        queryPlanner = pass == 0;
+        LONGLONG start = BenchNow();
+        for (int i = 0; i < BENCH_QUERIES; i++) {
+            int found = 0;
+            LONGLONG t0 = BenchNow();
+            StructuredSearch(queries[i], BenchCountRow, &found, NULL, 0);
+            HistRecord(&s, TicksToNs(BenchNow() - t0));
+            if (pass == 0) counts[i] = found;
+            else if (found != counts[i]) {
+                fprintf(stderr, "query_plan_equivalence: \"%s\" %d vs %d\n", queries[i], counts[i], found);
+                mismatches++;
+            }
+        }
+        BenchReport(run, pass == 0 ? "query_planned" : "query_scan", &s, BENCH_QUERIES, BenchNow() - start);
+    }
+    queryPlanner = TRUE;
+    BenchReportMismatches(run, "query_plan_equivalence", mismatches);
+    return mismatches;
+}
+
+// Phones typed the way the generator writes them, whole and cut short,
+// must not be taken for queries: the search box has to give the same rows as
+// the plain search with its digit matching.
+typedef struct {
+    char (*phones)[32];
+    int count;
+} BenchPhones;
+
+static int BenchCollectPhone(void *ctx, int id, const char *name, const char *phone, const char *email) {
+    BenchPhones *p = (BenchPhones *)ctx;
+    if (*phone) snprintf(p->phones[p->count++], sizeof(p->phones[0]), "%s", phone);
+    return p->count == BENCH_QUERIES;
+}
+
+static int BenchPhoneQueries(const BenchRun *run) {
+    char phones[BENCH_QUERIES][32];
+    BenchPhones collected = { phones, 0 };
+    store->scan(BenchCollectPhone, &collected);
+    BOOL ranked = rankResults;
+    rankResults = FALSE;
+    int mismatches = 0;
+    for (int i = 0; i < 2 * collected.count; i++) {
+        char typed[32];
+        snprintf(typed, sizeof(typed), "%.*s", i % 2 ? (int)strlen(phones[i / 2]) / 2 + 1 : 31, phones[i / 2]);
+        int plain = 0, box = 0;
+        store->search(typed, BenchCountRow, &plain);
+        RunContactSearch(typed, BenchCountRow, &box, NULL);
+        if (plain != box || IsStructuredQuery(typed)) {
+            fprintf(stderr, "phone_query_equivalence: \"%s\" %d vs %d\n", typed, plain, box);
+            mismatches++;
+        }
+    }
+    rankResults = ranked;
+    BenchReportMismatches(run, "phone_query_equivalence", mismatches);
+    return mismatches;
+}
+
+#ifdef _WIN32
+// The list's rows and their UTF-16 text (see Display Rows) are Win32 only.
+typedef struct {
+    int id;
+    char *fields[3];
+} BenchHeapRow;
+
+typedef struct {
+    BenchHeapRow *rows;
+    int count;
+    int cap;
+} BenchHeapRows;
+
+// the per-string copies the arena replaced
+static int BenchAppendHeapRow(void *ctx, int id, const char *name, const char *phone, const char *email) {
+    BenchHeapRows *h = (BenchHeapRows *)ctx;
+    if (h->count == h->cap) {
+        int cap = h->cap ? h->cap * 2 : 1024;
+        BenchHeapRow *rows = (BenchHeapRow *)realloc(h->rows, cap * sizeof(*rows));
+        if (!rows) return 1;
+        h->rows = rows;
+        h->cap = cap;
+    }
+    BenchHeapRow *r = &h->rows[h->count++];
+    r->id = id;
+    r->fields[0] = CopyField(name);
+    r->fields[1] = CopyField(phone);
+    r->fields[2] = CopyField(email);
+    return 0;
+}
+
+// Materializes the whole list three times with a malloc per string and then
+// into a DisplayRows arena, which is reset between passes.
+static void BenchArena(const BenchRun *run) {
+    OpStats s;
+    ZeroMemory(&s, sizeof(s));
+    LONGLONG start = BenchNow();
+    for (int pass = 0; pass < 3; pass++) {
+        BenchHeapRows h;
+        ZeroMemory(&h, sizeof(h));
+        LONGLONG t0 = BenchNow();
+        store->scan(BenchAppendHeapRow, &h);
+        for (int i = 0; i < h.count; i++) {
+            for (int f = 0; f < 3; f++) free(h.rows[i].fields[f]);
+        }
+        free(h.rows);
+        HistRecord(&s, TicksToNs(BenchNow() - t0));
+    }
+    BenchReport(run, "materialize_malloc", &s, 3, BenchNow() - start);
+
+    DisplayRows rows;
+    ZeroMemory(&rows, sizeof(rows));
+    rows.text.name = "bench";
+    ZeroMemory(&s, sizeof(s));
+    start = BenchNow();
+    for (int pass = 0; pass < 3; pass++) {
+        LONGLONG t0 = BenchNow();
+        DisplayRowsClear(&rows);
+        store->scan(AppendDisplayRow, &rows);
+        HistRecord(&s, TicksToNs(BenchNow() - t0));
+    }
+    BenchReport(run, "materialize_arena", &s, 3, BenchNow() - start);
+    char line[320];
+    snprintf(line, sizeof(line),
+             "{\"case\":\"arena_stats\",\"store\":\"%s\",\"rows\":%d,\"allocs\":%llu,\"resets\":%llu,"
+             "\"high_water_bytes\":%llu,\"reserved_bytes\":%llu,\"chunks\":%d}\n",
+             run->storeName, run->rows, rows.text.allocs, rows.text.resets,
+             (unsigned long long)rows.text.highWater, (unsigned long long)rows.text.reserved, rows.text.chunks);
+    fputs(line, stdout);
+    if (run->out) fputs(line, run->out);
+    DisplayRowsFree(&rows);
+}
+
+// one contact as the in-memory stores used to hold it: a fixed struct and a
+// malloc per field, the sort key included
+typedef struct {
+    int id;
+    unsigned visitMark;
+    long long lastUsed;
+    char *name;
+    char *phone;
+    char *email;
+    char *sortKey;
+} BenchWideContact;
+
+typedef struct {
+    BenchWideContact *rows;
+    int count;
+    int cap;
+    size_t heapBytes;
+} BenchWideRows;
+
+// glibc-style chunk: 8 bytes of header, 16-byte granularity, 32 minimum
+static size_t BenchChunkBytes(size_t n) {
+    size_t chunk = (n + 8 + 15) & ~(size_t)15;
+    return chunk < 32 ? 32 : chunk;
+}
+
+static char *BenchWideCopy(BenchWideRows *w, const char *s) {
+    if (!s) s = "";
+    w->heapBytes += BenchChunkBytes(strlen(s) + 1);
+    return CopyField(s);
+}
+
+static int BenchAppendWideRow(void *ctx, int id, const char *name, const char *phone, const char *email) {
+    BenchWideRows *w = (BenchWideRows *)ctx;
+    if (w->count == w->cap) {
+        int cap = w->cap ? w->cap * 2 : 1024;
+        BenchWideContact *rows = (BenchWideContact *)realloc(w->rows, cap * sizeof(*rows));
+        if (!rows) return 1;
+        w->rows = rows;
+        w->cap = cap;
+    }
+    BenchWideContact *c = &w->rows[w->count++];
+    ZeroMemory(c, sizeof(*c));
+    c->id = id;
+    c->name = BenchWideCopy(w, name);
+    c->phone = BenchWideCopy(w, phone);
+    c->email = BenchWideCopy(w, email);
+    size_t len = strlen(c->name);
+    c->sortKey = (char *)malloc(SORT_KEY_MAX(len) + 1);
+    if (c->sortKey) w->heapBytes += BenchChunkBytes(NameSortKey(c->name, len, c->sortKey) + 1);
+    w->heapBytes += BenchChunkBytes(sizeof(*c));
+    return 0;
+}
+
+static volatile size_t benchSink;   // keeps timed loops from being optimized away
+
+// reads every field, as a caller displaying the row would
+static int BenchTouchRow(void *ctx, int id, const char *name, const char *phone, const char *email) {
+    *(size_t *)ctx += (size_t)id + strlen(name) + strlen(phone) + strlen(email);
+    return 0;
+}
+
+// The compact MemContact encoding against one heap block per field: bytes
+// per contact, random id lookups that materialize the row, and a full search
+// scan. Every row must decode back to the values it was built from.
+static int BenchCompactRows(const BenchRun *run, char terms[][32], int termCount) {
+    BenchWideRows wide;
+    ZeroMemory(&wide, sizeof(wide));
+    store->scan(BenchAppendWideRow, &wide);
+    MemIndex compact;
+    ZeroMemory(&compact, sizeof(compact));
+    compact.records.name = "bench";
+    compact.nextId = 1;
+    int maxId = 0;
+    for (int i = 0; i < wide.count; i++) {
+        BenchWideContact *c = &wide.rows[i];
+        MemIndexPut(&compact, c->id, c->name, c->phone, c->email);
+        if (c->id > maxId) maxId = c->id;
+    }
+    // a direct id table for the wide rows, so their lookups cost no more
+    // than the pointer chase
+    BenchWideContact **byId = (BenchWideContact **)calloc((size_t)maxId + 1, sizeof(*byId));
+    if (!byId) {
+        MemIndexClear(&compact);
+        free(wide.rows);
+        return 1;
+    }
+    for (int i = 0; i < wide.count; i++) byId[wide.rows[i].id] = &wide.rows[i];
+
+    int mismatches = 0;
+    for (int i = 0; i < wide.count; i++) {
+        const BenchWideContact *c = &wide.rows[i];
+        const MemContact *m = MemIndexFind(&compact, c->id);
+        MemRow row;
+        if (!m || strcmp(MemRowOf(m, &row)->name, c->name) || strcmp(row.phone, c->phone) ||
+            strcmp(row.email, c->email) || !c->sortKey || strcmp(MemSortKey(m), c->sortKey)) {
+            if (mismatches++ < 5) fprintf(stderr, "mem_compact_equivalence: id %d\n", c->id);
+        }
+    }
+
+    MemIndexStats m;
+    GetMemIndexStats(&compact, &m);
+    // the old index had the same id hash and name order over its structs
+    size_t wideBytes = wide.heapBytes + m.indexBytes;
+    size_t compactBytes = m.arenaBytes + m.indexBytes + m.domainBytes;
+    double n = wide.count ? (double)wide.count : 1.0;
+    char line[384];
+    snprintf(line, sizeof(line),
+             "{\"case\":\"mem_footprint\",\"store\":\"%s\",\"rows\":%d,\"wide_bytes_per_contact\":%.1f,"
+             "\"compact_bytes_per_contact\":%.1f,\"record_bytes_per_contact\":%.1f,\"domains\":%u}\n",
+             run->storeName, run->rows, (double)wideBytes / n, (double)compactBytes / n,
+             (double)m.recordBytes / n, m.domains);
+    fputs(line, stdout);
+    if (run->out) fputs(line, run->out);
+
+    // random ids, wide first: find the row and hand the three fields on
+    for (int pass = 0; pass < 2 && wide.count; pass++) {
+        OpStats s;
+        ZeroMemory(&s, sizeof(s));
+        unsigned seed = 12345;
+        size_t seen = 0;
+        LONGLONG start = BenchNow();
+        for (int batch = 0; batch < 20; batch++) {
+            LONGLONG t0 = BenchNow();
+            for (int i = 0; i < 10000; i++) {
+                seed = seed * 1103515245u + 12345u;
+                int id = wide.rows[(seed >> 8) % (unsigned)wide.count].id;
+                if (pass == 0) {
+                    const BenchWideContact *c = byId[id];
+                    BenchTouchRow(&seen, c->id, c->name, c->phone, c->email);
+                } else {
+                    MemRowFn(BenchTouchRow, &seen, MemIndexFind(&compact, id));
+                }
+            }
+            HistRecord(&s, TicksToNs(BenchNow() - t0));
+        }
+        benchSink += seen;
+        BenchReport(run, pass == 0 ? "mem_lookup_wide" : "mem_lookup_compact", &s, 20, BenchNow() - start);
+    }
+
+    // the search scan over every row, field by field; both must match the
+    // same rows
+    int *counts = (int *)calloc((size_t)termCount, sizeof(int));
+    for (int pass = 0; pass < 2 && counts; pass++) {
+        OpStats s;
+        ZeroMemory(&s, sizeof(s));
+        LONGLONG start = BenchNow();
+        for (int t = 0; t < termCount; t++) {
+            SearchNeedle *needle = SearchNeedleNew(terms[t]);
+            if (!needle) continue;
+            int found = 0;
+            LONGLONG t0 = BenchNow();
+            if (pass == 0) {
+                for (int i = 0; i < wide.count; i++) {
+                    const BenchWideContact *c = &wide.rows[i];
+                    if (FindNoCase((const unsigned char *)c->name, strlen(c->name), needle) ||
+                        PhoneMatches((const unsigned char *)c->phone, strlen(c->phone), needle) ||
+                        FindNoCase((const unsigned char *)c->email, strlen(c->email), needle)) {
+                        found++;
+                    }
+                }
+            } else {
+                for (size_t i = 0; i < compact.count; i++) {
+                    if (MemContactMatches(compact.byName[i], needle)) found++;
+                }
+            }
+            HistRecord(&s, TicksToNs(BenchNow() - t0));
+            free(needle);
+            if (pass == 0) counts[t] = found;
+            else if (found != counts[t]) {
+                fprintf(stderr, "mem_compact_equivalence: \"%s\" %d vs %d\n", terms[t], counts[t], found);
+                mismatches++;
+            }
+        }
+        BenchReport(run, pass == 0 ? "mem_scan_wide" : "mem_scan_compact", &s, termCount, BenchNow() - start);
+    }
+
+    for (int i = 0; i < wide.count; i++) {
+        free(wide.rows[i].name);
+        free(wide.rows[i].phone);
+        free(wide.rows[i].email);
+        free(wide.rows[i].sortKey);
+    }
+    free(wide.rows);
+    free(byId);
+    free(counts);
+    MemIndexClear(&compact);
+    BenchReportMismatches(run, "mem_compact_equivalence", mismatches);
+    return mismatches;
+}
+
+// UTF-8 -> UTF-16 for the list: Utf8ToUtf16 against MultiByteToWideChar on
+// the whole book and on the same rows with non-Latin names, then the cost
+// and memory of filling the visible-window cache page by page.
+static int BenchUtf16(const BenchRun *run) {
+    static const char *names[8] = {
+        "Иван Петров", "李小龙", "Søren Ågård", "Ελένη Παππά",
+        "محمد علي", "山田 太郎", "Nguyễn Văn An", "Zoë O'Brien",
+    };
+    DisplayRows sets[2];
+    ZeroMemory(sets, sizeof(sets));
+    store->scan(AppendDisplayRow, &sets[0]);
+    for (int i = 0; i < sets[0].count; i++) {
+        AppendDisplayRow(&sets[1], sets[0].ids[i], names[i % 8], DisplayField(&sets[0], i, 1), DisplayField(&sets[0], i, 2));
+    }
+    int mismatches = 0;
+    for (int set = 0; set < 2; set++) {
+        DisplayRows *rows = &sets[set];
+        WCHAR *fast = (WCHAR *)malloc((rows->used + 1) * sizeof(WCHAR));
+        WCHAR *win32 = (WCHAR *)malloc((rows->used + 1) * sizeof(WCHAR));
+        if (!fast || !win32 || rows->count == 0) {
+            free(fast);
+            free(win32);
+            continue;
+        }
+        LONGLONG elapsed[2] = { 0, 0 };
+        for (int pass = 0; pass < 3; pass++) {
+            size_t out = 0;
+            LONGLONG start = BenchNow();
+            for (int r = 0; r < rows->count; r++) {
+                for (int col = 0; col < 3; col++) {
+                    const char *s = DisplayField(rows, r, col);
+                    out += Utf8ToUtf16(s, strlen(s), fast + out) + 1;
+                }
+            }
+            elapsed[0] += BenchNow() - start;
+            out = 0;
+            start = BenchNow();
+            for (int r = 0; r < rows->count; r++) {
+                for (int col = 0; col < 3; col++) {
+                    out += MultiByteToWideChar(CP_UTF8, 0, DisplayField(rows, r, col), -1, win32 + out, (int)(rows->used + 1 - out));
+                }
+            }
+            elapsed[1] += BenchNow() - start;
+        }
+        size_t unitsFast = 0, unitsWin32 = 0;
+        for (int r = 0; r < rows->count; r++) {
+            for (int col = 0; col < 3; col++) {
+                const WCHAR *a = fast + unitsFast, *b = win32 + unitsWin32;
+                size_t na = 0, nb = 0;
+                while (a[na]) na++;
+                while (b[nb]) nb++;
+                if (na != nb || memcmp(a, b, na * sizeof(WCHAR)) != 0) mismatches++;
+                unitsFast += na + 1;
+                unitsWin32 += nb + 1;
+            }
+        }
+        double mb = 3.0 * (double)rows->used / 1e6;
+        double fastSeconds = (double)TicksToNs(elapsed[0]) / 1e9, win32Seconds = (double)TicksToNs(elapsed[1]) / 1e9;
+        char line[320];
+        snprintf(line, sizeof(line),
+                 "{\"case\":\"%s\",\"store\":\"%s\",\"rows\":%d,\"utf8_bytes\":%llu,"
+                 "\"fast_mb_per_sec\":%.1f,\"win32_mb_per_sec\":%.1f}\n",
+                 set == 0 ? "utf16_transcode_book" : "utf16_transcode_mixed", run->storeName, run->rows,
+                 (unsigned long long)rows->used, fastSeconds > 0 ? mb / fastSeconds : 0.0,
+                 win32Seconds > 0 ? mb / win32Seconds : 0.0);
+        fputs(line, stdout);
+        if (run->out) fputs(line, run->out);
+        free(fast);
+        free(win32);
+    }
+
+    // scroll through the book a page at a time, as LVN_ODCACHEHINT would
+    WideCache cache;
+    ZeroMemory(&cache, sizeof(cache));
+    OpStats s;
+    ZeroMemory(&s, sizeof(s));
+    unsigned long long pages = 0;
+    LONGLONG start = BenchNow();
+    for (int first = 0; first < sets[0].count; first += 40, pages++) {
+        LONGLONG t0 = BenchNow();
+        WideCacheFill(&cache, &sets[0], first, first + 39);
+        HistRecord(&s, TicksToNs(BenchNow() - t0));
+    }
+    BenchReport(run, "utf16_page_fill", &s, pages, BenchNow() - start);
+    char line[256];
+    snprintf(line, sizeof(line),
+             "{\"case\":\"utf16_cache\",\"store\":\"%s\",\"rows\":%d,\"cache_bytes\":%llu,\"full_list_bytes\":%llu,"
+             "\"utf8_rows_bytes\":%llu,\"mismatches\":%d}\n",
+             run->storeName, run->rows, (unsigned long long)cache.peakBytes,
+             (unsigned long long)(sets[0].used * sizeof(WCHAR)),
+             (unsigned long long)(sets[0].text.reserved + (size_t)sets[0].cap * (sizeof(int) + sizeof(*sets[0].fields))),
+             mismatches);
+    fputs(line, stdout);
+    if (run->out) fputs(line, run->out);
+    WideCacheFree(&cache);
+    DisplayRowsFree(&sets[0]);
+    DisplayRowsFree(&sets[1]);
+    return mismatches;
+}
+#endif
+
+// Search and insert with SQLite's default memory setup and with the tuned
+// one. SQLite is shut down and reconfigured in between, and left on the
+// default setup. The inserts are rolled back, so the book is unchanged.
+static int BenchSqliteMemory(const BenchRun *run, ContactGen *gen, char nameTerms[][32]) {
+    static const SqliteMemConfig *configs[2] = { &sqliteDefaultMem, &sqliteTunedMem };
+    static const char *searchCases[2] = { "sqlite_mem_default_search", "sqlite_mem_tuned_search" };
+    static const char *insertCases[2] = { "sqlite_mem_default_insert", "sqlite_mem_tuned_insert" };
+    char name[100], phone[24], email[100];
+    int rc = SQLITE_OK;
+    for (int mode = 0; mode < 3 && rc == SQLITE_OK; mode++) {
+        store->close();
+        sqlite3_shutdown();
+        rc = ConfigureSqliteMemory(configs[mode == 1]);
+        if (rc == SQLITE_OK) rc = store->open(BENCH_DB_FILE);
+        if (rc != SQLITE_OK || mode == 2) break;
+
+        OpStats s;
+        ZeroMemory(&s, sizeof(s));
+        LONGLONG start = BenchNow();
+        for (int pass = 0; pass < 3; pass++) {
+            for (int i = 0; i < BENCH_QUERIES; i++) {
+                int found = 0;
+                LONGLONG t0 = BenchNow();
+                store->search(nameTerms[i], BenchCountRow, &found);
+                HistRecord(&s, TicksToNs(BenchNow() - t0));
+            }
+        }
+        BenchReport(run, searchCases[mode], &s, 3 * BENCH_QUERIES, BenchNow() - start);
+
+        ZeroMemory(&s, sizeof(s));
+        start = BenchNow();
+        store->begin();
+        for (int i = 0; i < 20 * BENCH_OPS; i++) {
+            GenerateContact(gen, name, sizeof(name), phone, sizeof(phone), email, sizeof(email));
+            LONGLONG t0 = BenchNow();
+            store->insert(name, phone, email);
+            HistRecord(&s, TicksToNs(BenchNow() - t0));
+        }
+        store->rollback();
+        BenchReport(run, insertCases[mode], &s, 20 * BENCH_OPS, BenchNow() - start);
+
+        SqliteMemStats m;
+        GetSqliteMemStats(&m);
+        char line[384];
+        snprintf(line, sizeof(line),
+                 "{\"case\":\"sqlite_mem_%s\",\"store\":\"%s\",\"rows\":%d,\"memory_used\":%lld,\"memory_peak\":%lld,"
+                 "\"allocs\":%lld,\"pagecache_used\":%d,\"pagecache_slots\":%d,\"pagecache_overflow\":%lld,"
+                 "\"lookaside_hits\":%d,\"lookaside_misses\":%d}\n",
+                 mode ? "tuned" : "default", run->storeName, run->rows, m.used, m.peak, m.allocs,
+                 m.pageCacheUsed, m.pageCacheSlots, m.pageCacheOverflow, m.lookasideHits, m.lookasideMisses);
+        fputs(line, stdout);
+        if (run->out) fputs(line, run->out);
+    }
+    if (rc != SQLITE_OK) fprintf(stderr, "sqlite_mem: cannot reconfigure SQLite (%d)\n", rc);
+    return rc;
+}
+
+// Duplicate checking during an import. The rows are generated up front:
+// every tenth reuses a phone or email from the book (regenerated from the
+// populate seed) and one in fifty repeats a phone from earlier in the
+// import. Each pass inserts
+// them BENCH_BATCH_SIZE per transaction with no check, with the store's
+// lookup for every row, or with the Bloom filter in front of the lookup at
+// a few false-positive rates, skipping the rows found to be duplicates, and
+// deletes its rows again afterwards. The checked passes must skip the same
+// rows. The filter is also probed with keys that were never added, to
+// measure its false-positive rate against the target.
+#define BENCH_IMPORT_ROWS 5000
+#define BENCH_FPR_PROBES 200000
+
+typedef struct {
+    char name[100];
+    char phone[24];
+    char email[100];
+} BenchImportRow;
+
+static int BenchMaxId(void *ctx, int id, const char *name, const char *phone, const char *email) {
+    if (id > *(int *)ctx) *(int *)ctx = id;
+    return 0;
+}
+
+// mode 0: no check, 1: lookup only, 2: filter then lookup. Marks the rows
+// found to be duplicates in skipped and returns how many were inserted.
+static int BenchImport(const BenchImportRow *rows, int count, int mode, char *skipped) {
+    int maxId = 0, inserted = 0;
+    int rc = SQLITE_OK;
+    for (int done = 0; rc == SQLITE_OK && done < count; ) {
+        rc = store->begin();
+        for (int i = 0; rc == SQLITE_OK && i < BENCH_BATCH_SIZE && done < count; i++, done++) {
+            const BenchImportRow *r = &rows[done];
+            DupMatch m;
+            skipped[done] = mode && FindDuplicateContact(r->phone, r->email, &m);
+            if (skipped[done]) continue;
+            rc = store->insert(r->name, r->phone, r->email);
+            if (mode == 2) DupFilterAdd(&dupFilter, r->phone, r->email);
+            inserted++;
+        }
+        if (rc == SQLITE_OK) rc = store->commit();
+    }
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "dup import: %s\n", store->errmsg());
+        store->rollback();
+    }
+    // ids are handed out in order, so the pass added the newest ones
+    store->scan(BenchMaxId, &maxId);
+    store->begin();
+    for (int i = 0; i < inserted; i++) store->remove(maxId - i);
+    store->commit();
+    return inserted;
+}
+
+static BenchImportRow *BenchImportRows(unsigned long long seed, int dups, int count) {
+    BenchImportRow *rows = (BenchImportRow *)malloc(count * sizeof(BenchImportRow));
+    ContactGen *book = (ContactGen *)malloc(sizeof(ContactGen)), *fresh = (ContactGen *)malloc(sizeof(ContactGen));
+    if (!rows || !book || !fresh) {
+        free(rows); free(book); free(fresh);
+        return NULL;
+    }
+    ContactGenInit(book, seed, dups);
+    ContactGenInit(fresh, seed + 1, 0);
+    for (int i = 0; i < count; i++) {
+        BenchImportRow *r = &rows[i];
+        char email[100];
+        GenerateContact(fresh, r->name, sizeof(r->name), r->phone, sizeof(r->phone), email, sizeof(email));
+        // generated addresses repeat often; a tag keeps the new ones new
+        const char *at = strchr(email, '@');
+        snprintf(r->email, sizeof(r->email), "%.*s+import%d%s", (int)(at - email), email, i, at);
+        if (i % 50 == 25) snprintf(r->phone, sizeof(r->phone), "%s", rows[i - 7].phone);
+        if (i % 10 == 0) {
+            char name[100], phone[24], email[100];
+            GenerateContact(book, name, sizeof(name), phone, sizeof(phone), email, sizeof(email));
+            if (i % 20 == 0) snprintf(r->phone, sizeof(r->phone), "%s", phone);
+            else snprintf(r->email, sizeof(r->email), "%s", email);
+        }
+    }
+    free(book); free(fresh);
+    return rows;
+}
+
+static int BenchDupCheck(const BenchRun *run, unsigned long long seed, int dups) {
+    // without an index every lookup in the memory stores is a scan
+    int count = store == &sqliteStore ? BENCH_IMPORT_ROWS : BENCH_IMPORT_ROWS / 5;
+    BenchImportRow *rows = BenchImportRows(seed, dups, count);
+    char *skipped = (char *)malloc(count), *expected = (char *)malloc(count);
+    if (!rows || !skipped || !expected) {
+        free(rows); free(skipped); free(expected);
+        return 1;
+    }
+
+    static const double rates[] = { 0.1, 0.01, 0.001 };
+    char line[512];
+    int mismatches = 0;
+    for (int pass = 0; pass < 2 + COUNT_OF(rates); pass++) {
+        int mode = pass < 2 ? pass : 2;
+        double fpr = mode == 2 ? rates[pass - 2] : 0.0;
+        double buildMs = 0.0;
+        DupFilterFree(&dupFilter);
+        if (mode == 2) {
+            LONGLONG t0 = BenchNow();
+            DupFilterRebuild(&dupFilter, fpr);
+            buildMs = (double)TicksToNs(BenchNow() - t0) / 1e6;
+        }
+        ZeroMemory(&dupStats, sizeof(dupStats));
+        LONGLONG start = BenchNow();
+        int inserted = BenchImport(rows, count, mode, skipped);
+        double seconds = (double)TicksToNs(BenchNow() - start) / 1e9;
+
+        char name[48];
+        if (mode == 0) snprintf(name, sizeof(name), "import_no_check");
+        else if (mode == 1) snprintf(name, sizeof(name), "import_dup_lookup");
+        else snprintf(name, sizeof(name), "import_dup_filter_fpr%g", fpr);
+        snprintf(line, sizeof(line),
+                 "{\"case\":\"%s\",\"store\":\"%s\",\"rows\":%d,\"imported\":%d,\"inserted\":%d,\"seconds\":%.6f,"
+                 "\"rows_per_sec\":%.1f,\"ruled_out\":%llu,\"lookups\":%llu,\"false_positives\":%llu,"
+                 "\"filter_bytes\":%zu,\"filter_k\":%d,\"filter_build_ms\":%.3f}\n",
+                 name, run->storeName, run->rows, count, inserted, seconds, seconds > 0 ? (double)count / seconds : 0.0,
+                 dupStats.ruledOut, dupStats.lookups, dupStats.falsePositives,
+                 DupFilterBytes(&dupFilter), dupFilter.k, buildMs);
+        fputs(line, stdout);
+        if (run->out) fputs(line, run->out);
+
+        if (mode == 1) memcpy(expected, skipped, count);
+        if (mode == 2) {
+            for (int i = 0; i < count; i++) mismatches += skipped[i] != expected[i];
+
+            // keys that were never added: every hit is a false positive.
+            // Probed as built, then again once filled to the size it was
+            // built for, which is where the target applies.
+            int hits[2] = { 0, 0 };
+            size_t keys = dupFilter.keys;
+            char key[32];
+            for (int fill = 0; fill < 2; fill++) {
+                for (int i = 0; fill && dupFilter.keys < dupFilter.capacity; i++) {
+                    snprintf(key, sizeof(key), "filler-%d", i);
+                    DupFilterAdd(&dupFilter, key, "");
+                }
+                for (int i = 0; i < BENCH_FPR_PROBES; i++) {
+                    snprintf(key, sizeof(key), "probe-%d", i);
+                    hits[fill] += DupFilterTest(&dupFilter, DupHash(i & 1 ? 'p' : 'e', key));
+                }
+            }
+            snprintf(line, sizeof(line),
+                     "{\"case\":\"dup_filter_fpr\",\"store\":\"%s\",\"rows\":%d,\"target\":%g,\"keys\":%zu,"
+                     "\"measured\":%.5f,\"capacity\":%zu,\"measured_full\":%.5f,\"bits_per_key\":%.2f,\"k\":%d}\n",
+                     run->storeName, run->rows, fpr, keys, (double)hits[0] / BENCH_FPR_PROBES, dupFilter.capacity,
+                     (double)hits[1] / BENCH_FPR_PROBES, 8.0 * (double)DupFilterBytes(&dupFilter) / (double)dupFilter.capacity,
+                     dupFilter.k);
+            fputs(line, stdout);
+            if (run->out) fputs(line, run->out);
+        }
+    }
+    // the checks alone, as the Add dialog runs them on each keystroke
+    int checkFound[3] = { 0, 0, 0 };
+    for (int mode = 1; mode <= 2; mode++) {
+        DupFilterFree(&dupFilter);
+        if (mode == 2) DupFilterRebuild(&dupFilter, DUP_FPR_DEFAULT);
+        OpStats s;
+        ZeroMemory(&s, sizeof(s));
+        LONGLONG start = BenchNow();
+        for (int i = 0; i < count; i++) {
+            DupMatch m;
+            LONGLONG t0 = BenchNow();
+            checkFound[mode] += FindDuplicateContact(rows[i].phone, rows[i].email, &m);
+            HistRecord(&s, TicksToNs(BenchNow() - t0));
+        }
+        BenchReport(run, mode == 1 ? "dup_check_lookup" : "dup_check_filter", &s, (unsigned long long)count, BenchNow() - start);
+    }
+    mismatches += abs(checkFound[1] - checkFound[2]);
+
+    BenchReportMismatches(run, "dup_check_equivalence", mismatches);
+
+    DupFilterFree(&dupFilter);
+    ZeroMemory(&dupStats, sizeof(dupStats));
+    free(rows); free(skipped); free(expected);
+    return mismatches != 0;
+}
+
+// Upserting the import rows (see BenchDupCheck) into the book, as a lookup
+// then an update or insert from C against the store's single statement:
+// first an UPDATE ... FROM over the plain key indexes, then, with the keys
+// the book shares made distinct and the indexes unique, INSERT ... ON
+// CONFLICT. Each pass starts from the same rows and everything is rolled
+// back at the end. Pairs of passes must leave identical tables.
+typedef struct {
+    const char *name;
+    BOOL unique;
+    BOOL selectWrite;
+    MergeRules rules;
+} BenchUpsertPass;
+
+// Order-independent sum over the rows. Ids count only for the rows that
+// were there before the pass: ON CONFLICT DO UPDATE draws a new id from
+// the AUTOINCREMENT sequence before it finds the conflict, so rows
+// inserted after an update get higher ids than with the other upserts.
+typedef struct {
+    unsigned long long sum;
+    int oldMaxId;
+} BenchChecksum;
+
+static int BenchChecksumRow(void *ctx, int id, const char *name, const char *phone, const char *email) {
+    BenchChecksum *c = ctx;
+    unsigned long long h = 1469598103934665603ULL;
+    const char *fields[3] = { name, phone, email };
+    for (int f = 0; f < 3; f++) {
+        for (const char *p = fields[f]; *p; p++) h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+        h = (h ^ 0xff) * 1099511628211ULL;
+    }
+    c->sum += id <= c->oldMaxId ? h * (2 * (unsigned long long)id + 1) : h;
+    return 0;
+}
+
+// With unique keys, the phone of one contact and the email of another:
+// the phone's contact is updated and keeps its email, which the index
+// would refuse to share, and the other contact is left alone.
+static BOOL BenchSplitRow(const char *phone, int *id, char *email, size_t size) {
+    sqlite3_stmt *stmt = NULL;
+    BOOL found = FALSE;
+    if (sqlite3_prepare_v2(db, "SELECT id, email FROM contacts WHERE phone=?;", -1, &stmt, NULL) == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, phone, -1, SQLITE_STATIC);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            *id = sqlite3_column_int(stmt, 0);
+            snprintf(email, size, "%s", (const char *)sqlite3_column_text(stmt, 1));
+            found = TRUE;
+        }
+    }
+    sqlite3_finalize(stmt);
+    return found;
+}
+
+static int BenchUpsertSplitKeys(void) {
+    static const MergeRules rules = { MERGE_KEEP, MERGE_OVERWRITE, MERGE_OVERWRITE };
+    int rc = sqlite3_exec(db, "SAVEPOINT bench_split;", 0, 0, 0);
+    if (rc != SQLITE_OK) return 1;
+    int alice = 0, bob = 0, matched = 0;
+    char aliceEmail[128] = "", bobEmail[128] = "";
+    rc = store->insert("Alice", "+99 999 000 0001", "alice@split.example");
+    if (rc == SQLITE_OK) rc = store->insert("Bob", "+99 999 000 0002", "bob@split.example");
+    if (rc == SQLITE_OK) rc = store->upsert("Mix", "+99 999 000 0001", "bob@split.example", &rules, &matched);
+    int mismatches = rc != SQLITE_OK;
+    if (rc != SQLITE_OK) fprintf(stderr, "upsert split keys: %s\n", store->errmsg());
+    mismatches += !BenchSplitRow("+99 999 000 0001", &alice, aliceEmail, sizeof(aliceEmail)) ||
+                  !BenchSplitRow("+99 999 000 0002", &bob, bobEmail, sizeof(bobEmail));
+    mismatches += matched != alice || strcmp(aliceEmail, "alice@split.example") != 0 ||
+                  strcmp(bobEmail, "bob@split.example") != 0;
+    sqlite3_exec(db, "ROLLBACK TO bench_split; RELEASE bench_split;", 0, 0, 0);
+    return mismatches;
+}
+
+static int BenchUpsert(const BenchRun *run, unsigned long long seed, int dups) {
+    static const BenchUpsertPass passes[] = {
+        { "upsert_select_write", FALSE, TRUE, { MERGE_OVERWRITE, MERGE_FILL, MERGE_FILL } },
+        { "upsert_update_from", FALSE, FALSE, { MERGE_OVERWRITE, MERGE_FILL, MERGE_FILL } },
+        { "upsert_select_write_overwrite", FALSE, TRUE, { MERGE_KEEP, MERGE_OVERWRITE, MERGE_OVERWRITE } },
+        { "upsert_update_from_overwrite", FALSE, FALSE, { MERGE_KEEP, MERGE_OVERWRITE, MERGE_OVERWRITE } },
+        { "upsert_select_write_unique", TRUE, TRUE, { MERGE_OVERWRITE, MERGE_FILL, MERGE_FILL } },
+        { "upsert_on_conflict", TRUE, FALSE, { MERGE_OVERWRITE, MERGE_FILL, MERGE_FILL } },
+    };
+    int count = BENCH_IMPORT_ROWS;
+    BenchImportRow *rows = BenchImportRows(seed + 2, dups, count);
+    if (!rows) return 1;
+    char line[512];
+    int mismatches = 0;
+    unsigned long long sums[COUNT_OF(passes)];
+    int updated[COUNT_OF(passes)];
+
+    int rc = FlushWrites();
+    if (rc == SQLITE_OK) rc = store->begin();
+    for (int p = 0; rc == SQLITE_OK && p < (int)COUNT_OF(passes); p++) {
+        const BenchUpsertPass *pass = &passes[p];
+        if (pass->unique && !passes[p - 1].unique) {
+            // tag the fields of all but the lowest id with each key, the
+            // one an upsert would have matched, so the keys become distinct
+            int shared;
+            rc = sqlite3_exec(db,
+                "UPDATE contacts SET phone=phone||'#'||id WHERE id IN (SELECT id FROM contact_rows WHERE phone_key IS NOT NULL"
+                " AND id NOT IN (SELECT min(id) FROM contact_rows WHERE phone_key IS NOT NULL GROUP BY phone_key));"
+                "UPDATE contacts SET email='#'||id||email WHERE id IN (SELECT id FROM contact_rows WHERE email_key IS NOT NULL"
+                " AND id NOT IN (SELECT min(id) FROM contact_rows WHERE email_key IS NOT NULL GROUP BY email_key));",
+                0, 0, 0);
+            if (rc == SQLITE_OK) rc = SqliteSetUniqueKeys(TRUE, &shared);
+            if (rc != SQLITE_OK) break;
+        }
+        rc = sqlite3_exec(db, "SAVEPOINT bench_upsert;", 0, 0, 0);
+        if (rc != SQLITE_OK) break;
+
+        BenchChecksum sum = { 0, 0 };
+        store->scan(BenchMaxId, &sum.oldMaxId);
+        int inserted = 0;
+        updated[p] = 0;
+        LONGLONG start = BenchNow();
+        for (int i = 0; rc == SQLITE_OK && i < count; i++) {
+            const BenchImportRow *r = &rows[i];
+            int matchedId;
+            rc = pass->selectWrite ? UpsertByLookup(store, r->name, r->phone, r->email, &pass->rules, &matchedId)
+                                   : store->upsert(r->name, r->phone, r->email, &pass->rules, &matchedId);
+            if (matchedId) updated[p]++;
+            else inserted++;
+        }
+        double seconds = (double)TicksToNs(BenchNow() - start) / 1e9;
+        if (rc == SQLITE_OK) rc = store->scan(BenchChecksumRow, &sum);
+        sums[p] = sum.sum;
+        sqlite3_exec(db, "ROLLBACK TO bench_upsert; RELEASE bench_upsert;", 0, 0, 0);
+        if (rc != SQLITE_OK) break;
+
+        snprintf(line, sizeof(line),
+                 "{\"case\":\"%s\",\"store\":\"%s\",\"rows\":%d,\"upserted\":%d,\"inserted\":%d,\"updated\":%d,"
+                 "\"seconds\":%.6f,\"rows_per_sec\":%.1f}\n",
+                 pass->name, run->storeName, run->rows, count, inserted, updated[p], seconds,
+                 seconds > 0 ? (double)count / seconds : 0.0);
+        fputs(line, stdout);
+        if (run->out) fputs(line, run->out);
+        if (p % 2) mismatches += sums[p] != sums[p - 1] || updated[p] != updated[p - 1];
+    }
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "upsert: %s\n", store->errmsg());
+        mismatches++;
+    }
+    // the unique indexes are still in place until the rollback
+    int split = rc == SQLITE_OK ? BenchUpsertSplitKeys() : 1;
+    store->rollback();
+
+    BenchReportMismatches(run, "upsert_equivalence", mismatches);
+    BenchReportMismatches(run, "upsert_split_keys", split);
+    free(rows);
+    return mismatches != 0 || split != 0;
+}
+
+// Set-based bulk updates against the same rule applied row by row. Each
+// edit runs there and back, once starting with each path, so the book ends
+// as it began; after every pass the book's checksum must match the state
+// the edit should have produced, and both paths must count the same rows.
+typedef struct {
+    const char *name;
+    BOOL sql;
+    BulkEdit edit;
+} BenchBulkUpdatePass;
+
+static int BenchBulkUpdate(const BenchRun *run) {
+    static const BenchBulkUpdatePass passes[] = {
+        { "bulk_update_domain_rows", FALSE, { BULK_EDIT_DOMAIN, FIELD_EMAIL, "gmail.com", "newmail.example" } },
+        { "bulk_update_domain_sql_back", TRUE, { BULK_EDIT_DOMAIN, FIELD_EMAIL, "newmail.example", "gmail.com" } },
+        { "bulk_update_domain_sql", TRUE, { BULK_EDIT_DOMAIN, FIELD_EMAIL, "gmail.com", "newmail.example" } },
+        { "bulk_update_domain_rows_back", FALSE, { BULK_EDIT_DOMAIN, FIELD_EMAIL, "newmail.example", "gmail.com" } },
+        { "bulk_update_phone_rows", FALSE, { BULK_EDIT_REPLACE, FIELD_PHONE, "+1 ", "+01 " } },
+        { "bulk_update_phone_sql_back", TRUE, { BULK_EDIT_REPLACE, FIELD_PHONE, "+01 ", "+1 " } },
+        { "bulk_update_phone_sql", TRUE, { BULK_EDIT_REPLACE, FIELD_PHONE, "+1 ", "+01 " } },
+        { "bulk_update_phone_rows_back", FALSE, { BULK_EDIT_REPLACE, FIELD_PHONE, "+01 ", "+1 " } },
+    };
+    BOOL sqlite = store == &sqliteStore;
+    char line[512];
+    int mismatches = 0;
+    int rc = FlushWrites();
+    BenchChecksum before = { 0, INT_MAX }, edited = { 0, INT_MAX };
+    for (int p = 0; rc == SQLITE_OK && p < (int)COUNT_OF(passes); p++) {
+        const BenchBulkUpdatePass *pass = &passes[p];
+        if (pass->sql && !sqlite) continue;
+        if (p % 4 == 0) {
+            before.sum = 0;
+            rc = store->scan(BenchChecksumRow, &before);
+        }
+        int matched, counted = 0, skipped;
+        LONGLONG start = BenchNow();
+        if (rc == SQLITE_OK) {
+            rc = pass->sql ? BulkUpdateSqlite(&pass->edit, FALSE, NULL, NULL, &matched, &skipped)
+                           : BulkUpdateRows(&pass->edit, FALSE, NULL, NULL, &matched, &skipped);
+        }
+        double seconds = (double)TicksToNs(BenchNow() - start) / 1e9;
+        BenchChecksum sum = { 0, INT_MAX };
+        if (rc == SQLITE_OK) rc = store->scan(BenchChecksumRow, &sum);
+        if (p % 4 == 0) edited = sum;
+        else mismatches += sum.sum != (p % 2 ? before.sum : edited.sum);
 
-        switch (id) {
-        case IDC_ADD_CONTACT:
-        case IDM_CONTACT_ADD:
-            if (DialogBox(hInst, MAKEINTRESOURCE(IDD_ADD_CONTACT), hWnd, AddDlgProc) == IDOK) {
-                LoadContactsToListView(hListView, NULL);
-            }
-            break;
+        // the dry runs of both paths over the edited book
+        const BenchBulkUpdatePass *back = &passes[p | 1];
+        if (rc == SQLITE_OK && p % 2 == 0) rc = BulkUpdateRows(&back->edit, TRUE, NULL, NULL, &counted, &skipped);
+        if (rc == SQLITE_OK && p % 2 == 0) mismatches += counted != matched;
+        if (rc == SQLITE_OK && p % 2 == 0 && sqlite) rc = BulkUpdateSqlite(&back->edit, TRUE, NULL, NULL, &counted, &skipped);
+        if (rc == SQLITE_OK && p % 2 == 0) mismatches += counted != matched;
+        if (rc != SQLITE_OK) break;
 
-        case IDC_EDIT_CONTACT:
-        case IDM_CONTACT_EDIT: {
-            int idToEdit = GetSelectedContactId();
-            if (idToEdit != -1) {
-                if (DialogBoxParam(hInst, MAKEINTRESOURCE(IDD_EDIT_CONTACT), hWnd, EditDlgProc, (LPARAM)idToEdit) == IDOK) {
-                    LoadContactsToListView(hListView, NULL);
+        snprintf(line, sizeof(line),
+                 "{\"case\":\"%s\",\"store\":\"%s\",\"rows\":%d,\"updated\":%d,\"seconds\":%.6f,\"rows_per_sec\":%.1f}\n",
+                 pass->name, run->storeName, run->rows, matched, seconds, seconds > 0 ? (double)matched / seconds : 0.0);
+        fputs(line, stdout);
+        if (run->out) fputs(line, run->out);
+    }
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "bulk update: %s\n", store->errmsg());
+        mismatches++;
+    }
+
+    // edits that would write invalid values: a letter into phones is refused
+    // outright, and dropping the '@' from every email skips every row, on
+    // both paths, leaving the book as it was
+    static const BulkEdit badPhone = { BULK_EDIT_REPLACE, FIELD_PHONE, "5", "x" };
+    static const BulkEdit noAt = { BULK_EDIT_REPLACE, FIELD_EMAIL, "@", "" };
+    int invalid = 0, matched, skipped[2] = { 0, 0 };
+    invalid += BulkUpdate(&badPhone, TRUE, NULL, NULL, &matched, &skipped[0]) != SQLITE_MISUSE;
+    BenchChecksum sums[2] = { { 0, INT_MAX }, { 0, INT_MAX } };
+    rc = store->scan(BenchChecksumRow, &sums[0]);
+    if (rc == SQLITE_OK) rc = BulkUpdateRows(&noAt, FALSE, NULL, NULL, &matched, &skipped[0]);
+    invalid += rc == SQLITE_OK && (matched != 0 || skipped[0] == 0);
+    if (rc == SQLITE_OK && sqlite) rc = BulkUpdateSqlite(&noAt, FALSE, NULL, NULL, &matched, &skipped[1]);
+    invalid += rc == SQLITE_OK && sqlite && (matched != 0 || skipped[1] != skipped[0]);
+    if (rc == SQLITE_OK) rc = store->scan(BenchChecksumRow, &sums[1]);
+    invalid += rc != SQLITE_OK || sums[1].sum != sums[0].sum;
+    dupFilter.stale = TRUE;
+
+    BenchReportMismatches(run, "bulk_update_equivalence", mismatches);
+    BenchReportMismatches(run, "bulk_update_invalid", invalid);
+    return mismatches != 0 || invalid != 0;
+}
+
+// Empties the book: BENCH_OPS contacts deleted one transaction each, the way
+// the list deleted a selection before, then the rest through the bulk API.
+// Latency samples are per chunk. Destroys the book, so it runs last.
+
+typedef struct {
+    OpStats stats;
+    LONGLONG last;
+} BenchBulkClock;
+
+static BOOL BenchBulkChunk(void *ctx, int done, int total) {
+    BenchBulkClock *c = (BenchBulkClock *)ctx;
+    LONGLONG now = BenchNow();
+    HistRecord(&c->stats, TicksToNs(now - c->last));
+    c->last = now;
+    return TRUE;
+}
+
+static BOOL BenchBulkCancel(void *ctx, int done, int total) {
+    return FALSE;
+}
+
+static int BenchFirstWordRow(void *ctx, int id, const char *name, const char *phone, const char *email) {
+    sscanf(name, "%31s", (char *)ctx);
+    return 1;
+}
+
+static int BenchBulk(const BenchRun *run) {
+    BulkIds all;
+    ZeroMemory(&all, sizeof(all));
+    int rc = FlushWrites();
+    if (rc == SQLITE_OK) rc = store->scan(BulkCollectRow, &all);
+    if (rc == SQLITE_OK && all.nomem) rc = SQLITE_NOMEM;
+    int before = all.count;
+
+    OpStats s;
+    ZeroMemory(&s, sizeof(s));
+    int single = all.count < BENCH_OPS ? all.count : BENCH_OPS;
+    LONGLONG start = BenchNow();
+    for (int i = 0; rc == SQLITE_OK && i < single; i++) {
+        LONGLONG t0 = BenchNow();
+        rc = store->begin();
+        if (rc == SQLITE_OK) rc = store->remove(all.ids[i]);
+        if (rc == SQLITE_OK) rc = store->commit();
+        HistRecord(&s, TicksToNs(BenchNow() - t0));
+    }
+    if (rc == SQLITE_OK) BenchReport(run, "delete_per_row", &s, (unsigned long long)single, BenchNow() - start);
+
+    BenchBulkClock clock;
+    int *rest = all.ids + single, restCount = all.count - single;
+
+    // an edit cancelled after its first chunk leaves the book as it was
+    int undone = 0;
+    if (rc == SQLITE_OK && restCount) {
+        BenchChecksum was = { 0, INT_MAX }, now = { 0, INT_MAX };
+        rc = store->scan(BenchChecksumRow, &was);
+        int cancelled = SQLITE_OK;
+        if (rc == SQLITE_OK) cancelled = BulkSetField(rest, restCount, FIELD_EMAIL, "cancelled@example.com", BenchBulkCancel, NULL);
+        if (rc == SQLITE_OK) rc = store->scan(BenchChecksumRow, &now);
+        undone = cancelled != SQLITE_ABORT || was.sum != now.sum;
+        BenchReportMismatches(run, "bulk_rollback", undone);
+    }
+
+    if (rc == SQLITE_OK) {
+        ZeroMemory(&clock, sizeof(clock));
+        start = clock.last = BenchNow();
+        rc = BulkSetField(rest, restCount, FIELD_EMAIL, "bulk@example.com", BenchBulkChunk, &clock);
+        if (rc == SQLITE_OK) BenchReport(run, "bulk_set_field", &clock.stats, (unsigned long long)restCount, BenchNow() - start);
+    }
+
+    int filtered = 0;
+    char term[32] = "";
+    if (rc == SQLITE_OK && restCount) rc = store->get(rest[0], BenchFirstWordRow, term);
+    if (rc == SQLITE_OK && term[0]) {
+        ZeroMemory(&clock, sizeof(clock));
+        start = clock.last = BenchNow();
+        rc = BulkDeleteByFilter(term, BenchBulkChunk, &clock, &filtered);
+        if (rc == SQLITE_OK) BenchReport(run, "bulk_delete_filter", &clock.stats, (unsigned long long)filtered, BenchNow() - start);
+    }
+
+    // the ids the filter already deleted are skipped
+    if (rc == SQLITE_OK) {
+        ZeroMemory(&clock, sizeof(clock));
+        start = clock.last = BenchNow();
+        rc = BulkDelete(rest, restCount, BenchBulkChunk, &clock);
+        if (rc == SQLITE_OK) BenchReport(run, "bulk_delete", &clock.stats, (unsigned long long)(restCount - filtered), BenchNow() - start);
+    }
+
+    int remaining = 0;
+    if (rc == SQLITE_OK) rc = store->scan(BenchCountRow, &remaining);
+    if (rc != SQLITE_OK) fprintf(stderr, "bulk: %s\n", store->errmsg());
+    char line[256];
+    snprintf(line, sizeof(line), "{\"case\":\"bulk_equivalence\",\"store\":\"%s\",\"rows\":%d,\"deleted\":%d,\"remaining\":%d}\n",
+             run->storeName, run->rows, before, remaining);
+    fputs(line, stdout);
+    if (run->out) fputs(line, run->out);
+    BulkIdsFree(&all);
+    return rc != SQLITE_OK || remaining != 0 || undone;
+}
+
+#ifdef _WIN32
+// Write batching under concurrent producers: every combination of producer
+// threads, writeBatchWindowMs and writeBatchMaxOps queues BENCH_WRITE_OPS
+// adds through QueueWrite with the batch thread running, as the window does.
+// Latency is from queueing to the callback after the commit. Each case must
+// add exactly its rows. Runs after BenchBulk, on the emptied book.
+#define BENCH_WRITE_OPS 2048
+#define BENCH_WRITE_MAX_THREADS 8
+
+typedef struct {
+    char name[100];
+    char phone[24];
+    char email[100];
+    LONGLONG queued;
+    LONGLONG done;
+    int rc;
+} BenchWrite;
+
+typedef struct {
+    BenchWrite *writes;
+    int count;
+} BenchWriteSlice;
+
+static void BenchWriteDone(void *ctx, int rc, const char *errmsg) {
+    BenchWrite *w = (BenchWrite *)ctx;
+    w->rc = rc;
+    w->done = BenchNow();
+}
+
+static DWORD WINAPI BenchWriteProducer(LPVOID param) {
+    BenchWriteSlice *slice = (BenchWriteSlice *)param;
+    for (int i = 0; i < slice->count; i++) {
+        BenchWrite *w = &slice->writes[i];
+        w->queued = BenchNow();
+        QueueWrite(WRITE_ADD, 0, w->name, w->phone, w->email, NULL, BenchWriteDone, w);
+    }
+    return 0;
+}
+
+static int BenchWriteBatch(const BenchRun *run, ContactGen *gen) {
+    static const int threadCounts[] = { 1, 2, 4, BENCH_WRITE_MAX_THREADS };
+    static const UINT windows[] = { 0, 1, 2, 5 };
+    static const int maxOps[] = { 1, 16, WRITE_BATCH_MAX_OPS };
+    BenchWrite *writes = (BenchWrite *)calloc(BENCH_WRITE_OPS, sizeof(BenchWrite));
+    if (!writes) return 1;
+    UINT savedWindow = writeBatchWindowMs;
+    int savedMaxOps = writeBatchMaxOps;
+    int failed = 0;
+
+    int rows = 0;
+    int rc = FlushWrites();
+    if (rc == SQLITE_OK) rc = store->scan(BenchCountRow, &rows);
+    for (int t = 0; rc == SQLITE_OK && t < (int)COUNT_OF(threadCounts); t++) {
+        for (int w = 0; rc == SQLITE_OK && w < (int)COUNT_OF(windows); w++) {
+            for (int m = 0; rc == SQLITE_OK && m < (int)COUNT_OF(maxOps); m++) {
+                for (int i = 0; i < BENCH_WRITE_OPS; i++) {
+                    BenchWrite *bw = &writes[i];
+                    GenerateContact(gen, bw->name, sizeof(bw->name), bw->phone, sizeof(bw->phone), bw->email, sizeof(bw->email));
+                    bw->rc = -1;
+                }
+                writeBatchWindowMs = windows[w];
+                writeBatchMaxOps = maxOps[m];
+
+                int threads = threadCounts[t];
+                BenchWriteSlice slices[BENCH_WRITE_MAX_THREADS];
+                HANDLE handles[BENCH_WRITE_MAX_THREADS];
+                LONGLONG start = BenchNow();
+                StartWriteBatcher();
+                for (int i = 0; i < threads; i++) {
+                    slices[i].writes = writes + i * (BENCH_WRITE_OPS / threads);
+                    slices[i].count = BENCH_WRITE_OPS / threads;
+                    handles[i] = CreateThread(NULL, 0, BenchWriteProducer, &slices[i], 0, NULL);
+                    if (!handles[i]) BenchWriteProducer(&slices[i]);
+                }
+                for (int i = 0; i < threads; i++) {
+                    if (!handles[i]) continue;
+                    WaitForSingleObject(handles[i], INFINITE);
+                    CloseHandle(handles[i]);
+                }
+                rc = StopWriteBatcher();
+                LONGLONG elapsed = BenchNow() - start;
+
+                OpStats s;
+                ZeroMemory(&s, sizeof(s));
+                int errors = 0;
+                for (int i = 0; i < BENCH_WRITE_OPS; i++) {
+                    if (writes[i].rc != SQLITE_OK) errors++;
+                    else HistRecord(&s, TicksToNs(writes[i].done - writes[i].queued));
                 }
+                char name[64];
+                snprintf(name, sizeof(name), "write_batch_t%d_w%u_n%d", threads, windows[w], maxOps[m]);
+                BenchReport(run, name, &s, BENCH_WRITE_OPS, elapsed);
+
+                int after = 0;
+                if (rc == SQLITE_OK) rc = store->scan(BenchCountRow, &after);
+                failed += errors + abs(after - rows - BENCH_WRITE_OPS);
+                rows = after;
+            }
+        }
+    }
+    writeBatchWindowMs = savedWindow;
+    writeBatchMaxOps = savedMaxOps;
+    free(writes);
+    if (rc != SQLITE_OK) fprintf(stderr, "write batch: %s\n", store->errmsg());
+    BenchReportMismatches(run, "write_batch_rows", failed);
+    return rc != SQLITE_OK || failed != 0;
+}
+#endif
+
+// The log store against SQLite on files of their own, after the other
+// cases since the book is closed for them. Each store is filled with the
+// run's rows, then:
+//   <store>_recovery       reopen and load every row (the log replays it)
+//   log_recovery_torn      the same after appending half a record, as a
+//                          crash mid-write leaves it; the tail must go
+//   sqlite_recovery_hot_journal
+//                          the same from a copy taken mid-transaction,
+//                          with its journal, which SQLite rolls back
+//   <store>_upsert_sustained
+//                          upserts for BENCH_SUSTAINED_SECONDS,
+//                          BENCH_BATCH_SIZE per transaction, nine in ten
+//                          matching a row by phone and email; stalls such
+//                          as a log compaction show in the per-transaction
+//                          p99 and max
+// Every reopen must find the rows that were committed. The selected store
+// is reopened on the bench book afterwards.
+#define BENCH_RECOVERY_DB "bench_recovery.db"
+#define BENCH_RECOVERY_LOG "bench_recovery.log"
+#define BENCH_CRASH_DB "bench_crash.db"
+#define BENCH_SUSTAINED_SECONDS 3
+
+typedef struct {
+    BenchImportRow *rows;
+    int count;      // kept, up to cap
+    int cap;
+    int seen;
+    int marked;     // names ending in '#', written by the rolled back update
+} BenchKeys;
+
+static int BenchKeyRow(void *ctx, int id, const char *name, const char *phone, const char *email) {
+    BenchKeys *k = (BenchKeys *)ctx;
+    size_t len = strlen(name);
+    if (len && name[len - 1] == '#') k->marked++;
+    k->seen++;
+    if (k->count < k->cap) {
+        snprintf(k->rows[k->count].phone, sizeof(k->rows[k->count].phone), "%s", phone);
+        snprintf(k->rows[k->count].email, sizeof(k->rows[k->count].email), "%s", email);
+        k->count++;
+    }
+    return 0;
+}
+
+// Times opening path and reading every row; returns the row count, or -1.
+static int BenchReopen(const BenchRun *run, const char *name, const char *path, BenchKeys *keys) {
+    OpStats s;
+    ZeroMemory(&s, sizeof(s));
+    keys->count = keys->seen = keys->marked = 0;
+    LONGLONG start = BenchNow();
+    if (store->open(path) != SQLITE_OK) return -1;
+    int rc = store->scan(BenchKeyRow, keys);
+    HistRecord(&s, TicksToNs(BenchNow() - start));
+    if (rc != SQLITE_OK) return -1;
+    BenchReport(run, name, &s, (unsigned long long)keys->seen, BenchNow() - start);
+    return keys->seen;
+}
+
+static long long BenchFileSize(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return -1;
+    fseek(f, 0, SEEK_END);
+    long long size = ftell(f);
+    fclose(f);
+    return size;
+}
+
+// Appends the first half of a record, cut off inside its strings.
+static BOOL BenchTearLog(const char *path) {
+    FILE *f = fopen(path, "ab");
+    if (!f) return FALSE;
+    LogRecordHeader hdr;
+    ZeroMemory(&hdr, sizeof(hdr));
+    hdr.op = LOG_OP_PUT;
+    hdr.nameLen = 20;
+    hdr.phoneLen = 12;
+    hdr.emailLen = 24;
+    hdr.id = INT_MAX;
+    BOOL ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 && fwrite("Torn Record", 1, 11, f) == 11;
+    return fclose(f) == 0 && ok;
+}
+
+// Leaves a copy of path as a crash mid-transaction would: every name is
+// rewritten with a cache too small to hold the change, so pages spill to
+// the file before the copy, and the journal is copied alongside.
+static BOOL BenchCrashCopy(const char *path, const char *copy) {
+    char journal[MAX_PATH], copyJournal[MAX_PATH];
+    snprintf(journal, sizeof(journal), "%s-journal", path);
+    snprintf(copyJournal, sizeof(copyJournal), "%s-journal", copy);
+    BOOL ok = sqlite3_exec(db, "PRAGMA cache_size=8; BEGIN; UPDATE contact_rows SET name=name||'#';", 0, 0, 0) == SQLITE_OK &&
+              CopyFileA(path, copy, FALSE) && CopyFileA(journal, copyJournal, FALSE);
+    sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+    return ok;
+}
+
+static int BenchLogStore(const BenchRun *selectedRun, ContactGen *gen) {
+    static const ContactStore *stores[2] = { &logStore, &sqliteStore };
+    const ContactStore *selected = store;
+    BenchKeys keys;
+    ZeroMemory(&keys, sizeof(keys));
+    keys.cap = selectedRun->rows;
+    keys.rows = (BenchImportRow *)malloc((size_t)keys.cap * sizeof(BenchImportRow));
+    if (!keys.rows) return 1;
+    int mismatches = 0;
+    char name[100], phone[24], email[100], caseName[64];
+
+    FlushWrites();
+    store->close();
+    for (int i = 0; i < 2; i++) {
+        BenchRun run = *selectedRun;
+        run.storeName = stores[i]->name;
+        const char *prefix = stores[i]->name;
+        DeleteFileA(BENCH_RECOVERY_DB);
+        DeleteFileA(BENCH_RECOVERY_LOG);
+        DeleteFileA(BENCH_CRASH_DB);
+        DeleteFileA(BENCH_CRASH_DB "-journal");
+        logFilePath = BENCH_RECOVERY_LOG;
+        store = stores[i];
+        int rc = store->open(BENCH_RECOVERY_DB);
+        if (rc == SQLITE_OK) {
+            rc = BenchPopulate(gen, run.rows, NULL);
+            store->close();
+        }
+        int expected = run.rows;
+        if (rc == SQLITE_OK) {
+            snprintf(caseName, sizeof(caseName), "%s_recovery", prefix);
+            mismatches += BenchReopen(&run, caseName, BENCH_RECOVERY_DB, &keys) != expected;
+
+            const char *crashPath = BENCH_RECOVERY_DB;
+            if (store == &logStore) {
+                store->close();
+                if (!BenchTearLog(BENCH_RECOVERY_LOG)) mismatches++;
+                snprintf(caseName, sizeof(caseName), "%s_recovery_torn", prefix);
             } else {
-                MessageBox(hWnd, "Please select a contact first.", "Info", MB_OK | MB_ICONINFORMATION);
+                if (!BenchCrashCopy(BENCH_RECOVERY_DB, BENCH_CRASH_DB)) mismatches++;
+                store->close();
+                crashPath = BENCH_CRASH_DB;
+                snprintf(caseName, sizeof(caseName), "%s_recovery_hot_journal", prefix);
+            }
+            mismatches += BenchReopen(&run, caseName, crashPath, &keys) != expected || keys.marked != 0;
+            // the torn tail is gone from the file, not just skipped
+            if (store == &logStore) mismatches += BenchFileSize(BENCH_RECOVERY_LOG) != logTotalBytes;
+            if (store == &sqliteStore) {
+                store->close();
+                rc = store->open(BENCH_RECOVERY_DB);
             }
-            break;
         }
-        
-        case IDC_DELETE_CONTACT:
-        case IDM_CONTACT_DEL: {
-            int idToDelete = GetSelectedContactId();
-            if (idToDelete != -1) {
-                if (MessageBoxA(hWnd, "Delete selected contact?", "Confirm", MB_YESNO | MB_ICONQUESTION) == IDYES) {
-                    DeleteContact(idToDelete);
-                    LoadContactsToListView(hListView, NULL);
+
+        OpStats s;
+        ZeroMemory(&s, sizeof(s));
+        int inserted = 0, done = 0;
+        LONGLONG start = BenchNow();
+        while (rc == SQLITE_OK && TicksToNs(BenchNow() - start) < BENCH_SUSTAINED_SECONDS * 1000000000ULL) {
+            LONGLONG t0 = BenchNow();
+            rc = store->begin();
+            for (int j = 0; rc == SQLITE_OK && j < BENCH_BATCH_SIZE; j++) {
+                GenerateContact(gen, name, sizeof(name), phone, sizeof(phone), email, sizeof(email));
+                if (j % 10 && keys.count) {
+                    const BenchImportRow *k = &keys.rows[RngBelow(&gen->rng, keys.count)];
+                    snprintf(phone, sizeof(phone), "%s", k->phone);
+                    snprintf(email, sizeof(email), "%s", k->email);
                 }
-            } else {
-                MessageBox(hWnd, "Please select a contact first.", "Info", MB_OK | MB_ICONINFORMATION);
+                int matchedId;
+                rc = store->upsert(name, phone, email, &defaultMergeRules, &matchedId);
+                if (!matchedId) inserted++;
             }
-            break;
+            if (rc == SQLITE_OK) rc = store->commit();
+            else store->rollback();
+            HistRecord(&s, TicksToNs(BenchNow() - t0));
+            done += BENCH_BATCH_SIZE;
         }
+        if (rc == SQLITE_OK) {
+            snprintf(caseName, sizeof(caseName), "%s_upsert_sustained", prefix);
+            BenchReport(&run, caseName, &s, (unsigned long long)done, BenchNow() - start);
 
-        case IDC_SEARCH_BTN:
-        case IDM_CONTACT_SEARCH: {
-            char search[200] = {0};
-            GetWindowTextA(hSearchEdit, search, sizeof(search));
-            if (strcmp(search, SEARCH_PLACEHOLDER) == 0) search[0] = '\0';
-            LoadContactsToListView(hListView, search);
-            break;
+            // and what was committed survives a reopen
+            store->close();
+            int rows = 0;
+            rc = store->open(BENCH_RECOVERY_DB);
+            if (rc == SQLITE_OK) rc = store->scan(BenchCountRow, &rows);
+            mismatches += rows != expected + inserted;
         }
-        
-        case IDM_CONTACT_VIEW: // Explicitly load all (Clear filter)
-            SetWindowTextA(hSearchEdit, SEARCH_PLACEHOLDER);
-            LoadContactsToListView(hListView, NULL);
-            break;
+        if (rc != SQLITE_OK) {
+            fprintf(stderr, "%s recovery: %s\n", prefix, store->errmsg());
+            mismatches++;
+        }
+        store->close();
+    }
+    DeleteFileA(BENCH_RECOVERY_DB);
+    DeleteFileA(BENCH_RECOVERY_LOG);
+    DeleteFileA(BENCH_CRASH_DB);
+    DeleteFileA(BENCH_CRASH_DB "-journal");
+    free(keys.rows);
 
-        case IDM_FILE_EXIT:
-            DestroyWindow(hWnd);
-            break;
-        } 
-        break;
-    } 
+    logFilePath = BENCH_LOG_FILE;
+    store = selected;
+    if (store->open(BENCH_DB_FILE) != SQLITE_OK) mismatches++;
+    BenchReportMismatches(selectedRun, "log_recovery_equivalence", mismatches);
+    return mismatches != 0;
+}
 
-    case WM_NOTIFY: {
-        LPNMHDR lpnmhdr = (LPNMHDR)lParam;
-        if (lpnmhdr->code == NM_DBLCLK) {
-            if (lpnmhdr->idFrom == IDC_LISTVIEW) {
-                // Double-click to Edit
-                SendMessage(hWnd, WM_COMMAND, (WPARAM)IDC_EDIT_CONTACT, 0);
-                return TRUE;
+// Statistics and tracing overhead: the name searches with both off, then
+// with both on and every search recorded, as the UI does. After a warm-up
+// the passes run in pairs, which one goes first alternating, and the median
+// of the pairs' ratios is the overhead, so drift and one-off stalls cancel
+// out. It must stay under BENCH_STATS_MAX_PCT.
+#define BENCH_STATS_ROUNDS 15
+#define BENCH_STATS_MAX_PCT 2.0
+
+static LONGLONG BenchStatsPass(char terms[][32], BOOL stats) {
+    statsEnabled = traceEnabled = stats;
+    LONGLONG start = BenchNow();
+    for (int i = 0; i < BENCH_QUERIES; i++) {
+        int found = 0;
+        if (!stats) {
+            store->search(terms[i], BenchCountRow, &found);
+            continue;
+        }
+        LONGLONG t0 = OpStart();
+        LONGLONG span = TraceBegin();
+        store->search(terms[i], BenchCountRow, &found);
+        TraceEnd("bench.search", span);
+        OpEnd(OP_SEARCH, t0, lastRowsScanned, (unsigned long long)found);
+    }
+    LONGLONG elapsed = BenchNow() - start;
+    statsEnabled = traceEnabled = TRUE;
+    return elapsed;
+}
+
+static double BenchMedian(double *v, int n) {
+    for (int i = 1; i < n; i++) {
+        double x = v[i];
+        int j = i;
+        for (; j > 0 && v[j - 1] > x; j--) v[j] = v[j - 1];
+        v[j] = x;
+    }
+    return v[n / 2];
+}
+
+static int BenchStatsOverhead(const BenchRun *run, char terms[][32]) {
+    double off[BENCH_STATS_ROUNDS], on[BENCH_STATS_ROUNDS], ratio[BENCH_STATS_ROUNDS];
+    BenchStatsPass(terms, FALSE);
+    BenchStatsPass(terms, TRUE);
+    for (int r = 0; r < BENCH_STATS_ROUNDS; r++) {
+        if (r % 2) {
+            on[r] = (double)TicksToNs(BenchStatsPass(terms, TRUE)) / 1e6;
+            off[r] = (double)TicksToNs(BenchStatsPass(terms, FALSE)) / 1e6;
+        } else {
+            off[r] = (double)TicksToNs(BenchStatsPass(terms, FALSE)) / 1e6;
+            on[r] = (double)TicksToNs(BenchStatsPass(terms, TRUE)) / 1e6;
+        }
+        ratio[r] = off[r] > 0 ? on[r] / off[r] : 1.0;
+    }
+    double pct = 100.0 * (BenchMedian(ratio, BENCH_STATS_ROUNDS) - 1.0);
+    char line[320];
+    snprintf(line, sizeof(line),
+             "{\"case\":\"stats_overhead\",\"store\":\"%s\",\"rows\":%d,\"rounds\":%d,\"off_median_ms\":%.3f,"
+             "\"on_median_ms\":%.3f,\"overhead_pct\":%.2f,\"max_pct\":%.1f}\n",
+             run->storeName, run->rows, BENCH_STATS_ROUNDS, BenchMedian(off, BENCH_STATS_ROUNDS),
+             BenchMedian(on, BENCH_STATS_ROUNDS), pct, BENCH_STATS_MAX_PCT);
+    fputs(line, stdout);
+    if (run->out) fputs(line, run->out);
+    if (pct > BENCH_STATS_MAX_PCT) fprintf(stderr, "stats_overhead: %.2f%% is over %.1f%%\n", pct, BENCH_STATS_MAX_PCT);
+    return pct > BENCH_STATS_MAX_PCT;
+}
+
+static int CommandGenerate(const char *args) {
+    const char *v;
+    int rows = (v = ArgValue(args, "--rows=")) ? atoi(v) : 10000;
+    int dups = (v = ArgValue(args, "--dups=")) ? atoi(v) : 0;
+    unsigned long long seed = (v = ArgValue(args, "--seed=")) ? strtoull(v, NULL, 10) : 1;
+    char path[MAX_PATH] = BENCH_DB_FILE;
+    if ((v = ArgValue(args, "--db=")) != NULL) sscanf(v, "%259s", path);
+
+    store = &sqliteStore;
+    if (store->open(path) != SQLITE_OK) return 1;
+    ContactGen *gen = (ContactGen *)malloc(sizeof(ContactGen));
+    if (!gen) return 1;
+    ContactGenInit(gen, seed, dups);
+    int rc = BenchPopulate(gen, rows, NULL);
+    free(gen);
+    store->close();
+    store = NULL;
+    printf("generated %d contacts in %s\n", rows, path);
+    return rc == SQLITE_OK ? 0 : 1;
+}
+
+// Ends a single-write transaction: commits it, or rolls it back if the
+// write or the commit failed. Prints the error for the case.
+static int BenchWriteEnd(const char *name, int rc) {
+    if (rc == SQLITE_OK) rc = store->commit();
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "%s: %s\n", name, store->errmsg());
+        store->rollback();
+    }
+    return rc;
+}
+
+// The suite, on the selected store opened on an empty book. Returns the
+// exit code; a failed write stops it, since later cases depend on the book.
+static int BenchSuite(BenchRun *run, ContactGen *gen, unsigned long long seed, int dups) {
+    const ContactStore *selected = store;
+    int rc = 0;
+    OpStats s;
+    ZeroMemory(&s, sizeof(s));
+    LONGLONG start = BenchNow();
+    if (BenchPopulate(gen, run->rows, &s) != SQLITE_OK) {
+        fprintf(stderr, "batch_insert: %s\n", store->errmsg());
+        return 1;
+    }
+    BenchReport(run, "batch_insert", &s, (unsigned long long)run->rows, BenchNow() - start);
+
+    char name[100], phone[24], email[100];
+    int writeRc = SQLITE_OK;
+    ZeroMemory(&s, sizeof(s));
+    start = BenchNow();
+    for (int i = 0; writeRc == SQLITE_OK && i < BENCH_OPS; i++) {
+        GenerateContact(gen, name, sizeof(name), phone, sizeof(phone), email, sizeof(email));
+        LONGLONG t0 = BenchNow();
+        writeRc = store->begin();
+        if (writeRc == SQLITE_OK) writeRc = store->insert(name, phone, email);
+        writeRc = BenchWriteEnd("insert", writeRc);
+        HistRecord(&s, TicksToNs(BenchNow() - t0));
+    }
+    if (writeRc != SQLITE_OK) return 1;
+    BenchReport(run, "insert", &s, BENCH_OPS, BenchNow() - start);
+
+    ZeroMemory(&s, sizeof(s));
+    start = BenchNow();
+    for (int i = 0; writeRc == SQLITE_OK && i < BENCH_OPS; i++) {
+        GenerateContact(gen, name, sizeof(name), phone, sizeof(phone), email, sizeof(email));
+        int id = 1 + RngBelow(&gen->rng, run->rows);
+        LONGLONG t0 = BenchNow();
+        writeRc = store->begin();
+        if (writeRc == SQLITE_OK) writeRc = store->update(id, name, phone, email);
+        writeRc = BenchWriteEnd("update", writeRc);
+        HistRecord(&s, TicksToNs(BenchNow() - t0));
+    }
+    if (writeRc != SQLITE_OK) return 1;
+    BenchReport(run, "update", &s, BENCH_OPS, BenchNow() - start);
+
+    // delete the rows added by the insert case so the book size is unchanged
+    ZeroMemory(&s, sizeof(s));
+    start = BenchNow();
+    for (int i = 0; writeRc == SQLITE_OK && i < BENCH_OPS; i++) {
+        LONGLONG t0 = BenchNow();
+        writeRc = store->begin();
+        if (writeRc == SQLITE_OK) writeRc = store->remove(run->rows + 1 + i);
+        writeRc = BenchWriteEnd("delete", writeRc);
+        HistRecord(&s, TicksToNs(BenchNow() - t0));
+    }
+    if (writeRc != SQLITE_OK) return 1;
+    BenchReport(run, "delete", &s, BENCH_OPS, BenchNow() - start);
+
+    ZeroMemory(&s, sizeof(s));
+    start = BenchNow();
+    for (int i = 0; i < 100; i++) {
+        int seen = 0;
+        LONGLONG t0 = BenchNow();
+        store->scan(BenchFirstPageRow, &seen);
+        HistRecord(&s, TicksToNs(BenchNow() - t0));
+    }
+    BenchReport(run, "list_first_page", &s, 100, BenchNow() - start);
+
+    ZeroMemory(&s, sizeof(s));
+    start = BenchNow();
+    for (int i = 0; i < 3; i++) {
+        int seen = 0;
+        LONGLONG t0 = BenchNow();
+        store->scan(BenchCountRow, &seen);
+        HistRecord(&s, TicksToNs(BenchNow() - t0));
+    }
+    BenchReport(run, "list_full", &s, 3, BenchNow() - start);
+
+    char nameTerms[BENCH_QUERIES][32], phoneTerms[BENCH_QUERIES][32], emailTerms[BENCH_QUERIES][32];
+    BenchSearchTerms(gen, nameTerms, phoneTerms, emailTerms);
+    BenchSearch(run, "search_name", nameTerms, BENCH_QUERIES);
+    BenchSearch(run, "search_phone", phoneTerms, BENCH_QUERIES);
+    BenchSearch(run, "search_email", emailTerms, BENCH_QUERIES);
+
+    // top-K by relevance, for the same terms and for one-letter terms that
+    // match nearly every row
+    char broadTerms[BENCH_QUERIES][32];
+    for (int i = 0; i < BENCH_QUERIES; i++) snprintf(broadTerms[i], sizeof(broadTerms[i]), "%c", "aeiou"[i % 5]);
+    BenchRank(run, "rank_top50_name", nameTerms, BENCH_QUERIES);
+    BenchRank(run, "rank_top50_broad", broadTerms, BENCH_QUERIES);
+    if (BenchQuery(run, nameTerms, phoneTerms, emailTerms) != 0) rc = 1;
+    if (BenchPhoneQueries(run) != 0) rc = 1;
+#ifdef _WIN32
+    BenchArena(run);
+    if (BenchCompactRows(run, nameTerms, BENCH_QUERIES) != 0) rc = 1;
+    if (BenchUtf16(run) != 0) rc = 1;
+#endif
+    if (BenchDupCheck(run, seed, dups) != 0) rc = 1;
+    // the other stores have no upsert of their own to compare
+    if (selected == &sqliteStore && BenchUpsert(run, seed, dups) != 0) rc = 1;
+
+    // the search filter with the custom functions against the LIKE clause it replaced
+    if (selected == &sqliteStore) {
+        static const char *likeSql =
+            "SELECT count(*) FROM contacts WHERE name LIKE ?1 OR phone LIKE ?1 OR email LIKE ?1;";
+        BenchFilterSql(run, "filter_like_name", likeSql, TRUE, nameTerms, BENCH_QUERIES);
+        BenchFilterSql(run, "filter_functions_name", benchFunctionSql, FALSE, nameTerms, BENCH_QUERIES);
+        BenchFilterSql(run, "filter_like_phone", likeSql, TRUE, phoneTerms, BENCH_QUERIES);
+        BenchFilterSql(run, "filter_functions_phone", benchFunctionSql, FALSE, phoneTerms, BENCH_QUERIES);
+
+        // contacts_search: the first query builds the index, then the join
+        // runs against the same baselines and must return the same counts
+        ZeroMemory(&s, sizeof(s));
+        start = BenchNow();
+        sqlite3_exec(db, "SELECT count(*) FROM contacts_search('zzzz');", NULL, NULL, NULL);
+        HistRecord(&s, TicksToNs(BenchNow() - start));
+        BenchReport(run, "search_index_build", &s, 1, BenchNow() - start);
+        BenchFilterSql(run, "filter_vtab_name", benchVtabSql, FALSE, nameTerms, BENCH_QUERIES);
+        BenchFilterSql(run, "filter_vtab_phone", benchVtabSql, FALSE, phoneTerms, BENCH_QUERIES);
+        if (BenchCompareCounts(run, "search_index_equivalence", benchFunctionSql, benchVtabSql, nameTerms, phoneTerms, emailTerms) != 0) {
+            rc = 1;
+        }
+        if (BenchSort(run) != 0) rc = 1;
+        if (BenchDomains(run) != 0) rc = 1;
+        if (BenchSqliteMemory(run, gen, nameTerms) != SQLITE_OK) rc = 1;
+    }
+
+    if (BenchStatsOverhead(run, nameTerms) != 0) rc = 1;
+
+    // reopen and time until the first page is available
+    store->close();
+    ZeroMemory(&s, sizeof(s));
+    start = BenchNow();
+    if (store->open(BENCH_DB_FILE) != SQLITE_OK) {
+        fprintf(stderr, "startup_first_page: %s\n", store->errmsg());
+        return 1;
+    }
+    int seen = 0;
+    store->scan(BenchFirstPageRow, &seen);
+    HistRecord(&s, TicksToNs(BenchNow() - start));
+    BenchReport(run, "startup_first_page", &s, 1, BenchNow() - start);
+
+    if (BenchValidate(run, gen, TRUE) != 0) rc = 1;
+
+    // the memory store came back from the startup case empty
+    seen = 0;
+    store->scan(BenchCountRow, &seen);
+    if (!seen && BenchPopulate(gen, run->rows, NULL) != SQLITE_OK) rc = 1;
+    if (BenchBulkUpdate(run) != 0) rc = 1;
+    if (BenchBulk(run) != 0) rc = 1;
+#ifdef _WIN32
+    if (BenchWriteBatch(run, gen) != 0) rc = 1;
+#endif
+    if (BenchLogStore(run, gen) != 0) rc = 1;
+    return rc;
+}
+
+static int CommandBench(const char *args) {
+    const char *v;
+    BenchRun run;
+    run.rows = (v = ArgValue(args, "--rows=")) ? atoi(v) : 10000;
+    int dups = (v = ArgValue(args, "--dups=")) ? atoi(v) : 0;
+    unsigned long long seed = (v = ArgValue(args, "--seed=")) ? strtoull(v, NULL, 10) : 1;
+    run.out = NULL;
+    if ((v = ArgValue(args, "--out=")) != NULL) {
+        char path[MAX_PATH];
+        if (sscanf(v, "%259s", path) == 1) run.out = fopen(path, "a");
+    }
+
+    const ContactStore *selected = &sqliteStore;
+    if (args && strstr(args, "--store=memory")) selected = &memoryStore;
+    if (args && strstr(args, "--store=log")) selected = &logStore;
+    run.storeName = selected->name;
+
+    // always start from an empty book
+    DeleteFileA(BENCH_DB_FILE);
+    DeleteFileA(BENCH_LOG_FILE);
+    logFilePath = BENCH_LOG_FILE;
+    store = selected;
+    ContactGen *gen = (ContactGen *)malloc(sizeof(ContactGen));
+    int rc = 1;
+    if (!gen) {
+        fprintf(stderr, "bench: out of memory\n");
+    } else if (store->open(BENCH_DB_FILE) != SQLITE_OK) {
+        fprintf(stderr, "bench: %s\n", store->errmsg());
+    } else {
+        ContactGenInit(gen, seed, dups);
+        rc = BenchSuite(&run, gen, seed, dups);
+    }
+
+    store->close();
+    store = NULL;
+    logFilePath = LOG_FILE;
+    free(gen);
+    if (run.out) fclose(run.out);
+    return rc;
+}
+
+// "check" runs only the bench's equivalence cases, untimed, on a fresh
+// SQLite book, and exits nonzero if any of them disagree. It is built
+// without Win32 too:
+//
+//   contact_manager check --rows=5000 --seed=3
+static int CommandCheck(const char *args) {
+    const char *v;
+    BenchRun run;
+    run.storeName = sqliteStore.name;
+    run.rows = (v = ArgValue(args, "--rows=")) ? atoi(v) : 2000;
+    run.out = NULL;
+    unsigned long long seed = (v = ArgValue(args, "--seed=")) ? strtoull(v, NULL, 10) : 1;
+
+    DeleteFileA(BENCH_DB_FILE);
+    store = &sqliteStore;
+    ContactGen *gen = (ContactGen *)malloc(sizeof(ContactGen));
+    int rc = gen ? store->open(BENCH_DB_FILE) : SQLITE_NOMEM;
+    if (gen) ContactGenInit(gen, seed, 0);
+    if (rc == SQLITE_OK) rc = BenchPopulate(gen, run.rows, NULL);
+    int failed = rc != SQLITE_OK;
+    if (rc == SQLITE_OK) {
+        char nameTerms[BENCH_QUERIES][32], phoneTerms[BENCH_QUERIES][32], emailTerms[BENCH_QUERIES][32];
+        BenchSearchTerms(gen, nameTerms, phoneTerms, emailTerms);
+        if (BenchCompareCounts(&run, "search_index_equivalence", benchFunctionSql, benchVtabSql,
+                               nameTerms, phoneTerms, emailTerms) != 0) {
+            failed = 1;
+        }
+        if (BenchValidate(&run, gen, FALSE) != 0) failed = 1;
+    } else {
+        fprintf(stderr, "check: %s\n", store->errmsg());
+    }
+    store->close();
+    store = NULL;
+    free(gen);
+    return failed;
+}
+
+#ifdef _WIN32
+// --- Command Line ---
+// "contact_manager.exe stats", "bench", "check", "generate", "replay", "sql", "query", "unique-keys" and "bulk-update" run
+// without a window and print to the console they were started from.
+
+static void AttachParentConsole(void) {
+    if (AttachConsole(ATTACH_PARENT_PROCESS)) {
+        freopen("CONOUT$", "w", stdout);
+        freopen("CONOUT$", "w", stderr);
+    }
+}
+
+// Prints the metrics saved by the last interactive session.
+static int CommandStats(void) {
+    FILE *f = fopen(METRICS_FILE, "r");
+    if (!f) {
+        fprintf(stderr, "No statistics recorded yet (%s not found).\n", METRICS_FILE);
+        return 1;
+    }
+    char line[512];
+    while (fgets(line, sizeof(line), f)) fputs(line, stdout);
+    fclose(f);
+    return 0;
+}
+
+// Runs ad-hoc SQL, with contacts_search and the search functions available,
+// and prints the rows tab-separated:
+//
+//   contact_manager.exe sql --db=contacts.db "SELECT c.name FROM contacts c JOIN contacts_search('acme') USING(id)"
+static int CommandSql(const char *args) {
+    const char *v;
+    char path[MAX_PATH] = DB_FILE;
+    if ((v = ArgValue(args, "--db=")) != NULL) {
+        sscanf(v, "%259s", path);
+        args = v + strlen(path);
+    }
+    args += strspn(args, " \t\"");
+    char *sql = CopyField(args);
+    if (!sql) return 1;
+    size_t len = strlen(sql);
+    if (len && sql[len - 1] == '"') sql[len - 1] = '\0';
+    if (!*sql) {
+        fprintf(stderr, "usage: sql [--db=path] \"statement\"\n");
+        free(sql);
+        return 1;
+    }
+
+    store = &sqliteStore;
+    if (store->open(path) != SQLITE_OK) {
+        free(sql);
+        return 1;
+    }
+    int rc = SQLITE_OK;
+    const char *tail = sql;
+    while (rc == SQLITE_OK && *tail) {
+        sqlite3_stmt *stmt = NULL;
+        rc = sqlite3_prepare_v2(db, tail, -1, &stmt, &tail);
+        if (rc != SQLITE_OK || !stmt) break;
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            for (int i = 0; i < sqlite3_column_count(stmt); i++) {
+                const char *text = (const char *)sqlite3_column_text(stmt, i);
+                printf("%s%s", i ? "\t" : "", text ? text : "NULL");
             }
+            printf("\n");
         }
-        break;
+        sqlite3_finalize(stmt);
+        if (rc == SQLITE_DONE) rc = SQLITE_OK;
     }
+    if (rc != SQLITE_OK) fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+    store->close();
+    store = NULL;
+    free(sql);
+    return rc == SQLITE_OK ? 0 : 1;
+}
 
-    case WM_DESTROY:
-        if (db) sqlite3_close(db);
-        PostQuitMessage(0);
-        break;
+static int PrintQueryRow(void *ctx, int id, const char *name, const char *phone, const char *email) {
+    printf("%d\t%s\t%s\t%s\n", id, name, phone, email);
+    return 0;
+}
+
+// Runs a search box query and prints the matches tab-separated, or with
+// --explain the plan it used and its estimated cost. Everything after the
+// options is the query, quotes included:
+//
+//   contact_manager.exe query --db=contacts.db --explain name:smith* email:"@acme.com"
+static int CommandQuery(const char *args) {
+    const char *v;
+    char path[MAX_PATH] = DB_FILE;
+    if ((v = ArgValue(args, "--db=")) != NULL) sscanf(v, "%259s", path);
+    const ContactStore *selected = &sqliteStore;
+    if (strstr(args, "--store=memory")) selected = &memoryStore;
+    if (strstr(args, "--store=log")) selected = &logStore;
+    BOOL explain = ArgValue(args, "--explain") != NULL;
+
+    const char *text = args + strspn(args, " \t");
+    while (text[0] == '-' && text[1] == '-') {
+        text += strcspn(text, " \t");
+        text += strspn(text, " \t");
+    }
+    if (!*text) {
+        fprintf(stderr, "usage: query [--db=path] [--store=memory|log] [--explain] query\n");
+        return 1;
     }
 
-    return DefWindowProc(hWnd, message, wParam, lParam);
+    store = selected;
+    if (store->open(path) != SQLITE_OK) return 1;
+    char plan[4096];
+    int found = 0;
+    int rc = StructuredSearch(text, explain ? BenchCountRow : PrintQueryRow, &found, explain ? plan : NULL, sizeof(plan));
+    if (rc != SQLITE_OK) fprintf(stderr, "%s\n", store->errmsg());
+    else if (explain) fputs(plan, stdout);
+    store->close();
+    store = NULL;
+    return rc == SQLITE_OK ? 0 : 1;
+}
+
+// Turns the unique phone and email key indexes on or off:
+//
+//   contact_manager.exe unique-keys --db=contacts.db on
+static int CommandUniqueKeys(const char *args) {
+    const char *v;
+    char path[MAX_PATH] = DB_FILE;
+    if ((v = ArgValue(args, "--db=")) != NULL) sscanf(v, "%259s", path);
+    const char *last = args + strlen(args);
+    while (last > args && (last[-1] == ' ' || last[-1] == '\t')) last--;
+    BOOL on = last - args >= 3 && strncmp(last - 3, " on", 3) == 0;
+    BOOL off = last - args >= 4 && strncmp(last - 4, " off", 4) == 0;
+    if (!on && !off) {
+        fprintf(stderr, "usage: unique-keys [--db=path] on|off\n");
+        return 1;
+    }
+
+    store = &sqliteStore;
+    if (store->open(path) != SQLITE_OK) return 1;
+    int shared;
+    int rc = SqliteSetUniqueKeys(on, &shared);
+    if (rc == SQLITE_CONSTRAINT && shared) {
+        fprintf(stderr, "%d phone or email keys are shared by several contacts; merge them first\n", shared);
+    } else if (rc != SQLITE_OK) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+    } else {
+        printf("phone and email keys are %s\n", on ? "unique" : "not unique");
+    }
+    store->close();
+    store = NULL;
+    return rc == SQLITE_OK ? 0 : 1;
+}
+
+// The next word of a command line into out, or a "quoted" one with its
+// spaces; NULL when there is none.
+static const char *NextArg(const char *p, char *out, size_t size) {
+    p += strspn(p, " \t");
+    if (!*p) return NULL;
+    char end = *p == '"' ? *p++ : ' ';
+    size_t n = 0;
+    for (; *p && *p != end && (end != ' ' || *p != '\t'); p++) {
+        if (n + 1 < size) out[n++] = *p;
+    }
+    out[n] = '\0';
+    return *p == '"' ? p + 1 : p;
+}
+
+static BOOL BulkUpdateProgress(void *ctx, int done, int total) {
+    fprintf(stderr, "\r%d of %d contacts", done, total);
+    return TRUE;
+}
+
+// Rewrites a field of every contact it applies to, as set-based SQL, and
+// reports rows per second; --dry-run only counts them:
+//
+//   contact_manager.exe bulk-update --db=contacts.db domain oldcorp.com newcorp.com
+//   contact_manager.exe bulk-update --dry-run strip-prefix phone "+1 "
+//   contact_manager.exe bulk-update replace name "Dr. " ""
+static int CommandBulkUpdate(const char *args) {
+    const char *v;
+    char path[MAX_PATH] = DB_FILE;
+    if ((v = ArgValue(args, "--db=")) != NULL) sscanf(v, "%259s", path);
+    const ContactStore *selected = &sqliteStore;
+    if (strstr(args, "--store=memory")) selected = &memoryStore;
+    if (strstr(args, "--store=log")) selected = &logStore;
+    BOOL dryRun = ArgValue(args, "--dry-run") != NULL;
+
+    char words[4][256] = { "", "", "", "" };
+    int count = 0;
+    for (const char *p = args; count < 4 && (p = NextArg(p, words[count], sizeof(words[count]))) != NULL; ) {
+        if (strncmp(words[count], "--", 2) != 0) count++;
+    }
+    BulkEdit edit = { BULK_EDIT_DOMAIN, FIELD_EMAIL, words[1], words[2] };
+    const char *field = words[1];
+    if (strcmp(words[0], "strip-prefix") == 0 && count == 3) {
+        edit.kind = BULK_EDIT_STRIP_PREFIX;
+        edit.from = words[2];
+        edit.to = NULL;
+    } else if (strcmp(words[0], "replace") == 0 && count == 4) {
+        edit.kind = BULK_EDIT_REPLACE;
+        edit.from = words[2];
+        edit.to = words[3];
+    } else if (strcmp(words[0], "domain") != 0 || count != 3) {
+        field = NULL;
+    }
+    if (edit.kind != BULK_EDIT_DOMAIN) {
+        edit.field = strcmp(field, "name") == 0 ? FIELD_NAME : strcmp(field, "phone") == 0 ? FIELD_PHONE
+                   : strcmp(field, "email") == 0 ? FIELD_EMAIL : FIELD_ANY;
+    }
+    if (!field || !*edit.from || edit.field == FIELD_ANY) {
+        fprintf(stderr, "usage: bulk-update [--db=path] [--store=memory|log] [--dry-run]\n"
+                        "         domain OLD NEW | strip-prefix name|phone|email PREFIX | replace name|phone|email OLD NEW\n");
+        return 1;
+    }
+    const char *fieldName = edit.field == FIELD_NAME ? "name" : edit.field == FIELD_PHONE ? "phone" : "email";
+    if (!BulkEditValid(&edit)) {
+        fprintf(stderr, "\"%s\" is not valid in %s\n", edit.to, edit.kind == BULK_EDIT_DOMAIN ? "an email domain" : fieldName);
+        return 1;
+    }
+
+    store = selected;
+    if (store->open(path) != SQLITE_OK) return 1;
+    int matched, skipped;
+    LONGLONG start = BenchNow();
+    int rc = BulkUpdate(&edit, dryRun, dryRun ? NULL : BulkUpdateProgress, NULL, &matched, &skipped);
+    double seconds = (double)TicksToNs(BenchNow() - start) / 1e9;
+    if (!dryRun && matched) fputc('\n', stderr);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "%s; %d contacts were updated\n", store->errmsg(), matched);
+    } else if (dryRun) {
+        printf("%d contacts match\n", matched);
+    } else {
+        printf("updated %d contacts in %.3f s (%.0f rows/s)\n", matched, seconds, seconds > 0 ? matched / seconds : 0.0);
+    }
+    if (rc == SQLITE_OK && skipped) printf("%d contacts skipped: the edit would leave an invalid %s\n", skipped, fieldName);
+    store->close();
+    store = NULL;
+    return rc == SQLITE_OK ? 0 : 1;
+}
+
+// Returns the process exit code, or -1 when cmdLine does not start with a
+// command and the GUI should run instead.
+int RunCommand(const char *cmdLine) {
+    char cmd[32] = {0};
+    if (!cmdLine || sscanf(cmdLine, "%31s", cmd) != 1 || cmd[0] == '-') return -1;
+
+    const char *args = cmdLine + strspn(cmdLine, " \t") + strlen(cmd);
+    if (strcmp(cmd, "stats") == 0) {
+        AttachParentConsole();
+        return CommandStats();
+    }
+    if (strcmp(cmd, "bench") == 0) {
+        AttachParentConsole();
+        return CommandBench(args);
+    }
+    if (strcmp(cmd, "check") == 0) {
+        AttachParentConsole();
+        return CommandCheck(args);
+    }
+    if (strcmp(cmd, "generate") == 0) {
+        AttachParentConsole();
+        return CommandGenerate(args);
+    }
+    if (strcmp(cmd, "replay") == 0) {
+        AttachParentConsole();
+        return CommandReplay(args);
+    }
+    if (strcmp(cmd, "sql") == 0) {
+        AttachParentConsole();
+        return CommandSql(args);
+    }
+    if (strcmp(cmd, "query") == 0) {
+        AttachParentConsole();
+        return CommandQuery(args);
+    }
+    if (strcmp(cmd, "unique-keys") == 0) {
+        AttachParentConsole();
+        return CommandUniqueKeys(args);
+    }
+    if (strcmp(cmd, "bulk-update") == 0) {
+        AttachParentConsole();
+        return CommandBulkUpdate(args);
+    }
+    return -1;
 }
 
 // --- Main Functions ---
@@ -508,6 +9258,7 @@ BOOL InitInstance(HINSTANCE hInstance, int nCmdShow) {
     hMainWnd = CreateWindow("ContactMgrClass", "Contact Management System",
         WS_OVERLAPPEDWINDOW, CW_USEDEFAULT, 0, 800, 480, NULL, NULL, hInstance, NULL);
     if (!hMainWnd) return FALSE;
+    StartWriteBatcher();
 
     ShowWindow(hMainWnd, nCmdShow);
     UpdateWindow(hMainWnd);
@@ -515,16 +9266,18 @@ BOOL InitInstance(HINSTANCE hInstance, int nCmdShow) {
 }
 
 int APIENTRY WinMain(HINSTANCE hInstance, HINSTANCE hPrev, LPSTR lpCmdLine, int nCmdShow) {
+    processStart = ClockNow();
+    int exitCode = RunCommand(lpCmdLine);
+    if (exitCode >= 0) return exitCode;
+
     INITCOMMONCONTROLSEX icex = { sizeof(icex), ICC_LISTVIEW_CLASSES | ICC_BAR_CLASSES };
     InitCommonControlsEx(&icex);
     
     HACCEL hAccel = LoadAccelerators(hInstance, MAKEINTRESOURCE(IDR_ACCEL));
 
-    InitDatabase();
-    if (!db) {
-        return 1;
-    }
-    
+    // the database is opened by the startup thread once the window exists
+    startupCmdLine = lpCmdLine;
+
     MyRegisterClass(hInstance);
     if (!InitInstance(hInstance, nCmdShow)) return FALSE;
     
@@ -537,4 +9290,31 @@ int APIENTRY WinMain(HINSTANCE hInstance, HINSTANCE hPrev, LPSTR lpCmdLine, int
     }
     
     return (int)msg.wParam;
-}
\ No newline at end of file
+}
+
+#else
+// --- Headless Main ---
+// Without Win32 the replay, bench, check and generate verbs are built, on the
+// same stores and search path as the window; bench skips the cases that need
+// the list view or the write batch thread. Link the system SQLite, or compile in the
+// amalgamation (sqlite3.c and sqlite3.h from https://sqlite.org/download.html)
+// in place of -lsqlite3:
+//
+//   cc -O2 -Wall main.c -lsqlite3 -lpthread -lm -ldl -o contact_manager
+//   ./contact_manager replay --db=bench_contacts.db --type=smith --interval=120
+//   ./contact_manager check
+
+int main(int argc, char **argv) {
+    char args[1024] = "";
+    size_t len = 0;
+    for (int i = 2; i < argc && len < sizeof(args); i++) {
+        len += snprintf(args + len, sizeof(args) - len, "%s%s", i > 2 ? " " : "", argv[i]);
+    }
+    if (argc >= 2 && strcmp(argv[1], "replay") == 0) return CommandReplay(args);
+    if (argc >= 2 && strcmp(argv[1], "bench") == 0) return CommandBench(args);
+    if (argc >= 2 && strcmp(argv[1], "check") == 0) return CommandCheck(args);
+    if (argc >= 2 && strcmp(argv[1], "generate") == 0) return CommandGenerate(args);
+    fprintf(stderr, "usage: %s replay|bench|check|generate [options]\n", argv[0]);
+    return 2;
+}
+#endif
@@ -16,12 +16,14 @@
 // Dialog IDs
 #define IDD_ADD_CONTACT 200
 #define IDD_EDIT_CONTACT 201
+#define IDD_BULK_EDIT 202
 
 // Add Dialog Control IDs
 #define IDC_ADD_NAME 301
 #define IDC_ADD_PHONE 302
 #define IDC_ADD_EMAIL 303
 #define IDC_CLEAR 304
+#define IDC_ADD_DUP 305
 
 // Edit Dialog Control IDs
 #define IDC_EDIT_NAME 401
@@ -29,12 +31,24 @@
 #define IDC_EDIT_EMAIL 403
 #define IDC_DELETE_ITEM 404
 
+// Bulk Edit Dialog Control IDs
+#define IDC_BULK_COUNT 601
+#define IDC_BULK_NAME 602
+#define IDC_BULK_PHONE 603
+#define IDC_BULK_EMAIL 604
+#define IDC_BULK_VALUE 605
+
 // Menu IDs and Accelerators
 #define IDR_MENU1 500
 #define IDR_ACCEL 501
 #define IDM_FILE_EXIT 510
+#define IDM_FILE_STATS 511
+#define IDM_FILE_TRACE 512
 #define IDM_CONTACT_ADD 520
 #define IDM_CONTACT_SEARCH 521
 #define IDM_CONTACT_VIEW 522
 #define IDM_CONTACT_EDIT 523
-#define IDM_CONTACT_DEL 524
\ No newline at end of file
+#define IDM_CONTACT_DEL 524
+#define IDM_CONTACT_RANK 525
+#define IDM_CONTACT_SELECT_ALL 526
+#define IDM_CONTACT_DEL_MATCHING 527
\ No newline at end of file